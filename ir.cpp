@@ -1,7 +1,45 @@
+#include <algorithm>
+#include <atomic>
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string.h>
+#include <type_traits>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 
+#include "lex.h"
+#include "utility/Arena.h"
 #include "utility/ByteStream.h"
+#include "utility/mix.h"
+#include "utility/WorkStealingPool.h"
+
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define TC_SSE2 1
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define TC_X64_JIT 1
+#endif
+
+// The JIT maps executable memory, object files are written through a descriptor, and the compile cache maps its
+// files and renames them into place.
+#if defined _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <errno.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define MaxOperands 3
 #define MaxSrcs 3
@@ -12,16 +50,53 @@
 #define RA_DEBUG_PRINTF(...) ((void)0)
 #endif
 
-enum RegLoc : uint16_t { RegLocInvalid = 4096 };
-enum SpillLoc : uint32_t { SpillLocInvalid = 4096 };
-
 // "a" types are typeless and can hold any type for a bit layout, e.g: a32 could be float or int.
+// Vector types are lanes of a scalar one. The opcodes are the same as for the scalar type, working lane-wise,
+// and test I/O of a vector is its lanes at consecutive offsets. Test I/O of an a64 is two 32-bit words, low first.
+// The values are in binary IR, so new typekinds go at the end.
 enum IrTypekind : uint8_t {
     Ir_void,
     Ir_bool,
     Ir_a32,
+    Ir_v4a32,
+    Ir_a64,
+    Ir_v8a32,
 };
 
+static const uint MaxLanes = 8;
+static inline uint LaneCount(IrTypekind typekind) { return typekind == Ir_v4a32 ? 4 : typekind == Ir_v8a32 ? 8 : 1; }
+// 32-bit words of test I/O or memory the value takes.
+static inline uint WordCount(IrTypekind typekind) { return typekind == Ir_a64 ? 2 : LaneCount(typekind); }
+
+// Each register class has its own register file and spill slots, and RA picks victims within a class.
+enum RegClass : uint8_t {
+    RegClass_data, // Ir_a32, Ir_a64, and Ir_bool on targets without predicate registers. Data registers are
+                   // 64-bit like on x86-64, so an a64 takes one register and one spill slot, not a pair.
+    RegClass_pred, // Ir_bool
+    RegClass_vec,  // Ir_v4a32 and Ir_v8a32, there is no other place for them. A register holds 8 lanes, like ymm.
+    RegClass_count,
+};
+
+static inline RegClass RegClassOf(IrTypekind typekind, bool bPredRegs)
+{
+    if (LaneCount(typekind) > 1)
+        return RegClass_vec;
+    return typekind == Ir_bool && bPredRegs ? RegClass_pred : RegClass_data;
+}
+
+// The class is in the bits above RegLocIndexBits, so data registers are numbered as if there were no others.
+// A spill slot number is per class, the class being the one of the register stored or reloaded.
+enum RegLoc : uint16_t { RegLocInvalid = 0xFFFF };
+enum SpillLoc : uint32_t { SpillLocInvalid = uint32_t(-1) };
+static constexpr uint RegLocIndexBits = 12;
+
+static inline RegLoc MakeRegLoc(RegClass regClass, uint index)
+{
+    return RegLoc(uint(regClass) << RegLocIndexBits | index);
+}
+static inline RegClass RegClassOf(RegLoc reg) { return RegClass(reg >> RegLocIndexBits); }
+static inline uint RegIndexOf(RegLoc reg) { return reg & ((1u << RegLocIndexBits) - 1); }
+
 enum Opcode : uint16_t {
     Opcode_Literal, // first non-Instruction-Value
     Opcode_GlobalVariable,
@@ -31,9 +106,23 @@ enum Opcode : uint16_t {
     Opcode_spill,
     Opcode_load_spilled,
     Opcode_return,
+    Opcode_jump,   // to Block::succs[0], operands are the arguments for its params
+    Opcode_branch, // to succs[0] if operand 0 is nonzero, else succs[1]
+    Opcode_move,   // register to register, or a literal into a register
+    Opcode_swap,   // exchanges the registers of its two operands
     Opcode_iadd,
+    Opcode_icmp_eq,  // bool
+    Opcode_icmp_ult, // bool, unsigned
+    Opcode_select,   // operand 1 if the bool operand 0 is true, else operand 2
+    Opcode_load_global,  // operand 0 is the literal index of the GlobalVariable
+    Opcode_store_global, // same, operand 1 is the value
 };
 
+static inline bool IsTerminator(Opcode opcode)
+{
+    return opcode == Opcode_return || opcode == Opcode_jump || opcode == Opcode_branch;
+}
+
 struct Value {
     Opcode opcode;
     IrTypekind typekind;
@@ -43,6 +132,13 @@ struct LiteralValue : Value {
     uint64_t zext;
 };
 
+// A 32-bit variable outside of any function, zero before anything stores to it. Instructions refer to it by
+// its index in Module::globals, as a literal operand like spill slots, so it is never a register operand.
+struct GlobalVariable : Value {
+    const char* name; // the symbol, static string or long-lifetime arena-allocated
+    uint index;
+};
+
 struct RuntimeValue;
 struct Instruction;
 
@@ -64,7 +160,8 @@ struct RuntimeValue : Value {
     RegLoc currentReg = RegLocInvalid; // for regalloc
     SpillLoc spillLoc = SpillLocInvalid;
     uint _nOperands = 0;
-    Value* _operands[MaxOperands] = { }; // XXX: not enough for pass-to-block-param terminator instrs
+    Value** _operands = _inlineOperands; // from Module::arena if there are more than MaxOperands, like jump arguments
+    Value* _inlineOperands[MaxOperands] = { };
 
     // static string or long-lifetime arena-allocated
     const char* debugName = nullptr;
@@ -98,6 +195,7 @@ struct Instruction : RuntimeValue {
     struct RegAllocState {
         RegLoc dstReg = RegLocInvalid;
         RegLoc srcRegs[MaxOperands] = {};
+        const Value* restores = nullptr; // for reloads and rematerializations: the value put in dstReg
         RegAllocState()
         {
             for (RegLoc& r : srcRegs)
@@ -108,28 +206,92 @@ struct Instruction : RuntimeValue {
     RegAllocState ra;
 };
 
+// The result or an operand is a vector, for backends that only have scalars.
+static inline bool HasVectorType(const Instruction* instr)
+{
+    bool b = LaneCount(instr->typekind) > 1;
+    for (const Value* operand : instr->Operands())
+        b |= LaneCount(operand->typekind) > 1;
+    return b;
+}
+
+// The result or an operand is an a64, for backends where those take wider slots or other instructions.
+static inline bool HasA64Type(const Instruction* instr)
+{
+    bool b = instr->typekind == Ir_a64;
+    for (const Value* operand : instr->Operands())
+        b |= operand->typekind == Ir_a64;
+    return b;
+}
+
+struct Block;
+
+// Gets its value from the jump of whichever predecessor was taken.
+struct BlockParameter : RuntimeValue {
+    Block* block;
+    uint index; // in Block::params and the jump's operands
+};
+
 struct Block {
+    std::vector<BlockParameter*> params; // only jumps can pass them, not branches
     std::vector<Instruction *> instructions;
 
+    // Filled in by the terminator and Function::BuildCfg.
+    Block* succs[2] = { };
+    uint numSuccs = 0;
+    std::vector<Block*> preds;
+    uint rpoIndex = uint(-1);
+
+    // Set by GlobalRegisterAllocation: what each register and spill slot holds on entry.
+    std::vector<const RuntimeValue*> raEntryRegs;
+    std::vector<std::pair<SpillLoc, const RuntimeValue*>> raEntrySlots;
+
     Block() = default;
     Block(const Block& rhs) = delete;
     Block& operator=(const Block& rhs) = delete;
 
+    // The block owns its instructions: CreateThenAppendInstr and RA allocate them with new, and passes that take
+    // one out of the block delete it.
     ~Block()
     {
         Instruction** pp = instructions.data();
         size_t e = instructions.size();
         while (e) {
-            pp[--e]->~Instruction();
+            delete pp[--e];
         }
+        for (BlockParameter* param : params)
+            delete param;
+    }
+
+    BlockParameter* AddParam(IrTypekind typekind, const char* debugName)
+    {
+        BlockParameter* param = new BlockParameter();
+        param->opcode = Opcode_ExplicitBlockParameter;
+        param->typekind = typekind;
+        param->debugName = debugName;
+        param->block = this;
+        param->index = uint(params.size());
+        params.push_back(param);
+        return param;
+    }
+
+    // Params are numbered right before the first instruction, so this is where the block's values begin.
+    uint BeginIndex() const
+    {
+        return params.empty() ? instructions.front()->instrIndexInBlock : params.front()->instrIndexInBlock;
     }
 
-    Instruction* CreateThenAppendInstr(Opcode opcode, IrTypekind typekind, uint numOperands)
+    // An arena is needed for more than MaxOperands operands.
+    Instruction* CreateThenAppendInstr(Opcode opcode, IrTypekind typekind, uint numOperands, Arena* arena = nullptr)
     {
         Instruction* instr = new Instruction();
         instr->opcode = opcode;
         instr->typekind = typekind;
         instr->_nOperands = numOperands;
+        if (numOperands > MaxOperands) {
+            Implemented(arena != nullptr);
+            instr->_operands = arena->AllocArray<Value*>(numOperands);
+        }
         instr->instrIndexInBlock = uint(instructions.size());
 
         instructions.push_back(instr);
@@ -152,410 +314,8760 @@ struct Block {
         instr->SetOperand(1, b);
         return instr;
     }
+
+    // Recomputes instrIndexInBlock, and rebuilds every use-list so it is in instruction order (RA depends on that).
+    // For passes that reorder, remove or re-point operands of many instructions, so they
+    // don't have to keep use-lists sorted themselves.
+    void RebuildUseLists()
+    {
+        for (uint i = 0; i < instructions.size(); ++i) {
+            instructions[i]->uses.clear();
+            instructions[i]->instrIndexInBlock = i;
+        }
+        for (Instruction* const instr : instructions) {
+            for (uint i = 0; i < instr->OperandCount(); ++i) {
+                Value* const operand = instr->Operand(i);
+                if (operand->opcode != Opcode_Literal)
+                    static_cast<RuntimeValue*>(operand)->uses.push_back({ instr, i });
+            }
+        }
+    }
 };
 
-struct Module {
+// One shard of Module's literal pools, a literal is in the shard picked by a hash of its key.
+struct LiteralShard {
+    std::mutex mutex;
     // high 32 bits are typekind, low 32 bits are the zext value
     std::unordered_map<uint64_t, LiteralValue> literalsNon64BitType;
-    // std::unordered_map<uint64_t, LiteralValue> literals64BitType;
+    // keyed by the whole value, there is no room for the typekind and only Ir_a64 is 64-bit
+    std::unordered_map<uint64_t, LiteralValue> literals64BitType;
+};
 
-    LiteralValue* LiteralU32(uint32_t z)
+struct Module {
+    // Literals are interned, equal ones are the same Value wherever they were created. RA creates them too, so with
+    // functions compiled on several threads (CompileBlocksParallel) the pools are sharded, each shard with its own
+    // lock, and threads rarely wait for the same one. Nodes don't move, so the Values stay where they are.
+    static const uint LiteralShardCount = 64;
+    LiteralShard literalShards[LiteralShardCount];
+
+    LiteralValue* Intern(bool b64BitType, uint64_t key, IrTypekind typekind, uint64_t zext)
     {
+        LiteralShard& shard = literalShards[Avalanche(uint32_t(key) ^ uint32_t(key >> 32)) % LiteralShardCount];
         std::pair<uint64_t, LiteralValue> p;
-        p.first = uint64_t(Ir_a32) << 32 | z;
+        p.first = key;
         p.second.opcode   = Opcode_Literal;
-        p.second.typekind = Ir_a32;
-        p.second.zext     = z;
-        auto r = literalsNon64BitType.insert(p);
+        p.second.typekind = typekind;
+        p.second.zext     = zext;
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto r = (b64BitType ? shard.literals64BitType : shard.literalsNon64BitType).insert(p);
         return &r.first->second; // r.first is iterator to pair<key, value>
     }
 
-    LiteralValue* lit_zero_a32;
-
-    Module()
+    LiteralValue* LiteralU32(uint32_t z)
     {
-        lit_zero_a32 = LiteralU32(0);
+        return Intern(false, uint64_t(Ir_a32) << 32 | z, Ir_a32, z);
     }
-};
-
-struct PrintContext {
-    bool bPrintRegs = false;
-};
 
-static const char* TypekindStr(IrTypekind typekind)
-{
-    const char* s = nullptr;
-    switch (typekind) {
-    case Ir_void: s = "void"; break;
-    case Ir_bool: s = "bool"; break;
-    case Ir_a32:  s = "dword"; break; // idea is to not use numbers since many other things will have numbers
-    } // switch
-    ASSUME(s);
-    return s;
-}
+    // Never the same as LiteralU32 of the same value, the type is different.
+    LiteralValue* LiteralU64(uint64_t z)
+    {
+        return Intern(true, z, Ir_a64, z);
+    }
 
-static const char* InstructionOpcodeStr(Opcode opcode)
-{
-    const char* s = nullptr;
-#define CASE(n) case Opcode_##n: s = #n; break
-    switch (opcode)
+    // Every lane is z.
+    LiteralValue* LiteralV4Splat(uint32_t z)
     {
-    case Opcode_Literal:
-    case Opcode_GlobalVariable:
-    case Opcode_ExplicitBlockParameter:
-        unreachable; // or not implemented
-    CASE(read_test_input);
-    CASE(write_test_output);
-    CASE(spill);
-    CASE(load_spilled);
-    CASE(return);
-    CASE(iadd);
+        return Intern(false, uint64_t(Ir_v4a32) << 32 | z, Ir_v4a32, z);
+    }
+    LiteralValue* LiteralV8Splat(uint32_t z)
+    {
+        return Intern(false, uint64_t(Ir_v8a32) << 32 | z, Ir_v8a32, z);
+    }
+    LiteralValue* LiteralSplat(IrTypekind typekind, uint32_t z)
+    {
+        ASSERT(LaneCount(typekind) > 1);
+        return typekind == Ir_v8a32 ? LiteralV8Splat(z) : LiteralV4Splat(z);
     }
-#undef CASE
-    ASSUME(s);
-    return s;
-}
 
-static void PrintValue(PrintContext&, ByteStream& bs, const Value& value)
-{
-    switch (value.opcode) {
-    case Opcode_Literal: {
-        const LiteralValue& lit = static_cast<const LiteralValue&>(value);
-        switch (value.typekind) {
-        case Ir_void:
-            unreachable;
-        case Ir_bool:
-            ASSERT(lit.zext < 2u);
-            Print(bs, lit.zext ? "true" : "false");
-            break;
-        case Ir_a32:
-            // i32 is most common, so have no suffix for it (so just "0" instead of "0_i32" or "i32 0").
-            // Will want suffix for other types.
-            // If opcode [+ operand index] is float data: print float, in addition to hex. 
-            Print(bs, int32_t(lit.zext));
-            break;
-        } // switch
-    } break;
-    default: {
-        const RuntimeValue& rtv = static_cast<const RuntimeValue&>(value);
-        Print(bs, rtv.debugName);
-    } break;
-    } // switch
-}
+    LiteralValue* LiteralBool(bool b)
+    {
+        return Intern(false, uint64_t(Ir_bool) << 32 | uint32_t(b), Ir_bool, b);
+    }
 
-static void PrintSlashAndReg(ByteStream& bs, RegLoc reg)
-{
-    if (reg == RegLocInvalid) Print(bs, R"(\r?)");
-    else                     Print(bs, R"(\r)", unsigned(reg));
-}
+    LiteralValue* lit_zero_a32;
 
-static void PrintBlock(PrintContext& ctx, ByteStream& bs, const Block& block, uint indentation)
-{
-    for (const Instruction* const instr : block.instructions) {
-        bs.PutByteRepeated(' ', indentation);
-        if (instr->typekind != Ir_void) {
-            ByteStream_printf(bs, "%s %s", TypekindStr(instr->typekind), instr->debugName);
-            if (ctx.bPrintRegs) {
-                PrintSlashAndReg(bs, instr->ra.dstReg);
-            }
-            Print(bs, " = ");
-        }
-        Print(bs, InstructionOpcodeStr(instr->opcode));
-        switch (instr->opcode) {
-        case Opcode_return:
-            if (instr->OperandCount() == 0)
-                break;
-            // fallthrough
-        default:
-            bs.PutByte('(');
-            for (uint i = 0;;) {
-                const Value* operand = instr->Operand(i);
-                PrintValue(ctx, bs, *operand);
-                if (ctx.bPrintRegs && operand->opcode != Opcode_Literal) {
-                    ASSERT(operand->typekind != Ir_void);
-                    PrintSlashAndReg(bs, instr->ra.srcRegs[i]);
-                }
-                if (++i == instr->OperandCount())
-                    break;
-                Print(bs, ", ");
-            }
-            bs.PutByte(')');
-        }
-        Print(bs, ";\n");
-    }
-}
+    Arena arena; // lives as long as the blocks
+    std::vector<std::unique_ptr<Arena>> threadArenas; // same, one per thread of CompileBlocksParallel
 
-struct RegAllocCtx {
-    Module& module;
+    std::vector<GlobalVariable*> globals; // from arena
 
-    uint reglimit; // can use at most this many registers
+    GlobalVariable* AddGlobal(const char* name)
+    {
+        GlobalVariable* const global = arena.AllocArray<GlobalVariable>(1);
+        global->opcode = Opcode_GlobalVariable;
+        global->typekind = Ir_a32;
+        global->name = name;
+        global->index = uint(globals.size());
+        globals.push_back(global);
+        return global;
+    }
 
-    uint32_t occupiedSpillsBitset = 0;
+    Module()
+    {
+        lit_zero_a32 = LiteralU32(0);
+    }
+};
 
-    uint32_t freeRegsBitset;
-    RuntimeValue* valuesInReg[32] = { };
-    const char* spillNames[32] = { };
+// Blocks are owned by the function, blocks[0] is the entry and has no predecessors.
+// Values defined in one block can be used in any block it dominates, there are no phis yet.
+struct Function {
+    std::vector<Block*> blocks;
 
-    std::vector<Instruction*> newInstrs;
+    // Set by BuildCfg.
+    std::vector<Block*> rpo; // reachable blocks in reverse postorder
+    uint numInstrs = 0;      // in reachable blocks
+    // Set by ComputeDominators, indexed by rpoIndex, the entry is its own.
+    std::vector<uint> idoms;
+    // A block's dominator subtree is [domPreorder, domPreorder + domSubtreeSize) in a preorder walk of the tree.
+    std::vector<uint> domPreorder;
+    std::vector<uint> domSubtreeSize;
 
-    RegAllocCtx(const RegAllocCtx&) = delete;
-    RegAllocCtx& operator=(const RegAllocCtx&) = delete;
+    Function() = default;
+    Function(const Function&) = delete;
+    Function& operator=(const Function&) = delete;
 
-    RegAllocCtx(Module& module, uint registerLimit)
-        : module(module)
-        , reglimit(registerLimit)
+    ~Function()
     {
-        freeRegsBitset = uint32_t(-1) >> (32 - reglimit);
+        for (Block* block : blocks)
+            delete block;
     }
-};
 
-// Location(s) because it is in a register now, but may have spilled somewhere before.
-static void UpdateJustUsedSrcValueInReg(
-    RegAllocCtx& ctx, uint /*origInstrIndex*/, Instruction* instr, uint srcIndex, RuntimeValue* src)
-{
-    ASSERT(src->opcode != Opcode_Literal);
-    RegLoc const reg = instr->ra.srcRegs[srcIndex];
-    ASSERT(src->currentReg == reg);
-    ASSERT(reg != RegLocInvalid);
-    ASSERT(!(ctx.freeRegsBitset & 1u << reg));
+    Block* NewBlock()
+    {
+        blocks.push_back(new Block());
+        return blocks.back();
+    }
 
-    ASSERT(src->useIterAccelerator < src->uses.size());
-    if (++src->useIterAccelerator == src->uses.size()) {
-        src->currentReg = RegLocInvalid;
-        ctx.valuesInReg[reg] = nullptr;
-        ctx.freeRegsBitset |= 1u << reg;
+    // Computes predecessors, splits critical edges (so code passing values to a successor can go before
+    // the jump of a predecessor), and orders reachable blocks in reverse postorder.
+    // Then numbers instructions across the function in that order and rebuilds use-lists,
+    // so a use-list is in the order blocks are allocated in.
+    void BuildCfg()
+    {
+        for (Block* block : blocks) {
+            block->preds.clear();
+            block->rpoIndex = uint(-1);
+        }
+        for (Block* block : blocks) {
+            ASSERT(!block->instructions.empty() && IsTerminator(block->instructions.back()->opcode));
+            for (uint i = 0; i < block->numSuccs; ++i)
+                block->succs[i]->preds.push_back(block);
+        }
+        Implemented(!blocks.empty() && blocks[0]->preds.empty() && blocks[0]->params.empty());
 
-        if (src->spillLoc != SpillLocInvalid) {
-            src->spillLoc = SpillLocInvalid;
+        for (size_t b = 0, numBlocks = blocks.size(); b < numBlocks; ++b) {
+            Block* const pred = blocks[b];
+            if (pred->numSuccs < 2)
+                continue;
+            for (uint i = 0; i < pred->numSuccs; ++i) {
+                Block* const succ = pred->succs[i];
+                if (succ->preds.size() < 2)
+                    continue;
+                Block* const split = NewBlock();
+                split->CreateThenAppendInstr(Opcode_jump, Ir_void, 0);
+                split->succs[0] = succ;
+                split->numSuccs = 1;
+                split->preds.push_back(pred);
+                pred->succs[i] = split;
+                *std::find(succ->preds.begin(), succ->preds.end(), pred) = split;
+            }
         }
-    }
-}
 
-// value could be a src or dst
-static RegLoc AllocRegForValueAfterPossiblySpilling(
-    RegAllocCtx& ctx, uint origInstrIndex, Instruction* instr, RuntimeValue* value)
-{
-    ASSERT(value->opcode != Opcode_Literal);
+        // Iterative DFS, a block is appended to the postorder after all its successors.
+        rpo.clear();
+        std::vector<std::pair<Block*, uint>> stack;
+        blocks[0]->rpoIndex = 0; // visited
+        stack.emplace_back(blocks[0], 0);
+        while (!stack.empty()) {
+            Block* const block = stack.back().first;
+            uint& nextSucc = stack.back().second;
+            if (nextSucc < block->numSuccs) {
+                Block* const succ = block->succs[nextSucc++];
+                if (succ->rpoIndex == uint(-1)) {
+                    succ->rpoIndex = 0;
+                    stack.emplace_back(succ, 0);
+                }
+            }
+            else {
+                rpo.push_back(block);
+                stack.pop_back();
+            }
+        }
+        std::reverse(rpo.begin(), rpo.end());
 
-    RegLoc reg;
-    if (ctx.freeRegsBitset == 0) {
-        // See notes for accelerating this, especially for many registers.
-        // Some kind of dataflow analysis for estimated distance when the next use is not with the block,
-        // even if use by callblock shouldn't be considered for deciding what to spill (should callblock be considered?),
-        // since could have `var a = ...; if (cond) { ThenBlock; } MergeBlock;` where ThenBlock doesn't modify var a
-        // (so no ExplicitBlockParameter for it in MergeBlock) and it is live-into MergeBlock; but not used for a long time.
-        uint farthestDist = 0;
-        RegLoc farthestVictimReg = RegLocInvalid;
-        uint32_t const occupiedRegsBitset = ctx.freeRegsBitset ^ (uint32_t(-1) >> (32 - ctx.reglimit));
-        for (uint bits = occupiedRegsBitset; bits; bits &= bits - 1) {
-            // When a value is a src of the current instruction, value.uses[value.useIterAccelerator] should refer to:
-            //  1: Before all sources are allocated: the current instruction.
-            //      Note value.useIterAccelerator might not be the last entry in value.uses to do so,
-            //      unless this is the rightmost src of the value, see @useIterAccelerator_rightmost
-            //  2: After all sources are allocated (case for allocating the dst): an instruction after the current
-            //     instruction, or useIterAccelerator == size, which means "no next use".
-            //
-            // The farthest distance (Belady's) heuristic has another purpose: with bullet 1 above, it is one way of
-            // preventing trying to evict src0 when allocating src1 for e.g: `dst = op(src0, src1)`.
-            RegLoc const victimReg = RegLoc(bsf(bits));
-            RuntimeValue* const victimValue = ctx.valuesInReg[victimReg];
-
-            ASSERT(victimValue->uses.size() >= victimValue->useIterAccelerator);
-            uint const nextUseOrigInstrIndex = victimValue->useIterAccelerator == victimValue->uses.size() ?
-                uint32_t(-1) :
-                victimValue->uses[victimValue->useIterAccelerator].value->instrIndexInBlock;
-            ASSERT(nextUseOrigInstrIndex >= origInstrIndex);
-            uint const dist = nextUseOrigInstrIndex - origInstrIndex;
-            if (dist > farthestDist) {
-                farthestDist = dist;
-                farthestVictimReg = victimReg;
+        numInstrs = 0;
+        for (uint b = 0; b < rpo.size(); ++b) {
+            rpo[b]->rpoIndex = b;
+            for (BlockParameter* const param : rpo[b]->params) {
+                param->uses.clear();
+                param->instrIndexInBlock = numInstrs++;
+            }
+            for (Instruction* const instr : rpo[b]->instructions) {
+                instr->uses.clear();
+                instr->instrIndexInBlock = numInstrs++;
             }
         }
-        ASSERT(farthestVictimReg != RegLocInvalid);
-        // allocating for a src?
-        if (instr != value) {
-#if _DEBUG
-            for (uint j = 0; j < countof(instr->ra.srcRegs); ++j) {
-                ASSERT(instr->ra.srcRegs[j] != farthestVictimReg);
+        for (Block* const block : rpo) {
+            for (Instruction* const instr : block->instructions) {
+                for (uint i = 0; i < instr->OperandCount(); ++i) {
+                    Value* const operand = instr->Operand(i);
+                    if (operand->opcode != Opcode_Literal)
+                        static_cast<RuntimeValue*>(operand)->uses.push_back({ instr, i });
+                }
             }
         }
-#endif
-        reg = farthestVictimReg;
-        RuntimeValue* const farthestVictimValue = ctx.valuesInReg[farthestVictimReg];
-        farthestVictimValue->currentReg = RegLocInvalid;
-        // Within a basic block, only need to spill a value once.
-        if (farthestVictimValue->spillLoc == SpillLocInvalid) {
-            // XXX:  Allocate spill loc in immediate dominator of other spills of this value.
+    }
 
-            uint32_t freeSpillLocs = ~ctx.occupiedSpillsBitset;
-            Implemented(freeSpillLocs);
-            SpillLoc spillLoc = SpillLoc(bsf(freeSpillLocs));
-            ctx.occupiedSpillsBitset |= 1u << spillLoc;
-            farthestVictimValue->spillLoc = spillLoc;
-            ctx.spillNames[spillLoc] = farthestVictimValue->debugName;
+    // Cooper, Harvey, Kennedy: "A Simple, Fast Dominance Algorithm".
+    // Iterates over reverse postorder until nothing changes, which is once for reducible
+    // CFGs plus one pass to see that, and walks up the tree by rpoIndex to intersect.
+    void ComputeDominators()
+    {
+        ASSERT(!rpo.empty() && rpo[0] == blocks[0]);
+        idoms.assign(rpo.size(), uint(-1));
+        idoms[0] = 0;
+        for (bool bChanged = true; bChanged;) {
+            bChanged = false;
+            for (uint b = 1; b < rpo.size(); ++b) {
+                uint newIdom = uint(-1);
+                for (const Block* const pred : rpo[b]->preds) {
+                    if (pred->rpoIndex == uint(-1) || idoms[pred->rpoIndex] == uint(-1))
+                        continue; // unreachable or not processed yet
+                    newIdom = newIdom == uint(-1) ? pred->rpoIndex : NearestCommonDominator(pred->rpoIndex, newIdom);
+                }
+                if (idoms[b] != newIdom) {
+                    idoms[b] = newIdom;
+                    bChanged = true;
+                }
+            }
+        }
 
-            Instruction* spillInstr = new Instruction();
-            spillInstr->opcode = Opcode_spill;
-            spillInstr->typekind = Ir_void;
-            spillInstr->_nOperands = 2;
-            spillInstr->_operands[0] = ctx.module.LiteralU32(spillLoc);
-            spillInstr->_operands[1] = farthestVictimValue;
-            spillInstr->ra.srcRegs[1] = reg;
-            // XXX: uses/isntrindex messed up
-            ctx.newInstrs.push_back(spillInstr);
+        // A block's idom comes before it in reverse postorder, so subtree sizes can be summed backwards,
+        // then children placed after their parent forwards.
+        uint const numBlocks = uint(rpo.size());
+        domSubtreeSize.assign(numBlocks, 1);
+        for (uint b = numBlocks - 1; b > 0; --b)
+            domSubtreeSize[idoms[b]] += domSubtreeSize[b];
+        std::vector<uint> nextChild(numBlocks);
+        domPreorder.assign(numBlocks, 0);
+        nextChild[0] = 1;
+        for (uint b = 1; b < numBlocks; ++b) {
+            domPreorder[b] = nextChild[idoms[b]];
+            nextChild[idoms[b]] += domSubtreeSize[b];
+            nextChild[b] = domPreorder[b] + 1;
         }
     }
-    else {
-        reg = RegLoc(bsf(ctx.freeRegsBitset));
-        ASSERT(value->currentReg == RegLocInvalid);
-        ASSERT(ctx.valuesInReg[reg] == nullptr);
-        ctx.freeRegsBitset &= ~(1u << reg);
-    }
 
-    if (value->spillLoc != SpillLocInvalid) {
-        ASSERT(instr != value); // should be allocating a reg for a src, not a dst
+    uint NearestCommonDominator(uint a, uint b) const
+    {
+        while (a != b) {
+            while (a > b)
+                a = idoms[a];
+            while (b > a)
+                b = idoms[b];
+        }
+        return a;
+    }
 
-        Instruction* loadInstr = new Instruction();
-        loadInstr->opcode = Opcode_load_spilled;
-        loadInstr->typekind = Ir_a32;
-        loadInstr->_nOperands = 1;
-        loadInstr->_operands[0] = ctx.module.LiteralU32(value->spillLoc);
-        // XXX: uses/isntrindex messed up
-        loadInstr->debugName = ctx.spillNames[value->spillLoc]; // TODO: diff name or seqno
-        loadInstr->spillLoc = value->spillLoc; // in case ahve to spill a value multiplek times, relaod from original spill
-        loadInstr->ra.dstReg = reg;
-        ctx.newInstrs.push_back(loadInstr);
+    bool Dominates(uint a, uint b) const
+    {
+        return domPreorder[b] - domPreorder[a] < domSubtreeSize[a];
     }
+};
 
-    value->currentReg = reg;
-    ctx.valuesInReg[reg] = value;
-    return reg;
-}
+static forceinline bool IsLiteral(const Value* value) { return value->opcode == Opcode_Literal; }
 
-static void LocalRegisterAllocation(RegAllocCtx& ctx, Block& block)
+// If value is `iadd(x, literal)`, returns the instruction, else nullptr.
+// Builders keep literals as the rightmost operand, so only operand 1 is checked.
+static Instruction* AsIaddOfLiteral(Value* value)
 {
-    ASSERT(ctx.newInstrs.empty());
-    ctx.newInstrs.reserve(size_t(1) << CeilLog2(uint(block.instructions.size()) | 2));
+    if (value->opcode != Opcode_iadd)
+        return nullptr;
+    Instruction* instr = static_cast<Instruction*>(value);
+    return IsLiteral(instr->Operand(1)) ? instr : nullptr;
+}
 
-    for (uint origInstrIndex = 0; origInstrIndex < block.instructions.size(); ++origInstrIndex) {
-        Instruction* const instr = block.instructions[origInstrIndex];
+// Appends instructions to the end of a block, but first tries to fold or simplify them,
+// so a builder method may return a literal or an existing value instead of a new instruction.
+// This means fewer Instructions reach RA; unlike a later pass, the unfolded instructions
+// never exist, though a folded-through operand may be left without uses.
+struct IrBuilder {
+    Module& module;
+    Block* block; // appending to this, see SetBlock
+    bool bFold = true; // false is mostly for comparing
 
-        // TODO: if is branch, conditional or not, do not handle here,
-        // since actual HW branch needs to be after register/etc passing code.
-        // After passing code, update use info of the condition bool if needed.
-        // if (instr->opcode == )
-        // ^^^ actually, do this by initing size/end to iterate to above loop
+    IrBuilder(Module& module, Block& block) : module(module), block(&block) { }
 
-        uint32_t uniqueSrcIndexes = 0;
-        for (uint srcIndex = 0; srcIndex < instr->OperandCount(); ++srcIndex) {
-            Value* const _src = instr->Operand(srcIndex);
-            if (_src->opcode == Opcode_Literal) {
-                continue;
-            }
-            RuntimeValue* const src = static_cast<RuntimeValue *>(_src);
-            // Since not iterating over callblock instrs, this loop should have few iterations:
+    void SetBlock(Block& newBlock)
+    {
+        ASSERT(block->instructions.empty() || IsTerminator(block->instructions.back()->opcode));
+        block = &newBlock;
+    }
+
+    // typekind is Ir_a32 or Ir_a64.
+    Value* ReadTestInput(uint32_t offset, const char* debugName, IrTypekind typekind = Ir_a32)
+    {
+        ASSERT(typekind == Ir_a32 || typekind == Ir_a64);
+        return block->CreateThenAppendInstr1(Opcode_read_test_input, typekind, module.LiteralU32(offset), debugName);
+    }
+
+    void WriteTestOutput(uint32_t offset, Value* value)
+    {
+        (void)block->CreateThenAppendInstr2(Opcode_write_test_output, Ir_void, module.LiteralU32(offset), value);
+    }
+
+    Value* LoadGlobal(const GlobalVariable* global, const char* debugName)
+    {
+        return block->CreateThenAppendInstr1(Opcode_load_global, Ir_a32, module.LiteralU32(global->index), debugName);
+    }
+
+    void StoreGlobal(const GlobalVariable* global, Value* value)
+    {
+        (void)block->CreateThenAppendInstr2(Opcode_store_global, Ir_void, module.LiteralU32(global->index), value);
+    }
+
+    void Return()
+    {
+        (void)block->CreateThenAppendInstr(Opcode_return, Ir_void, 0);
+    }
+
+    // One argument per param of target.
+    void Jump(Block& target, std::initializer_list<Value*> args = {})
+    {
+        Jump(target, view<Value* const>{ args.begin(), uint(args.size()) });
+    }
+
+    void Jump(Block& target, view<Value* const> args)
+    {
+        Verify(args.length == target.params.size());
+        Instruction* const instr = block->CreateThenAppendInstr(Opcode_jump, Ir_void, args.length, &module.arena);
+        for (uint i = 0; i < args.length; ++i) {
+            ASSERT(args[i]->typekind == target.params[i]->typekind);
+            instr->SetOperand(i, args[i]);
+        }
+        block->succs[0] = &target;
+        block->numSuccs = 1;
+    }
+
+    // To ifNonzero if cond isn't 0 (or false), else to ifZero. Neither can have params.
+    void Branch(Value* cond, Block& ifNonzero, Block& ifZero)
+    {
+        ASSERT(cond->typekind == Ir_a32 || cond->typekind == Ir_bool);
+        Implemented(ifNonzero.params.empty() && ifZero.params.empty());
+        (void)block->CreateThenAppendInstr1(Opcode_branch, Ir_void, cond);
+        block->succs[0] = &ifNonzero;
+        block->succs[1] = &ifZero;
+        block->numSuccs = 2;
+    }
+
+    // A literal of the type of a and b, which are both Ir_a32 or both Ir_a64.
+    LiteralValue* LiteralOfType(IrTypekind typekind, uint64_t z)
+    {
+        return typekind == Ir_a64 ? module.LiteralU64(z) : module.LiteralU32(uint32_t(z));
+    }
+
+    // All arithmetic is modulo 2^32, or 2^64 for a64, same as the runtime iadd.
+    Value* Iadd(Value* a, Value* b, const char* debugName)
+    {
+        IrTypekind const typekind = a->typekind;
+        ASSERT((typekind == Ir_a32 || typekind == Ir_a64) && b->typekind == typekind);
+        if (!bFold)
+            return block->CreateThenAppendInstr2(Opcode_iadd, typekind, a, b, debugName);
+
+        // Canonicalize the literal to be on the right, so the other rules only need to check one side.
+        if (IsLiteral(a)) {
+            Value* t = a;
+            a = b;
+            b = t;
+        }
+        if (!IsLiteral(b))
+            return block->CreateThenAppendInstr2(Opcode_iadd, typekind, a, b, debugName);
+
+        uint64_t const mask = typekind == Ir_a64 ? ~uint64_t(0) : 0xFFFF'FFFFu;
+        uint64_t c = static_cast<LiteralValue*>(b)->zext;
+        if (IsLiteral(a)) {
+            return LiteralOfType(typekind, static_cast<LiteralValue*>(a)->zext + c);
+        }
+        // (x + c0) + c  ->  x + (c0 + c)
+        // Looping isn't needed if every iadd was created by this, since then `x` can't also be an iadd of a literal,
+        // but the block could have been built some other way.
+        while (Instruction* inner = AsIaddOfLiteral(a)) {
+            c += static_cast<LiteralValue*>(inner->Operand(1))->zext;
+            a = inner->Operand(0);
+        }
+        if ((c & mask) == 0)
+            return a;
+        return block->CreateThenAppendInstr2(Opcode_iadd, typekind, a, LiteralOfType(typekind, c), debugName);
+    }
+
+    // opcode is icmp_eq or icmp_ult.
+    Value* Icmp(Opcode opcode, Value* a, Value* b, const char* debugName)
+    {
+        ASSERT(opcode == Opcode_icmp_eq || opcode == Opcode_icmp_ult);
+        ASSERT((a->typekind == Ir_a32 || a->typekind == Ir_a64) && b->typekind == a->typekind);
+        if (bFold && IsLiteral(a) && IsLiteral(b)) {
+            uint64_t const x = static_cast<LiteralValue*>(a)->zext, y = static_cast<LiteralValue*>(b)->zext;
+            return module.LiteralBool(opcode == Opcode_icmp_eq ? x == y : x < y);
+        }
+        if (bFold && a == b)
+            return module.LiteralBool(opcode == Opcode_icmp_eq);
+        return block->CreateThenAppendInstr2(opcode, Ir_bool, a, b, debugName);
+    }
+
+    Value* Select(Value* cond, Value* ifTrue, Value* ifFalse, const char* debugName)
+    {
+        ASSERT(cond->typekind == Ir_bool && (ifTrue->typekind == Ir_a32 || ifTrue->typekind == Ir_a64));
+        ASSERT(ifFalse->typekind == ifTrue->typekind);
+        if (bFold && IsLiteral(cond))
+            return static_cast<LiteralValue*>(cond)->zext ? ifTrue : ifFalse;
+        if (bFold && ifTrue == ifFalse)
+            return ifTrue;
+        Instruction* const instr = block->CreateThenAppendInstr(Opcode_select, ifTrue->typekind, 3);
+        instr->debugName = debugName;
+        instr->SetOperand(0, cond);
+        instr->SetOperand(1, ifTrue);
+        instr->SetOperand(2, ifFalse);
+        return instr;
+    }
+};
+
+struct OptimizeStats {
+    uint numForwardedReads = 0;
+    uint numDeadWrites     = 0;
+    uint numDeadInstrs     = 0; // includes the above
+};
+
+// Removes instructions whose result is never used and that have no side effects, forwards
+// read_test_input of an offset that was already read (test input doesn't change), and removes
+// write_test_output to an offset that is written again later (nothing reads test output).
+// Runs before RA, and is linear in the number of instructions and operands.
+static OptimizeStats EliminateDeadCodeAndRedundantTestIo(Block& block)
+{
+    OptimizeStats stats;
+    std::vector<Instruction*>& instrs = block.instructions;
+
+    // Forward redundant reads: re-point uses of a later read to the first one of the same offset and type.
+    // Use-lists of the first read become out of order, but only liveness is computed from them
+    // before they are rebuilt.
+    {
+        std::unordered_map<uint64_t, Instruction*> firstReads;
+        for (Instruction* const instr : instrs) {
+            if (instr->opcode != Opcode_read_test_input)
+                continue;
+            ASSERT(instr->Operand(0)->opcode == Opcode_Literal);
+            uint64_t const offset = static_cast<LiteralValue*>(instr->Operand(0))->zext;
+            auto const r = firstReads.insert({ uint64_t(instr->typekind) << 32 | offset, instr });
+            if (r.second)
+                continue;
+            Instruction* const first = r.first->second;
+            for (const Use& use : instr->uses) {
+                use.value->_operands[use.operandIndex] = first;
+                first->uses.push_back(use);
+            }
+            instr->uses.clear();
+            stats.numForwardedReads++;
+        }
+    }
+
+    // Walking backwards, all users of an instruction were visited before it,
+    // so if none of them are live, the instruction isn't either.
+    std::vector<bool> live(instrs.size());
+    {
+        std::unordered_set<uint32_t> laterWrites;
+        for (uint i = uint(instrs.size()); i--;) {
+            Instruction* const instr = instrs[i];
+            ASSERT(instr->instrIndexInBlock == i);
+            bool isLive;
+            switch (instr->opcode) {
+            case Opcode_read_test_input:
+            case Opcode_iadd:
+            case Opcode_icmp_eq:
+            case Opcode_icmp_ult:
+            case Opcode_select:
+            case Opcode_load_global: {
+                isLive = false;
+                for (const Use& use : instr->uses) {
+                    if (live[use.value->instrIndexInBlock]) {
+                        isLive = true;
+                        break;
+                    }
+                }
+            } break;
+            case Opcode_write_test_output: {
+                // A vector or a64 write is dead only if every word's offset is written later.
+                ASSERT(instr->Operand(0)->opcode == Opcode_Literal);
+                uint32_t const offset = uint32_t(static_cast<LiteralValue*>(instr->Operand(0))->zext);
+                isLive = false;
+                for (uint word = 0; word < WordCount(instr->Operand(1)->typekind); ++word)
+                    isLive |= laterWrites.insert(offset + 4 * word).second;
+                stats.numDeadWrites += !isLive;
+            } break;
+            case Opcode_spill:
+            case Opcode_load_spilled:
+                unreachable; // should run before RA
+            default:
+                isLive = true;
+                break;
+            }
+            live[i] = isLive;
+        }
+    }
+
+    uint n = 0;
+    for (uint i = 0; i < instrs.size(); ++i) {
+        if (live[i]) {
+            instrs[n++] = instrs[i];
+        }
+        else {
+            delete instrs[i];
+        }
+    }
+    stats.numDeadInstrs = uint(instrs.size()) - n;
+    instrs.resize(n);
+    block.RebuildUseLists();
+    return stats;
+}
+
+// Straight-line SLP vectorization into Ir_v8a32 or Ir_v4a32, before RA and after EliminateDeadCodeAndRedundantTestIo.
+// Seeds are writes of Lanes adjacent test output offsets. From the values written, the tree of isomorphic
+// operations is followed down the operands: Lanes iadds become a vector iadd of the vectors of their operands
+// (commuted per lane when that makes the lanes match), Lanes reads of adjacent offsets a vector read, and Lanes equal
+// literals a splat. Anything else, or an iadd also used outside of its lane, stops the whole tree, since there is
+// no way to gather scalars into a vector or extract lanes. A vectorized tree goes right before the last of its
+// writes, which are removed, and the scalar instructions left without uses are removed after.
+template<uint Lanes>
+struct SlpVectorizer {
+    static const uint MaxDepth = 64; // keeps the recursion shallow
+    static const IrTypekind VectorTypekind = Lanes == 8 ? Ir_v8a32 : Ir_v4a32;
+
+    Module& module;
+    Arena& arena; // for the names of the vectors
+    std::vector<Instruction*> newInstrs; // the current tree, in order
+
+    static uint32_t OffsetOf(const Value* read)
+    {
+        return uint32_t(static_cast<const LiteralValue*>(static_cast<const Instruction*>(read)->Operand(0))->zext);
+    }
+
+    // Could v be in the given lane of a vector whose lane 0 is lane0, as far as v itself goes.
+    static bool Matches(const Value* v, const Value* lane0, uint lane)
+    {
+        if (v->opcode != lane0->opcode || v->typekind != lane0->typekind)
+            return false;
+        if (IsLiteral(v))
+            return static_cast<const LiteralValue*>(v)->zext == static_cast<const LiteralValue*>(lane0)->zext;
+        if (v->opcode == Opcode_read_test_input)
+            return OffsetOf(v) == OffsetOf(lane0) + 4 * lane;
+        return true;
+    }
+
+    // The operands of the iadds by lane, those of lanes 1 and up swapped if only that way they match lane 0's.
+    static void OperandsOf(Value* const (&values)[Lanes], Value* (&a)[Lanes], Value* (&b)[Lanes])
+    {
+        for (uint lane = 0; lane < Lanes; ++lane) {
+            const Instruction* const iadd = static_cast<const Instruction*>(values[lane]);
+            a[lane] = iadd->Operand(0);
+            b[lane] = iadd->Operand(1);
+            if (lane && !(Matches(a[lane], a[0], lane) && Matches(b[lane], b[0], lane)) &&
+                Matches(b[lane], a[0], lane) && Matches(a[lane], b[0], lane)) {
+                std::swap(a[lane], b[lane]);
+            }
+        }
+    }
+
+    static bool CanVectorize(Value* const (&values)[Lanes], uint depth)
+    {
+        if (depth > MaxDepth)
+            return false;
+        if (values[0]->typekind != Ir_a32)
+            return false;
+        if (IsLiteral(values[0]) || values[0]->opcode == Opcode_read_test_input) {
+            for (uint lane = 0; lane < Lanes; ++lane) {
+                if (!Matches(values[lane], values[0], lane))
+                    return false;
+            }
+            return true;
+        }
+        for (uint lane = 0; lane < Lanes; ++lane) {
+            if (!Matches(values[lane], values[0], lane) || values[lane]->opcode != Opcode_iadd ||
+                static_cast<RuntimeValue*>(values[lane])->uses.size() != 1)
+                return false;
+            for (uint other = 0; other < lane; ++other) {
+                if (values[other] == values[lane])
+                    return false;
+            }
+        }
+        Value* a[Lanes];
+        Value* b[Lanes];
+        OperandsOf(values, a, b);
+        return CanVectorize(a, depth + 1) && CanVectorize(b, depth + 1);
+    }
+
+    Instruction* NewInstr(Opcode opcode, uint numOperands, const Value* lane0)
+    {
+        Instruction* const instr = new Instruction();
+        instr->opcode = opcode;
+        instr->typekind = VectorTypekind;
+        instr->_nOperands = numOperands;
+        const char* const name = static_cast<const RuntimeValue*>(lane0)->debugName;
+        size_t const length = name ? strlen(name) : 0;
+        char* const vecName = arena.AllocArray<char>(length + 3);
+        memcpy(vecName, name, length);
+        memcpy(vecName + length, Lanes == 8 ? "x8" : "x4", 3);
+        instr->debugName = vecName;
+        newInstrs.push_back(instr);
+        return instr;
+    }
+
+    // Appends the instructions computing the vector of values to newInstrs, operands first.
+    Value* Vectorize(Value* const (&values)[Lanes])
+    {
+        if (IsLiteral(values[0]))
+            return module.LiteralSplat(VectorTypekind, uint32_t(static_cast<LiteralValue*>(values[0])->zext));
+        if (values[0]->opcode == Opcode_read_test_input) {
+            Instruction* const read = NewInstr(Opcode_read_test_input, 1, values[0]);
+            read->SetOperand(0, module.LiteralU32(OffsetOf(values[0])));
+            return read;
+        }
+        Value* a[Lanes];
+        Value* b[Lanes];
+        OperandsOf(values, a, b);
+        Value* const va = Vectorize(a);
+        Value* const vb = Vectorize(b);
+        Instruction* const iadd = NewInstr(Opcode_iadd, 2, values[0]);
+        iadd->SetOperand(0, va);
+        iadd->SetOperand(1, vb);
+        return iadd;
+    }
+
+    // If the writes from it on start a tree of Lanes writes, puts it in newInstrs with the vector write last, the
+    // scalar writes in seeds, and moves it past them.
+    bool TakeTree(std::map<uint32_t, Instruction*>& writes, std::map<uint32_t, Instruction*>::iterator& it,
+        Instruction** seeds)
+    {
+        Value* values[Lanes];
+        auto next = it;
+        uint lane = 0;
+        for (; lane < Lanes && next != writes.end() && next->first == it->first + 4 * lane; ++lane, ++next) {
+            seeds[lane] = next->second;
+            values[lane] = next->second->Operand(1);
+        }
+        if (lane < Lanes || !CanVectorize(values, 0))
+            return false;
+        newInstrs.clear();
+        Value* const vector = Vectorize(values);
+        Instruction* const write = new Instruction();
+        write->opcode = Opcode_write_test_output;
+        write->typekind = Ir_void;
+        write->_nOperands = 2;
+        write->SetOperand(0, seeds[0]->Operand(0));
+        write->SetOperand(1, vector);
+        newInstrs.push_back(write);
+        it = next;
+        return true;
+    }
+};
+
+// Returns the number of trees vectorized. maxLanes is 4 or 8, with 8 the trees of 8 are taken first, then those of
+// 4 in what is left. The names of the vectors are from arena, the module's if null.
+static uint VectorizeSlp(Module& module, Block& block, Arena* arena = nullptr, uint maxLanes = 4)
+{
+    ASSERT(maxLanes == 4 || maxLanes == 8);
+    std::vector<Instruction*>& instrs = block.instructions;
+
+    // Offsets written once, by a scalar write. Sorted, so adjacent offsets are next to each other.
+    std::map<uint32_t, Instruction*> writes;
+    std::unordered_set<uint32_t> writtenAgain;
+    for (Instruction* const instr : instrs) {
+        if (instr->opcode != Opcode_write_test_output)
+            continue;
+        uint32_t const offset = uint32_t(static_cast<LiteralValue*>(instr->Operand(0))->zext);
+        if (instr->Operand(1)->typekind != Ir_a32 || !writes.insert({ offset, instr }).second)
+            writtenAgain.insert(offset);
+    }
+    for (uint32_t offset : writtenAgain)
+        writes.erase(offset);
+
+    Arena& names = arena ? *arena : module.arena;
+    SlpVectorizer<8> slp8 = { module, names, {} };
+    SlpVectorizer<4> slp4 = { module, names, {} };
+    std::unordered_map<const Instruction*, std::vector<Instruction*>> insertBefore;
+    std::unordered_set<const Instruction*> removed;
+    uint numTrees = 0;
+    for (auto it = writes.begin(); it != writes.end();) {
+        Instruction* seeds[MaxLanes];
+        uint numLanes;
+        std::vector<Instruction*>* tree;
+        if (maxLanes == 8 && slp8.TakeTree(writes, it, seeds)) {
+            numLanes = 8;
+            tree = &slp8.newInstrs;
+        }
+        else if (slp4.TakeTree(writes, it, seeds)) {
+            numLanes = 4;
+            tree = &slp4.newInstrs;
+        }
+        else {
+            ++it;
+            continue;
+        }
+        const Instruction* last = seeds[0];
+        for (uint lane = 0; lane < numLanes; ++lane) {
+            if (seeds[lane]->instrIndexInBlock > last->instrIndexInBlock)
+                last = seeds[lane];
+            removed.insert(seeds[lane]);
+        }
+        std::vector<Instruction*>& before = insertBefore[last];
+        before.insert(before.end(), tree->begin(), tree->end());
+        ++numTrees;
+    }
+    if (!numTrees)
+        return 0;
+
+    std::vector<Instruction*> vectorized;
+    vectorized.reserve(instrs.size() + 4 * numTrees);
+    for (Instruction* const instr : instrs) {
+        auto const r = insertBefore.find(instr);
+        if (r != insertBefore.end())
+            vectorized.insert(vectorized.end(), r->second.begin(), r->second.end());
+        if (removed.count(instr))
+            delete instr;
+        else
+            vectorized.push_back(instr);
+    }
+    instrs.swap(vectorized);
+    block.RebuildUseLists();
+    EliminateDeadCodeAndRedundantTestIo(block); // the scalar trees and reads no longer used
+    return numTrees;
+}
+
+// Top-down list scheduling of a block before RA, to lower register pressure.
+//
+// Live values are counted per register class, against reglimit, predlimit and veclimit, as RA will see them
+// (bools are data values when predlimit is 0). While every class stays within its limit, the ready instruction
+// that was earliest in the original order is picked, so the source order is kept when it doesn't matter.
+// Otherwise, the ready instruction that frees the most registers (operands it is the last use of, minus its own
+// def) in the classes at their limit is picked, with ties broken by the higher Sethi-Ullman number, then by
+// original order. This helps blocks that read everything up front and use it late.
+//
+// Edges of the dependence DAG are the use-lists, plus an edge between writes to the same test output offset,
+// and between accesses to the same global. Reads of test input can move freely since nothing writes test input.
+// Vector and a64 writes cover several offsets, so if there are any, all writes keep their order. The return stays last.
+//
+// Instructions that had no dependences (usually reads) are kept in a heap by original index, and only its top
+// is considered, since they all have the same effect on pressure; instructions that became ready later are
+// scanned linearly, there are usually few of them.
+static void ScheduleForRegisterPressure(Block& block, uint reglimit, uint predlimit = 0, uint veclimit = 0)
+{
+    uint const limits[RegClass_count] = { reglimit, predlimit, veclimit };
+    bool const bPredRegs = predlimit != 0;
+    std::vector<Instruction*>& instrs = block.instructions;
+    ASSERT(!instrs.empty() && instrs.back()->opcode == Opcode_return && instrs.back()->OperandCount() == 0);
+    uint const n = uint(instrs.size()) - 1; // not counting the return
+
+    std::vector<uint> numUnscheduledPreds(n);
+    std::vector<uint> remainingUses(n);
+    std::vector<uint> nextOrdered(n, uint(-1)); // the next write to the same test output offset or global
+    std::vector<uint> suNumbers(n);
+    bool bWideWrites = false;
+    for (uint i = 0; i < n; ++i)
+        bWideWrites |= instrs[i]->opcode == Opcode_write_test_output && WordCount(instrs[i]->Operand(1)->typekind) > 1;
+    {
+        std::unordered_map<uint32_t, uint> lastWrites; // all in one chain at offset 0 with vector or a64 writes
+        std::unordered_map<uint32_t, uint> lastGlobalAccesses; // loads too, they can't pass stores
+        for (uint i = 0; i < n; ++i) {
+            Instruction* const instr = instrs[i];
+            ASSERT(instr->instrIndexInBlock == i);
+            remainingUses[i] = uint(instr->uses.size());
+
+            uint numPreds = 0;
+            uint suMax = 0, suMaxCount = 0;
+            for (uint j = 0; j < instr->OperandCount(); ++j) {
+                Value* const operand = instr->Operand(j);
+                if (operand->opcode == Opcode_Literal)
+                    continue;
+                uint const operandIndex = static_cast<RuntimeValue*>(operand)->instrIndexInBlock;
+                ASSERT(operandIndex < i);
+                numPreds++; // counted again if repeated, see below
+                uint const su = suNumbers[operandIndex];
+                if (su > suMax) {
+                    suMax = su;
+                    suMaxCount = 1;
+                }
+                else if (su == suMax) {
+                    suMaxCount++;
+                }
+            }
+            // Sethi-Ullman: needs one more register if 2+ operands need the most registers.
+            suNumbers[i] = instr->typekind == Ir_void ? suMax : Max(1u, suMax + (suMaxCount > 1));
+
+            if (instr->opcode == Opcode_write_test_output) {
+                ASSERT(instr->Operand(0)->opcode == Opcode_Literal);
+                uint32_t const offset = bWideWrites ? 0 : uint32_t(static_cast<LiteralValue*>(instr->Operand(0))->zext);
+                auto const r = lastWrites.insert({ offset, i });
+                if (!r.second) {
+                    nextOrdered[r.first->second] = i;
+                    r.first->second = i;
+                    numPreds++;
+                }
+            }
+            else if (instr->opcode == Opcode_load_global || instr->opcode == Opcode_store_global) {
+                uint32_t const global = uint32_t(static_cast<LiteralValue*>(instr->Operand(0))->zext);
+                auto const r = lastGlobalAccesses.insert({ global, i });
+                if (!r.second) {
+                    nextOrdered[r.first->second] = i;
+                    r.first->second = i;
+                    numPreds++;
+                }
+            }
+            else {
+                ASSERT(instr->opcode == Opcode_read_test_input || instr->opcode == Opcode_iadd ||
+                       instr->opcode == Opcode_icmp_eq || instr->opcode == Opcode_icmp_ult || instr->opcode == Opcode_select);
+            }
+            numUnscheduledPreds[i] = numPreds;
+        }
+    }
+
+    // Min-heap of original index:
+    std::vector<uint> readyRoots;
+    std::vector<uint> readyLater;
+    for (uint i = 0; i < n; ++i) {
+        if (numUnscheduledPreds[i] == 0)
+            readyRoots.push_back(i); // already a heap since sorted
+    }
+    auto heapGreater = [](uint a, uint b) { return a > b; };
+
+    // How much scheduling i lowers the number of live values of each class; negative means it raises it.
+    auto const pressureDecrease = [&](uint i, int (&decrease)[RegClass_count]) {
+        const Instruction* const instr = instrs[i];
+        for (int& d : decrease)
+            d = 0;
+        for (uint j = 0; j < instr->OperandCount(); ++j) {
+            const Value* const operand = instr->Operand(j);
+            if (operand->opcode == Opcode_Literal)
+                continue;
+            uint occurrences = 0;
+            for (uint k = 0; k < instr->OperandCount(); ++k)
+                occurrences += instr->Operand(k) == operand;
+            uint const opIndex = static_cast<const RuntimeValue*>(operand)->instrIndexInBlock;
+            // Only count a repeated operand at its first occurrence:
+            bool first = true;
+            for (uint k = 0; k < j; ++k)
+                first &= instr->Operand(k) != operand;
+            decrease[RegClassOf(operand->typekind, bPredRegs)] += first && remainingUses[opIndex] == occurrences;
+        }
+        if (!instr->uses.empty())
+            decrease[RegClassOf(instr->typekind, bPredRegs)]--;
+    };
+    std::vector<Instruction*> scheduled;
+    scheduled.reserve(instrs.size());
+    int numLive[RegClass_count] = { };
+    while (scheduled.size() < n) {
+        // Candidates are readyLater[0:size) and the top of readyRoots, stored as index size:
+        uint const numCandidates = uint(readyLater.size()) + !readyRoots.empty();
+        ASSERT(numCandidates != 0);
+        auto const candidate = [&](uint c) { return c < readyLater.size() ? readyLater[c] : readyRoots[0]; };
+
+        uint best = uint(-1);
+        uint bestInstr = uint(-1);
+        int decrease[RegClass_count];
+        // Prefer original order while it doesn't go over any limit.
+        for (uint c = 0; c < numCandidates; ++c) {
+            uint const i = candidate(c);
+            if (i > bestInstr)
+                continue;
+            pressureDecrease(i, decrease);
+            bool bFits = true;
+            for (uint cls = 0; cls < RegClass_count; ++cls)
+                bFits &= numLive[cls] - decrease[cls] <= int(limits[cls]);
+            if (bFits) {
+                best = c;
+                bestInstr = i;
+            }
+        }
+        if (best == uint(-1)) {
+            // A def adds at most one value, so the classes it would go over are the ones already at their limit.
+            int bestDecrease = INT32_MIN;
+            for (uint c = 0; c < numCandidates; ++c) {
+                uint const i = candidate(c);
+                pressureDecrease(i, decrease);
+                int atLimitDecrease = 0;
+                for (uint cls = 0; cls < RegClass_count; ++cls)
+                    atLimitDecrease += numLive[cls] >= int(limits[cls]) ? decrease[cls] : 0;
+                if (atLimitDecrease > bestDecrease ||
+                    (atLimitDecrease == bestDecrease &&
+                     (suNumbers[i] > suNumbers[bestInstr] || (suNumbers[i] == suNumbers[bestInstr] && i < bestInstr)))) {
+                    best = c;
+                    bestInstr = i;
+                    bestDecrease = atLimitDecrease;
+                }
+            }
+        }
+
+        uint const i = bestInstr;
+        Instruction* const instr = instrs[i];
+        pressureDecrease(i, decrease);
+        for (uint cls = 0; cls < RegClass_count; ++cls)
+            numLive[cls] -= decrease[cls];
+        if (best < readyLater.size()) {
+            readyLater[best] = readyLater.back();
+            readyLater.pop_back();
+        }
+        else {
+            std::pop_heap(readyRoots.begin(), readyRoots.end(), heapGreater);
+            readyRoots.pop_back();
+        }
+        scheduled.push_back(instr);
+
+        for (uint j = 0; j < instr->OperandCount(); ++j) {
+            Value* const operand = instr->Operand(j);
+            if (operand->opcode != Opcode_Literal)
+                remainingUses[static_cast<RuntimeValue*>(operand)->instrIndexInBlock]--;
+        }
+        auto const release = [&](uint succ) {
+            ASSERT(numUnscheduledPreds[succ] != 0);
+            if (--numUnscheduledPreds[succ] == 0)
+                readyLater.push_back(succ);
+        };
+        for (const Use& use : instr->uses)
+            release(use.value->instrIndexInBlock);
+        if (nextOrdered[i] != uint(-1))
+            release(nextOrdered[i]);
+    }
+
+    scheduled.push_back(instrs.back());
+    instrs = std::move(scheduled);
+    block.RebuildUseLists();
+}
+
+struct PrintContext {
+    bool bPrintRegs = false;
+};
+
+static const char* TypekindStr(IrTypekind typekind)
+{
+    const char* s = nullptr;
+    switch (typekind) {
+    case Ir_void: s = "void"; break;
+    case Ir_bool: s = "bool"; break;
+    case Ir_a32:  s = "dword"; break; // idea is to not use numbers since many other things will have numbers
+    case Ir_v4a32: s = "dwordx4"; break;
+    case Ir_a64:  s = "qword"; break;
+    case Ir_v8a32: s = "dwordx8"; break;
+    } // switch
+    ASSUME(s);
+    return s;
+}
+
+static const char* InstructionOpcodeStr(Opcode opcode)
+{
+    const char* s = nullptr;
+#define CASE(n) case Opcode_##n: s = #n; break
+    switch (opcode)
+    {
+    case Opcode_Literal:
+    case Opcode_GlobalVariable:
+    case Opcode_ExplicitBlockParameter:
+        unreachable; // or not implemented
+    CASE(read_test_input);
+    CASE(write_test_output);
+    CASE(spill);
+    CASE(load_spilled);
+    CASE(return);
+    CASE(jump);
+    CASE(branch);
+    CASE(move);
+    CASE(swap);
+    CASE(iadd);
+    CASE(icmp_eq);
+    CASE(icmp_ult);
+    CASE(select);
+    CASE(load_global);
+    CASE(store_global);
+    }
+#undef CASE
+    ASSUME(s);
+    return s;
+}
+
+static void PrintValue(PrintContext&, ByteStream& bs, const Value& value)
+{
+    switch (value.opcode) {
+    case Opcode_Literal: {
+        const LiteralValue& lit = static_cast<const LiteralValue&>(value);
+        switch (value.typekind) {
+        case Ir_void:
+            unreachable;
+        case Ir_bool:
+            ASSERT(lit.zext < 2u);
+            Print(bs, lit.zext ? "true" : "false");
+            break;
+        case Ir_a32:
+            // i32 is most common, so have no suffix for it (so just "0" instead of "0_i32" or "i32 0").
+            // Will want suffix for other types.
+            // If opcode [+ operand index] is float data: print float, in addition to hex. 
+            Print(bs, int32_t(lit.zext));
+            break;
+        case Ir_v4a32:
+            Print(bs, "splat(", int32_t(lit.zext), ")");
+            break;
+        case Ir_v8a32:
+            Print(bs, "splat8(", int32_t(lit.zext), ")");
+            break;
+        case Ir_a64:
+            Print(bs, int64_t(lit.zext), "_q");
+            break;
+        } // switch
+    } break;
+    default: {
+        const RuntimeValue& rtv = static_cast<const RuntimeValue&>(value);
+        Print(bs, rtv.debugName);
+    } break;
+    } // switch
+}
+
+// \r for data registers, \p for predicate registers, \v for vector registers.
+static void PrintSlashAndReg(ByteStream& bs, RegLoc reg)
+{
+    if (reg == RegLocInvalid)                  ByteStream_format(bs, R"(\r?)");
+    else if (RegClassOf(reg) == RegClass_pred) ByteStream_format(bs, R"(\p%u)", unsigned(RegIndexOf(reg)));
+    else if (RegClassOf(reg) == RegClass_vec)  ByteStream_format(bs, R"(\v%u)", unsigned(RegIndexOf(reg)));
+    else                                       ByteStream_format(bs, R"(\r%u)", unsigned(RegIndexOf(reg)));
+}
+
+static void PrintBlock(PrintContext& ctx, ByteStream& bs, const Block& block, uint indentation)
+{
+    for (const Instruction* const instr : block.instructions) {
+        bs.PutByteRepeated(' ', indentation);
+        if (instr->typekind != Ir_void) {
+            ByteStream_format(bs, "%s %s", TypekindStr(instr->typekind), instr->debugName);
+            if (ctx.bPrintRegs) {
+                PrintSlashAndReg(bs, instr->ra.dstReg);
+            }
+            Print(bs, " = ");
+        }
+        Print(bs, InstructionOpcodeStr(instr->opcode));
+        switch (instr->opcode) {
+        case Opcode_return:
+        case Opcode_jump:
+            if (instr->OperandCount() == 0)
+                break;
+            // fallthrough
+        default:
+            bs.PutByte('(');
+            for (uint i = 0;;) {
+                const Value* operand = instr->Operand(i);
+                PrintValue(ctx, bs, *operand);
+                // Jump arguments aren't read from registers, the moves before the jump put them in the params.
+                if (ctx.bPrintRegs && operand->opcode != Opcode_Literal && instr->opcode != Opcode_jump) {
+                    ASSERT(operand->typekind != Ir_void);
+                    PrintSlashAndReg(bs, instr->ra.srcRegs[i]);
+                }
+                if (++i == instr->OperandCount())
+                    break;
+                Print(bs, ", ");
+            }
+            bs.PutByte(')');
+        }
+        if (instr->opcode == Opcode_jump || instr->opcode == Opcode_branch) {
+            for (uint i = 0; i < block.numSuccs; ++i) {
+                if (i)
+                    ByteStream_format(bs, ", bb%u", block.succs[i]->rpoIndex);
+                else
+                    ByteStream_format(bs, " -> bb%u", block.succs[i]->rpoIndex);
+            }
+        }
+        Print(bs, ";\n");
+    }
+}
+
+static void PrintFunction(PrintContext& ctx, ByteStream& bs, const Function& function, uint indentation)
+{
+    for (const Block* const block : function.rpo) {
+        bs.PutByteRepeated(' ', indentation);
+        ByteStream_format(bs, "bb%u", block->rpoIndex);
+        for (const BlockParameter* const param : block->params) {
+            if (param->index)
+                ByteStream_format(bs, ", %s %s", TypekindStr(param->typekind), param->debugName);
+            else
+                ByteStream_format(bs, "(%s %s", TypekindStr(param->typekind), param->debugName);
+        }
+        Print(bs, block->params.empty() ? ":\n" : "):\n");
+        PrintBlock(ctx, bs, *block, indentation + 4);
+    }
+}
+
+// Parses straight-line blocks as PrintBlock prints them, one after another with each ending at its return, so IR
+// dumps can be replayed through the passes and RA. Register annotations are optional, and printing a parsed block
+// gives back the text it was parsed from. Text that isn't IR Verifies, like in the Scanner.
+// One pass over the tokens: a name is looked up in a hash table of the block's definitions, and copied to the
+// module's arena once. Operands are set without touching use-lists, which are built once at the end of a block.
+//
+// After RA, reloads, rematerializations and moves are named after the value they restore or copy, and operands
+// still refer to the original value. So a definition with a register annotation of a name already defined doesn't
+// rebind the name, and restores the value if it is a load_spilled or has the same opcode (rematerialized).
+// Without an annotation, a second definition shadows the first. Either way, a block whose names repeat before RA,
+// like the ones GenerateDataParallelBlock builds, prints as text that means something else.
+struct IrTextParser {
+    Module& module;
+    Scanner scanner;
+    Token token;
+
+    // Open addressing, hashed by the bytes of the name. Slots of earlier blocks are empty, by generation.
+    struct NameSlot {
+        uint64_t hash;
+        Instruction* instr;
+        uint generation;
+    };
+    std::vector<NameSlot> names;
+    uint numNames = 0;
+    uint generation = 0;
+
+    // text[text.length] must be '\0'. The module must have the globals the text uses.
+    IrTextParser(Module& module, view<const char> text) : module(module), scanner(text), names(1024)
+    {
+        Next();
+    }
+
+    bool AtEnd() const { return token.kind == Token_EOF; }
+
+    // Into the empty block.
+    void ParseBlock(Block& block)
+    {
+        ASSERT(block.instructions.empty());
+        generation++;
+        numNames = 0;
+        for (;;) {
+            IrTypekind typekind = Ir_void;
+            Token name = { };
+            RegLoc dstReg = RegLocInvalid;
+            bool bDstReg = false;
+            if (TakeTypekind(typekind)) {
+                Verify(token.kind == Token_Name); // @invalid_source
+                name = token;
+                Next();
+                if (token.kind == Token_Backslash) {
+                    dstReg = TakeReg();
+                    bDstReg = true;
+                }
+                Expect(Token_Assign);
+            }
+            Opcode const opcode = TakeOpcode();
+            Implemented(opcode != Opcode_jump && opcode != Opcode_branch);
+            Instruction* const instr = block.CreateThenAppendInstr(opcode, typekind, 0);
+            instr->ra.dstReg = dstReg;
+            if (token.kind == Token_ParenOpen) {
+                Next();
+                for (;;) {
+                    Verify(instr->_nOperands < MaxOperands); // @invalid_source
+                    uint const i = instr->_nOperands++;
+                    instr->_operands[i] = TakeOperand(instr->ra.srcRegs[i]);
+                    if (token.kind != Token_Comma)
+                        break;
+                    Next();
+                }
+                Expect(Token_ParenClose);
+            }
+            Expect(Token_Semicolon);
+            if (opcode == Opcode_load_global || opcode == Opcode_store_global) {
+                Verify(instr->OperandCount() != 0 && IsLiteral(instr->Operand(0)) &&
+                       static_cast<const LiteralValue*>(instr->Operand(0))->zext < module.globals.size());
+            }
+            if (typekind != Ir_void)
+                Define(instr, name, bDstReg);
+            if (opcode == Opcode_return)
+                break;
+        }
+        block.RebuildUseLists();
+    }
+
+private:
+    void Next() { Scanner_ScanToken(&scanner, &token); }
+
+    void Expect(TokenKind kind)
+    {
+        Verify(token.kind == kind); // @invalid_source
+        Next();
+    }
+
+    bool TokenIs(const char* s) const
+    {
+        return token.kind == Token_Name && strlen(s) == token.length && memcmp(s, token.source, token.length) == 0;
+    }
+
+    bool TakeTypekind(IrTypekind& typekind)
+    {
+        for (IrTypekind t : { Ir_a32, Ir_bool, Ir_a64, Ir_v4a32, Ir_v8a32 }) {
+            if (TokenIs(TypekindStr(t))) {
+                typekind = t;
+                Next();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    Opcode TakeOpcode()
+    {
+        for (uint opcode = Opcode_read_test_input; opcode <= Opcode_store_global; ++opcode) {
+            if (TokenIs(InstructionOpcodeStr(Opcode(opcode)))) {
+                Next();
+                return Opcode(opcode);
+            }
+        }
+        Verify(0); // @invalid_source: not an opcode
+        unreachable;
+    }
+
+    // \r3, \p0, \v1, or \r? for none.
+    RegLoc TakeReg()
+    {
+        Expect(Token_Backslash);
+        Verify(token.kind == Token_Name); // @invalid_source
+        char const c = token.source[0];
+        Verify(c == 'r' || c == 'p' || c == 'v'); // @invalid_source
+        RegClass const regClass = c == 'r' ? RegClass_data : c == 'p' ? RegClass_pred : RegClass_vec;
+        if (token.length == 1) {
+            Next();
+            Expect(Token_QuestionMark);
+            return RegLocInvalid;
+        }
+        uint index = 0;
+        for (uint i = 1; i < token.length; ++i) {
+            uint const d = uint(token.source[i] - '0');
+            Verify(d < 10u && index < (1u << RegLocIndexBits)); // @invalid_source
+            index = index * 10 + d;
+        }
+        Verify(index < (1u << RegLocIndexBits)); // @invalid_source
+        Next();
+        return MakeRegLoc(regClass, index);
+    }
+
+    // A literal as PrintValue prints it: -1, -1_q, splat(-1), true, or a name with an optional register.
+    Value* TakeOperand(RegLoc& reg)
+    {
+        bool const bNegative = token.kind == Token_Minus;
+        if (bNegative)
+            Next();
+        if (token.kind == Token_NumberLiteral) {
+            uint64_t const magnitude = token.data.number.nonFpZext64;
+            bool const b64 = token.xdata.number.udSuffixLength != 0;
+            Verify(!b64 || (token.xdata.number.udSuffixLength == 2 && memcmp(token.source + token.length - 2, "_q", 2) == 0));
+            Verify(b64 ? !bNegative || magnitude <= uint64_t(1) << 63
+                       : magnitude <= (bNegative ? uint64_t(1) << 31 : 0xFFFF'FFFFu)); // @invalid_source: too big
+            uint64_t const z = bNegative ? 0 - magnitude : magnitude;
+            Next();
+            return b64 ? module.LiteralU64(z) : module.LiteralU32(uint32_t(z));
+        }
+        Verify(!bNegative && token.kind == Token_Name); // @invalid_source
+        if (TokenIs("true") || TokenIs("false")) {
+            bool const b = token.length == 4;
+            Next();
+            return module.LiteralBool(b);
+        }
+        if (TokenIs("splat") || TokenIs("splat8")) {
+            IrTypekind const typekind = token.length == 5 ? Ir_v4a32 : Ir_v8a32;
+            Next();
+            Expect(Token_ParenOpen);
+            RegLoc none;
+            Value* const lane = TakeOperand(none);
+            Verify(lane->typekind == Ir_a32 && IsLiteral(lane)); // @invalid_source
+            Expect(Token_ParenClose);
+            return module.LiteralSplat(typekind, uint32_t(static_cast<LiteralValue*>(lane)->zext));
+        }
+        NameSlot* const slot = FindName(token.source, token.length, HashBytes64(token.source, token.length));
+        Verify(slot->generation == generation); // @invalid_source: not defined before in the block
+        Next();
+        if (token.kind == Token_Backslash)
+            reg = TakeReg();
+        return slot->instr;
+    }
+
+    // The slot of the name, or the empty one where it would go.
+    NameSlot* FindName(const char* s, uint length, uint64_t hash)
+    {
+        size_t const mask = names.size() - 1;
+        for (size_t i = size_t(hash) & mask;; i = (i + 1) & mask) {
+            NameSlot& slot = names[i];
+            if (slot.generation != generation)
+                return &slot;
+            const char* const other = slot.instr->debugName;
+            if (slot.hash == hash && strncmp(other, s, length) == 0 && other[length] == '\0')
+                return &slot;
+        }
+    }
+
+    void Define(Instruction* instr, const Token& name, bool bRegs)
+    {
+        if (2 * (numNames + 1) > names.size()) {
+            std::vector<NameSlot> old(names.size() * 2);
+            old.swap(names); // names is the bigger one now
+            for (const NameSlot& slot : old) {
+                if (slot.generation == generation)
+                    *FindName(slot.instr->debugName, uint(strlen(slot.instr->debugName)), slot.hash) = slot;
+            }
+        }
+        uint64_t const hash = HashBytes64(name.source, name.length);
+        NameSlot* const slot = FindName(name.source, name.length, hash);
+        if (slot->generation == generation) {
+            Instruction* const first = slot->instr;
+            instr->debugName = first->debugName;
+            if (!bRegs)
+                slot->instr = instr;
+            else if (instr->opcode == Opcode_load_spilled || (instr->opcode == first->opcode && instr->opcode != Opcode_move))
+                instr->ra.restores = first;
+            return;
+        }
+        char* const copy = module.arena.AllocArray<char>(name.length + 1);
+        memcpy(copy, name.source, name.length);
+        instr->debugName = copy;
+        *slot = { hash, instr, generation };
+        numNames++;
+    }
+};
+
+// Liveness sets are dense bitsets indexed by instrIndexInBlock, so every instruction has a bit, not
+// just the ones defining values. Sets are padded to a multiple of 128 bits for SSE2.
+struct Liveness {
+    uint numWords = 0; // per set, even
+    std::vector<uint64_t> liveIn;  // numWords per block, by rpoIndex
+    std::vector<uint64_t> liveOut;
+
+    const uint64_t* LiveIn(uint rpoIndex) const  { return &liveIn[size_t(rpoIndex) * numWords]; }
+    const uint64_t* LiveOut(uint rpoIndex) const { return &liveOut[size_t(rpoIndex) * numWords]; }
+};
+
+static forceinline bool TestBit(const uint64_t* bits, uint i) { return (bits[i / 64] >> (i % 64)) & 1; }
+static forceinline void SetBit(uint64_t* bits, uint i)        { bits[i / 64] |= uint64_t(1) << (i % 64); }
+
+template<class F>
+static void ForEachSetBit(const uint64_t* bits, uint numWords, F f)
+{
+    for (uint w = 0; w < numWords; ++w) {
+        for (uint64_t b = bits[w]; b; b &= b - 1)
+            f(w * 64 + uint(bsf64(b)));
+    }
+}
+
+static void ClearBitRange(uint64_t* bits, uint begin, uint end) // [begin, end)
+{
+    for (; begin < end && begin % 64; ++begin)
+        bits[begin / 64] &= ~(uint64_t(1) << (begin % 64));
+    for (; begin + 64 <= end; begin += 64)
+        bits[begin / 64] = 0;
+    for (; begin < end; ++begin)
+        bits[begin / 64] &= ~(uint64_t(1) << (begin % 64));
+}
+
+static void BitsetOrInto(uint64_t* dst, const uint64_t* src, uint numWords)
+{
+#if TC_SSE2
+    for (uint w = 0; w < numWords; w += 2) {
+        __m128i const d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + w));
+        __m128i const s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + w));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + w), _mm_or_si128(d, s));
+    }
+#else
+    for (uint w = 0; w < numWords; ++w)
+        dst[w] |= src[w];
+#endif
+}
+
+// dst = a | b, returns whether dst changed.
+static bool BitsetUnionChanged(uint64_t* dst, const uint64_t* a, const uint64_t* b, uint numWords)
+{
+#if TC_SSE2
+    __m128i diff = _mm_setzero_si128();
+    for (uint w = 0; w < numWords; w += 2) {
+        __m128i const r = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + w)),
+                                       _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + w)));
+        diff = _mm_or_si128(diff, _mm_xor_si128(r, _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + w))));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + w), r);
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF;
+#else
+    uint64_t diff = 0;
+    for (uint w = 0; w < numWords; ++w) {
+        uint64_t const r = a[w] | b[w];
+        diff |= r ^ dst[w];
+        dst[w] = r;
+    }
+    return diff != 0;
+#endif
+}
+
+static void BitsetAndInto(uint64_t* dst, const uint64_t* src, uint numWords)
+{
+#if TC_SSE2
+    for (uint w = 0; w < numWords; w += 2) {
+        __m128i const d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + w));
+        __m128i const s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + w));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + w), _mm_and_si128(d, s));
+    }
+#else
+    for (uint w = 0; w < numWords; ++w)
+        dst[w] &= src[w];
+#endif
+}
+
+// Backward dataflow over reverse postorder until nothing changes. Since values are SSA and a block's
+// params and instructions have contiguous indexes, a block's defs are a range instead of another set.
+// Jump arguments are uses at the end of the predecessor, so they aren't live into the successor.
+static void ComputeLiveness(const Function& function, Liveness& liveness)
+{
+    uint const numBlocks = uint(function.rpo.size());
+    uint const numWords = (function.numInstrs + 127) / 128 * 2;
+    liveness.numWords = numWords;
+    liveness.liveIn.assign(size_t(numBlocks) * numWords, 0);
+    liveness.liveOut.assign(size_t(numBlocks) * numWords, 0);
+
+    // Upward exposed uses, which are the ones defined in another block.
+    std::vector<uint64_t> gen(size_t(numBlocks) * numWords, 0);
+    for (uint b = 0; b < numBlocks; ++b) {
+        const Block& block = *function.rpo[b];
+        uint const begin = block.BeginIndex();
+        uint const end = block.instructions.back()->instrIndexInBlock + 1;
+        for (const Instruction* const instr : block.instructions) {
+            for (const Value* const operand : instr->Operands()) {
+                if (IsLiteral(operand))
+                    continue;
+                uint const index = static_cast<const RuntimeValue*>(operand)->instrIndexInBlock;
+                if (index < begin || index >= end)
+                    SetBit(&gen[size_t(b) * numWords], index);
+            }
+        }
+    }
+
+    // The sets are big, so after the first pass only blocks with a successor whose live-in changed since
+    // the block was last done are redone. Steps count block visits.
+    std::vector<uint> changedStep(numBlocks, 0), doneStep(numBlocks, 0);
+    uint step = 0;
+    std::vector<uint64_t> outMinusDefs(numWords);
+    for (bool bChanged = true; bChanged;) {
+        bChanged = false;
+        for (uint b = numBlocks; b--;) {
+            const Block& block = *function.rpo[b];
+            bool bSuccChanged = doneStep[b] == 0;
+            for (uint i = 0; i < block.numSuccs; ++i)
+                bSuccChanged |= changedStep[block.succs[i]->rpoIndex] > doneStep[b];
+            if (!bSuccChanged)
+                continue;
+            doneStep[b] = ++step;
+
+            uint64_t* const liveOut = &liveness.liveOut[size_t(b) * numWords];
+            if (block.numSuccs == 0)
+                std::fill(liveOut, liveOut + numWords, 0);
+            else
+                std::copy(liveness.LiveIn(block.succs[0]->rpoIndex), liveness.LiveIn(block.succs[0]->rpoIndex) + numWords, liveOut);
+            for (uint i = 1; i < block.numSuccs; ++i)
+                BitsetOrInto(liveOut, liveness.LiveIn(block.succs[i]->rpoIndex), numWords);
+
+            std::copy(liveOut, liveOut + numWords, outMinusDefs.begin());
+            ClearBitRange(outMinusDefs.data(), block.BeginIndex(),
+                          block.instructions.back()->instrIndexInBlock + 1);
+            if (BitsetUnionChanged(&liveness.liveIn[size_t(b) * numWords], &gen[size_t(b) * numWords],
+                                   outMinusDefs.data(), numWords)) {
+                changedStep[b] = step;
+                bChanged = true;
+            }
+        }
+    }
+}
+
+// Register bitsets. RegAllocCtx's register file width picks one at compile time (see RegBitset below),
+// so a file of up to 32 registers is the same single uint32_t code as before there were others.
+static forceinline uint FirstSetBit(uint32_t v) { return uint(bsf(v)); }
+static forceinline uint FirstSetBit(uint64_t v) { return uint(bsf64(v)); }
+
+template<class Word>
+struct SingleWordRegBitset {
+    Word bits = 0;
+
+    void SetFirstN(uint n)  { ASSERT(n <= sizeof(Word) * BitsPerByte); bits = n ? Word(-1) >> (sizeof(Word) * BitsPerByte - n) : 0; }
+    bool Test(uint i) const { return (bits >> i) & 1u; }
+    void Set(uint i)        { bits |= Word(1) << i; }
+    void Clear(uint i)      { bits &= ~(Word(1) << i); }
+    bool Any() const        { return bits != 0; }
+    uint First() const      { ASSERT(bits); return FirstSetBit(bits); }
+
+    SingleWordRegBitset AndNot(const SingleWordRegBitset& rhs) const { SingleWordRegBitset r; r.bits = bits & ~rhs.bits; return r; }
+
+    template<class F> void ForEach(F f) const
+    {
+        for (Word b = bits; b; b &= b - 1)
+            f(FirstSetBit(b));
+    }
+};
+
+template<uint NumWords>
+struct MultiWordRegBitset {
+    uint64_t words[NumWords] = { };
+
+    void SetFirstN(uint n)
+    {
+        ASSERT(n <= NumWords * 64);
+        for (uint w = 0; w < NumWords; ++w) {
+            uint const nw = n > w * 64 ? Min(n - w * 64, 64u) : 0;
+            words[w] = nw ? uint64_t(-1) >> (64 - nw) : 0;
+        }
+    }
+    bool Test(uint i) const { return (words[i / 64] >> (i % 64)) & 1u; }
+    void Set(uint i)        { words[i / 64] |= uint64_t(1) << (i % 64); }
+    void Clear(uint i)      { words[i / 64] &= ~(uint64_t(1) << (i % 64)); }
+    bool Any() const
+    {
+        uint64_t any = 0;
+        for (uint64_t word : words)
+            any |= word;
+        return any != 0;
+    }
+    uint First() const
+    {
+        for (uint w = 0;; ++w) {
+            ASSERT(w < NumWords);
+            if (words[w])
+                return w * 64 + FirstSetBit(words[w]);
+        }
+    }
+
+    MultiWordRegBitset AndNot(const MultiWordRegBitset& rhs) const
+    {
+        MultiWordRegBitset r;
+        for (uint w = 0; w < NumWords; ++w)
+            r.words[w] = words[w] & ~rhs.words[w];
+        return r;
+    }
+
+    template<class F> void ForEach(F f) const
+    {
+        for (uint w = 0; w < NumWords; ++w) {
+            for (uint64_t b = words[w]; b; b &= b - 1)
+                f(w * 64 + FirstSetBit(b));
+        }
+    }
+};
+
+template<uint MaxRegs>
+using RegBitset = typename std::conditional<(MaxRegs <= 32), SingleWordRegBitset<uint32_t>,
+                  typename std::conditional<(MaxRegs <= 64), SingleWordRegBitset<uint64_t>,
+                                            MultiWordRegBitset<(MaxRegs + 63) / 64>>::type>::type;
+
+static constexpr uint CeilPow2(uint x)
+{
+    uint p = 1;
+    while (p < x)
+        p *= 2;
+    return p;
+}
+
+// Tournament tree over registers for picking the one whose value has the farthest next use.
+// Each register has a key (the original instruction index of its value's next use), each internal
+// node holds the register with the largest key of its subtree, so the root is the victim.
+// Updating a key is O(log R) and finding the max is O(1), instead of an O(R) scan per spill.
+// Ties go to the lower register, same as a scan from register 0 would.
+template<uint MaxRegs>
+struct FarthestNextUseTree {
+    uint numLeaves = 1; // power of 2
+    uint keys[CeilPow2(MaxRegs)] = { };
+    RegLoc winners[2 * CeilPow2(MaxRegs)] = { }; // [1] is the root, leaf for reg r is [numLeaves + r]
+
+    void Init(uint reglimit)
+    {
+        ASSERT(reglimit <= MaxRegs);
+        ASSERT(reglimit != 0);
+        numLeaves = 1u << CeilLog2(reglimit);
+        for (uint r = 0; r < numLeaves; ++r) {
+            winners[numLeaves + r] = RegLoc(r);
+        }
+        for (uint i = numLeaves; --i;) {
+            winners[i] = winners[2*i];
+        }
+    }
+
+    void Set(RegLoc reg, uint key)
+    {
+        ASSERT(reg < numLeaves);
+        keys[reg] = key;
+        for (uint i = (numLeaves + reg) >> 1; i; i >>= 1) {
+            RegLoc const l = winners[2*i], r = winners[2*i + 1];
+            winners[i] = keys[r] > keys[l] ? r : l;
+        }
+    }
+
+    RegLoc Farthest() const { return winners[1]; }
+    uint Key(RegLoc reg) const { return keys[reg]; }
+};
+
+// Whether an evicted value can be recomputed instead of reloaded, which needs no spill slot or memory traffic.
+// Test inputs can be read again. `iadd(x, literal)` can be redone if x lives at least as long as the value,
+// since then x is in a register, spilled or itself recomputable whenever the value is needed.
+static bool CanRematerialize(const RuntimeValue* value)
+{
+    if (value->opcode == Opcode_read_test_input)
+        return true;
+    if (value->opcode != Opcode_iadd || value->uses.empty())
+        return false;
+    const Instruction* const iadd = static_cast<const Instruction*>(value);
+    if (!IsLiteral(iadd->Operand(1)))
+        return false;
+    const Value* const x = iadd->Operand(0);
+    if (IsLiteral(x) || x->opcode == Opcode_ExplicitBlockParameter || x->opcode == Opcode_GlobalVariable)
+        return false;
+    const RuntimeValue* const rtx = static_cast<const RuntimeValue*>(x);
+    return rtx->uses.back().value->instrIndexInBlock >= value->uses.back().value->instrIndexInBlock;
+}
+
+enum EvictionHeuristic : uint8_t {
+    // Belady's MIN: evict the value whose next use is farthest away.
+    Eviction_farthestNextUse,
+    // Evicting a clean value (one that already has a spill slot) needs only a reload later,
+    // a dirty one needs a spill now and a reload later. So pick the victim with the farthest
+    // next use per unit of cost, like MIN for clean/dirty pages.
+    Eviction_cleanAware,
+};
+
+// The registers and spill slots of one class. Bitsets, valuesInReg and the trees are by register index.
+template<uint MaxRegs>
+struct RegFile {
+    RegClass regClass = RegClass_data;
+    uint reglimit = 0; // can use at most this many registers
+
+    RegBitset<MaxRegs> freeRegsBitset;
+    RegBitset<MaxRegs> allRegsBitset; // first reglimit
+    RuntimeValue* valuesInReg[MaxRegs] = { };
+
+    // There can be any number of spill slots, a slot is reused once the value in it dies.
+    std::vector<const char*> spillNames; // indexed by SpillLoc, size is the number of slots used
+    std::vector<SpillLoc> freeSpillLocs;
+
+    FarthestNextUseTree<MaxRegs> nextUses; // keys of free registers are 0
+    FarthestNextUseTree<MaxRegs> cleanNextUses; // same, but keys of registers with dirty values are 0 too
+
+    void Init(RegClass cls, uint registerLimit)
+    {
+        Implemented(registerLimit <= MaxRegs);
+        regClass = cls;
+        reglimit = registerLimit;
+        allRegsBitset.SetFirstN(reglimit);
+        freeRegsBitset = allRegsBitset;
+        nextUses.Init(Max(reglimit, 1u));
+        cleanNextUses.Init(Max(reglimit, 1u));
+    }
+
+    RegLoc Reg(uint index) const { return MakeRegLoc(regClass, index); }
+};
+
+// MaxRegs is the register file width the code is specialized for, the limit of each class can be anything up to it.
+// Without predicate registers (predlimit 0), bools are in the data registers like everything else.
+template<uint MaxRegs>
+struct RegAllocCtx {
+    static_assert(MaxRegs <= (1u << RegLocIndexBits), "");
+
+    Module& module;
+
+    RegFile<MaxRegs> files[RegClass_count];
+    // RegClassOf of each typekind, looked up once here: FileOf is on every use and def, where recomputing it
+    // (and going from the class to its file) cost up to a tenth of the allocation time. With only data registers,
+    // the usual case, FileOf doesn't look at the value at all.
+    RegFile<MaxRegs>* filesByTypekind[Ir_v8a32 + 1];
+    bool bDataOnly;
+
+    EvictionHeuristic eviction = Eviction_farthestNextUse;
+    bool bRematerialize = true;
+    bool bLinearVictimSearch = false; // for comparing
+
+    // Only set for functions with more than one block, see GlobalRegisterAllocation.
+    // Value numbers are instrIndexInBlock, which is then the index in the whole function.
+    const uint64_t* liveOutBits = nullptr; // of the current block
+    std::vector<SpillLoc> spillLocOfValue; // a value always gets the same slot, slots aren't reused
+    uint blockEndIndex = uint(-2); // instrIndexInBlock of the current block's last instruction
+
+    std::vector<Instruction*> newInstrs;
+
+    RegAllocCtx(const RegAllocCtx&) = delete;
+    RegAllocCtx& operator=(const RegAllocCtx&) = delete;
+
+    RegAllocCtx(Module& module, uint registerLimit, uint predRegisterLimit = 0, uint vecRegisterLimit = 0)
+        : module(module)
+    {
+        files[RegClass_data].Init(RegClass_data, registerLimit);
+        files[RegClass_pred].Init(RegClass_pred, predRegisterLimit);
+        files[RegClass_vec].Init(RegClass_vec, vecRegisterLimit);
+        for (uint typekind = 0; typekind < countof(filesByTypekind); ++typekind)
+            filesByTypekind[typekind] = &files[RegClassOf(IrTypekind(typekind), HasPredRegs())];
+        bDataOnly = predRegisterLimit == 0 && vecRegisterLimit == 0;
+    }
+
+    bool HasPredRegs() const { return files[RegClass_pred].reglimit != 0; }
+    RegFile<MaxRegs>& FileOf(const RuntimeValue* value)
+    {
+        return bDataOnly ? files[RegClass_data] : *filesByTypekind[value->typekind];
+    }
+    RegFile<MaxRegs>& FileOf(RegLoc reg) { return bDataOnly ? files[RegClass_data] : files[RegClassOf(reg)]; }
+
+    uint NumSpillLocs() const
+    {
+        uint n = 0;
+        for (const RegFile<MaxRegs>& file : files)
+            n += uint(file.spillNames.size());
+        return n;
+    }
+
+    // Clean values have a spill slot already or can be rematerialized.
+    bool NeedsSpillToEvict(const RuntimeValue* value) const
+    {
+        return value->spillLoc == SpillLocInvalid && !(bRematerialize && CanRematerialize(value));
+    }
+
+    bool IsLiveOut(const RuntimeValue* value) const
+    {
+        return liveOutBits && ((liveOutBits[value->instrIndexInBlock / 64] >> (value->instrIndexInBlock % 64)) & 1);
+    }
+
+    // After its uses by the current instruction have been counted.
+    bool IsDead(const RuntimeValue* value) const
+    {
+        ASSERT(value->useIterAccelerator <= value->uses.size());
+        return (value->useIterAccelerator == value->uses.size() ||
+                value->uses[value->useIterAccelerator].value->instrIndexInBlock > blockEndIndex) &&
+               !IsLiveOut(value);
+    }
+
+    // reg is in file.
+    void SetNextUse(RegFile<MaxRegs>& file, RegLoc reg, const RuntimeValue* value, uint nextUseOrigInstrIndex)
+    {
+        ASSERT(&file == &FileOf(reg));
+        file.nextUses.Set(RegLoc(RegIndexOf(reg)), nextUseOrigInstrIndex);
+        file.cleanNextUses.Set(RegLoc(RegIndexOf(reg)), NeedsSpillToEvict(value) ? 0 : nextUseOrigInstrIndex);
+    }
+
+    SpillLoc AllocSpillLoc(RegFile<MaxRegs>& file, const char* debugName)
+    {
+        SpillLoc spillLoc;
+        if (!file.freeSpillLocs.empty()) {
+            spillLoc = file.freeSpillLocs.back();
+            file.freeSpillLocs.pop_back();
+            file.spillNames[spillLoc] = debugName;
+        }
+        else {
+            spillLoc = SpillLoc(file.spillNames.size());
+            Implemented(spillLoc != SpillLocInvalid);
+            file.spillNames.push_back(debugName);
+        }
+        return spillLoc;
+    }
+
+    void FreeSpillLoc(RegFile<MaxRegs>& file, SpillLoc spillLoc)
+    {
+        ASSERT(spillLoc < file.spillNames.size());
+        if (!liveOutBits)
+            file.freeSpillLocs.push_back(spillLoc);
+    }
+
+    SpillLoc SpillLocForStore(const RuntimeValue* value)
+    {
+        if (!liveOutBits)
+            return AllocSpillLoc(FileOf(value), value->debugName);
+        SpillLoc& spillLoc = spillLocOfValue[value->instrIndexInBlock];
+        if (spillLoc == SpillLocInvalid)
+            spillLoc = AllocSpillLoc(FileOf(value), value->debugName);
+        return spillLoc;
+    }
+};
+
+// Original instruction index of the next use, or uint(-1) if there is none.
+static uint NextUseOrigInstrIndex(const RuntimeValue* value)
+{
+    ASSERT(value->uses.size() >= value->useIterAccelerator);
+    return value->useIterAccelerator == value->uses.size() ?
+        uint32_t(-1) :
+        value->uses[value->useIterAccelerator].value->instrIndexInBlock;
+}
+
+// Returns a register index of the file.
+template<uint MaxRegs>
+static RegLoc FindFarthestNextUseVictimLinear(
+    const RegAllocCtx<MaxRegs>& ctx, const RegFile<MaxRegs>& file, uint origInstrIndex, bool bCleanOnly)
+{
+    uint farthestDist = 0;
+    RegLoc farthestVictimReg = RegLocInvalid;
+    file.allRegsBitset.AndNot(file.freeRegsBitset).ForEach([&](uint victimReg) {
+        if (bCleanOnly && ctx.NeedsSpillToEvict(file.valuesInReg[victimReg]))
+            return;
+        uint const nextUseOrigInstrIndex = NextUseOrigInstrIndex(file.valuesInReg[victimReg]);
+        ASSERT(nextUseOrigInstrIndex >= origInstrIndex);
+        uint const dist = nextUseOrigInstrIndex - origInstrIndex;
+        if (dist > farthestDist) {
+            farthestDist = dist;
+            farthestVictimReg = RegLoc(victimReg);
+        }
+    });
+    return farthestVictimReg;
+}
+
+// reg is in file.
+template<uint MaxRegs>
+static void FreeRegOfValue(RegAllocCtx<MaxRegs>& ctx, RegFile<MaxRegs>& file, RuntimeValue* value, RegLoc reg)
+{
+    ASSERT(&file == &ctx.FileOf(reg));
+    uint const index = RegIndexOf(reg);
+    ASSERT(value->currentReg == reg && file.valuesInReg[index] == value);
+    value->currentReg = RegLocInvalid;
+    file.valuesInReg[index] = nullptr;
+    file.freeRegsBitset.Set(index);
+    file.nextUses.Set(RegLoc(index), 0);
+    file.cleanNextUses.Set(RegLoc(index), 0);
+}
+
+// Location(s) because it is in a register now, but may have spilled somewhere before.
+template<uint MaxRegs>
+static void UpdateJustUsedSrcValueInReg(
+    RegAllocCtx<MaxRegs>& ctx, uint /*origInstrIndex*/, Instruction* instr, uint srcIndex, RuntimeValue* src)
+{
+    ASSERT(src->opcode != Opcode_Literal);
+    RegLoc const reg = instr->ra.srcRegs[srcIndex];
+    ASSERT(src->currentReg == reg);
+    ASSERT(reg != RegLocInvalid);
+    RegFile<MaxRegs>& file = ctx.FileOf(reg);
+    ASSERT(!file.freeRegsBitset.Test(RegIndexOf(reg)));
+
+    ASSERT(src->useIterAccelerator < src->uses.size());
+    ++src->useIterAccelerator;
+    if (ctx.IsDead(src)) {
+        FreeRegOfValue(ctx, file, src, reg);
+
+        if (src->spillLoc != SpillLocInvalid) {
+            ctx.FreeSpillLoc(file, src->spillLoc);
+            src->spillLoc = SpillLocInvalid;
+        }
+    }
+    else {
+        ctx.SetNextUse(file, reg, src, NextUseOrigInstrIndex(src));
+    }
+}
+
+// value is a literal when a register was given one for a block param. slot is the LiteralU32 of the SpillLoc.
+static Instruction* NewSpillInstr(LiteralValue* slot, Value* value, RegLoc reg)
+{
+    Instruction* spillInstr = new Instruction();
+    spillInstr->opcode = Opcode_spill;
+    spillInstr->typekind = Ir_void;
+    spillInstr->_nOperands = 2;
+    spillInstr->_operands[0] = slot;
+    spillInstr->_operands[1] = value;
+    spillInstr->ra.srcRegs[1] = reg;
+    // XXX: uses/isntrindex messed up
+    return spillInstr;
+}
+
+static const char* DebugNameOf(const Value* value)
+{
+    return IsLiteral(value) ? "literal" : static_cast<const RuntimeValue*>(value)->debugName;
+}
+
+static Instruction* NewSpillInstr(Module& module, SpillLoc spillLoc, Value* value, RegLoc reg)
+{
+    return NewSpillInstr(module.LiteralU32(spillLoc), value, reg);
+}
+
+static Instruction* NewLoadSpilledInstr(LiteralValue* slot, const Value* value, RegLoc reg)
+{
+    SpillLoc const spillLoc = SpillLoc(slot->zext);
+    Instruction* loadInstr = new Instruction();
+    loadInstr->opcode = Opcode_load_spilled;
+    loadInstr->typekind = value->typekind;
+    loadInstr->_nOperands = 1;
+    loadInstr->_operands[0] = slot;
+    // XXX: uses/isntrindex messed up
+    loadInstr->debugName = DebugNameOf(value); // TODO: diff name or seqno
+    loadInstr->spillLoc = spillLoc; // in case ahve to spill a value multiplek times, relaod from original spill
+    loadInstr->ra.dstReg = reg;
+    loadInstr->ra.restores = value;
+    return loadInstr;
+}
+
+static Instruction* NewLoadSpilledInstr(Module& module, SpillLoc spillLoc, const Value* value, RegLoc reg)
+{
+    return NewLoadSpilledInstr(module.LiteralU32(spillLoc), value, reg);
+}
+
+// A copy of def writing reg. Its operands are def's and aren't added to uses, same as spill instrs.
+static Instruction* NewRematerializeInstr(const Instruction* def, RegLoc reg)
+{
+    Instruction* rematInstr = new Instruction();
+    rematInstr->opcode = def->opcode;
+    rematInstr->typekind = def->typekind;
+    rematInstr->_nOperands = def->_nOperands;
+    for (uint i = 0; i < def->_nOperands; ++i) {
+        rematInstr->_operands[i] = def->_operands[i];
+    }
+    rematInstr->debugName = def->debugName;
+    rematInstr->ra.dstReg = reg;
+    rematInstr->ra.restores = def;
+    return rematInstr;
+}
+
+// Emits a reload of the value into reg, or instructions recomputing it.
+// Doesn't make reg hold the value as far as the context is concerned, the caller does that.
+template<uint MaxRegs>
+static void RestoreEvictedValue(RegAllocCtx<MaxRegs>& ctx, RuntimeValue* value, RegLoc reg)
+{
+    ASSERT(value->currentReg == RegLocInvalid);
+    if (value->spillLoc != SpillLocInvalid) {
+        ctx.newInstrs.push_back(NewLoadSpilledInstr(ctx.module, value->spillLoc, value, reg));
+        return;
+    }
+
+    ASSERT(ctx.bRematerialize && CanRematerialize(value));
+    const Instruction* const def = static_cast<const Instruction*>(value);
+    Instruction* const rematInstr = NewRematerializeInstr(def, reg);
+    if (def->opcode == Opcode_iadd) {
+        RuntimeValue* const x = static_cast<RuntimeValue*>(def->Operand(0));
+        if (x->currentReg != RegLocInvalid) {
+            rematInstr->ra.srcRegs[0] = x->currentReg;
+        }
+        else {
+            // x is not needed in a register after this, so build it in reg and add to that.
+            RestoreEvictedValue(ctx, x, reg);
+            rematInstr->ra.srcRegs[0] = reg;
+        }
+    }
+    ctx.newInstrs.push_back(rematInstr);
+}
+
+// value could be a src or dst
+template<uint MaxRegs>
+static RegLoc AllocRegForValueAfterPossiblySpilling(
+    RegAllocCtx<MaxRegs>& ctx, uint origInstrIndex, Instruction* instr, RuntimeValue* value)
+{
+    ASSERT(value->opcode != Opcode_Literal);
+
+    // Only values of the same class compete for registers.
+    RegFile<MaxRegs>& file = ctx.FileOf(value);
+    Implemented(file.reglimit != 0);
+    RegLoc reg;
+    if (!file.freeRegsBitset.Any()) {
+        // See notes for accelerating this, especially for many registers.
+        // Some kind of dataflow analysis for estimated distance when the next use is not with the block,
+        // even if use by callblock shouldn't be considered for deciding what to spill (should callblock be considered?),
+        // since could have `var a = ...; if (cond) { ThenBlock; } MergeBlock;` where ThenBlock doesn't modify var a
+        // (so no ExplicitBlockParameter for it in MergeBlock) and it is live-into MergeBlock; but not used for a long time.
+        //
+        // When a value is a src of the current instruction, value.uses[value.useIterAccelerator] should refer to:
+        //  1: Before all sources are allocated: the current instruction.
+        //      Note value.useIterAccelerator might not be the last entry in value.uses to do so,
+        //      unless this is the rightmost src of the value, see @useIterAccelerator_rightmost
+        //  2: After all sources are allocated (case for allocating the dst): an instruction after the current
+        //     instruction, or useIterAccelerator == size, which means "no next use".
+        //
+        // The farthest distance (Belady's) heuristic has another purpose: with bullet 1 above, it is one way of
+        // preventing trying to evict src0 when allocating src1 for e.g: `dst = op(src0, src1)`.
+        //
+        // Since every key is >= origInstrIndex, the farthest next use is also the farthest distance.
+        // Register indexes of the file until reg is set.
+        RegLoc farthestVictimReg;
+        if (ctx.bLinearVictimSearch) {
+            farthestVictimReg = FindFarthestNextUseVictimLinear(ctx, file, origInstrIndex, false);
+        }
+        else {
+            farthestVictimReg = file.nextUses.Farthest();
+            if (file.nextUses.Key(farthestVictimReg) == origInstrIndex)
+                farthestVictimReg = RegLocInvalid; // everything is used by this instruction
+            ASSERT(farthestVictimReg == FindFarthestNextUseVictimLinear(ctx, file, origInstrIndex, false));
+        }
+        ASSERT(farthestVictimReg != RegLocInvalid);
+
+        if (ctx.eviction == Eviction_cleanAware && ctx.NeedsSpillToEvict(file.valuesInReg[farthestVictimReg])) {
+            RegLoc cleanVictimReg;
+            if (ctx.bLinearVictimSearch) {
+                cleanVictimReg = FindFarthestNextUseVictimLinear(ctx, file, origInstrIndex, true);
+            }
+            else {
+                cleanVictimReg = file.cleanNextUses.Farthest();
+                if (file.cleanNextUses.Key(cleanVictimReg) <= origInstrIndex)
+                    cleanVictimReg = RegLocInvalid; // no clean values, or all are used by this instruction
+                ASSERT(cleanVictimReg == FindFarthestNextUseVictimLinear(ctx, file, origInstrIndex, true));
+            }
+            // Dirty costs a spill and a reload, clean only a reload (or recompute).
+            if (cleanVictimReg != RegLocInvalid &&
+                uint64_t(file.nextUses.Key(cleanVictimReg) - origInstrIndex) * 2 >=
+                    file.nextUses.Key(farthestVictimReg) - origInstrIndex) {
+                farthestVictimReg = cleanVictimReg;
+            }
+        }
+        RuntimeValue* const farthestVictimValue = file.valuesInReg[farthestVictimReg];
+        reg = file.Reg(farthestVictimReg);
+#if _DEBUG
+        // allocating for a src?
+        if (instr != value) {
+            for (uint j = 0; j < countof(instr->ra.srcRegs); ++j) {
+                ASSERT(instr->ra.srcRegs[j] != reg);
+            }
+        }
+#endif
+        farthestVictimValue->currentReg = RegLocInvalid;
+        // Within a basic block, only need to spill a value once.
+        if (ctx.NeedsSpillToEvict(farthestVictimValue)) {
+            // XXX:  Allocate spill loc in immediate dominator of other spills of this value.
+
+            SpillLoc const spillLoc = ctx.SpillLocForStore(farthestVictimValue);
+            farthestVictimValue->spillLoc = spillLoc;
+
+            ctx.newInstrs.push_back(NewSpillInstr(ctx.module, spillLoc, farthestVictimValue, reg));
+        }
+    }
+    else {
+        uint const index = file.freeRegsBitset.First();
+        ASSERT(value->currentReg == RegLocInvalid);
+        ASSERT(file.valuesInReg[index] == nullptr);
+        file.freeRegsBitset.Clear(index);
+        reg = file.Reg(index);
+    }
+
+    // A src not in a register was evicted earlier.
+    if (instr != value) {
+        RestoreEvictedValue(ctx, value, reg);
+    }
+
+    value->currentReg = reg;
+    file.valuesInReg[RegIndexOf(reg)] = value;
+    ctx.SetNextUse(file, reg, value, NextUseOrigInstrIndex(value));
+    return reg;
+}
+
+template<uint MaxRegs>
+static void LocalRegisterAllocation(RegAllocCtx<MaxRegs>& ctx, Block& block)
+{
+    ASSERT(ctx.newInstrs.empty());
+    ctx.newInstrs.reserve(size_t(1) << CeilLog2(uint(block.instructions.size()) | 2));
+
+    for (uint i = 0; i < block.instructions.size(); ++i) {
+        Instruction* const instr = block.instructions[i];
+        uint const origInstrIndex = instr->instrIndexInBlock;
+        ASSERT(ctx.liveOutBits || origInstrIndex == i);
+
+        // Branches are handled like anything else, GlobalRegisterAllocation puts the code
+        // passing registers to a successor before the jump, which is why critical edges are split.
+        // That code also moves jump arguments to the params from wherever they are, so they aren't loaded here.
+        if (instr->opcode == Opcode_jump) {
+            for (Value* const arg : instr->Operands()) {
+                if (!IsLiteral(arg))
+                    ++static_cast<RuntimeValue*>(arg)->useIterAccelerator;
+            }
+            ctx.newInstrs.push_back(instr);
+            continue;
+        }
+
+        uint32_t uniqueSrcIndexes = 0;
+        for (uint srcIndex = 0; srcIndex < instr->OperandCount(); ++srcIndex) {
+            Value* const _src = instr->Operand(srcIndex);
+            if (_src->opcode == Opcode_Literal) {
+                continue;
+            }
+            RuntimeValue* const src = static_cast<RuntimeValue *>(_src);
+            // Since not iterating over callblock instrs, this loop should have few iterations:
             ASSERT(instr->OperandCount() < 6u);
             uint j = 0;
-            for (; j < srcIndex; ++j) {
-                if (instr->Operand(j) == src) {
-                    ASSERT(instr->ra.srcRegs[j] == src->currentReg);
-                    instr->ra.srcRegs[srcIndex] = src->currentReg;
-                    src->useIterAccelerator++; // @useIterAccelerator_rightmost
-                    goto outer_continue_target; // not unique
+            for (; j < srcIndex; ++j) {
+                if (instr->Operand(j) == src) {
+                    ASSERT(instr->ra.srcRegs[j] == src->currentReg);
+                    instr->ra.srcRegs[srcIndex] = src->currentReg;
+                    src->useIterAccelerator++; // @useIterAccelerator_rightmost
+                    goto outer_continue_target; // not unique
+                }
+            }
+            ASSERT(srcIndex < sizeof(uniqueSrcIndexes) * BitsPerByte);
+            uniqueSrcIndexes |= 1u << srcIndex;
+            if (src->currentReg == RegLocInvalid) {
+                RA_DEBUG_PRINTF("allocating instr %s src %d\n", instr->debugName, srcIndex);
+                instr->ra.srcRegs[srcIndex] = AllocRegForValueAfterPossiblySpilling(ctx, origInstrIndex, instr, src);
+            }
+            else {
+                instr->ra.srcRegs[srcIndex] = src->currentReg;
+            }
+            outer_continue_target:;
+        }
+        for (uint32_t bits = uniqueSrcIndexes; bits; bits &= bits - 1) {
+            uint const srcIndex = bsf(bits);
+            UpdateJustUsedSrcValueInReg(ctx, origInstrIndex, instr, srcIndex,
+                                        static_cast<RuntimeValue*>(instr->Operand(srcIndex)));
+        }
+        if (instr->typekind != Ir_void) {
+            RA_DEBUG_PRINTF("allocating instr %s dst\n", instr->debugName);
+            instr->ra.dstReg = AllocRegForValueAfterPossiblySpilling(ctx, origInstrIndex, instr, instr);
+            // Still need a register to write to, but it is free right after.
+            if (ctx.IsDead(instr)) {
+                FreeRegOfValue(ctx, ctx.FileOf(instr), instr, instr->ra.dstReg);
+            }
+        }
+        ctx.newInstrs.push_back(instr);
+    }
+
+#if _DEBUG
+    ASSERT(!block.instructions.empty());
+    // Could be stricter than this, like for a value defined in a block but only used in that block.
+    if (!ctx.liveOutBits && block.instructions.back()->opcode == Opcode_return) {
+        for (const Instruction* const instr : block.instructions) {
+            ASSERT(instr->useIterAccelerator == instr->uses.size());
+        }
+    }
+#endif
+
+    // NOTE: use vectors are invalid if spilled, but don't have those always anyway?
+    block.instructions = std::move(ctx.newInstrs);
+}
+
+// Uses the narrowest register file specialization that fits reglimit, predlimit and veclimit.
+// Returns the number of spill slots used, of all classes.
+template<uint MaxRegs>
+static uint LocalRegisterAllocation(Module& module, Block& block, uint reglimit, EvictionHeuristic eviction,
+    bool bRematerialize, uint predlimit, uint veclimit)
+{
+    RegAllocCtx<MaxRegs> ctx(module, reglimit, predlimit, veclimit);
+    ctx.eviction = eviction;
+    ctx.bRematerialize = bRematerialize;
+    LocalRegisterAllocation(ctx, block);
+    return ctx.NumSpillLocs();
+}
+
+static uint LocalRegisterAllocation(Module& module, Block& block, uint reglimit,
+    EvictionHeuristic eviction = Eviction_farthestNextUse, bool bRematerialize = true, uint predlimit = 0,
+    uint veclimit = 0)
+{
+    uint const width = Max(reglimit, Max(predlimit, veclimit));
+    if (width <= 32)
+        return LocalRegisterAllocation<32>(module, block, reglimit, eviction, bRematerialize, predlimit, veclimit);
+    else if (width <= 64)
+        return LocalRegisterAllocation<64>(module, block, reglimit, eviction, bRematerialize, predlimit, veclimit);
+    else
+        return LocalRegisterAllocation<256>(module, block, reglimit, eviction, bRematerialize, predlimit, veclimit);
+}
+
+// Linear scan over live intervals, for when compiling fast matters more than the code, see CompileOptions.
+// In a block, intervals are already sorted by start (the def), so this is one pass over the instructions, and an
+// interval's end is read off its use list, which is in instruction order. When a register is needed and none is
+// free, the active interval used again last is evicted, stored unless it is in memory already, and reloaded at its
+// next use into a register it keeps for the rest of its interval or until it is evicted again. Test inputs are
+// read again instead, the one rematerialization that needs no operand in a register.
+// None of RegAllocCtx is needed, and there are no other rematerializations or preferring clean victims. Next uses
+// are only looked up for the active intervals of a class when one of them is evicted, by moving each value's use
+// cursor, and kept with the interval until they have passed. The active intervals are kept ordered by end, so the
+// ones ending at an instruction are last.
+template<uint MaxRegs>
+struct LinearScanFile {
+    struct Active {
+        uint end;
+        uint index; // in the file
+        RuntimeValue* value;
+        uint nextUse; // as of some earlier instruction, still right while it's later than the current one
+    };
+
+    RegClass regClass = RegClass_data;
+    RegBitset<MaxRegs> freeRegsBitset;
+    std::vector<Active> active; // latest end first
+    std::vector<SpillLoc> freeSpillLocs;
+    uint numSpillLocs = 0;
+
+    RegLoc Reg(uint index) const { return MakeRegLoc(regClass, index); }
+
+    void Activate(uint end, uint index, RuntimeValue* value)
+    {
+        auto it = active.begin();
+        while (it != active.end() && it->end > end)
+            ++it;
+        active.insert(it, { end, index, value, 0 });
+    }
+
+    SpillLoc AllocSpillLoc()
+    {
+        if (freeSpillLocs.empty())
+            return SpillLoc(numSpillLocs++);
+        SpillLoc const spillLoc = freeSpillLocs.back();
+        freeSpillLocs.pop_back();
+        return spillLoc;
+    }
+};
+
+// Returns the number of spill slots used, of all classes.
+template<uint MaxRegs>
+static uint LinearScanRegisterAllocation(Module& module, Block& block, const uint (&reglimits)[RegClass_count])
+{
+    bool const bPredRegs = reglimits[RegClass_pred] != 0;
+    LinearScanFile<MaxRegs> files[RegClass_count];
+    for (uint cls = 0; cls < RegClass_count; ++cls) {
+        Implemented(reglimits[cls] <= MaxRegs);
+        files[cls].regClass = RegClass(cls);
+        files[cls].freeRegsBitset.SetFirstN(reglimits[cls]);
+        files[cls].active.reserve(reglimits[cls]);
+    }
+    auto fileOf = [&](const Value* value) -> LinearScanFile<MaxRegs>& {
+        return files[RegClassOf(value->typekind, bPredRegs)];
+    };
+    // Spill and reload instructions name their slot with a literal, these save interning one each time.
+    std::vector<LiteralValue*> slotLiterals;
+    auto slotLiteral = [&](SpillLoc spillLoc) {
+        while (slotLiterals.size() <= spillLoc)
+            slotLiterals.push_back(module.LiteralU32(uint32_t(slotLiterals.size())));
+        return slotLiterals[spillLoc];
+    };
+    std::vector<Instruction*> newInstrs;
+    newInstrs.reserve(size_t(1) << CeilLog2(uint(block.instructions.size()) | 2));
+
+    // A free register, or the one of the active interval used again last after instruction i, except for the
+    // operands of except, storing its value unless it is in memory already.
+    auto takeReg = [&](LinearScanFile<MaxRegs>& file, uint i, const Instruction* except) {
+        if (file.freeRegsBitset.Any()) {
+            uint const index = file.freeRegsBitset.First();
+            file.freeRegsBitset.Clear(index);
+            return index;
+        }
+        auto victim = file.active.end();
+        uint victimNextUse = 0;
+        for (auto it = file.active.begin(); it != file.active.end(); ++it) {
+            RuntimeValue* const value = it->value;
+            bool bOperand = false;
+            if (except) {
+                for (const Value* const src : except->Operands())
+                    bOperand |= src == value;
+            }
+            if (bOperand)
+                continue;
+            if (it->nextUse <= i) {
+                while (value->useIterAccelerator < value->uses.size() &&
+                       value->uses[value->useIterAccelerator].value->instrIndexInBlock <= i)
+                    ++value->useIterAccelerator;
+                it->nextUse = NextUseOrigInstrIndex(value);
+            }
+            if (victim == file.active.end() || it->nextUse > victimNextUse) {
+                victim = it;
+                victimNextUse = it->nextUse;
+            }
+        }
+        Implemented(victim != file.active.end()); // more operands of the class than registers
+        uint const index = victim->index;
+        RuntimeValue* const value = victim->value;
+        value->currentReg = RegLocInvalid;
+        if (value->spillLoc == SpillLocInvalid && value->opcode != Opcode_read_test_input) {
+            value->spillLoc = file.AllocSpillLoc();
+            newInstrs.push_back(NewSpillInstr(slotLiteral(value->spillLoc), value, file.Reg(index)));
+        }
+        file.active.erase(victim);
+        return index;
+    };
+
+    for (uint i = 0; i < block.instructions.size(); ++i) {
+        Instruction* const instr = block.instructions[i];
+        ASSERT(instr->instrIndexInBlock == i);
+
+        for (uint srcIndex = 0; srcIndex < instr->OperandCount(); ++srcIndex) {
+            Value* const _src = instr->Operand(srcIndex);
+            if (IsLiteral(_src))
+                continue;
+            RuntimeValue* const src = static_cast<RuntimeValue*>(_src);
+            if (src->currentReg == RegLocInvalid) {
+                LinearScanFile<MaxRegs>& file = fileOf(src);
+                uint const index = takeReg(file, i, instr);
+                src->currentReg = file.Reg(index);
+                newInstrs.push_back(src->spillLoc != SpillLocInvalid ?
+                    NewLoadSpilledInstr(slotLiteral(src->spillLoc), src, src->currentReg) :
+                    NewRematerializeInstr(static_cast<Instruction*>(src), src->currentReg));
+                file.Activate(src->uses.back().value->instrIndexInBlock, index, src);
+            }
+            instr->ra.srcRegs[srcIndex] = src->currentReg;
+        }
+
+        // Operands are all in registers, so every interval ending here is active.
+        for (LinearScanFile<MaxRegs>& file : files) {
+            while (!file.active.empty() && file.active.back().end == i) {
+                RuntimeValue* const value = file.active.back().value;
+                file.freeRegsBitset.Set(file.active.back().index);
+                value->currentReg = RegLocInvalid;
+                if (value->spillLoc != SpillLocInvalid) {
+                    file.freeSpillLocs.push_back(value->spillLoc);
+                    value->spillLoc = SpillLocInvalid;
+                }
+                file.active.pop_back();
+            }
+        }
+
+        if (instr->typekind == Ir_void) {
+            newInstrs.push_back(instr);
+            continue;
+        }
+        LinearScanFile<MaxRegs>& file = fileOf(instr);
+        uint const index = takeReg(file, i, nullptr); // the store of a value it evicts goes before instr
+        instr->ra.dstReg = file.Reg(index);
+        newInstrs.push_back(instr);
+        if (instr->uses.empty()) {
+            file.freeRegsBitset.Set(index); // never read
+            continue;
+        }
+        instr->currentReg = instr->ra.dstReg;
+        file.Activate(instr->uses.back().value->instrIndexInBlock, index, instr);
+    }
+
+    block.instructions = std::move(newInstrs);
+    return files[RegClass_data].numSpillLocs + files[RegClass_pred].numSpillLocs + files[RegClass_vec].numSpillLocs;
+}
+
+// Returns the number of spill slots used, of all classes.
+static uint LinearScanRegisterAllocation(Module& module, Block& block, uint reglimit, uint predlimit = 0,
+    uint veclimit = 0)
+{
+    uint const reglimits[RegClass_count] = { reglimit, predlimit, veclimit };
+    uint const width = Max(reglimit, Max(predlimit, veclimit));
+    if (width <= 32)
+        return LinearScanRegisterAllocation<32>(module, block, reglimits);
+    else if (width <= 64)
+        return LinearScanRegisterAllocation<64>(module, block, reglimits);
+    else
+        return LinearScanRegisterAllocation<256>(module, block, reglimits);
+}
+
+// Copies value (a runtime value or literal) from srcReg, or the literal into dstReg.
+static Instruction* NewMoveInstr(Value* value, RegLoc dstReg, RegLoc srcReg)
+{
+    Instruction* moveInstr = new Instruction();
+    moveInstr->opcode = Opcode_move;
+    moveInstr->typekind = value->typekind;
+    moveInstr->_nOperands = 1;
+    moveInstr->_operands[0] = value; // XXX: not added to uses, same as spill instrs
+    moveInstr->debugName = DebugNameOf(value);
+    moveInstr->ra.dstReg = dstReg;
+    moveInstr->ra.srcRegs[0] = srcReg;
+    return moveInstr;
+}
+
+static Instruction* NewSwapInstr(Value* a, RegLoc regA, Value* b, RegLoc regB)
+{
+    Instruction* swapInstr = new Instruction();
+    swapInstr->opcode = Opcode_swap;
+    swapInstr->typekind = Ir_void;
+    swapInstr->_nOperands = 2;
+    swapInstr->_operands[0] = a;
+    swapInstr->_operands[1] = b;
+    swapInstr->ra.srcRegs[0] = regA;
+    swapInstr->ra.srcRegs[1] = regB;
+    return swapInstr;
+}
+
+// Somewhere a value can be moved from or to at the end of a block.
+struct MoveLoc {
+    enum Kind : uint8_t {
+        Reg,     // index is a RegLoc
+        Slot,    // index is a SpillLoc
+        Literal, // only a src, index is up to the caller
+        Scratch, // index 0 or 1, slots only used while sequentializing
+    };
+    Kind kind;
+    uint32_t index;
+
+    bool IsReg() const { return kind == Reg; }
+    bool operator==(const MoveLoc& rhs) const { return kind == rhs.kind && index == rhs.index; }
+    bool operator!=(const MoveLoc& rhs) const { return !(*this == rhs); }
+};
+
+struct ParallelMove {
+    MoveLoc dst; // a register or slot
+    MoveLoc src;
+};
+
+// A swap exchanges two registers. A copy has a register on at least one side.
+struct MoveOp {
+    bool bSwap;
+    MoveLoc dst;
+    MoveLoc src;
+};
+
+// Orders moves that happen at once (every dst gets what its src held before any of them) so no location is
+// written while a move still has to read it. Each is then one instruction. What is left after that is cycles:
+// one of n registers takes n - 1 swaps, others go through a free register, or scratch slot 0 if there is none.
+// A copy between two slots needs a register as well, and without a free one, some register is saved to
+// scratch slot 1 and restored after. No location can be the dst of two moves.
+// A register is free if bRegNeeded is false for it (the caller needs nothing in it after) and no move reads it.
+static void SequentializeParallelMoves(std::vector<ParallelMove>& moves, const std::vector<bool>& bRegNeeded,
+    std::vector<MoveOp>& ops)
+{
+    ops.clear();
+    auto removeNoOps = [&]() {
+        moves.erase(std::remove_if(moves.begin(), moves.end(), [](const ParallelMove& m) { return m.dst == m.src; }),
+                    moves.end());
+    };
+    auto isRead = [&](MoveLoc loc) {
+        for (const ParallelMove& m : moves) {
+            if (m.src == loc)
+                return true;
+        }
+        return false;
+    };
+    auto freeReg = [&]() {
+        for (uint r = 0; r < bRegNeeded.size(); ++r) {
+            if (!bRegNeeded[r] && !isRead({ MoveLoc::Reg, r }))
+                return MoveLoc{ MoveLoc::Reg, r };
+        }
+        return MoveLoc{ MoveLoc::Scratch, 0 };
+    };
+    auto copy = [&](MoveLoc dst, MoveLoc src) {
+        if (dst.IsReg() || src.IsReg()) {
+            ops.push_back({ false, dst, src });
+            return;
+        }
+        MoveLoc const reg = freeReg();
+        if (reg.IsReg()) {
+            ops.push_back({ false, reg, src });
+            ops.push_back({ false, dst, reg });
+            return;
+        }
+        Implemented(!bRegNeeded.empty());
+        MoveLoc const borrowed = { MoveLoc::Reg, 0 };
+        MoveLoc const saved = { MoveLoc::Scratch, 1 };
+        ops.push_back({ false, saved, borrowed });
+        ops.push_back({ false, borrowed, src });
+        ops.push_back({ false, dst, borrowed });
+        ops.push_back({ false, borrowed, saved });
+    };
+
+    removeNoOps();
+    while (!moves.empty()) {
+        bool bProgress = false;
+        for (size_t i = 0; i < moves.size();) {
+            if (isRead(moves[i].dst)) {
+                ++i;
+                continue;
+            }
+            ParallelMove const m = moves[i];
+            moves[i] = moves.back();
+            moves.pop_back();
+            copy(m.dst, m.src);
+            bProgress = true;
+        }
+        if (bProgress || moves.empty())
+            continue;
+
+        // Only cycles are left, so every location in a move is read by exactly one move.
+        auto regToReg = std::find_if(moves.begin(), moves.end(),
+            [](const ParallelMove& m) { return m.dst.IsReg() && m.src.IsReg(); });
+        if (regToReg != moves.end()) {
+            // dst gets what it needs, src gets what dst had, which the move reading dst now reads from src.
+            ParallelMove const m = *regToReg;
+            moves.erase(regToReg);
+            ops.push_back({ true, m.dst, m.src });
+            for (ParallelMove& other : moves) {
+                if (other.src == m.dst)
+                    other.src = m.src;
+            }
+            removeNoOps();
+            continue;
+        }
+        // Saving a register to scratch is a store, saving a slot would need a register.
+        auto fromReg = std::find_if(moves.begin(), moves.end(), [](const ParallelMove& m) { return m.src.IsReg(); });
+        ParallelMove& m = fromReg != moves.end() ? *fromReg : moves.front();
+        MoveLoc const temp = freeReg();
+        copy(temp, m.src);
+        m.src = temp;
+    }
+}
+
+// Allocates blocks in reverse postorder with the local allocator, so eviction and spilling work the same.
+// A block starts with the registers and spilled values at the end of its first predecessor in reverse
+// postorder. Next uses are by instrIndexInBlock, which is in allocation order, so a value only used in a
+// later block looks far away, and one only used after a loop back edge looks farthest.
+// Then for every other edge, code before the predecessor's jump stores and reloads values so the successor
+// gets what it started with. Going through memory means there are no register cycles to break.
+// Last, stores of a value in several blocks become one in their nearest common dominator.
+template<uint MaxRegs>
+static void GlobalRegisterAllocation(RegAllocCtx<MaxRegs>& ctx, Function& function, const Liveness& liveness)
+{
+    uint const numBlocks = uint(function.rpo.size());
+    uint const numWords = liveness.numWords;
+    // Predicate registers aren't passed between blocks, bools are in data registers like everything else.
+    Implemented(!ctx.HasPredRegs());
+    RegFile<MaxRegs>& file = ctx.files[RegClass_data];
+    ctx.bRematerialize = false; // CanRematerialize only reasons about one block
+    ctx.spillLocOfValue.assign(function.numInstrs, SpillLocInvalid);
+
+    std::vector<RuntimeValue*> valueOfIndex(function.numInstrs);
+    for (Block* const block : function.rpo) {
+        for (BlockParameter* const param : block->params)
+            valueOfIndex[param->instrIndexInBlock] = param;
+        for (Instruction* const instr : block->instructions)
+            valueOfIndex[instr->instrIndexInBlock] = instr;
+    }
+
+    struct BlockExit {
+        std::vector<RuntimeValue*> regs;
+        std::vector<uint64_t> clean; // live-out values and jump arguments that are in their spill slots
+        uint instrIndex = 0; // of the terminator, the state above holds right before it
+    };
+    std::vector<BlockExit> exits(numBlocks);
+    auto firstPred = [](const Block& block) {
+        const Block* first = nullptr;
+        for (const Block* const pred : block.preds) {
+            if (pred->rpoIndex != uint(-1) && (!first || pred->rpoIndex < first->rpoIndex))
+                first = pred;
+        }
+        return first;
+    };
+
+    std::vector<uint64_t> cleanIn(numWords);
+    for (uint b = 0; b < numBlocks; ++b) {
+        Block& block = *function.rpo[b];
+        uint const blockBegin = block.instructions.front()->instrIndexInBlock;
+        const uint64_t* const liveIn = liveness.LiveIn(b);
+        const uint64_t* const liveOut = liveness.LiveOut(b);
+        ctx.liveOutBits = liveOut;
+        ctx.blockEndIndex = block.instructions.back()->instrIndexInBlock;
+        for (uint r = 0; r < file.reglimit; ++r) {
+            if (file.valuesInReg[r])
+                FreeRegOfValue(ctx, file, file.valuesInReg[r], RegLoc(r));
+        }
+        block.raEntryRegs.assign(file.reglimit, nullptr);
+        block.raEntrySlots.clear();
+
+        if (b != 0) {
+            const BlockExit& firstExit = exits[firstPred(block)->rpoIndex];
+            // Clean if clean at the end of every predecessor allocated so far, later ones get stores.
+            std::copy(firstExit.clean.begin(), firstExit.clean.end(), cleanIn.begin());
+            for (const Block* const pred : block.preds) {
+                if (pred->rpoIndex < b)
+                    BitsetAndInto(cleanIn.data(), exits[pred->rpoIndex].clean.data(), numWords);
+            }
+            ForEachSetBit(liveIn, numWords, [&](uint v) {
+                RuntimeValue* const value = valueOfIndex[v];
+                value->currentReg = RegLocInvalid;
+                value->spillLoc = SpillLocInvalid;
+                value->useIterAccelerator = uint(std::lower_bound(value->uses.begin(), value->uses.end(), blockBegin,
+                    [](const Use& use, uint index) { return use.value->instrIndexInBlock < index; }) - value->uses.begin());
+            });
+            for (uint r = 0; r < file.reglimit; ++r) {
+                RuntimeValue* const value = firstExit.regs[r];
+                if (value && TestBit(liveIn, value->instrIndexInBlock)) {
+                    value->currentReg = RegLoc(r);
+                    file.valuesInReg[r] = value;
+                    file.freeRegsBitset.Clear(r);
+                    block.raEntryRegs[r] = value;
+                }
+            }
+            ForEachSetBit(liveIn, numWords, [&](uint v) {
+                RuntimeValue* const value = valueOfIndex[v];
+                // Not in a register means it was spilled.
+                ASSERT(value->currentReg != RegLocInvalid || TestBit(firstExit.clean.data(), v));
+                if (value->currentReg == RegLocInvalid || TestBit(cleanIn.data(), v)) {
+                    value->spillLoc = ctx.spillLocOfValue[v];
+                    ASSERT(value->spillLoc != SpillLocInvalid);
+                    block.raEntrySlots.emplace_back(value->spillLoc, value);
+                }
+            });
+
+            // A param takes the register its argument is in at the end of the first predecessor if it's free,
+            // then any free register, else it starts in its slot. Params no one uses are left out.
+            const Instruction* const firstJump = firstPred(block)->instructions.back();
+            for (BlockParameter* const param : block.params) {
+                param->currentReg = RegLocInvalid;
+                param->spillLoc = SpillLocInvalid;
+                param->useIterAccelerator = 0;
+                Value* const arg = firstJump->Operand(param->index);
+                if (param->uses.empty() || IsLiteral(arg))
+                    continue;
+                RegLoc const reg = RegLoc(std::find(firstExit.regs.begin(), firstExit.regs.end(), arg) - firstExit.regs.begin());
+                if (reg < file.reglimit && !file.valuesInReg[reg]) {
+                    param->currentReg = reg;
+                    file.valuesInReg[reg] = param;
+                    file.freeRegsBitset.Clear(reg);
+                    block.raEntryRegs[reg] = param;
+                }
+            }
+            for (BlockParameter* const param : block.params) {
+                if (param->uses.empty() || param->currentReg != RegLocInvalid)
+                    continue;
+                if (file.freeRegsBitset.Any()) {
+                    RegLoc const reg = RegLoc(file.freeRegsBitset.First());
+                    param->currentReg = reg;
+                    file.valuesInReg[reg] = param;
+                    file.freeRegsBitset.Clear(reg);
+                    block.raEntryRegs[reg] = param;
+                }
+                else {
+                    param->spillLoc = ctx.SpillLocForStore(param);
+                    block.raEntrySlots.emplace_back(param->spillLoc, param);
+                }
+            }
+
+            for (uint r = 0; r < file.reglimit; ++r) {
+                if (file.valuesInReg[r])
+                    ctx.SetNextUse(file, RegLoc(r), file.valuesInReg[r], NextUseOrigInstrIndex(file.valuesInReg[r]));
+            }
+        }
+
+        LocalRegisterAllocation(ctx, block);
+
+        BlockExit& exit = exits[b];
+        exit.regs.assign(file.valuesInReg, file.valuesInReg + file.reglimit);
+        exit.clean.assign(numWords, 0);
+        ForEachSetBit(liveOut, numWords, [&](uint v) {
+            if (valueOfIndex[v]->spillLoc != SpillLocInvalid)
+                SetBit(exit.clean.data(), v);
+        });
+        if (block.instructions.back()->opcode == Opcode_jump) {
+            for (const Value* const arg : block.instructions.back()->Operands()) {
+                if (!IsLiteral(arg) && static_cast<const RuntimeValue*>(arg)->spillLoc != SpillLocInvalid)
+                    SetBit(exit.clean.data(), static_cast<const RuntimeValue*>(arg)->instrIndexInBlock);
+            }
+        }
+        ASSERT(IsTerminator(block.instructions.back()->opcode));
+        exit.instrIndex = uint(block.instructions.size() - 1);
+    }
+    ctx.liveOutBits = nullptr;
+
+    // Moves on every edge so the successor starts with what it was allocated with: arguments into params, and
+    // for predecessors other than the first, values that are somewhere else at the end of that one.
+    std::vector<ParallelMove> moves;
+    std::vector<MoveOp> ops;
+    std::vector<Value*> literals; // MoveLoc::Literal indexes
+    std::vector<bool> bRegNeeded(file.reglimit);
+    std::unordered_map<uint64_t, Value*> contents; // by location, while turning ops into instructions
+    SpillLoc scratchSlots[2] = { SpillLocInvalid, SpillLocInvalid };
+    std::vector<Instruction*> fixups;
+    auto key = [](MoveLoc loc) { return uint64_t(loc.kind) << 32 | loc.index; };
+    auto slotOf = [&](MoveLoc loc) {
+        if (loc.kind == MoveLoc::Slot)
+            return SpillLoc(loc.index);
+        ASSERT(loc.kind == MoveLoc::Scratch);
+        if (scratchSlots[loc.index] == SpillLocInvalid)
+            scratchSlots[loc.index] = ctx.AllocSpillLoc(file, "scratch");
+        return scratchSlots[loc.index];
+    };
+    for (uint b = 1; b < numBlocks; ++b) {
+        const Block& block = *function.rpo[b];
+        const Block* const first = firstPred(block);
+        for (Block* const pred : block.preds) {
+            if (pred->rpoIndex == uint(-1) || (pred == first && block.params.empty()))
+                continue;
+            const BlockExit& exit = exits[pred->rpoIndex];
+            const Instruction* const terminator = pred->instructions.back();
+            auto argOf = [&](const RuntimeValue* value) -> Value* {
+                if (value->opcode == Opcode_ExplicitBlockParameter && static_cast<const BlockParameter*>(value)->block == &block)
+                    return terminator->Operand(static_cast<const BlockParameter*>(value)->index);
+                return valueOfIndex[value->instrIndexInBlock];
+            };
+            contents.clear();
+            literals.clear();
+            moves.clear();
+            auto addMove = [&](MoveLoc dst, Value* value) {
+                MoveLoc src;
+                if (IsLiteral(value)) {
+                    src = { MoveLoc::Literal, uint32_t(literals.size()) };
+                    literals.push_back(value);
+                }
+                else {
+                    uint const index = static_cast<RuntimeValue*>(value)->instrIndexInBlock;
+                    auto const reg = std::find(exit.regs.begin(), exit.regs.end(), value);
+                    if (reg != exit.regs.end()) {
+                        src = { MoveLoc::Reg, uint32_t(reg - exit.regs.begin()) };
+                    }
+                    else {
+                        // Not in a register means it was spilled.
+                        ASSERT(TestBit(exit.clean.data(), index));
+                        src = { MoveLoc::Slot, ctx.spillLocOfValue[index] };
+                        contents[key(src)] = value;
+                    }
+                }
+                moves.push_back({ dst, src });
+            };
+            for (uint r = 0; r < file.reglimit; ++r) {
+                bRegNeeded[r] = block.raEntryRegs[r] != nullptr;
+                if (block.raEntryRegs[r])
+                    addMove({ MoveLoc::Reg, r }, argOf(block.raEntryRegs[r]));
+            }
+            for (const auto& slotAndValue : block.raEntrySlots) {
+                Value* const value = argOf(slotAndValue.second);
+                if (value == slotAndValue.second && TestBit(exit.clean.data(), slotAndValue.second->instrIndexInBlock))
+                    continue; // stored already
+                addMove({ MoveLoc::Slot, slotAndValue.first }, value);
+            }
+            SequentializeParallelMoves(moves, bRegNeeded, ops);
+            if (ops.empty())
+                continue;
+            Implemented(terminator->opcode == Opcode_jump); // a branch's successors have one pred each
+
+            auto contentOf = [&](MoveLoc loc) -> Value* {
+                if (loc.kind == MoveLoc::Literal)
+                    return literals[loc.index];
+                auto const it = contents.find(key(loc));
+                if (it != contents.end())
+                    return it->second;
+                ASSERT(loc.IsReg());
+                return exit.regs[loc.index];
+            };
+            fixups.clear();
+            for (const MoveOp& op : ops) {
+                Value* const srcValue = contentOf(op.src);
+                if (op.bSwap) {
+                    Value* const dstValue = contentOf(op.dst);
+                    fixups.push_back(NewSwapInstr(dstValue, RegLoc(op.dst.index), srcValue, RegLoc(op.src.index)));
+                    contents[key(op.dst)] = srcValue;
+                    contents[key(op.src)] = dstValue;
+                    continue;
+                }
+                contents[key(op.dst)] = srcValue;
+                if (!srcValue)
+                    continue; // saving or restoring a register that holds nothing
+                if (op.dst.IsReg() && op.src.kind != MoveLoc::Slot && op.src.kind != MoveLoc::Scratch)
+                    fixups.push_back(NewMoveInstr(srcValue, RegLoc(op.dst.index), op.src.IsReg() ? RegLoc(op.src.index) : RegLocInvalid));
+                else if (op.dst.IsReg())
+                    fixups.push_back(NewLoadSpilledInstr(ctx.module, slotOf(op.src), srcValue, RegLoc(op.dst.index)));
+                else
+                    fixups.push_back(NewSpillInstr(ctx.module, slotOf(op.dst), srcValue, RegLoc(op.src.index)));
+            }
+            pred->instructions.insert(pred->instructions.end() - 1, fixups.begin(), fixups.end());
+        }
+    }
+
+    // Stores of a value in several blocks become one at the end of their nearest common dominator,
+    // if the value is in a register there. A value's own slot only ever holds it, so later stores would
+    // write what is already there. Not so for a param's slot, which gets arguments stored to it.
+    struct Store {
+        uint valueIndex;
+        uint rpoIndex;
+        Instruction* instr;
+    };
+    std::vector<Store> stores;
+    for (uint b = 0; b < numBlocks; ++b) {
+        for (Instruction* const instr : function.rpo[b]->instructions) {
+            if (instr->opcode != Opcode_spill || IsLiteral(instr->Operand(1)))
+                continue;
+            uint const valueIndex = static_cast<RuntimeValue*>(instr->Operand(1))->instrIndexInBlock;
+            if (static_cast<const LiteralValue*>(instr->Operand(0))->zext == ctx.spillLocOfValue[valueIndex])
+                stores.push_back({ valueIndex, b, instr });
+        }
+    }
+    std::sort(stores.begin(), stores.end(), [](const Store& l, const Store& r) {
+        return l.valueIndex != r.valueIndex ? l.valueIndex < r.valueIndex : l.rpoIndex < r.rpoIndex;
+    });
+    std::unordered_set<const Instruction*> removedStores;
+    std::vector<std::vector<Instruction*>> hoistedStores(numBlocks);
+    std::vector<uint> rpoOfPreorder(numBlocks);
+    for (uint b = 0; b < numBlocks; ++b)
+        rpoOfPreorder[function.domPreorder[b]] = b;
+    for (size_t i = 0, next; i < stores.size(); i = next) {
+        uint dom = stores[i].rpoIndex;
+        bool bDomHasStore = false;
+        for (next = i; next < stores.size() && stores[next].valueIndex == stores[i].valueIndex; ++next)
+            dom = function.NearestCommonDominator(dom, stores[next].rpoIndex);
+        for (size_t j = i; j < next; ++j)
+            bDomHasStore |= stores[j].rpoIndex == dom;
+        if (bDomHasStore)
+            continue;
+        RuntimeValue* const value = valueOfIndex[stores[i].valueIndex];
+        const std::vector<RuntimeValue*>& domRegs = exits[dom].regs;
+        RegLoc const reg = RegLoc(std::find(domRegs.begin(), domRegs.end(), value) - domRegs.begin());
+        if (reg >= file.reglimit)
+            continue;
+        SpillLoc const spillLoc = ctx.spillLocOfValue[stores[i].valueIndex];
+        hoistedStores[dom].push_back(NewSpillInstr(ctx.module, spillLoc, value, reg));
+        for (size_t j = i; j < next; ++j)
+            removedStores.insert(stores[j].instr);
+        // Every path into a block dom strictly dominates leaves dom, so the slot holds the value there.
+        uint const preorderBegin = function.domPreorder[dom];
+        for (uint p = preorderBegin + 1; p < preorderBegin + function.domSubtreeSize[dom]; ++p) {
+            uint const d = rpoOfPreorder[p];
+            if (TestBit(liveness.LiveIn(d), stores[i].valueIndex))
+                function.rpo[d]->raEntrySlots.emplace_back(spillLoc, value);
+        }
+    }
+    if (removedStores.empty())
+        return;
+    for (uint b = 0; b < numBlocks; ++b) {
+        auto& entrySlots = function.rpo[b]->raEntrySlots; // the slot may have been clean on entry already
+        std::sort(entrySlots.begin(), entrySlots.end());
+        entrySlots.erase(std::unique(entrySlots.begin(), entrySlots.end()), entrySlots.end());
+        std::vector<Instruction*>& instrs = function.rpo[b]->instructions;
+        std::vector<Instruction*> newInstrs;
+        newInstrs.reserve(instrs.size() + hoistedStores[b].size());
+        for (uint i = 0; i < instrs.size(); ++i) {
+            if (i == exits[b].instrIndex)
+                newInstrs.insert(newInstrs.end(), hoistedStores[b].begin(), hoistedStores[b].end());
+            if (removedStores.count(instrs[i]))
+                delete instrs[i];
+            else
+                newInstrs.push_back(instrs[i]);
+        }
+        instrs = std::move(newInstrs);
+    }
+}
+
+// Function::BuildCfg and ComputeLiveness must have been done. Returns the number of spill slots used.
+static uint GlobalRegisterAllocation(Module& module, Function& function, const Liveness& liveness, uint reglimit,
+    EvictionHeuristic eviction = Eviction_farthestNextUse)
+{
+    if (reglimit <= 32) {
+        RegAllocCtx<32> ctx(module, reglimit);
+        ctx.eviction = eviction;
+        GlobalRegisterAllocation(ctx, function, liveness);
+        return ctx.NumSpillLocs();
+    }
+    else if (reglimit <= 64) {
+        RegAllocCtx<64> ctx(module, reglimit);
+        ctx.eviction = eviction;
+        GlobalRegisterAllocation(ctx, function, liveness);
+        return ctx.NumSpillLocs();
+    }
+    else {
+        RegAllocCtx<256> ctx(module, reglimit);
+        ctx.eviction = eviction;
+        GlobalRegisterAllocation(ctx, function, liveness);
+        return ctx.NumSpillLocs();
+    }
+}
+
+#if _DEBUG || BUILD_TESTS
+// Checks the allocated block by tracking which original value each register and spill slot holds:
+// every src register must hold the operand's value, and reloads must read a slot holding the value they restore.
+// Registers must be of the class of the value in them. regHolds has the data registers, then the predicate ones,
+// then the vector ones, and slots are keyed by class and SpillLoc, since each class numbers its own.
+static void VerifyAllocatedInstrs(const Block& block, uint reglimit, uint predlimit, uint veclimit,
+    std::vector<const Value*>& regHolds, std::unordered_map<uint64_t, const Value*>& slotHolds)
+{
+    uint const limits[RegClass_count] = { reglimit, predlimit, veclimit };
+    uint const firsts[RegClass_count] = { 0, reglimit, reglimit + predlimit };
+    auto regHoldsOf = [&](RegLoc reg) -> const Value*& {
+        uint const index = RegIndexOf(reg);
+        Verify(index < limits[RegClassOf(reg)]);
+        return regHolds[firsts[RegClassOf(reg)] + index];
+    };
+    auto holds = [&](RegLoc reg, const Value* value) -> const Value*& {
+        Verify(RegClassOf(reg) == RegClassOf(value->typekind, predlimit != 0));
+        return regHoldsOf(reg);
+    };
+    auto slotKey = [&](const Instruction* instr, const Value* value) {
+        return uint64_t(RegClassOf(value->typekind, predlimit != 0)) << 32 |
+               static_cast<const LiteralValue*>(instr->Operand(0))->zext;
+    };
+    for (const Instruction* const instr : block.instructions) {
+        for (uint i = 0; i < instr->OperandCount(); ++i) {
+            const Value* const operand = instr->Operand(i);
+            if (IsLiteral(operand) || (instr->opcode == Opcode_load_spilled && i == 0) || instr->opcode == Opcode_jump)
+                continue;
+            Verify(!(instr->opcode == Opcode_spill && i == 0));
+            Verify(holds(instr->ra.srcRegs[i], operand) == operand);
+        }
+        const Value* defined = instr;
+        if (instr->opcode == Opcode_spill) {
+            slotHolds[slotKey(instr, instr->Operand(1))] = instr->Operand(1);
+        }
+        else if (instr->opcode == Opcode_load_spilled) {
+            auto const it = slotHolds.find(slotKey(instr, instr->ra.restores));
+            Verify(it != slotHolds.end() && it->second == instr->ra.restores);
+            defined = it->second;
+        }
+        else if (instr->opcode == Opcode_move) {
+            defined = instr->Operand(0);
+        }
+        else if (instr->opcode == Opcode_swap) {
+            std::swap(regHoldsOf(instr->ra.srcRegs[0]), regHoldsOf(instr->ra.srcRegs[1]));
+        }
+        else if (instr->ra.restores) {
+            defined = instr->ra.restores; // rematerialized
+            Verify(instr->opcode == instr->ra.restores->opcode);
+        }
+        if (instr->typekind != Ir_void)
+            holds(instr->ra.dstReg, defined) = defined;
+    }
+}
+
+static void VerifyRegisterAllocation(const Block& block, uint reglimit, uint predlimit = 0, uint veclimit = 0)
+{
+    std::vector<const Value*> regHolds(reglimit + predlimit + veclimit, nullptr);
+    std::unordered_map<uint64_t, const Value*> slotHolds;
+    VerifyAllocatedInstrs(block, reglimit, predlimit, veclimit, regHolds, slotHolds);
+}
+
+// After GlobalRegisterAllocation: each block starts from its raEntryRegs and raEntrySlots,
+// and must end holding what every successor starts with, with jump arguments where the params are.
+static void VerifyRegisterAllocation(const Function& function, uint reglimit)
+{
+    auto argOf = [](const Block& pred, const Block& succ, const RuntimeValue* value) -> const Value* {
+        if (value->opcode == Opcode_ExplicitBlockParameter && static_cast<const BlockParameter*>(value)->block == &succ)
+            return pred.instructions.back()->Operand(static_cast<const BlockParameter*>(value)->index);
+        return value;
+    };
+    std::vector<const Value*> regHolds;
+    std::unordered_map<uint64_t, const Value*> slotHolds;
+    for (const Block* const block : function.rpo) {
+        Verify(block->raEntryRegs.size() == reglimit);
+        regHolds.assign(block->raEntryRegs.begin(), block->raEntryRegs.end());
+        slotHolds.clear();
+        for (const auto& slotAndValue : block->raEntrySlots)
+            slotHolds[slotAndValue.first] = slotAndValue.second;
+        VerifyAllocatedInstrs(*block, reglimit, 0, 0, regHolds, slotHolds);
+        for (uint i = 0; i < block->numSuccs; ++i) {
+            const Block* const succ = block->succs[i];
+            for (uint r = 0; r < reglimit; ++r)
+                Verify(!succ->raEntryRegs[r] || regHolds[r] == argOf(*block, *succ, succ->raEntryRegs[r]));
+            for (const auto& slotAndValue : succ->raEntrySlots) {
+                auto const it = slotHolds.find(slotAndValue.first);
+                Verify(it != slotHolds.end() && it->second == argOf(*block, *succ, slotAndValue.second));
+            }
+        }
+    }
+}
+#endif
+
+struct PeepholeStats {
+    uint numRedundantReloads = 0; // the register already held the value
+    uint numForwardedReloads = 0; // another register held the value, its readers now read that one
+    uint numDeadSpills       = 0; // never reloaded, or overwritten first
+};
+
+// Linear pass after RA that removes memory operations the allocator left behind,
+// keeping register assignments valid (VerifyRegisterAllocation still passes).
+//
+// One forward walk. Whether a reload can be forwarded depends on what comes after it, so it is removed for now
+// and its register collects the readers; the reload is put back if a reader comes after the register holding the
+// value was written, and otherwise the readers move to that register once this one is written, or at the end.
+static PeepholeStats EliminateRedundantSpillCode(Block& block)
+{
+    PeepholeStats stats;
+    std::vector<Instruction*>& instrs = block.instructions;
+    std::vector<bool> removed(instrs.size(), false);
+    struct SlotState {
+        const Value* value = nullptr;
+        uint spillInstrIndex = 0;
+        uint16_t numForwardedReads = 0; // by reloads being forwarded, which may be put back; the spill stays until then
+        bool bRead = false;
+    };
+    std::vector<SlotState> slots[RegClass_count]; // indexed by SpillLoc, of the class of the register stored or loaded
+    std::vector<const Value*> regHolds[RegClass_count]; // indexed by RegIndexOf, null while a reload into it is forwarded
+    // The reload being forwarded into a register, if any. Its readers read `to` instead, unless `to` is written
+    // before one of them; then the reload is put back.
+    struct Forward {
+        uint load = uint(-1);
+        RegLoc to = RegLocInvalid;
+        const Value* valueBeforeLoad = nullptr;
+        uint64_t slot = 0;
+        uint spillInstrIndex = 0; // of the slot when reloaded, to tell whether it was spilled to again since
+        std::vector<std::pair<uint, uint>> readers; // instruction and operand index
+    };
+    // Both indexed by RegIndexOf, and only sized and kept up to date while forwarding: it is rare, and only writes
+    // after a reload matter to its forward.
+    std::vector<Forward> forwards[RegClass_count];
+    std::vector<uint> lastWrites[RegClass_count];
+
+    auto setReg = [&](RegLoc reg, const Value* value) {
+        std::vector<const Value*>& holds = regHolds[RegClassOf(reg)];
+        if (RegIndexOf(reg) >= holds.size())
+            holds.resize(RegIndexOf(reg) + 1, nullptr);
+        holds[RegIndexOf(reg)] = value;
+    };
+    // Register files are small enough to scan, and this is only done for reloads.
+    auto regHolding = [&](RegClass cls, const Value* value) {
+        for (uint index = 0; index < regHolds[cls].size(); ++index) {
+            if (regHolds[cls][index] == value)
+                return MakeRegLoc(cls, index);
+        }
+        return RegLocInvalid;
+    };
+    auto forwardOf = [&](RegLoc reg) -> Forward* {
+        if (reg == RegLocInvalid || RegIndexOf(reg) >= forwards[RegClassOf(reg)].size())
+            return nullptr;
+        Forward& forward = forwards[RegClassOf(reg)][RegIndexOf(reg)];
+        return forward.load != uint(-1) ? &forward : nullptr;
+    };
+    auto setLastWrite = [&](RegLoc reg, uint i) {
+        std::vector<uint>& classWrites = lastWrites[RegClassOf(reg)];
+        if (RegIndexOf(reg) >= classWrites.size())
+            classWrites.resize(RegIndexOf(reg) + 1, 0);
+        classWrites[RegIndexOf(reg)] = i;
+    };
+    // Ends the forward of the reload into reg: its readers read forward.to, or the reload is put back.
+    auto endForward = [&](RegLoc reg, Forward& forward, bool bForwarded) {
+        SlotState& slotState = slots[RegClassOf(reg)][size_t(forward.slot)];
+        bool const bSameSpill = slotState.spillInstrIndex == forward.spillInstrIndex;
+        if (bSameSpill)
+            slotState.numForwardedReads--;
+        if (bForwarded) {
+            for (const std::pair<uint, uint>& reader : forward.readers)
+                instrs[reader.first]->ra.srcRegs[reader.second] = forward.to;
+            stats.numForwardedReloads++;
+            setReg(reg, forward.valueBeforeLoad);
+        }
+        else {
+            removed[forward.load] = false;
+            if (bSameSpill)
+                slotState.bRead = true;
+            setReg(reg, instrs[forward.load]->ra.restores);
+        }
+        forward.load = uint(-1);
+        forward.readers.clear();
+    };
+
+    uint numForwarding = 0; // usually none, then readers and writes needn't be looked at
+    for (uint i = 0; i < instrs.size(); ++i) {
+        Instruction* const instr = instrs[i];
+        if (numForwarding != 0) {
+            for (uint j = 0; j < instr->OperandCount(); ++j) {
+                RegLoc const src = instr->ra.srcRegs[j];
+                Forward* const forward = forwardOf(src);
+                if (!forward || IsLiteral(instr->Operand(j)))
+                    continue;
+                const std::vector<uint>& toWrites = lastWrites[RegClassOf(forward->to)];
+                if (RegIndexOf(forward->to) < toWrites.size() && toWrites[RegIndexOf(forward->to)] > forward->load) {
+                    endForward(src, *forward, false);
+                    numForwarding--;
+                }
+                else {
+                    forward->readers.push_back({ i, j });
+                }
+            }
+            // The write, if any, ends the forward into its register. A reload counts even if removed below.
+            if (instr->typekind != Ir_void) {
+                if (Forward* const forward = forwardOf(instr->ra.dstReg)) {
+                    endForward(instr->ra.dstReg, *forward, true);
+                    numForwarding--;
+                }
+                setLastWrite(instr->ra.dstReg, i);
+            }
+        }
+
+        if (instr->opcode == Opcode_spill) {
+            uint64_t const slot = static_cast<const LiteralValue*>(instr->Operand(0))->zext;
+            Implemented(slot < SpillLocInvalid);
+            std::vector<SlotState>& classSlots =
+                slots[IsLiteral(instr->Operand(1)) ? RegClass_data : RegClassOf(instr->ra.srcRegs[1])];
+            if (slot >= classSlots.size())
+                classSlots.resize(size_t(slot) + 1);
+            SlotState& state = classSlots[slot];
+            if (state.value == instr->Operand(1)) {
+                removed[i] = true; // the slot already holds it
+                stats.numDeadSpills++;
+                continue;
+            }
+            if (state.value && !state.bRead && state.numForwardedReads == 0) {
+                removed[state.spillInstrIndex] = true; // overwritten before being read
+                stats.numDeadSpills++;
+            }
+            state.value = instr->Operand(1);
+            state.spillInstrIndex = i;
+            state.bRead = false;
+            state.numForwardedReads = 0;
+        }
+        else if (instr->opcode == Opcode_load_spilled) {
+            uint64_t const slot = static_cast<const LiteralValue*>(instr->Operand(0))->zext;
+            RegLoc const dst = instr->ra.dstReg;
+            std::vector<SlotState>& classSlots = slots[RegClassOf(dst)];
+            ASSERT(slot < classSlots.size() && classSlots[slot].value);
+            SlotState& state = classSlots[slot];
+            RegLoc const resident = regHolding(RegClassOf(dst), state.value);
+            if (resident == dst) {
+                removed[i] = true;
+                stats.numRedundantReloads++;
+                continue;
+            }
+            if (resident != RegLocInvalid) {
+                removed[i] = true; // for now
+                const Value* const valueBeforeLoad =
+                    RegIndexOf(dst) < regHolds[RegClassOf(dst)].size() ? regHolds[RegClassOf(dst)][RegIndexOf(dst)] : nullptr;
+                setReg(dst, nullptr);
+                if (RegIndexOf(dst) >= forwards[RegClassOf(dst)].size())
+                    forwards[RegClassOf(dst)].resize(RegIndexOf(dst) + 1);
+                Forward& forward = forwards[RegClassOf(dst)][RegIndexOf(dst)];
+                forward.load = i;
+                forward.to = resident;
+                forward.valueBeforeLoad = valueBeforeLoad;
+                forward.slot = slot;
+                forward.spillInstrIndex = state.spillInstrIndex;
+                state.numForwardedReads++;
+                numForwarding++;
+                continue;
+            }
+            state.bRead = true;
+            setReg(dst, state.value);
+        }
+        else if (instr->typekind != Ir_void) {
+            setReg(instr->ra.dstReg, instr->ra.restores ? instr->ra.restores : instr);
+        }
+    }
+    for (uint cls = 0; cls < RegClass_count; ++cls) {
+        for (uint index = 0; index < forwards[cls].size(); ++index) {
+            if (forwards[cls][index].load != uint(-1))
+                endForward(MakeRegLoc(RegClass(cls), index), forwards[cls][index], true);
+        }
+    }
+    for (const std::vector<SlotState>& classSlots : slots) {
+        for (const SlotState& state : classSlots) {
+            ASSERT(state.numForwardedReads == 0);
+            if (state.value && !state.bRead && !removed[state.spillInstrIndex]) {
+                removed[state.spillInstrIndex] = true;
+                stats.numDeadSpills++;
+            }
+        }
+    }
+
+    uint n = 0;
+    for (uint i = 0; i < instrs.size(); ++i) {
+        if (removed[i])
+            delete instrs[i];
+        else
+            instrs[n++] = instrs[i];
+    }
+    instrs.resize(n);
+    return stats;
+}
+
+enum RegisterAllocator : uint8_t {
+    RegisterAllocator_local,      // LocalRegisterAllocation
+    RegisterAllocator_linearScan, // LinearScanRegisterAllocation, less work per instruction but cruder spilling
+};
+
+struct CompileOptions {
+    uint reglimit = 2;
+    uint predlimit = 0; // predicate registers for bools, 0 puts them in the data registers; only for blocks
+    uint veclimit = 0;  // vector registers, needed by bVectorize; only for blocks
+    bool bEliminateDeadCode = true;
+    bool bVectorize = false; // VectorizeSlp, after dead code elimination
+    uint vecLanes = 4;       // the widest vectors VectorizeSlp makes, 4 or 8
+    bool bSchedule = true;
+    RegisterAllocator allocator = RegisterAllocator_local; // only for blocks, functions always use the global one
+    EvictionHeuristic eviction = Eviction_farthestNextUse;
+    bool bRematerialize = true;
+    bool bPeephole = true;
+};
+
+// Everything after building the IR of a function with any number of blocks.
+// The block-local passes in CompileOptions don't know about values used in other blocks yet,
+// so only register allocation is done here.
+static void CompileFunction(Module& module, Function& function, const CompileOptions& options)
+{
+    function.BuildCfg();
+    function.ComputeDominators();
+    Liveness liveness;
+    ComputeLiveness(function, liveness);
+    GlobalRegisterAllocation(module, function, liveness, options.reglimit, options.eviction);
+#if _DEBUG
+    VerifyRegisterAllocation(function, options.reglimit);
+#endif
+}
+
+// Everything after building the IR. What the passes allocate is from arena, the module's if null; either way it
+// must live as long as the block.
+static void CompileBlock(Module& module, Block& block, const CompileOptions& options, Arena* arena = nullptr)
+{
+    if (options.bEliminateDeadCode)
+        EliminateDeadCodeAndRedundantTestIo(block);
+    if (options.bVectorize) {
+        Verify(options.veclimit != 0);
+        VectorizeSlp(module, block, arena, options.vecLanes);
+    }
+    if (options.bSchedule)
+        ScheduleForRegisterPressure(block, options.reglimit, options.predlimit, options.veclimit);
+
+    if (options.allocator == RegisterAllocator_linearScan) {
+        LinearScanRegisterAllocation(module, block, options.reglimit, options.predlimit, options.veclimit);
+    }
+    else {
+        LocalRegisterAllocation(module, block, options.reglimit, options.eviction, options.bRematerialize,
+                                options.predlimit, options.veclimit);
+    }
+#if _DEBUG
+    VerifyRegisterAllocation(block, options.reglimit, options.predlimit, options.veclimit);
+#endif
+    if (options.bPeephole) {
+        EliminateRedundantSpillCode(block);
+#if _DEBUG
+        VerifyRegisterAllocation(block, options.reglimit, options.predlimit, options.veclimit);
+#endif
+    }
+}
+
+// CompileBlock for every block, on the pool's threads. The blocks only share the module: its literal pools are
+// sharded and locked, and each thread allocates from an arena of its own, kept in the module. RA state is per call.
+// So each block comes out the same as when compiled alone, whatever the number of threads or the order.
+// Not static, it's an entry point for whoever embeds the compiler, like DoSomething.
+void CompileBlocksParallel(Module& module, view<Block* const> blocks, const CompileOptions& options,
+    WorkStealingPool& pool)
+{
+    while (module.threadArenas.size() < pool.NumThreads())
+        module.threadArenas.emplace_back(new Arena());
+    pool.ParallelFor(blocks.length, [&](size_t i, uint worker) {
+        CompileBlock(module, *blocks[uint(i)], options, module.threadArenas[worker].get());
+    });
+}
+
+// CompileFunction for every function, on the pool's threads. Functions share only the module's literal pools,
+// like the blocks above, and global RA allocates nothing from an arena, so they come out the same too.
+void CompileFunctionsParallel(Module& module, view<Function* const> functions, const CompileOptions& options,
+    WorkStealingPool& pool)
+{
+    pool.ParallelFor(functions.length, [&](size_t i, uint) {
+        CompileFunction(module, *functions[uint(i)], options);
+    });
+}
+
+// Running a block: LowerToBytecode turns it into flat records over one array of 32-bit cells, the frame, which
+// holds every value before RA, or the registers and spill slots after, and the literals either way. Then there is
+// nothing to look up while running, spill, load_spilled and move are all a copy between cells.
+// Test I/O reads and writes 4 bytes at its offset in the input and output buffers, in host byte order.
+// The lowering and the runners are exported, a block is lowered once and then run for as many inputs as needed.
+enum BytecodeOp : uint8_t {
+    Bc_read,
+    Bc_write,
+    Bc_iadd,
+    Bc_icmp_eq,
+    Bc_icmp_ult,
+    Bc_select,
+    Bc_move,
+    Bc_swap,
+    Bc_return,
+
+    // An a64 add carries into its high word and a compare needs both, so these take both cells of each a64 in one
+    // record: dst, a and b are the low cells, the high ones follow. The compares' dst is a single cell.
+    Bc_iadd64,
+    Bc_icmp_eq64,
+    Bc_icmp_ult64,
+
+    // Superinstructions: both records in one dispatch, the second keeps its own op. Pairs that are common in
+    // allocated blocks, where a reload feeds an iadd and a def is spilled or written right away.
+    Bc_iadd_iadd,
+    Bc_iadd_write,
+    Bc_iadd_move,
+    Bc_move_iadd,
+    Bc_move_move,
+
+    Bc_count
+};
+
+struct BytecodeInstr {
+    BytecodeOp op;
+    uint32_t dst; // frame index
+    uint32_t a;   // frame index, or the byte offset of test I/O
+    uint32_t b;   // frame index
+    uint32_t c;   // frame index
+};
+
+struct BytecodeProgram {
+    std::vector<BytecodeInstr> code;
+    std::vector<uint32_t> frameInit; // literals are at the end, everything else starts at 0
+    uint32_t inputBytes = 0; // the input and output buffers must be at least this big
+    uint32_t outputBytes = 0;
+    uint numIrInstrs = 0; // that code was lowered from, not counting the return
+};
+
+static void FuseSuperinstructions(std::vector<BytecodeInstr>& code)
+{
+    static const struct {
+        BytecodeOp first, second, fused;
+    } pairs[] = {
+        { Bc_iadd, Bc_iadd,  Bc_iadd_iadd },
+        { Bc_iadd, Bc_write, Bc_iadd_write },
+        { Bc_iadd, Bc_move,  Bc_iadd_move },
+        { Bc_move, Bc_iadd,  Bc_move_iadd },
+        { Bc_move, Bc_move,  Bc_move_move },
+    };
+    for (size_t i = 0; i + 1 < code.size(); ++i) {
+        for (const auto& pair : pairs) {
+            if (code[i].op == pair.first && code[i + 1].op == pair.second) {
+                code[i].op = pair.fused;
+                ++i; // the second one can't start another pair
+                break;
+            }
+        }
+    }
+}
+
+// bAllocated: operands are read from ra.srcRegs and spill slots, as after register allocation.
+// A value takes a cell per word: one per lane of a vector, whose records are repeated for each lane at the next
+// cells and offsets, and the words of an a64 low first. After RA, every register and spill slot of a class is as
+// many cells as the widest value of the class in the block.
+void LowerToBytecode(const Block& block, bool bAllocated, bool bSuperinstructions, BytecodeProgram& program)
+{
+    Implemented(block.params.empty());
+    const std::vector<Instruction*>& instrs = block.instructions;
+    program.code.clear();
+    program.code.reserve(instrs.size());
+    program.inputBytes = 0;
+    program.outputBytes = 0;
+    program.numIrInstrs = uint(instrs.size()) - 1;
+
+    // Frame layout after RA: registers of each class, then spill slots of each class.
+    uint numRegs[RegClass_count] = { };
+    uint numSlots[RegClass_count] = { };
+    uint width[RegClass_count] = { 1, 1, 1 };
+    auto slotClass = [](const Instruction* instr) {
+        if (instr->opcode == Opcode_load_spilled)
+            return RegClassOf(instr->ra.dstReg);
+        return IsLiteral(instr->Operand(1)) ? RegClass_data : RegClassOf(instr->ra.srcRegs[1]);
+    };
+    auto slotOf = [](const Instruction* instr) { return uint(static_cast<const LiteralValue*>(instr->Operand(0))->zext); };
+    std::vector<uint32_t> valueCells; // before RA, by instruction index
+    uint32_t numCells = 0;
+    if (bAllocated) {
+        for (const Instruction* const instr : instrs) {
+            if (instr->typekind != Ir_void) {
+                RegClass const regClass = RegClassOf(instr->ra.dstReg);
+                numRegs[regClass] = Max(numRegs[regClass], RegIndexOf(instr->ra.dstReg) + 1);
+                width[regClass] = Max(width[regClass], WordCount(instr->typekind));
+            }
+            if (instr->opcode == Opcode_spill || instr->opcode == Opcode_load_spilled)
+                numSlots[slotClass(instr)] = Max(numSlots[slotClass(instr)], slotOf(instr) + 1);
+        }
+    }
+    else {
+        valueCells.resize(instrs.size());
+        for (uint i = 0; i < instrs.size(); ++i) {
+            valueCells[i] = numCells;
+            numCells += instrs[i]->typekind != Ir_void ? WordCount(instrs[i]->typekind) : 0;
+        }
+    }
+    uint32_t regBase[RegClass_count], slotBase[RegClass_count];
+    if (bAllocated) {
+        for (uint c = 0; c < RegClass_count; ++c) {
+            regBase[c] = numCells;
+            numCells += numRegs[c] * width[c];
+        }
+        for (uint c = 0; c < RegClass_count; ++c) {
+            slotBase[c] = numCells;
+            numCells += numSlots[c] * width[c];
+        }
+    }
+    auto regCell = [&](RegLoc reg) {
+        ASSERT(reg != RegLocInvalid);
+        return regBase[RegClassOf(reg)] + RegIndexOf(reg) * width[RegClassOf(reg)];
+    };
+    auto slotCell = [&](const Instruction* instr) {
+        return slotBase[slotClass(instr)] + slotOf(instr) * width[slotClass(instr)];
+    };
+
+    // Literals are interned, so one cell range per LiteralValue.
+    program.frameInit.assign(numCells, 0);
+    std::unordered_map<const Value*, uint32_t> literalCells;
+    auto cell = [&](const Instruction* instr, uint i) {
+        const Value* const v = instr->Operand(i);
+        if (IsLiteral(v)) {
+            auto const r = literalCells.insert({ v, uint32_t(program.frameInit.size()) });
+            if (r.second) {
+                uint64_t const zext = static_cast<const LiteralValue*>(v)->zext;
+                if (v->typekind == Ir_a64) {
+                    program.frameInit.push_back(uint32_t(zext));
+                    program.frameInit.push_back(uint32_t(zext >> 32));
+                }
+                else {
+                    program.frameInit.insert(program.frameInit.end(), LaneCount(v->typekind), uint32_t(zext));
+                }
+            }
+            return r.first->second;
+        }
+        if (bAllocated)
+            return regCell(instr->ra.srcRegs[i]);
+        ASSERT(instrs[static_cast<const RuntimeValue*>(v)->instrIndexInBlock] == v);
+        return valueCells[static_cast<const RuntimeValue*>(v)->instrIndexInBlock];
+    };
+    auto ioOffset = [&](const Instruction* instr, uint32_t& bytes, uint numWords) {
+        uint32_t const offset = uint32_t(static_cast<const LiteralValue*>(instr->Operand(0))->zext);
+        bytes = Max(bytes, offset + 4 * numWords);
+        return offset;
+    };
+
+    for (uint i = 0; i < instrs.size(); ++i) {
+        const Instruction* const instr = instrs[i];
+        ASSERT(bAllocated || instr->instrIndexInBlock == i);
+        BytecodeInstr bc = { };
+        if (instr->typekind != Ir_void)
+            bc.dst = bAllocated ? regCell(instr->ra.dstReg) : valueCells[i];
+        // How many records, and which operands advance a cell per record: the vectors and a64s.
+        uint numWords = 1;
+        bool bWide[MaxOperands] = { };
+        for (uint j = 0; j < instr->OperandCount(); ++j) {
+            bWide[j] = WordCount(instr->Operand(j)->typekind) > 1;
+            numWords = Max(numWords, WordCount(instr->Operand(j)->typekind));
+        }
+        numWords = Max(numWords, WordCount(instr->typekind));
+        bool const bWideDst = WordCount(instr->typekind) > 1;
+        switch (instr->opcode) {
+        case Opcode_read_test_input:
+            bc.op = Bc_read;
+            bc.a = ioOffset(instr, program.inputBytes, numWords);
+            break;
+        case Opcode_write_test_output:
+            bc.op = Bc_write;
+            bc.a = ioOffset(instr, program.outputBytes, numWords);
+            bc.b = cell(instr, 1);
+            break;
+        case Opcode_iadd:
+        case Opcode_icmp_eq:
+        case Opcode_icmp_ult:
+            bc.op = instr->opcode == Opcode_iadd ? Bc_iadd : instr->opcode == Opcode_icmp_eq ? Bc_icmp_eq : Bc_icmp_ult;
+            if (instr->Operand(0)->typekind == Ir_a64) {
+                bc.op = bc.op == Bc_iadd ? Bc_iadd64 : bc.op == Bc_icmp_eq ? Bc_icmp_eq64 : Bc_icmp_ult64;
+                numWords = 1;
+            }
+            Implemented(bc.op == Bc_iadd || numWords == 1); // a lane-wise compare has no bool vector to go to
+            bc.a = cell(instr, 0);
+            bc.b = cell(instr, 1);
+            break;
+        case Opcode_select:
+            bc.op = Bc_select;
+            bc.a = cell(instr, 0);
+            bc.b = cell(instr, 1);
+            bc.c = cell(instr, 2);
+            break;
+        case Opcode_spill:
+            bc.op = Bc_move;
+            bc.dst = slotCell(instr);
+            bc.a = cell(instr, 1);
+            bWide[0] = bWide[1];
+            break;
+        case Opcode_load_spilled:
+            bc.op = Bc_move;
+            bc.a = slotCell(instr);
+            bWide[0] = bWideDst;
+            break;
+        case Opcode_move:
+            bc.op = Bc_move;
+            bc.a = IsLiteral(instr->Operand(0)) ? cell(instr, 0) : regCell(instr->ra.srcRegs[0]);
+            break;
+        case Opcode_swap:
+            bc.op = Bc_swap;
+            bc.a = regCell(instr->ra.srcRegs[0]);
+            bc.b = regCell(instr->ra.srcRegs[1]);
+            break;
+        case Opcode_return:
+            Implemented(instr->OperandCount() == 0);
+            bc.op = Bc_return;
+            break;
+        default:
+            Implemented(false); // jumps, branches and globals
+        }
+        program.code.push_back(bc);
+        // The other words. Test I/O goes 4 bytes further each time, the I/O offset isn't a cell.
+        bool const bIo = bc.op == Bc_read || bc.op == Bc_write;
+        for (uint word = 1; word < numWords; ++word) {
+            BytecodeInstr next = bc;
+            next.dst += bWideDst || bc.op == Bc_move ? word : 0;
+            next.a += bIo ? 4 * word : bWide[0] ? word : 0;
+            next.b += bWide[1] || bc.op == Bc_swap ? word : 0;
+            next.c += bWide[2] ? word : 0;
+            program.code.push_back(next);
+        }
+    }
+    Verify(!program.code.empty() && program.code.back().op == Bc_return);
+    if (bSuperinstructions)
+        FuseSuperinstructions(program.code);
+}
+
+static forceinline void BcRead(const BytecodeInstr& i, uint32_t* f, const ubyte* in) { memcpy(&f[i.dst], in + i.a, 4); }
+static forceinline void BcWrite(const BytecodeInstr& i, const uint32_t* f, ubyte* out) { memcpy(out + i.a, &f[i.b], 4); }
+static forceinline void BcIadd(const BytecodeInstr& i, uint32_t* f)     { f[i.dst] = f[i.a] + f[i.b]; }
+static forceinline void BcIcmpEq(const BytecodeInstr& i, uint32_t* f)   { f[i.dst] = f[i.a] == f[i.b]; }
+static forceinline void BcIcmpUlt(const BytecodeInstr& i, uint32_t* f)  { f[i.dst] = f[i.a] < f[i.b]; }
+static forceinline void BcSelect(const BytecodeInstr& i, uint32_t* f)   { f[i.dst] = f[i.a] ? f[i.b] : f[i.c]; }
+static forceinline void BcMove(const BytecodeInstr& i, uint32_t* f)     { f[i.dst] = f[i.a]; }
+static forceinline void BcSwap(const BytecodeInstr& i, uint32_t* f)     { std::swap(f[i.a], f[i.b]); }
+static forceinline uint64_t BcA64(const uint32_t* f, uint32_t cell)     { return f[cell] | uint64_t(f[cell + 1]) << 32; }
+static forceinline void BcIadd64(const BytecodeInstr& i, uint32_t* f)
+{
+    uint64_t const r = BcA64(f, i.a) + BcA64(f, i.b);
+    f[i.dst] = uint32_t(r);
+    f[i.dst + 1] = uint32_t(r >> 32);
+}
+static forceinline void BcIcmpEq64(const BytecodeInstr& i, uint32_t* f)  { f[i.dst] = BcA64(f, i.a) == BcA64(f, i.b); }
+static forceinline void BcIcmpUlt64(const BytecodeInstr& i, uint32_t* f) { f[i.dst] = BcA64(f, i.a) < BcA64(f, i.b); }
+
+// The naive dispatch, for comparing, and the fallback where there are no label addresses.
+void RunBytecodeSwitch(const BytecodeProgram& program, std::vector<uint32_t>& frame,
+    const ubyte* input, size_t inputSize, ubyte* output, size_t outputSize)
+{
+    Verify(inputSize >= program.inputBytes && outputSize >= program.outputBytes);
+    frame = program.frameInit;
+    uint32_t* const f = frame.data();
+    for (const BytecodeInstr* ip = program.code.data();;) {
+        switch (ip->op) {
+        case Bc_read:       BcRead(*ip, f, input);                     ip += 1; break;
+        case Bc_write:      BcWrite(*ip, f, output);                   ip += 1; break;
+        case Bc_iadd:       BcIadd(*ip, f);                            ip += 1; break;
+        case Bc_icmp_eq:    BcIcmpEq(*ip, f);                          ip += 1; break;
+        case Bc_icmp_ult:   BcIcmpUlt(*ip, f);                         ip += 1; break;
+        case Bc_select:     BcSelect(*ip, f);                          ip += 1; break;
+        case Bc_move:       BcMove(*ip, f);                            ip += 1; break;
+        case Bc_swap:       BcSwap(*ip, f);                            ip += 1; break;
+        case Bc_iadd64:     BcIadd64(*ip, f);                          ip += 1; break;
+        case Bc_icmp_eq64:  BcIcmpEq64(*ip, f);                        ip += 1; break;
+        case Bc_icmp_ult64: BcIcmpUlt64(*ip, f);                       ip += 1; break;
+        case Bc_iadd_iadd:  BcIadd(ip[0], f); BcIadd(ip[1], f);        ip += 2; break;
+        case Bc_iadd_write: BcIadd(ip[0], f); BcWrite(ip[1], f, output); ip += 2; break;
+        case Bc_iadd_move:  BcIadd(ip[0], f); BcMove(ip[1], f);        ip += 2; break;
+        case Bc_move_iadd:  BcMove(ip[0], f); BcIadd(ip[1], f);        ip += 2; break;
+        case Bc_move_move:  BcMove(ip[0], f); BcMove(ip[1], f);        ip += 2; break;
+        case Bc_return:
+            return;
+        default:
+            unreachable;
+        }
+    }
+}
+
+// Direct threaded: each handler jumps to the next one itself, so every op gets its own indirect branch
+// for the predictor, instead of all of them sharing the switch's.
+void RunBytecode(const BytecodeProgram& program, std::vector<uint32_t>& frame,
+    const ubyte* input, size_t inputSize, ubyte* output, size_t outputSize)
+{
+#if defined __GNUC__
+    Verify(inputSize >= program.inputBytes && outputSize >= program.outputBytes);
+    static void* const handlers[Bc_count] = {
+        &&read, &&write, &&iadd, &&icmp_eq, &&icmp_ult, &&select, &&move, &&swap, &&ret,
+        &&iadd64, &&icmp_eq64, &&icmp_ult64, &&iadd_iadd, &&iadd_write, &&iadd_move, &&move_iadd, &&move_move,
+    };
+    frame = program.frameInit;
+    uint32_t* const f = frame.data();
+    const BytecodeInstr* ip = program.code.data();
+#define BC_NEXT(n) do { ip += (n); goto *handlers[ip->op]; } while (0)
+    BC_NEXT(0);
+read:       BcRead(*ip, f, input);                       BC_NEXT(1);
+write:      BcWrite(*ip, f, output);                     BC_NEXT(1);
+iadd:       BcIadd(*ip, f);                              BC_NEXT(1);
+icmp_eq:    BcIcmpEq(*ip, f);                            BC_NEXT(1);
+icmp_ult:   BcIcmpUlt(*ip, f);                           BC_NEXT(1);
+select:     BcSelect(*ip, f);                            BC_NEXT(1);
+move:       BcMove(*ip, f);                              BC_NEXT(1);
+swap:       BcSwap(*ip, f);                              BC_NEXT(1);
+iadd64:     BcIadd64(*ip, f);                            BC_NEXT(1);
+icmp_eq64:  BcIcmpEq64(*ip, f);                          BC_NEXT(1);
+icmp_ult64: BcIcmpUlt64(*ip, f);                         BC_NEXT(1);
+iadd_iadd:  BcIadd(ip[0], f); BcIadd(ip[1], f);          BC_NEXT(2);
+iadd_write: BcIadd(ip[0], f); BcWrite(ip[1], f, output); BC_NEXT(2);
+iadd_move:  BcIadd(ip[0], f); BcMove(ip[1], f);          BC_NEXT(2);
+move_iadd:  BcMove(ip[0], f); BcIadd(ip[1], f);          BC_NEXT(2);
+move_move:  BcMove(ip[0], f); BcMove(ip[1], f);          BC_NEXT(2);
+ret:
+    return;
+#undef BC_NEXT
+#else
+    RunBytecodeSwitch(program, frame, input, inputSize, output, outputSize);
+#endif
+}
+
+// SPMD over a batch of records: each bytecode record is run for BatchLanes records before the next one, so
+// the dispatch is paid once per chunk instead of once per record, and the cells are columns of BatchLanes words.
+// The test I/O is a structure of arrays, the column for byte offset 4k is numRecords words at k * numRecords.
+// Fused pairs would save nothing per record here, so the program must be lowered without superinstructions.
+static const uint BatchLanes = 64;
+
+// d = op(a, b, c) in every lane. In the last chunk the lanes past the records hold garbage, that is harmless.
+template<BytecodeOp Op>
+static forceinline void BatchAlu(uint32_t* d, const uint32_t* a, const uint32_t* b, const uint32_t* c)
+{
+#if TC_SSE2
+    __m128i const one = _mm_set1_epi32(1);
+    __m128i const sign = _mm_set1_epi32(int(0x8000'0000u));
+    for (uint i = 0; i < BatchLanes; i += 4) {
+        __m128i const x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i const y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        __m128i r;
+        if (Op == Bc_iadd) {
+            r = _mm_add_epi32(x, y);
+        }
+        else if (Op == Bc_icmp_eq) {
+            r = _mm_and_si128(_mm_cmpeq_epi32(x, y), one);
+        }
+        else if (Op == Bc_icmp_ult) { // there is only a signed compare
+            r = _mm_and_si128(_mm_cmplt_epi32(_mm_xor_si128(x, sign), _mm_xor_si128(y, sign)), one);
+        }
+        else {
+            __m128i const z = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c + i));
+            __m128i const isFalse = _mm_cmpeq_epi32(x, _mm_setzero_si128());
+            r = _mm_or_si128(_mm_and_si128(isFalse, z), _mm_andnot_si128(isFalse, y));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), r);
+    }
+#else
+    for (uint i = 0; i < BatchLanes; ++i) {
+        if (Op == Bc_iadd)
+            d[i] = a[i] + b[i];
+        else if (Op == Bc_icmp_eq)
+            d[i] = a[i] == b[i];
+        else if (Op == Bc_icmp_ult)
+            d[i] = a[i] < b[i];
+        else
+            d[i] = a[i] ? b[i] : c[i];
+    }
+#endif
+}
+
+// The same for the a64 records, whose high words are in the column after the low ones.
+template<BytecodeOp Op>
+static forceinline void BatchAlu64(uint32_t* d, const uint32_t* a, const uint32_t* b)
+{
+    for (uint i = 0; i < BatchLanes; ++i) {
+        uint64_t const x = a[i] | uint64_t(a[i + BatchLanes]) << 32;
+        uint64_t const y = b[i] | uint64_t(b[i + BatchLanes]) << 32;
+        if (Op == Bc_iadd64) {
+            d[i] = uint32_t(x + y);
+            d[i + BatchLanes] = uint32_t((x + y) >> 32);
+        }
+        else {
+            d[i] = Op == Bc_icmp_eq64 ? x == y : x < y;
+        }
+    }
+}
+
+void RunBytecodeBatch(const BytecodeProgram& program, std::vector<uint32_t>& frame,
+    const uint32_t* input, uint32_t* output, size_t numRecords)
+{
+    frame.resize(program.frameInit.size() * BatchLanes);
+    for (size_t cell = 0; cell < program.frameInit.size(); ++cell)
+        std::fill_n(&frame[cell * BatchLanes], BatchLanes, program.frameInit[cell]); // literals stay put
+    uint32_t* const f = frame.data();
+    auto col = [f](uint32_t cell) { return f + size_t(cell) * BatchLanes; };
+
+    for (size_t first = 0; first < numRecords; first += BatchLanes) {
+        size_t const n = Min<size_t>(BatchLanes, numRecords - first);
+        for (const BytecodeInstr* ip = program.code.data(); ip->op != Bc_return; ++ip) {
+            const BytecodeInstr& i = *ip;
+            switch (i.op) {
+            case Bc_read:       memcpy(col(i.dst), input + (i.a / 4) * numRecords + first, n * 4); break;
+            case Bc_write:      memcpy(output + (i.a / 4) * numRecords + first, col(i.b), n * 4); break;
+            case Bc_iadd:       BatchAlu<Bc_iadd>(col(i.dst), col(i.a), col(i.b), nullptr); break;
+            case Bc_icmp_eq:    BatchAlu<Bc_icmp_eq>(col(i.dst), col(i.a), col(i.b), nullptr); break;
+            case Bc_icmp_ult:   BatchAlu<Bc_icmp_ult>(col(i.dst), col(i.a), col(i.b), nullptr); break;
+            case Bc_select:     BatchAlu<Bc_select>(col(i.dst), col(i.a), col(i.b), col(i.c)); break;
+            case Bc_move:       memcpy(col(i.dst), col(i.a), BatchLanes * 4); break;
+            case Bc_swap:       std::swap_ranges(col(i.a), col(i.a) + BatchLanes, col(i.b)); break;
+            case Bc_iadd64:     BatchAlu64<Bc_iadd64>(col(i.dst), col(i.a), col(i.b)); break;
+            case Bc_icmp_eq64:  BatchAlu64<Bc_icmp_eq64>(col(i.dst), col(i.a), col(i.b)); break;
+            case Bc_icmp_ult64: BatchAlu64<Bc_icmp_ult64>(col(i.dst), col(i.a), col(i.b)); break;
+            default:            Verify(false); // superinstructions
+            }
+        }
+    }
+}
+
+// x86-64 machine code for an allocated block, a function taking pointers to the test I/O buffers.
+// Registers of both classes map to the general purpose registers in X64AllocatableRegs, data ones first,
+// and spill slots to 4 bytes each on the stack, or 8 for the data ones if the block has a64 values, which use
+// the REX.W forms. r13 is scratch for literals that can't be immediates,
+// r14 and r15 hold the input and output pointers. Everything callee-saved is saved, it is only a few pushes.
+// Globals are addressed rip-relative, through fixups the JIT patches or the object file writer relocates.
+enum X64Reg : uint8_t {
+    X64_rax, X64_rcx, X64_rdx, X64_rbx, X64_rsp, X64_rbp, X64_rsi, X64_rdi,
+    X64_r8, X64_r9, X64_r10, X64_r11, X64_r12, X64_r13, X64_r14, X64_r15,
+};
+
+static const X64Reg X64AllocatableRegs[] = {
+    X64_rax, X64_rcx, X64_rdx, X64_rsi, X64_rdi, X64_r8, X64_r9, X64_r10, X64_r11, X64_rbx, X64_rbp, X64_r12,
+};
+static const X64Reg X64Scratch = X64_r13;
+static const X64Reg X64Input = X64_r14;
+static const X64Reg X64Output = X64_r15;
+
+// The calling conventions differ in which registers pass the arguments and must be saved.
+struct X64Abi {
+    view<const X64Reg> calleeSaved;
+    X64Reg args[2];
+};
+static const X64Reg X64SysVCalleeSaved[] = { X64_rbx, X64_rbp, X64_r12, X64_r13, X64_r14, X64_r15 };
+static const X64Reg X64Win64CalleeSaved[] = { X64_rbx, X64_rbp, X64_rsi, X64_rdi, X64_r12, X64_r13, X64_r14, X64_r15 };
+static const X64Abi X64SysV = { { X64SysVCalleeSaved, countof(X64SysVCalleeSaved) }, { X64_rdi, X64_rsi } };
+static const X64Abi X64Win64 = { { X64Win64CalleeSaved, countof(X64Win64CalleeSaved) }, { X64_rcx, X64_rdx } };
+
+// A rip-relative reference to a global.
+struct X64GlobalFixup {
+    uint32_t offset; // of the 4-byte displacement in the code
+    uint global;     // index in Module::globals
+    int32_t addend;  // minus the bytes from the displacement to the end of the instruction
+};
+
+// Only the encodings the lowering below needs. All operations are 32-bit unless named 64 or given w.
+struct X64Emitter {
+    std::vector<ubyte> code;
+    std::vector<X64GlobalFixup> fixups;
+    uint32_t inputBytes = 0; // the test I/O buffers must be at least this big
+    uint32_t outputBytes = 0;
+
+    void Byte(uint b) { code.push_back(ubyte(b)); }
+    void Imm32(uint32_t v) { for (uint i = 0; i < 4; ++i) Byte(v >> (i * 8)); }
+
+    // A byte operand of spl, bpl, sil or dil needs a REX prefix even if it has no bits set.
+    void Rex(bool w, uint reg, uint rm, bool bByteRegs = false)
+    {
+        uint const rex = 0x40 | uint(w) << 3 | (reg >> 3) << 2 | (rm >> 3);
+        if (rex != 0x40 || (bByteRegs && ((reg & 7) >= 4 || (rm & 7) >= 4)))
+            Byte(rex);
+    }
+    // opcode reg, rm where both are registers. bEscape adds the 0x0F before the opcode.
+    void RR(uint opcode, uint reg, uint rm, bool w = false, bool bEscape = false, bool bByteRegs = false)
+    {
+        Rex(w, reg, rm, bByteRegs);
+        if (bEscape)
+            Byte(0x0F);
+        Byte(opcode);
+        Byte(0xC0 | (reg & 7) << 3 | (rm & 7));
+    }
+    // opcode reg, [base + disp].
+    void RM(uint opcode, uint reg, X64Reg base, int32_t disp, bool w = false)
+    {
+        Rex(w, reg, base);
+        Byte(opcode);
+        bool const bDisp8 = disp >= -128 && disp <= 127;
+        Byte((bDisp8 ? 0x40 : 0x80) | (reg & 7) << 3 | (base & 7));
+        if ((base & 7) == X64_rsp)
+            Byte(0x24); // SIB with no index
+        if (bDisp8)
+            Byte(uint(disp));
+        else
+            Imm32(uint32_t(disp));
+    }
+
+    void MovRR(X64Reg dst, X64Reg src, bool w = false) { if (dst != src) RR(0x8B, dst, src, w); }
+    void MovRR64(X64Reg dst, X64Reg src)      { RR(0x8B, dst, src, true); }
+    void MovRI(X64Reg dst, uint32_t imm) // not xor for 0, flags must survive it
+    {
+        Rex(false, 0, dst);
+        Byte(0xB8 + (dst & 7));
+        Imm32(imm);
+    }
+    // The 32-bit form zero-extends, so the 10-byte one is only for values that need it.
+    void MovRI64(X64Reg dst, uint64_t imm)
+    {
+        if (imm <= 0xFFFF'FFFFu) {
+            MovRI(dst, uint32_t(imm));
+            return;
+        }
+        Rex(true, 0, dst);
+        Byte(0xB8 + (dst & 7));
+        Imm32(uint32_t(imm));
+        Imm32(uint32_t(imm >> 32));
+    }
+    // opcode reg, [rip + global], immBytes follow the displacement.
+    void RipGlobal(uint opcode, uint reg, uint global, uint immBytes)
+    {
+        Rex(false, reg, 0);
+        Byte(opcode);
+        Byte((reg & 7) << 3 | 5);
+        fixups.push_back({ uint32_t(code.size()), global, -int32_t(4 + immBytes) });
+        Imm32(0);
+    }
+
+    void Load(X64Reg dst, X64Reg base, int32_t disp, bool w = false)  { RM(0x8B, dst, base, disp, w); }
+    void Store(X64Reg base, int32_t disp, X64Reg src, bool w = false) { RM(0x89, src, base, disp, w); }
+    // With w the immediate is sign-extended to 64 bits.
+    void StoreI(X64Reg base, int32_t disp, uint32_t imm, bool w = false) { RM(0xC7, 0, base, disp, w); Imm32(imm); }
+    void LoadGlobal(X64Reg dst, uint global)             { RipGlobal(0x8B, dst, global, 0); }
+    void StoreGlobal(uint global, X64Reg src)            { RipGlobal(0x89, src, global, 0); }
+    void StoreGlobalI(uint global, uint32_t imm)         { RipGlobal(0xC7, 0, global, 4); Imm32(imm); }
+    void AddRR(X64Reg dst, X64Reg src, bool w = false) { RR(0x03, dst, src, w); }
+    void CmpRR(X64Reg a, X64Reg b, bool w = false)     { RR(0x3B, a, b, w); }
+    void TestRR(X64Reg a, X64Reg b)           { RR(0x85, b, a); }
+    void XchgRR(X64Reg a, X64Reg b, bool w = false)    { RR(0x87, a, b, w); }
+    void CmovRR(uint cc, X64Reg dst, X64Reg src, bool w = false) { RR(0x40 | cc, dst, src, w, true); }
+    void SetccZext(uint cc, X64Reg dst)
+    {
+        RR(0x90 | cc, 0, dst, false, true, true);
+        RR(0xB6, dst, dst, false, true, true); // movzx
+    }
+    // op is the /digit of the 0x81 group: 0 add, 5 sub, 7 cmp. With w the immediate is sign-extended too.
+    void AluRI(uint op, X64Reg dst, uint32_t imm, bool w = false)
+    {
+        bool const bImm8 = int32_t(imm) >= -128 && int32_t(imm) <= 127;
+        RR(bImm8 ? 0x83 : 0x81, op, dst, w);
+        if (bImm8)
+            Byte(imm);
+        else
+            Imm32(imm);
+    }
+    void Push(X64Reg r) { Rex(false, 0, r); Byte(0x50 + (r & 7)); }
+    void Pop(X64Reg r)  { Rex(false, 0, r); Byte(0x58 + (r & 7)); }
+    void Ret() { Byte(0xC3); }
+};
+
+enum X64Cond : uint8_t { X64Cond_b = 0x2, X64Cond_e = 0x4, X64Cond_ne = 0x5, X64Cond_a = 0x7 };
+
+// Whether v can be the 32-bit immediate of an instruction, which is sign-extended in the REX.W forms.
+static bool X64FitsImm32(uint64_t v, bool w)
+{
+    return !w || uint64_t(int64_t(int32_t(uint32_t(v)))) == v;
+}
+
+// Appends the function to e. The block must have been allocated with at most countof(X64AllocatableRegs)
+// registers of both classes together.
+static void EmitX64Block(const Block& block, const X64Abi& abi, X64Emitter& e)
+{
+    Implemented(block.params.empty());
+    const std::vector<Instruction*>& instrs = block.instructions;
+
+    uint numRegs[RegClass_count] = { };
+    uint numSlots[RegClass_count] = { };
+    auto slotClass = [](const Instruction* instr) {
+        if (instr->opcode == Opcode_load_spilled)
+            return RegClassOf(instr->ra.dstReg);
+        return IsLiteral(instr->Operand(1)) ? RegClass_data : RegClassOf(instr->ra.srcRegs[1]);
+    };
+    auto slotOf = [](const Instruction* instr) { return uint(static_cast<const LiteralValue*>(instr->Operand(0))->zext); };
+    uint dataSlotBytes = 4;
+    for (const Instruction* const instr : instrs) {
+        Implemented(!HasVectorType(instr)); // no xmm registers yet
+        if (HasA64Type(instr))
+            dataSlotBytes = 8;
+        if (instr->typekind != Ir_void)
+            numRegs[RegClassOf(instr->ra.dstReg)] = Max(numRegs[RegClassOf(instr->ra.dstReg)], RegIndexOf(instr->ra.dstReg) + 1);
+        if (instr->opcode == Opcode_spill || instr->opcode == Opcode_load_spilled)
+            numSlots[slotClass(instr)] = Max(numSlots[slotClass(instr)], slotOf(instr) + 1);
+    }
+    Implemented(numRegs[RegClass_data] + numRegs[RegClass_pred] <= countof(X64AllocatableRegs));
+    auto phys = [&](RegLoc reg) {
+        ASSERT(reg != RegLocInvalid);
+        return X64AllocatableRegs[RegClassOf(reg) == RegClass_pred ? numRegs[RegClass_data] + RegIndexOf(reg) : RegIndexOf(reg)];
+    };
+    auto slotDisp = [&](const Instruction* instr) {
+        if (slotClass(instr) == RegClass_pred)
+            return int32_t(numSlots[RegClass_data] * dataSlotBytes + slotOf(instr) * 4);
+        return int32_t(slotOf(instr) * dataSlotBytes);
+    };
+    // An even number of pushes and the return address leave rsp 8 off 16-byte alignment.
+    uint const numSlotBytes = numSlots[RegClass_data] * dataSlotBytes + numSlots[RegClass_pred] * 4;
+    uint const frameBytes = ((numSlotBytes + 15) & ~15u) + 8 * ((abi.calleeSaved.length + 1) % 2);
+    Implemented(frameBytes < (1u << 30));
+
+    auto literal = [](const Value* v) { return uint32_t(static_cast<const LiteralValue*>(v)->zext); };
+    auto literal64 = [](const Value* v) { return static_cast<const LiteralValue*>(v)->zext; };
+    auto isA64 = [](const Instruction* instr, uint i) { return instr->Operand(i)->typekind == Ir_a64; };
+    auto src = [&](const Instruction* instr, uint i, X64Reg scratch) {
+        if (!IsLiteral(instr->Operand(i)))
+            return phys(instr->ra.srcRegs[i]);
+        e.MovRI64(scratch, literal64(instr->Operand(i)));
+        return scratch;
+    };
+    // dst = value of operand i, whatever it is in.
+    auto movOperand = [&](X64Reg dst, const Instruction* instr, uint i) {
+        if (IsLiteral(instr->Operand(i)))
+            e.MovRI64(dst, literal64(instr->Operand(i)));
+        else
+            e.MovRR(dst, phys(instr->ra.srcRegs[i]), isA64(instr, i));
+    };
+    // [base + disp] = operand i, through scratch if it is a literal that doesn't fit the immediate.
+    auto storeOperand = [&](X64Reg base, int32_t disp, const Instruction* instr, uint i) {
+        bool const w = isA64(instr, i);
+        if (IsLiteral(instr->Operand(i)) && X64FitsImm32(literal64(instr->Operand(i)), w))
+            e.StoreI(base, disp, literal(instr->Operand(i)), w);
+        else
+            e.Store(base, disp, src(instr, i, X64Scratch), w);
+    };
+
+    for (X64Reg r : abi.calleeSaved)
+        e.Push(r);
+    if (frameBytes)
+        e.AluRI(5, X64_rsp, frameBytes, true);
+    e.MovRR64(X64Input, abi.args[0]);
+    e.MovRR64(X64Output, abi.args[1]);
+
+    for (const Instruction* const instr : instrs) {
+        X64Reg const dst = instr->typekind != Ir_void ? phys(instr->ra.dstReg) : X64Scratch;
+        bool const w = instr->typekind == Ir_a64;
+        switch (instr->opcode) {
+        case Opcode_read_test_input: {
+            uint32_t const offset = literal(instr->Operand(0));
+            Implemented(offset < (1u << 30));
+            e.inputBytes = Max(e.inputBytes, offset + (w ? 8 : 4));
+            e.Load(dst, X64Input, int32_t(offset), w);
+            break;
+        }
+        case Opcode_write_test_output: {
+            uint32_t const offset = literal(instr->Operand(0));
+            Implemented(offset < (1u << 30));
+            e.outputBytes = Max(e.outputBytes, offset + (isA64(instr, 1) ? 8 : 4));
+            storeOperand(X64Output, int32_t(offset), instr, 1);
+            break;
+        }
+        case Opcode_iadd: {
+            // Literals are the rightmost operand unless both are, see IrBuilder::Iadd.
+            if (IsLiteral(instr->Operand(1))) {
+                uint64_t const c = literal64(instr->Operand(1));
+                movOperand(dst, instr, 0);
+                if (X64FitsImm32(c, w)) {
+                    if (c)
+                        e.AluRI(0, dst, uint32_t(c), w);
+                }
+                else {
+                    e.MovRI64(X64Scratch, c);
+                    e.AddRR(dst, X64Scratch, w);
+                }
+                break;
+            }
+            X64Reg const a = src(instr, 0, X64Scratch), b = phys(instr->ra.srcRegs[1]);
+            if (dst == b) {
+                e.AddRR(dst, a, w);
+            }
+            else {
+                e.MovRR(dst, a, w);
+                e.AddRR(dst, b, w);
+            }
+            break;
+        }
+        case Opcode_icmp_eq:
+        case Opcode_icmp_ult: {
+            bool const bWide = isA64(instr, 0);
+            X64Reg const a = src(instr, 0, X64Scratch);
+            if (IsLiteral(instr->Operand(1)) && X64FitsImm32(literal64(instr->Operand(1)), bWide)) {
+                e.AluRI(7, a, literal(instr->Operand(1)), bWide);
+            }
+            else {
+                // If a is in scratch, both are literals and dst isn't the register of an operand.
+                X64Reg const b = src(instr, 1, a == X64Scratch ? dst : X64Scratch);
+                e.CmpRR(a, b, bWide);
+            }
+            e.SetccZext(instr->opcode == Opcode_icmp_eq ? X64Cond_e : X64Cond_b, dst);
+            break;
+        }
+        case Opcode_select: {
+            if (IsLiteral(instr->Operand(0))) {
+                movOperand(dst, instr, literal(instr->Operand(0)) ? 1 : 2);
+                break;
+            }
+            // Moves don't change flags. The false value goes to scratch first, in case dst is its register.
+            X64Reg const cond = phys(instr->ra.srcRegs[0]);
+            e.TestRR(cond, cond);
+            movOperand(X64Scratch, instr, 2);
+            movOperand(dst, instr, 1);
+            e.CmovRR(X64Cond_e, dst, X64Scratch, w);
+            break;
+        }
+        case Opcode_load_global:
+            e.LoadGlobal(dst, literal(instr->Operand(0)));
+            break;
+        case Opcode_store_global:
+            if (IsLiteral(instr->Operand(1)))
+                e.StoreGlobalI(literal(instr->Operand(0)), literal(instr->Operand(1)));
+            else
+                e.StoreGlobal(literal(instr->Operand(0)), phys(instr->ra.srcRegs[1]));
+            break;
+        case Opcode_spill:
+            storeOperand(X64_rsp, slotDisp(instr), instr, 1);
+            break;
+        case Opcode_load_spilled:
+            e.Load(dst, X64_rsp, slotDisp(instr), w);
+            break;
+        case Opcode_move:
+            movOperand(dst, instr, 0);
+            break;
+        case Opcode_swap:
+            e.XchgRR(phys(instr->ra.srcRegs[0]), phys(instr->ra.srcRegs[1]), isA64(instr, 0) || isA64(instr, 1));
+            break;
+        case Opcode_return:
+            Implemented(instr->OperandCount() == 0);
+            if (frameBytes)
+                e.AluRI(0, X64_rsp, frameBytes, true);
+            for (uint i = abi.calleeSaved.length; i-- > 0;)
+                e.Pop(abi.calleeSaved[i]);
+            e.Ret();
+            break;
+        default:
+            Implemented(false); // jumps and branches
+        }
+    }
+    Verify(!instrs.empty() && instrs.back()->opcode == Opcode_return);
+}
+
+// A function for WriteElfObject, its block allocated as EmitX64Block needs.
+struct ObjectFunction {
+    const char* name;
+    const Block* block;
+};
+
+static void PutLe(ByteStream& bs, uint64_t v, uint numBytes)
+{
+    ubyte bytes[8];
+    for (uint i = 0; i < numBytes; ++i)
+        bytes[i] = ubyte(v >> (8 * i));
+    bs.PutBytes(bytes, numBytes);
+}
+
+static void PutElfSectionHeader(ByteStream& bs, uint32_t name, uint32_t type, uint64_t flags, uint64_t offset,
+    uint64_t size, uint32_t link, uint32_t info, uint64_t align, uint64_t entsize)
+{
+    PutLe(bs, name, 4);
+    PutLe(bs, type, 4);
+    PutLe(bs, flags, 8);
+    PutLe(bs, 0, 8); // address, assigned by the linker
+    PutLe(bs, offset, 8);
+    PutLe(bs, size, 8);
+    PutLe(bs, link, 4);
+    PutLe(bs, info, 4);
+    PutLe(bs, align, 8);
+    PutLe(bs, entsize, 8);
+}
+
+// An x86-64 ELF relocatable object with the functions in .text, callable from C as
+// void name(const void* input, void* output) with the SysV ABI, and every global of the module as a zeroed
+// uint32_t in .bss. All symbols are global so any object can link with it.
+// The code is generated into memory first since the section sizes come before it, then everything is
+// written front to back, so the stream can go straight to a file.
+static void WriteElfObject(ByteStream& bs, const Module& module, view<const ObjectFunction> functions)
+{
+    X64Emitter e;
+    std::vector<uint32_t> offsets(functions.length + 1);
+    for (uint i = 0; i < functions.length; ++i) {
+        e.code.resize((e.code.size() + 15) & ~size_t(15), 0xCC); // int3
+        offsets[i] = uint32_t(e.code.size());
+        EmitX64Block(*functions[i].block, X64SysV, e);
+    }
+    Verify(e.code.size() < 0x7FFF'FFFFu);
+    offsets[functions.length] = uint32_t(e.code.size());
+
+    enum {
+        Section_null, Section_text, Section_relaText, Section_bss, Section_symtab, Section_strtab, Section_shstrtab,
+        Section_noteGnuStack, Section_count
+    };
+    static const char shstrtab[] = "\0.text\0.rela.text\0.bss\0.symtab\0.strtab\0.shstrtab\0.note.GNU-stack";
+    static const uint32_t shnames[Section_count] = { 0, 1, 7, 18, 23, 31, 39, 49 };
+
+    std::vector<char> strtab(1, '\0');
+    std::vector<uint32_t> symNames;
+    symNames.reserve(functions.length + module.globals.size());
+    auto addName = [&](const char* name) {
+        symNames.push_back(uint32_t(strtab.size()));
+        strtab.insert(strtab.end(), name, name + strlen(name) + 1);
+    };
+    for (const ObjectFunction& function : functions)
+        addName(function.name);
+    for (const GlobalVariable* global : module.globals)
+        addName(global->name);
+    uint32_t const firstGlobalSym = 1 + functions.length;
+    uint32_t const numSyms = firstGlobalSym + uint32_t(module.globals.size());
+
+    auto align8 = [](uint64_t x) { return (x + 7) & ~uint64_t(7); };
+    uint64_t const ehdrBytes = 64, shdrBytes = 64, symBytes = 24, relaBytes = 24;
+    uint64_t const textOffset = ehdrBytes;
+    uint64_t const relaOffset = align8(textOffset + e.code.size());
+    uint64_t const symtabOffset = relaOffset + relaBytes * e.fixups.size();
+    uint64_t const strtabOffset = symtabOffset + symBytes * numSyms;
+    uint64_t const shstrtabOffset = strtabOffset + strtab.size();
+    uint64_t const shdrsOffset = align8(shstrtabOffset + sizeof shstrtab);
+
+    // Elf64_Ehdr
+    static const ubyte ident[16] = { 0x7F, 'E', 'L', 'F', 2 /* 64-bit */, 1 /* little endian */, 1 /* version */ };
+    bs.PutBytes(ident, sizeof ident);
+    PutLe(bs, 1, 2);    // ET_REL
+    PutLe(bs, 62, 2);   // EM_X86_64
+    PutLe(bs, 1, 4);    // version
+    PutLe(bs, 0, 8);    // entry
+    PutLe(bs, 0, 8);    // program headers
+    PutLe(bs, shdrsOffset, 8);
+    PutLe(bs, 0, 4);    // flags
+    PutLe(bs, ehdrBytes, 2);
+    PutLe(bs, 0, 2);    // program header size and count
+    PutLe(bs, 0, 2);
+    PutLe(bs, shdrBytes, 2);
+    PutLe(bs, Section_count, 2);
+    PutLe(bs, Section_shstrtab, 2);
+
+    bs.PutBytes(e.code.data(), e.code.size());
+    bs.PutByteRepeated(0, relaOffset - (textOffset + e.code.size()));
+
+    // Elf64_Rela, the fixup addend already accounts for the displacement not being at the end.
+    for (const X64GlobalFixup& fixup : e.fixups) {
+        PutLe(bs, fixup.offset, 8);
+        PutLe(bs, uint64_t(firstGlobalSym + fixup.global) << 32 | 2 /* R_X86_64_PC32 */, 8);
+        PutLe(bs, uint64_t(int64_t(fixup.addend)), 8);
+    }
+
+    // Elf64_Sym, the null symbol is the only local one.
+    bs.PutByteRepeated(0, symBytes);
+    for (uint i = 0; i < functions.length; ++i) {
+        PutLe(bs, symNames[i], 4);
+        PutLe(bs, 1 << 4 | 2, 1); // STB_GLOBAL, STT_FUNC
+        PutLe(bs, 0, 1);
+        PutLe(bs, Section_text, 2);
+        PutLe(bs, offsets[i], 8);
+        PutLe(bs, offsets[i + 1] - offsets[i], 8);
+    }
+    for (uint i = 0; i < module.globals.size(); ++i) {
+        PutLe(bs, symNames[functions.length + i], 4);
+        PutLe(bs, 1 << 4 | 1, 1); // STB_GLOBAL, STT_OBJECT
+        PutLe(bs, 0, 1);
+        PutLe(bs, Section_bss, 2);
+        PutLe(bs, 4 * i, 8);
+        PutLe(bs, 4, 8);
+    }
+
+    bs.PutBytes(strtab.data(), strtab.size());
+    bs.PutBytes(shstrtab, sizeof shstrtab);
+    bs.PutByteRepeated(0, shdrsOffset - (shstrtabOffset + sizeof shstrtab));
+
+    // Elf64_Shdr
+    uint64_t const alloc = 2, exec = 4, write = 1, infoLink = 0x40;
+    PutElfSectionHeader(bs, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    PutElfSectionHeader(bs, shnames[Section_text], 1 /* SHT_PROGBITS */, alloc | exec, textOffset, e.code.size(),
+                        0, 0, 16, 0);
+    PutElfSectionHeader(bs, shnames[Section_relaText], 4 /* SHT_RELA */, infoLink, relaOffset,
+                        relaBytes * e.fixups.size(), Section_symtab, Section_text, 8, relaBytes);
+    PutElfSectionHeader(bs, shnames[Section_bss], 8 /* SHT_NOBITS */, alloc | write, symtabOffset,
+                        4 * module.globals.size(), 0, 0, 4, 0);
+    PutElfSectionHeader(bs, shnames[Section_symtab], 2 /* SHT_SYMTAB */, 0, symtabOffset, symBytes * numSyms,
+                        Section_strtab, 1 /* first non-local */, 8, symBytes);
+    PutElfSectionHeader(bs, shnames[Section_strtab], 3 /* SHT_STRTAB */, 0, strtabOffset, strtab.size(), 0, 0, 1, 0);
+    PutElfSectionHeader(bs, shnames[Section_shstrtab], 3, 0, shstrtabOffset, sizeof shstrtab, 0, 0, 1, 0);
+    // Empty, says the code doesn't need an executable stack.
+    PutElfSectionHeader(bs, shnames[Section_noteGnuStack], 1, 0, shdrsOffset, 0, 0, 0, 1, 0);
+}
+
+// Exported, for ahead-of-time compiles: WriteElfObject to the file at path, which is created or replaced.
+// Returns false if it couldn't be opened or written, then what is there is garbage.
+bool WriteElfObjectFile(const char* path, const Module& module, view<const ObjectFunction> functions)
+{
+#if defined _WIN32
+    int const fd = _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    int const fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if (fd < 0)
+        return false;
+    bool bOk;
+    {
+        FileByteStream bs(fd, 1u << 20);
+        WriteElfObject(bs, module, functions);
+        bOk = bs.Flush();
+    }
+#if defined _WIN32
+    bOk &= _close(fd) == 0;
+#else
+    bOk &= close(fd) == 0;
+#endif
+    return bOk;
+}
+
+#if TC_X64_JIT
+typedef void (*JitBlockFn)(const ubyte* input, ubyte* output);
+
+// Owns the executable copy of the code, followed by the globals on their own pages.
+struct JitCode {
+    void* mem = nullptr;
+    size_t size = 0;
+    JitBlockFn fn = nullptr;
+    uint32_t* globals = nullptr; // by index, zeroed at Install
+    uint32_t inputBytes = 0; // the input and output buffers must be at least this big
+    uint32_t outputBytes = 0;
+
+    JitCode() = default;
+    JitCode(const JitCode&) = delete;
+    JitCode& operator=(const JitCode&) = delete;
+    ~JitCode() { Free(); }
+
+    void Free()
+    {
+        if (!mem)
+            return;
+#if defined _WIN32
+        VirtualFree(mem, 0, MEM_RELEASE);
+#else
+        munmap(mem, size);
+#endif
+        mem = nullptr;
+        fn = nullptr;
+        globals = nullptr;
+    }
+
+    // The code is writable while copying and patching, then only executable. The globals stay writable,
+    // within the +-2GB a rip-relative displacement reaches since they are in the same mapping.
+    void Install(const std::vector<ubyte>& code, const std::vector<X64GlobalFixup>& fixups)
+    {
+        Free();
+        uint numGlobals = 0;
+        for (const X64GlobalFixup& fixup : fixups)
+            numGlobals = Max(numGlobals, fixup.global + 1);
+        size_t const page = 4096;
+        size_t const codeSize = (code.size() + page - 1) & ~(page - 1);
+        size = codeSize + ((numGlobals * sizeof(uint32_t) + page - 1) & ~(page - 1));
+#if defined _WIN32
+        mem = VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        Verify(mem != nullptr);
+#else
+        mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        Verify(mem != MAP_FAILED);
+#endif
+        ubyte* const base = static_cast<ubyte*>(mem);
+        memcpy(base, code.data(), code.size());
+        globals = reinterpret_cast<uint32_t*>(base + codeSize); // fresh pages are zeroed
+        for (const X64GlobalFixup& fixup : fixups) {
+            intptr_t const disp = reinterpret_cast<intptr_t>(globals + fixup.global) + fixup.addend
+                - reinterpret_cast<intptr_t>(base + fixup.offset);
+            int32_t const disp32 = int32_t(disp);
+            memcpy(base + fixup.offset, &disp32, sizeof disp32);
+        }
+#if defined _WIN32
+        DWORD oldProtect;
+        Verify(VirtualProtect(mem, codeSize, PAGE_EXECUTE_READ, &oldProtect));
+#else
+        Verify(mprotect(mem, codeSize, PROT_READ | PROT_EXEC) == 0);
+#endif
+        fn = reinterpret_cast<JitBlockFn>(mem);
+    }
+};
+
+// Exported: after this, jit.fn runs the allocated block natively, any number of times.
+void JitCompileBlock(const Block& block, JitCode& jit)
+{
+    X64Emitter e;
+#if defined _WIN32
+    EmitX64Block(block, X64Win64, e);
+#else
+    EmitX64Block(block, X64SysV, e);
+#endif
+    jit.inputBytes = e.inputBytes;
+    jit.outputBytes = e.outputBytes;
+    jit.Install(e.code, e.fixups);
+}
+#endif // TC_X64_JIT
+
+// Binary IR: straight-line blocks in one buffer that is read in place, like a mapped file, without building any
+// Instructions to walk it. Every array is dense, indexed by instruction (in order through all the blocks), operand
+// or literal, and starts at an offset from the header that is a multiple of 8. Host byte order, it is for passing
+// IR between stages on one machine. An operand is a reference: the index of an instruction in the same block,
+// or BinaryIrLiteralRef | the index of a literal. Literals are written once however often they're used.
+enum BinaryIrFlags : uint16_t {
+    BinaryIr_names = 1, // names and nameBytes
+    BinaryIr_regs  = 2, // dstRegs, srcRegs and restores, for blocks after RA
+};
+
+static const uint32_t BinaryIrMagic = 0x52494354; // "TCIR"
+static const uint16_t BinaryIrVersion = 1;
+static const uint32_t BinaryIrLiteralRef = 1u << 31;
+static const uint32_t BinaryIrNone = uint32_t(-1);
+
+struct BinaryIrHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint32_t numBlocks;
+    uint32_t numInstrs;
+    uint32_t numOperands;
+    uint32_t numLiterals;
+    uint32_t numNameBytes;
+    uint32_t pad;
+    uint64_t totalBytes; // from the header, with it
+    // Offsets from the header, 0 if absent.
+    uint64_t blockEnds;        // uint32_t per block, where the next block's instructions begin
+    uint64_t opcodes;          // Opcode per instruction
+    uint64_t typekinds;        // IrTypekind per instruction
+    uint64_t operandEnds;      // uint32_t per instruction, where the next instruction's operands begin
+    uint64_t operands;         // uint32_t reference per operand
+    uint64_t literalValues;    // uint64_t zext per literal
+    uint64_t literalTypekinds; // IrTypekind per literal
+    uint64_t names;            // uint32_t offset in nameBytes per instruction, or BinaryIrNone
+    uint64_t nameBytes;        // each name ends with a '\0'
+    uint64_t dstRegs;          // RegLoc per instruction
+    uint64_t srcRegs;          // RegLoc per operand
+    uint64_t restores;         // uint32_t reference per instruction, or BinaryIrNone
+};
+
+// Renumbers instrIndexInBlock, references to instructions are written as those.
+static void WriteBinaryIr(ByteStream& bs, view<Block* const> blocks, uint flags)
+{
+    BinaryIrHeader header = { };
+    header.magic = BinaryIrMagic;
+    header.version = BinaryIrVersion;
+    header.flags = uint16_t(flags);
+    header.numBlocks = blocks.length;
+
+    // The arrays are gathered in one walk over the instructions, each is then written with one put.
+    std::vector<uint32_t> blockEnds, operandEnds, operands, names, restores;
+    std::vector<Opcode> opcodes;
+    std::vector<IrTypekind> typekinds, literalTypekinds;
+    std::vector<uint64_t> literalValues;
+    std::vector<char> nameBytes;
+    std::vector<RegLoc> dstRegs, srcRegs;
+    std::unordered_map<const Value*, uint32_t> literalIndices;
+    auto refOf = [&](const Value* value) {
+        if (!IsLiteral(value))
+            return uint32_t(static_cast<const RuntimeValue*>(value)->instrIndexInBlock);
+        auto const r = literalIndices.insert({ value, uint32_t(literalValues.size()) });
+        if (r.second) {
+            literalValues.push_back(static_cast<const LiteralValue*>(value)->zext);
+            literalTypekinds.push_back(value->typekind);
+        }
+        return BinaryIrLiteralRef | r.first->second;
+    };
+    for (Block* const block : blocks) {
+        Implemented(block->params.empty() && block->numSuccs == 0);
+        for (uint i = 0; i < block->instructions.size(); ++i) {
+            Instruction* const instr = block->instructions[i];
+            instr->instrIndexInBlock = i;
+            opcodes.push_back(instr->opcode);
+            typekinds.push_back(instr->typekind);
+            for (const Value* operand : instr->Operands())
+                operands.push_back(refOf(operand));
+            operandEnds.push_back(uint32_t(operands.size()));
+            // Names are nearly always one per instruction, so they're copied without looking for repeats.
+            if ((flags & BinaryIr_names) && instr->debugName) {
+                names.push_back(uint32_t(nameBytes.size()));
+                nameBytes.insert(nameBytes.end(), instr->debugName, instr->debugName + strlen(instr->debugName) + 1);
+            } else if (flags & BinaryIr_names) {
+                names.push_back(BinaryIrNone);
+            }
+            if (flags & BinaryIr_regs) {
+                dstRegs.push_back(instr->ra.dstReg);
+                srcRegs.insert(srcRegs.end(), instr->ra.srcRegs, instr->ra.srcRegs + instr->OperandCount());
+                restores.push_back(instr->ra.restores ? refOf(instr->ra.restores) : BinaryIrNone);
+            }
+            Implemented(operands.size() < BinaryIrNone && nameBytes.size() < BinaryIrNone);
+        }
+        blockEnds.push_back(uint32_t(opcodes.size()));
+    }
+    Implemented(opcodes.size() < BinaryIrLiteralRef);
+    header.numInstrs = uint32_t(opcodes.size());
+    header.numOperands = uint32_t(operands.size());
+    header.numLiterals = uint32_t(literalValues.size());
+    header.numNameBytes = uint32_t(nameBytes.size());
+
+    uint64_t offset = sizeof header;
+    auto place = [&](uint64_t& field, const auto& array) {
+        field = offset;
+        offset = (offset + array.size() * sizeof array[0] + 7) & ~uint64_t(7);
+    };
+    place(header.blockEnds, blockEnds);
+    place(header.opcodes, opcodes);
+    place(header.typekinds, typekinds);
+    place(header.operandEnds, operandEnds);
+    place(header.operands, operands);
+    place(header.literalValues, literalValues);
+    place(header.literalTypekinds, literalTypekinds);
+    if (flags & BinaryIr_names) {
+        place(header.names, names);
+        place(header.nameBytes, nameBytes);
+    }
+    if (flags & BinaryIr_regs) {
+        place(header.dstRegs, dstRegs);
+        place(header.srcRegs, srcRegs);
+        place(header.restores, restores);
+    }
+    header.totalBytes = offset;
+
+    // Each array is padded up to where the next one begins.
+    uint64_t written = 0;
+    auto put = [&](const void* data, size_t bytes) {
+        bs.PutBytes(data, bytes);
+        bs.PutByteRepeated(0, size_t(((bytes + 7) & ~size_t(7)) - bytes));
+        written += (bytes + 7) & ~size_t(7);
+    };
+    auto putArray = [&](const auto& array) { put(array.data(), array.size() * sizeof array[0]); };
+    put(&header, sizeof header);
+    putArray(blockEnds);
+    putArray(opcodes);
+    putArray(typekinds);
+    putArray(operandEnds);
+    putArray(operands);
+    putArray(literalValues);
+    putArray(literalTypekinds);
+    if (flags & BinaryIr_names) {
+        putArray(names);
+        putArray(nameBytes);
+    }
+    if (flags & BinaryIr_regs) {
+        putArray(dstRegs);
+        putArray(srcRegs);
+        putArray(restores);
+    }
+    ASSERT(written == header.totalBytes);
+}
+
+// Binary IR read in place. Open only looks at the header; Validate checks everything the loader relies on,
+// for buffers that could be damaged, like files. The buffer must be 8-byte aligned and outlive the view.
+struct BinaryIrView {
+    BinaryIrHeader header = { };
+    const uint32_t* blockEnds = nullptr;
+    const Opcode* opcodes = nullptr;
+    const IrTypekind* typekinds = nullptr;
+    const uint32_t* operandEnds = nullptr;
+    const uint32_t* operands = nullptr;
+    const uint64_t* literalValues = nullptr;
+    const IrTypekind* literalTypekinds = nullptr;
+    const uint32_t* names = nullptr;    // null without BinaryIr_names
+    const char* nameBytes = nullptr;
+    const RegLoc* dstRegs = nullptr;    // null without BinaryIr_regs
+    const RegLoc* srcRegs = nullptr;
+    const uint32_t* restores = nullptr;
+
+    uint BlockBegin(uint blockIndex) const { return blockIndex ? blockEnds[blockIndex - 1] : 0; }
+    uint OperandBegin(uint instrIndex) const { return instrIndex ? operandEnds[instrIndex - 1] : 0; }
+
+    bool Open(const void* data, size_t size)
+    {
+        ASSERT((uintptr_t(data) & 7) == 0);
+        const ubyte* const base = static_cast<const ubyte*>(data);
+        if (size < sizeof header)
+            return false;
+        memcpy(&header, base, sizeof header);
+        if (header.magic != BinaryIrMagic || header.version != BinaryIrVersion || header.totalBytes > size ||
+            (header.flags & ~(BinaryIr_names | BinaryIr_regs)))
+            return false;
+        bool bOk = true;
+        auto array = [&](auto*& p, uint64_t offset, uint64_t count, bool bPresent) {
+            typedef typename std::remove_pointer<typename std::remove_reference<decltype(p)>::type>::type T;
+            bOk &= !bPresent || (offset % 8 == 0 && offset >= sizeof header && offset <= header.totalBytes &&
+                                 count <= (header.totalBytes - offset) / sizeof(T));
+            p = bPresent && bOk ? reinterpret_cast<T*>(base + offset) : nullptr;
+        };
+        bool const bNames = header.flags & BinaryIr_names, bRegs = header.flags & BinaryIr_regs;
+        array(blockEnds, header.blockEnds, header.numBlocks, true);
+        array(opcodes, header.opcodes, header.numInstrs, true);
+        array(typekinds, header.typekinds, header.numInstrs, true);
+        array(operandEnds, header.operandEnds, header.numInstrs, true);
+        array(operands, header.operands, header.numOperands, true);
+        array(literalValues, header.literalValues, header.numLiterals, true);
+        array(literalTypekinds, header.literalTypekinds, header.numLiterals, true);
+        array(names, header.names, header.numInstrs, bNames);
+        array(nameBytes, header.nameBytes, header.numNameBytes, bNames);
+        array(dstRegs, header.dstRegs, header.numInstrs, bRegs);
+        array(srcRegs, header.srcRegs, header.numOperands, bRegs);
+        array(restores, header.restores, header.numInstrs, bRegs);
+        return bOk;
+    }
+
+    // Whether instruction i, whose operand refs are in range and point backwards, has the operands its opcode takes:
+    // how many, a32 literals for offsets, slots and global indices, and types that fit together. Jumps and branches
+    // don't, the format is for straight-line blocks.
+    bool ValidOperands(uint i, uint begin, const uint32_t* refs, uint numOperands) const
+    {
+        auto isLiteral = [&](uint j) { return (refs[j] & BinaryIrLiteralRef) != 0; };
+        auto typekindOf = [&](uint j) {
+            return isLiteral(j) ? literalTypekinds[refs[j] & ~BinaryIrLiteralRef] : typekinds[begin + refs[j]];
+        };
+        auto isIndex = [&](uint j) { return isLiteral(j) && typekindOf(j) == Ir_a32; };
+        IrTypekind const typekind = typekinds[i];
+        bool const bArith = typekind == Ir_a32 || LaneCount(typekind) > 1 || typekind == Ir_a64;
+        switch (opcodes[i]) {
+        case Opcode_read_test_input:
+            return numOperands == 1 && isIndex(0) && bArith;
+        case Opcode_write_test_output:
+        case Opcode_spill:
+            return numOperands == 2 && isIndex(0) && typekindOf(1) != Ir_void && typekind == Ir_void;
+        case Opcode_load_spilled:
+            return numOperands == 1 && isIndex(0) && typekind != Ir_void;
+        case Opcode_return:
+            return numOperands == 0 && typekind == Ir_void;
+        case Opcode_move:
+            return numOperands == 1 && typekindOf(0) == typekind && typekind != Ir_void;
+        case Opcode_swap:
+            return numOperands == 2 && !isLiteral(0) && !isLiteral(1) && typekindOf(0) != Ir_void &&
+                   typekindOf(1) != Ir_void && typekind == Ir_void;
+        case Opcode_iadd:
+            return numOperands == 2 && bArith && typekindOf(0) == typekind && typekindOf(1) == typekind;
+        case Opcode_icmp_eq:
+        case Opcode_icmp_ult:
+            return numOperands == 2 && typekind == Ir_bool && (typekindOf(0) == Ir_a32 || typekindOf(0) == Ir_a64) &&
+                   typekindOf(1) == typekindOf(0);
+        case Opcode_select:
+            return numOperands == 3 && typekindOf(0) == Ir_bool && bArith && typekindOf(1) == typekind &&
+                   typekindOf(2) == typekind;
+        case Opcode_load_global:
+            return numOperands == 1 && isIndex(0) && typekind == Ir_a32;
+        case Opcode_store_global:
+            return numOperands == 2 && isIndex(0) && typekindOf(1) == Ir_a32 && typekind == Ir_void;
+        default:
+            return false;
+        }
+    }
+
+    bool Validate() const
+    {
+        auto validRef = [&](uint32_t ref, uint begin, uint i) {
+            return ref & BinaryIrLiteralRef ? (ref & ~BinaryIrLiteralRef) < header.numLiterals : ref < i - begin;
+        };
+        auto validReg = [](RegLoc reg) { return reg == RegLocInvalid || RegClassOf(reg) < RegClass_count; };
+        for (uint i = 0; i < header.numLiterals; ++i) {
+            if (literalTypekinds[i] == Ir_void || literalTypekinds[i] > Ir_v8a32)
+                return false;
+        }
+        if (header.numNameBytes && nameBytes[header.numNameBytes - 1] != '\0')
+            return false;
+        uint begin = 0, operandBegin = 0;
+        for (uint b = 0; b < header.numBlocks; ++b) {
+            uint const end = blockEnds[b];
+            if (end <= begin || end > header.numInstrs || opcodes[end - 1] != Opcode_return)
+                return false;
+            for (uint i = begin; i < end; ++i) {
+                uint const operandEnd = operandEnds[i];
+                if (typekinds[i] > Ir_v8a32 ||
+                    operandEnd < operandBegin || operandEnd - operandBegin > MaxOperands || operandEnd > header.numOperands)
+                    return false;
+                for (uint j = operandBegin; j < operandEnd; ++j) {
+                    if (!validRef(operands[j], begin, i) || (srcRegs && !validReg(srcRegs[j])))
+                        return false;
+                }
+                if (!ValidOperands(i, begin, operands + operandBegin, operandEnd - operandBegin))
+                    return false;
+                if (names && names[i] != BinaryIrNone && names[i] >= header.numNameBytes)
+                    return false;
+                if (restores && ((restores[i] != BinaryIrNone && !validRef(restores[i], begin, i)) || !validReg(dstRegs[i])))
+                    return false;
+                operandBegin = operandEnd;
+            }
+            begin = end;
+        }
+        return begin == header.numInstrs && operandBegin == header.numOperands;
+    }
+
+    // Validate doesn't know the module, this checks a validated view only uses globals it has, which the loader
+    // Verifies. So a module with fewer globals than the one the IR was written from can reject it instead.
+    bool GlobalsFit(size_t numGlobals) const
+    {
+        for (uint i = 0; i < header.numInstrs; ++i) {
+            if ((opcodes[i] == Opcode_load_global || opcodes[i] == Opcode_store_global) &&
+                literalValues[operands[OperandBegin(i)] & ~BinaryIrLiteralRef] >= numGlobals)
+                return false;
+        }
+        return true;
+    }
+};
+
+// Builds Blocks from a validated view. The literals are interned in the module once for all the blocks, and the
+// names are copied to its arena, so the blocks don't need the buffer after.
+struct BinaryIrLoader {
+    const BinaryIrView& ir;
+    Module& module;
+    std::vector<Value*> literals;
+    const char* nameBytes = nullptr;
+
+    BinaryIrLoader(const BinaryIrView& ir, Module& module) : ir(ir), module(module), literals(ir.header.numLiterals)
+    {
+        for (uint i = 0; i < ir.header.numLiterals; ++i) {
+            uint64_t const z = ir.literalValues[i];
+            switch (ir.literalTypekinds[i]) {
+            case Ir_bool:  literals[i] = module.LiteralBool(z != 0); break;
+            case Ir_a32:   literals[i] = module.LiteralU32(uint32_t(z)); break;
+            case Ir_v4a32: literals[i] = module.LiteralV4Splat(uint32_t(z)); break;
+            case Ir_v8a32: literals[i] = module.LiteralV8Splat(uint32_t(z)); break;
+            case Ir_a64:   literals[i] = module.LiteralU64(z); break;
+            default:       unreachable;
+            }
+        }
+        if (ir.names) {
+            char* const names = module.arena.AllocArray<char>(ir.header.numNameBytes);
+            memcpy(names, ir.nameBytes, ir.header.numNameBytes);
+            nameBytes = names;
+        }
+    }
+
+    // Into the empty block. The module must have the globals the block uses.
+    void LoadBlock(uint blockIndex, Block& block)
+    {
+        ASSERT(block.instructions.empty());
+        uint const begin = ir.BlockBegin(blockIndex), end = ir.blockEnds[blockIndex];
+        std::vector<Instruction*>& instrs = block.instructions;
+        instrs.reserve(end - begin);
+        auto valueOf = [&](uint32_t ref) -> Value* {
+            return ref & BinaryIrLiteralRef ? literals[ref & ~BinaryIrLiteralRef] : instrs[ref];
+        };
+        for (uint i = begin; i < end; ++i) {
+            uint const operandBegin = ir.OperandBegin(i);
+            Instruction* const instr = block.CreateThenAppendInstr(ir.opcodes[i], ir.typekinds[i], ir.operandEnds[i] - operandBegin);
+            for (uint j = 0; j < instr->OperandCount(); ++j)
+                instr->_operands[j] = valueOf(ir.operands[operandBegin + j]);
+            if (ir.names && ir.names[i] != BinaryIrNone)
+                instr->debugName = nameBytes + ir.names[i];
+            if (ir.restores) {
+                instr->ra.dstReg = ir.dstRegs[i];
+                for (uint j = 0; j < instr->OperandCount(); ++j)
+                    instr->ra.srcRegs[j] = ir.srcRegs[operandBegin + j];
+                instr->ra.restores = ir.restores[i] != BinaryIrNone ? valueOf(ir.restores[i]) : nullptr;
+            }
+            if (instr->opcode == Opcode_load_global || instr->opcode == Opcode_store_global)
+                Verify(static_cast<const LiteralValue*>(instr->Operand(0))->zext < module.globals.size());
+        }
+        block.RebuildUseLists();
+    }
+};
+
+// Blocks compiled with CompileBlock, in a directory of files named by their key, which is the hash of the source
+// the block was built from, the options and CompileCacheVersion. A file is a CacheFileHeader and the block in
+// binary IR with names and registers. It is written under a temporary name and then renamed, so other threads and
+// processes see either no file or a whole one, and when two of them store the same key the last rename wins, with
+// the same contents. There is no fsync: a file cut short by a crash is a miss.
+// A hit maps the file and loads the block from it, skipping building the IR and CompileBlock.
+// Nothing is ever removed, clearing the directory is up to the user.
+static const uint32_t CacheFileMagic = 0x42434354; // "TCCB"
+
+// Bump whenever a pass could output something else for the same input, so entries of older compilers are missed
+// instead of used.
+static const uint32_t CompileCacheVersion = 1;
+
+struct CacheFileHeader {
+    uint32_t magic;
+    uint32_t version; // CompileCacheVersion
+    uint64_t key;
+};
+
+struct CompileCache {
+    const char* dir; // must exist, and outlive this
+
+    // The file operations below, on POSIX and on Windows.
+
+    // A whole file mapped read-only, or nothing if it doesn't exist or is too small to be a cache file.
+    class MappedFile {
+#if defined _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+#endif
+    public:
+        const ubyte* data = nullptr;
+        size_t size = 0;
+
+        explicit MappedFile(const char* path)
+        {
+#if defined _WIN32
+            // FILE_SHARE_DELETE, so a Store of the same key can replace the file while it is mapped.
+            file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                               FILE_ATTRIBUTE_NORMAL, nullptr);
+            LARGE_INTEGER fileSize;
+            if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fileSize) ||
+                uint64_t(fileSize.QuadPart) < sizeof(CacheFileHeader) || uint64_t(fileSize.QuadPart) > SIZE_MAX)
+                return;
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (!mapping)
+                return;
+            data = static_cast<const ubyte*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            size = data ? size_t(fileSize.QuadPart) : 0;
+#else
+            int const fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                return;
+            struct stat st;
+            if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(CacheFileHeader)) {
+                void* const p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    data = static_cast<const ubyte*>(p);
+                    size = size_t(st.st_size);
+                }
+            }
+            close(fd); // the mapping stays
+#endif
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile()
+        {
+#if defined _WIN32
+            if (data)
+                UnmapViewOfFile(data);
+            if (mapping)
+                CloseHandle(mapping);
+            if (file != INVALID_HANDLE_VALUE)
+                CloseHandle(file);
+#else
+            if (data)
+                munmap(const_cast<ubyte*>(data), size);
+#endif
+        }
+    };
+
+    // Creates a file named path plus a unique suffix, only for this caller, and puts its name in tempPath.
+    // Returns the descriptor, or -1.
+    static int CreateTempFile(const char* path, char (&tempPath)[512])
+    {
+#if defined _WIN32
+        static std::atomic<uint32_t> counter(0);
+        for (uint attempt = 0; attempt < 16; ++attempt) {
+            int const n = snprintf(tempPath, sizeof tempPath, "%s.%lx.%lx.%x", path, GetCurrentProcessId(),
+                                   GetCurrentThreadId(), uint(counter++));
+            if (n <= 0 || size_t(n) >= sizeof tempPath)
+                return -1;
+            int const fd = _open(tempPath, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+            if (fd >= 0 || errno != EEXIST) // left behind by a crash, take another name
+                return fd;
+        }
+        return -1;
+#else
+        int const n = snprintf(tempPath, sizeof tempPath, "%s.XXXXXX", path);
+        if (n <= 0 || size_t(n) >= sizeof tempPath)
+            return -1;
+        return mkstemp(tempPath);
+#endif
+    }
+
+    static bool CloseFile(int fd)
+    {
+#if defined _WIN32
+        return _close(fd) == 0;
+#else
+        return close(fd) == 0;
+#endif
+    }
+
+    // Atomically, replacing whatever is at to.
+    static bool MoveIntoPlace(const char* from, const char* to)
+    {
+#if defined _WIN32
+        wchar_t wideFrom[512], wideTo[512];
+        return MultiByteToWideChar(CP_UTF8, 0, from, -1, wideFrom, int(countof(wideFrom))) != 0 &&
+               MultiByteToWideChar(CP_UTF8, 0, to, -1, wideTo, int(countof(wideTo))) != 0 &&
+               MoveFileExW(wideFrom, wideTo, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+        return rename(from, to) == 0;
+#endif
+    }
+
+    static void RemoveFile(const char* path)
+    {
+#if defined _WIN32
+        _unlink(path);
+#else
+        unlink(path);
+#endif
+    }
+
+    explicit CompileCache(const char* dir) : dir(dir) { }
+
+    // source is whatever the block is built from, like the text of a function.
+    static uint64_t Key(view<const ubyte> source, const CompileOptions& options)
+    {
+        uint64_t h = MixCombine(HashBytes64(source.ptr, source.length), CompileCacheVersion);
+        uint64_t const fields[] = { options.reglimit, options.predlimit, options.veclimit, options.bEliminateDeadCode,
+                                    options.bVectorize, options.vecLanes, options.bSchedule, options.allocator,
+                                    options.eviction, options.bRematerialize, options.bPeephole };
+        for (uint64_t field : fields)
+            h = MixCombine(h, field);
+        return Avalanche(h);
+    }
+
+    void PathOf(char (&path)[512], uint64_t key, const char* suffix) const
+    {
+        int const n = snprintf(path, sizeof path, "%s/%016llx%s", dir, static_cast<unsigned long long>(key), suffix);
+        Verify(n > 0 && size_t(n) < sizeof path);
+    }
+
+    // Fills the empty block and returns true if the key has a valid file, else leaves it alone. A file using a
+    // global the module doesn't have is a miss too.
+    bool Lookup(uint64_t key, Module& module, Block& block) const
+    {
+        char path[512];
+        PathOf(path, key, ".tcc");
+        MappedFile const file(path);
+        if (!file.data)
+            return false;
+        CacheFileHeader header;
+        memcpy(&header, file.data, sizeof header);
+        BinaryIrView ir;
+        if (header.magic == CacheFileMagic && header.version == CompileCacheVersion && header.key == key &&
+            ir.Open(file.data + sizeof header, file.size - sizeof header) &&
+            ir.header.numBlocks == 1 && ir.restores && ir.Validate() && ir.GlobalsFit(module.globals.size())) {
+            BinaryIrLoader(ir, module).LoadBlock(0, block);
+            return true;
+        }
+        return false;
+    }
+
+    // Returns false if the file couldn't be written. The cache is only an optimization, so callers can go on.
+    bool Store(uint64_t key, Block& block) const
+    {
+        char path[512], tempPath[512];
+        PathOf(path, key, ".tcc");
+        int const fd = CreateTempFile(path, tempPath);
+        if (fd < 0)
+            return false;
+        bool bOk;
+        {
+            FileByteStream bs(fd);
+            CacheFileHeader const header = { CacheFileMagic, CompileCacheVersion, key };
+            bs.PutBytes(&header, sizeof header);
+            Block* const blocks[] = { &block };
+            WriteBinaryIr(bs, { blocks, 1 }, BinaryIr_names | BinaryIr_regs);
+            bOk = bs.Flush();
+        }
+        bOk &= CloseFile(fd);
+        bOk = bOk && MoveIntoPlace(tempPath, path);
+        if (!bOk)
+            RemoveFile(tempPath);
+        return bOk;
+    }
+};
+
+// CompileBlock through the cache. On a miss, build(block) builds the IR into the empty block, which is compiled and
+// stored. Returns true on a hit.
+template<class BuildFn>
+static bool CompileBlockCached(const CompileCache& cache, view<const ubyte> source, Module& module, Block& block,
+    const CompileOptions& options, BuildFn&& build)
+{
+    uint64_t const key = CompileCache::Key(source, options);
+    if (cache.Lookup(key, module, block))
+        return true;
+    build(block);
+    CompileBlock(module, block, options);
+    (void)cache.Store(key, block);
+    return false;
+}
+
+void DoSomething()
+{
+    PrintContext ctx = { };
+    MemoryByteStream bs;
+
+    Module m;
+    Block block;
+
+    {
+        // As PrintBlock prints it, so dumps can be pasted in.
+        char const text[] = R"(
+            dword x = read_test_input(0);
+            dword y = read_test_input(4);
+            dword xy = iadd(x, y);
+            dword z = read_test_input(8);
+            dword zy = iadd(z, y);
+            write_test_output(0, xy);
+            write_test_output(4, zy);
+            dword w = read_test_input(12);
+            dword ww = iadd(w, w);
+            write_test_output(8, ww);
+            return;
+        )";
+        IrTextParser(m, { text, uint(sizeof text - 1) }).ParseBlock(block);
+    }
+
+    {
+        ctx.bPrintRegs = false;
+        Print(bs, "// Before RA/spilling:\n");
+        Print(bs, "void main()\n{\n");
+        PrintBlock(ctx, bs, block, 4);
+        Print(bs, "}\n");
+    }
+
+    {
+        CompileOptions options;
+        options.reglimit = 2; // try changing this...
+        CompileBlock(m, block, options);
+    }
+
+    {
+        ctx.bPrintRegs = true;
+        Print(bs, "// After RA/spilling:\n");
+        Print(bs, "void main()\n{\n");
+        PrintBlock(ctx, bs, block, 4);
+        Print(bs, "}\n");
+    }
+
+    {
+        // Blocks of a function are allocated together, values live across them and jump arguments go to params.
+        Function function;
+        IrBuilder b(m, *function.NewBlock());
+        Value* const x = b.ReadTestInput(0, "x");
+        Value* const y = b.ReadTestInput(4, "y");
+        Value* const z = b.ReadTestInput(8, "z");
+        Block& xNonzero = *function.NewBlock();
+        Block& xZero = *function.NewBlock();
+        Block& merge = *function.NewBlock();
+        BlockParameter* const xOrY = merge.AddParam(Ir_a32, "xOrY");
+        b.Branch(x, xNonzero, xZero);
+        b.SetBlock(xNonzero);
+        b.Jump(merge, { x });
+        b.SetBlock(xZero);
+        b.Jump(merge, { b.Iadd(y, z, "yz") });
+        b.SetBlock(merge);
+        b.WriteTestOutput(0, b.Iadd(xOrY, z, "sum"));
+        b.WriteTestOutput(4, y);
+        b.Return();
+
+        CompileOptions options;
+        options.reglimit = 2;
+        CompileFunction(m, function, options);
+
+        Print(bs, "// Function after RA/spilling:\n");
+        Print(bs, "void f()\n{\n");
+        PrintFunction(ctx, bs, function, 4);
+        Print(bs, "}\n");
+    }
+    fwrite(bs.Data(), 1, bs.Size(), stdout);
+}
+
+#if BUILD_TESTS || BUILD_BENCHMARKS
+#include "tc_common.h"
+
+static uint CountInstrs(const Block& block, Opcode opcode)
+{
+    uint n = 0;
+    for (const Instruction* instr : block.instructions)
+        n += (instr->opcode == opcode);
+    return n;
+}
+
+static uint CountDataSpills(const Block& block)
+{
+    uint n = 0;
+    for (const Instruction* instr : block.instructions)
+        n += instr->opcode == Opcode_spill && (instr->Operand(1)->typekind == Ir_a32 || instr->Operand(1)->typekind == Ir_a64);
+    return n;
+}
+
+struct RandomBlockParams {
+    uint     numInstrs;       // approximate, not counting the return
+    uint     numInputs;       // read_test_input offsets are [0, numInputs) * 4
+    uint     literalPercent;  // chance an iadd operand is a literal
+    uint     writePercent;
+    uint     readPercent;
+    uint64_t seed;
+    uint     recentWindow = 8;  // most operands are one of this many latest values
+    uint     farPercent = 25;   // chance an operand is any earlier value instead
+    uint     cmpPercent = 0;    // chance of a compare, and of a select on a recent one instead of an iadd
+};
+
+// Names are written to nameStorage, which must not reallocate while the block is alive.
+struct RandomInstrGenerator {
+    IrBuilder& b;
+    const RandomBlockParams& params;
+    std::vector<char>& nameStorage;
+    uint64_t counter;
+    uint numNames = 0;
+    std::vector<Value*> defs; // operands are picked from these
+    std::vector<Value*> bools; // compare results, select conditions are picked from the latest few
+
+    RandomInstrGenerator(IrBuilder& b, const RandomBlockParams& params, std::vector<char>& nameStorage, uint numNamesReserved)
+        : b(b), params(params), nameStorage(nameStorage), counter(params.seed << 32)
+    {
+        ASSERT(params.numInputs != 0);
+        nameStorage.clear();
+        nameStorage.reserve(size_t(numNamesReserved + 1) * 12);
+    }
+
+    uint32_t Rand() { return uint32_t(Avalanche(++counter)); }
+
+    const char* Name()
+    {
+        Implemented(nameStorage.size() + 12 <= nameStorage.capacity()); // names must not move
+        const char* p = nameStorage.data() + nameStorage.size();
+        char stage[12];
+        int n = snprintf(stage, sizeof stage, "v%u", numNames++);
+        nameStorage.insert(nameStorage.end(), stage, stage + n + 1);
+        return p;
+    }
+
+    Value* PickOperand()
+    {
+        if (Rand() % 100u < params.literalPercent) {
+            // Bias towards values that fold interestingly: zero and wraparound.
+            static const uint32_t interesting[] = { 0, 1, 2, 0xFFFF'FFFFu, 0x8000'0000u };
+            uint32_t const r = Rand();
+            return b.module.LiteralU32(r & 1 ? interesting[(r >> 1) % countof(interesting)] : r >> 24);
+        }
+        // Prefer recent values, but sometimes reach back far to make long live ranges.
+        uint32_t const r = Rand();
+        uint const n = uint(defs.size());
+        bool const far = (r & 127) < params.farPercent * 128 / 100;
+        uint const back = (r >> 7) % (far ? n : Min(n, params.recentWindow));
+        return defs[n - 1 - back];
+    }
+
+    void Emit(uint numInstrs)
+    {
+        for (uint i = 0; i < numInstrs; ++i) {
+            uint const kind = Rand() % 100u;
+            if (kind < params.readPercent) {
+                defs.push_back(b.ReadTestInput(Rand() % params.numInputs * 4, Name()));
+            }
+            else if (kind < params.readPercent + params.writePercent) {
+                b.WriteTestOutput(Rand() % params.numInputs * 4, PickOperand());
+            }
+            else if (kind < params.readPercent + params.writePercent + params.cmpPercent) {
+                Opcode const opcode = Rand() & 1 ? Opcode_icmp_eq : Opcode_icmp_ult;
+                Value* const result = b.Icmp(opcode, PickOperand(), PickOperand(), Name());
+                if (!IsLiteral(result))
+                    bools.push_back(result);
+            }
+            else if (!bools.empty() && Rand() % 100u < params.cmpPercent) {
+                uint const n = uint(bools.size());
+                Value* const cond = bools[n - 1 - Rand() % Min(n, 4u)];
+                Value* const result = b.Select(cond, PickOperand(), PickOperand(), Name());
+                if (!IsLiteral(result))
+                    defs.push_back(result);
+            }
+            else {
+                Value* const result = b.Iadd(PickOperand(), PickOperand(), Name());
+                if (!IsLiteral(result)) // folded to a literal: there is no new def to choose from
+                    defs.push_back(result);
+            }
+        }
+    }
+};
+
+static void GenerateRandomBlock(IrBuilder& b, const RandomBlockParams& params, std::vector<char>& nameStorage)
+{
+    RandomInstrGenerator gen(b, params, nameStorage, params.numInstrs);
+    gen.defs.push_back(b.ReadTestInput(0, gen.Name()));
+    gen.Emit(params.numInstrs - 1);
+    b.Return();
+}
+
+// Structured control flow: if/else, if without else (which has a critical edge) and loops, nested a few deep,
+// with params.numInstrs instructions per block. A value is only used where its block dominates.
+// Loop headers and if/else merges get up to 2 block params, so a loop can stop when its condition is a param.
+static void GenerateRandomFunction(IrBuilder& b, Function& function, const RandomBlockParams& params, uint numBlocks,
+    std::vector<char>& nameStorage)
+{
+    ASSERT(function.blocks.size() == 1 && b.block == function.blocks[0]);
+    RandomInstrGenerator gen(b, params, nameStorage, (params.numInstrs + 2) * (numBlocks + 16));
+    gen.defs.push_back(b.ReadTestInput(0, gen.Name()));
+    gen.Emit(params.numInstrs);
+
+    struct Local {
+        static void Region(RandomInstrGenerator& gen, Function& function, uint depth)
+        {
+            IrBuilder& b = gen.b;
+            uint const n = gen.params.numInstrs;
+            size_t const numDefs = gen.defs.size();
+            uint const kind = depth < 3 ? gen.Rand() % 4 : 3;
+            bool const bNest = gen.Rand() % 2 == 0;
+            uint const numParams = gen.Rand() % 3;
+            Value* args[2];
+            auto jumpWithArgs = [&](Block& target) {
+                for (uint i = 0; i < numParams; ++i)
+                    args[i] = gen.PickOperand();
+                b.Jump(target, view<Value* const>{ args, numParams });
+            };
+            auto addParams = [&](Block& target) {
+                for (uint i = 0; i < numParams; ++i)
+                    target.AddParam(Ir_a32, gen.Name());
+            };
+            if (kind == 0) {
+                Block& t = *function.NewBlock();
+                Block& e = *function.NewBlock();
+                Block& merge = *function.NewBlock();
+                addParams(merge);
+                b.Branch(gen.PickOperand(), t, e);
+                b.SetBlock(t);
+                gen.Emit(n);
+                if (bNest)
+                    Region(gen, function, depth + 1);
+                jumpWithArgs(merge);
+                gen.defs.resize(numDefs);
+                b.SetBlock(e);
+                gen.Emit(n);
+                jumpWithArgs(merge);
+                gen.defs.resize(numDefs);
+                gen.defs.insert(gen.defs.end(), merge.params.begin(), merge.params.end());
+                b.SetBlock(merge);
+                gen.Emit(n);
+            }
+            else if (kind == 1) {
+                Block& t = *function.NewBlock();
+                Block& merge = *function.NewBlock();
+                b.Branch(gen.PickOperand(), t, merge);
+                b.SetBlock(t);
+                gen.Emit(n);
+                if (bNest)
+                    Region(gen, function, depth + 1);
+                b.Jump(merge);
+                gen.defs.resize(numDefs);
+                b.SetBlock(merge);
+                gen.Emit(n);
+            }
+            else if (kind == 2) {
+                Block& header = *function.NewBlock();
+                Block& body = *function.NewBlock();
+                Block& exit = *function.NewBlock();
+                addParams(header);
+                jumpWithArgs(header);
+                b.SetBlock(header);
+                gen.defs.insert(gen.defs.end(), header.params.begin(), header.params.end());
+                gen.Emit(n);
+                size_t const numHeaderDefs = gen.defs.size();
+                b.Branch(gen.PickOperand(), body, exit);
+                b.SetBlock(body);
+                gen.Emit(n);
+                if (bNest)
+                    Region(gen, function, depth + 1);
+                jumpWithArgs(header);
+                gen.defs.resize(numHeaderDefs);
+                b.SetBlock(exit);
+                gen.Emit(n);
+            }
+            else {
+                gen.Emit(n);
+            }
+        }
+    };
+    while (function.blocks.size() < numBlocks)
+        Local::Region(gen, function, 0);
+    b.Return();
+}
+
+// Spills after every def and reloads before every use, the worst case for EliminateRedundantSpillCode.
+// The slot of a value is its instruction index. Uses 2 registers.
+static void SpillEverywhereForTest(Module& m, Block& block)
+{
+    std::vector<Instruction*> newInstrs;
+    for (Instruction* const instr : block.instructions) {
+        uint nextReg = 0;
+        for (uint i = 0; i < instr->OperandCount(); ++i) {
+            Value* const operand = instr->Operand(i);
+            if (IsLiteral(operand))
+                continue;
+            uint j = 0;
+            while (j < i && instr->Operand(j) != operand)
+                ++j;
+            if (j < i) {
+                instr->ra.srcRegs[i] = instr->ra.srcRegs[j];
+                continue;
+            }
+            RuntimeValue* const src = static_cast<RuntimeValue*>(operand);
+            Instruction* const loadInstr = new Instruction();
+            loadInstr->opcode = Opcode_load_spilled;
+            loadInstr->typekind = Ir_a32;
+            loadInstr->_nOperands = 1;
+            loadInstr->_operands[0] = m.LiteralU32(src->instrIndexInBlock);
+            loadInstr->debugName = src->debugName;
+            loadInstr->ra.dstReg = RegLoc(nextReg);
+            loadInstr->ra.restores = src;
+            newInstrs.push_back(loadInstr);
+            instr->ra.srcRegs[i] = RegLoc(nextReg++);
+        }
+        newInstrs.push_back(instr);
+        if (instr->typekind != Ir_void) {
+            instr->ra.dstReg = RegLoc(0);
+            Instruction* const spillInstr = new Instruction();
+            spillInstr->opcode = Opcode_spill;
+            spillInstr->typekind = Ir_void;
+            spillInstr->_nOperands = 2;
+            spillInstr->_operands[0] = m.LiteralU32(instr->instrIndexInBlock);
+            spillInstr->_operands[1] = instr;
+            spillInstr->ra.srcRegs[1] = RegLoc(0);
+            newInstrs.push_back(spillInstr);
+        }
+    }
+    block.instructions = std::move(newInstrs);
+}
+
+static uint PopCount64(uint64_t v)
+{
+    uint n = 0;
+    for (; v; v &= v - 1)
+        ++n;
+    return n;
+}
+
+template<class F>
+static void ForEachSubsetOfSize(uint64_t set, uint k, uint64_t chosen, F& f)
+{
+    if (k == 0) {
+        f(chosen);
+        return;
+    }
+    if (PopCount64(set) < k)
+        return;
+    uint64_t const low = set & (0 - set);
+    ForEachSubsetOfSize(set & ~low, k - 1, chosen | low, f);
+    ForEachSubsetOfSize(set & ~low, k, chosen, f);
+}
+
+// Exact minimum number of spills + reloads for the model LocalRegisterAllocation works in, as a reference
+// for the eviction heuristics: the instruction order is fixed, a value is spilled at most once since its
+// slot stays valid until it dies, srcs not in a register are reloaded, and the dst gets a register after
+// the srcs that die at the instruction are freed. Evicting only on demand loses nothing, so the only choice
+// is which values to evict. Exponential in the number of live values, only for small blocks.
+static uint OptimalLocalSpillCost(const Block& block, uint reglimit)
+{
+    // Values are numbered in definition order, at most 64 of them.
+    std::unordered_map<const Value*, uint> valueIndexes;
+    std::vector<uint64_t> srcMasks;
+    std::vector<uint64_t> dstMasks;
+    std::vector<uint64_t> lastUseMasks;
+    std::vector<uint> lastUses;
+    for (uint i = 0; i < block.instructions.size(); ++i) {
+        const Instruction* const instr = block.instructions[i];
+        uint64_t srcs = 0;
+        for (uint srcIndex = 0; srcIndex < instr->OperandCount(); ++srcIndex) {
+            const Value* const src = instr->Operand(srcIndex);
+            if (IsLiteral(src))
+                continue;
+            auto const it = valueIndexes.find(src);
+            ASSERT(it != valueIndexes.end());
+            srcs |= uint64_t(1) << it->second;
+            lastUses[it->second] = i;
+        }
+        srcMasks.push_back(srcs);
+        uint64_t dst = 0;
+        if (instr->typekind != Ir_void) {
+            uint const valueIndex = uint(valueIndexes.size());
+            Implemented(valueIndex < 64);
+            valueIndexes.emplace(instr, valueIndex);
+            lastUses.push_back(i); // no uses: dies right away
+            dst = uint64_t(1) << valueIndex;
+        }
+        dstMasks.push_back(dst);
+    }
+    lastUseMasks.assign(block.instructions.size(), 0);
+    for (uint v = 0; v < lastUses.size(); ++v)
+        lastUseMasks[lastUses[v]] |= uint64_t(1) << v;
+
+    // State is (values in registers, those of them that are already spilled), values that are live and
+    // not in a register are always spilled.
+    typedef std::pair<uint64_t, uint64_t> State;
+    std::map<State, uint> costs, nextCosts;
+    costs[State(0, 0)] = 0;
+    auto relax = [&nextCosts](uint64_t inRegs, uint64_t spilled, uint cost) {
+        auto const inserted = nextCosts.emplace(State(inRegs, spilled & inRegs), cost);
+        if (!inserted.second && cost < inserted.first->second)
+            inserted.first->second = cost;
+    };
+    for (uint i = 0; i < block.instructions.size(); ++i) {
+        uint64_t const srcs = srcMasks[i], dst = dstMasks[i], dying = lastUseMasks[i];
+        Implemented(PopCount64(srcs) <= reglimit);
+        nextCosts.clear();
+        for (const auto& stateAndCost : costs) {
+            uint64_t const inRegs = stateAndCost.first.first, spilled = stateAndCost.first.second;
+            uint64_t const missing = srcs & ~inRegs;
+            uint const numFree = reglimit - PopCount64(inRegs);
+            uint const numToEvict = PopCount64(missing) > numFree ? PopCount64(missing) - numFree : 0;
+            auto evicted = [&](uint64_t srcEvictions) {
+                uint const srcCost = stateAndCost.second + PopCount64(srcEvictions & ~spilled) + PopCount64(missing);
+                uint64_t const regs = ((inRegs & ~srcEvictions) | missing) & ~dying;
+                uint64_t const clean = spilled | missing; // reloaded values are still spilled
+                if (!dst) {
+                    relax(regs, clean, srcCost);
+                }
+                else if (PopCount64(regs) < reglimit) {
+                    relax((regs | dst) & ~dying, clean, srcCost);
+                }
+                else {
+                    for (uint64_t bits = regs; bits; bits &= bits - 1) {
+                        uint64_t const victim = bits & (0 - bits);
+                        relax(((regs & ~victim) | dst) & ~dying, clean, srcCost + ((clean & victim) ? 0 : 1));
+                    }
+                }
+            };
+            ForEachSubsetOfSize(inRegs & ~srcs, numToEvict, 0, evicted);
+        }
+        costs.swap(nextCosts);
+    }
+
+    uint minCost = uint(-1);
+    for (const auto& stateAndCost : costs)
+        minCost = Min(minCost, stateAndCost.second);
+    return minCost;
+}
+
+// out[e] = in0[e] + in1[e] + ... + 3 for each element e, with the arrays one after the other in test input.
+// Term by term over all elements, so every partial sum is live at once, like a loop over arrays unrolled.
+static void GenerateDataParallelBlock(IrBuilder& b, uint numElements, uint numTerms)
+{
+    std::vector<Value*> sums(numElements);
+    for (uint t = 0; t < numTerms; ++t) {
+        for (uint e = 0; e < numElements; ++e) {
+            Value* const x = b.ReadTestInput((t * numElements + e) * 4, "x");
+            sums[e] = t ? b.Iadd(sums[e], x, "sum") : x;
+        }
+    }
+    for (uint e = 0; e < numElements; ++e)
+        b.WriteTestOutput(e * 4, b.Iadd(sums[e], b.module.LiteralU32(3), "out"));
+    b.Return();
+}
+
+// Vectors built directly: 8 read, each added to the next, then all the sums and a splat of 7 added up, and written
+// with the fourth sum. The 8 sums are live at once. Reads 32 words, writes 8.
+static void GenerateNeighborSumsBlock(Module& m, Block& block)
+{
+    Value* v[8];
+    Value* sums[8];
+    for (uint i = 0; i < 8; ++i)
+        v[i] = block.CreateThenAppendInstr1(Opcode_read_test_input, Ir_v4a32, m.LiteralU32(i * 16), "v");
+    for (uint i = 0; i < 8; ++i)
+        sums[i] = block.CreateThenAppendInstr2(Opcode_iadd, Ir_v4a32, v[i], v[(i + 1) % 8], "s");
+    Value* total = block.CreateThenAppendInstr2(Opcode_iadd, Ir_v4a32, sums[0], m.LiteralV4Splat(7), "t");
+    for (uint i = 8; i-- > 1;)
+        total = block.CreateThenAppendInstr2(Opcode_iadd, Ir_v4a32, total, sums[i], "t");
+    (void)block.CreateThenAppendInstr2(Opcode_write_test_output, Ir_void, m.LiteralU32(0), total);
+    (void)block.CreateThenAppendInstr2(Opcode_write_test_output, Ir_void, m.LiteralU32(16), sums[3]);
+    IrBuilder(m, block).Return();
+}
+
+// Same as GenerateDataParallelBlock with 64-bit elements and + 2^32 + 3, either as a64 values or split into
+// 32-bit halves like on a target without them: the low words are added, and their carry (low sum < an addend)
+// goes into the high words. The test I/O is the same either way.
+static void GenerateWideAddBlock(IrBuilder& b, uint numElements, uint numTerms, bool bNative)
+{
+    Module& m = b.module;
+    std::vector<Value*> lo(numElements), hi(numElements);
+    auto addSplit = [&](uint e, Value* xlo, Value* xhi) {
+        Value* const sum = b.Iadd(lo[e], xlo, "lo");
+        Value* const carry = b.Select(b.Icmp(Opcode_icmp_ult, sum, xlo, "c"), m.LiteralU32(1), m.LiteralU32(0), "carry");
+        lo[e] = sum;
+        hi[e] = b.Iadd(b.Iadd(hi[e], xhi, "hi"), carry, "hic");
+    };
+    for (uint t = 0; t < numTerms; ++t) {
+        for (uint e = 0; e < numElements; ++e) {
+            uint32_t const offset = (t * numElements + e) * 8;
+            if (bNative) {
+                Value* const x = b.ReadTestInput(offset, "x", Ir_a64);
+                lo[e] = t ? b.Iadd(lo[e], x, "sum") : x;
+                continue;
+            }
+            Value* const xlo = b.ReadTestInput(offset, "xlo");
+            Value* const xhi = b.ReadTestInput(offset + 4, "xhi");
+            if (t) {
+                addSplit(e, xlo, xhi);
+            }
+            else {
+                lo[e] = xlo;
+                hi[e] = xhi;
+            }
+        }
+    }
+    for (uint e = 0; e < numElements; ++e) {
+        if (bNative) {
+            b.WriteTestOutput(e * 8, b.Iadd(lo[e], m.LiteralU64(0x1'0000'0003u), "out"));
+            continue;
+        }
+        addSplit(e, m.LiteralU32(3), m.LiteralU32(1));
+        b.WriteTestOutput(e * 8, lo[e]);
+        b.WriteTestOutput(e * 8 + 4, hi[e]);
+    }
+    b.Return();
+}
+#endif
+
+#if BUILD_TESTS
+static void EliminateDeadCodeTest()
+{
+    Module m;
+    Block block;
+    IrBuilder b(m, block);
+
+    Value* const x  = b.ReadTestInput(0, "x");
+    Value* const y  = b.ReadTestInput(4, "y");
+    Value* const x2 = b.ReadTestInput(0, "x2");
+    Value* const z  = b.ReadTestInput(8, "z");
+    (void)b.Iadd(x, y, "unused");
+    Value* const s  = b.Iadd(x2, y, "s");
+    b.WriteTestOutput(0, s);
+    Value* const xz = b.Iadd(x2, z, "xz");
+    b.WriteTestOutput(4, xz);
+    b.WriteTestOutput(0, x);
+    b.Return();
+
+    OptimizeStats const stats = EliminateDeadCodeAndRedundantTestIo(block);
+    Verify(stats.numForwardedReads == 1 && stats.numDeadWrites == 1);
+
+    // y and s were only used by dead instructions.
+    static const Opcode expected[] = {
+        Opcode_read_test_input, Opcode_read_test_input, Opcode_iadd,
+        Opcode_write_test_output, Opcode_write_test_output, Opcode_return
+    };
+    Verify(block.instructions.size() == countof(expected));
+    for (uint i = 0; i < countof(expected); ++i) {
+        Verify(block.instructions[i]->opcode == expected[i]);
+        Verify(block.instructions[i]->instrIndexInBlock == i);
+    }
+    Verify(block.instructions[0] == x && block.instructions[1] == z && block.instructions[2] == xz);
+    const Instruction* const xi = block.instructions[0];
+    Verify(block.instructions[2]->Operand(0) == x);
+    Verify(xi->uses.size() == 2 && xi->uses[0].value == xz && xi->uses[1].value == block.instructions[4]);
+
+    LocalRegisterAllocation(m, block, 2);
+    Verify(CountInstrs(block, Opcode_spill) == 0);
+}
+INVOKE_TEST(EliminateDeadCodeTest);
+
+static void ScheduleTest()
+{
+    for (bool bSchedule : { false, true }) {
+        // Same as DoSomething:
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        Value* const x = b.ReadTestInput(0, "x");
+        Value* const y = b.ReadTestInput(4, "y");
+        Value* const xy = b.Iadd(x, y, "xy");
+        Value* const z = b.ReadTestInput(8, "z");
+        Value* const zy = b.Iadd(z, y, "zy");
+        b.WriteTestOutput(0, xy);
+        b.WriteTestOutput(4, zy);
+        Value* const w = b.ReadTestInput(12, "w");
+        b.WriteTestOutput(8, b.Iadd(w, w, "ww"));
+        b.WriteTestOutput(0, x); // stays after the write of xy
+        b.Return();
+
+        CompileOptions options;
+        options.bEliminateDeadCode = false;
+        options.bSchedule = bSchedule;
+        options.bRematerialize = false; // x is a test input, which would never need a spill
+        if (bSchedule) {
+            ScheduleForRegisterPressure(block, options.reglimit);
+            Verify(block.instructions.size() == 12 && block.instructions.back()->opcode == Opcode_return);
+            uint writeXy = 0, writeX = 0;
+            for (uint i = 0; i < block.instructions.size(); ++i) {
+                const Instruction* const instr = block.instructions[i];
+                Verify(instr->instrIndexInBlock == i);
+                if (instr->opcode == Opcode_write_test_output && instr->Operand(1) == xy) writeXy = i;
+                if (instr->opcode == Opcode_write_test_output && instr->Operand(1) == x)  writeX = i;
+                for (Value* operand : instr->Operands()) {
+                    if (operand->opcode != Opcode_Literal)
+                        Verify(static_cast<RuntimeValue*>(operand)->instrIndexInBlock < i);
+                }
+            }
+            Verify(writeXy < writeX);
+            options.bSchedule = false;
+        }
+        CompileBlock(m, block, options);
+        // x is live across everything, so there is still one spill with scheduling.
+        Verify(CountInstrs(block, Opcode_spill) == (bSchedule ? 1u : 2u));
+    }
+}
+INVOKE_TEST(ScheduleTest);
+
+static void RegAllocWidthAndSpillSlotTest()
+{
+    for (uint reglimit : { 2u, 33u, 64u, 65u, 200u }) {
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        std::vector<char> names;
+        RandomBlockParams params = { 3000, 1u << 16, 10, 5, 30, reglimit };
+        params.recentWindow = reglimit * 2;
+        GenerateRandomBlock(b, params, names);
+        EliminateDeadCodeAndRedundantTestIo(block);
+
+        uint const numSpillLocs = LocalRegisterAllocation(m, block, reglimit);
+        uint const numSpills = CountInstrs(block, Opcode_spill);
+        Verify(numSpillLocs <= numSpills);
+        if (reglimit == 2) {
+            Verify(numSpillLocs < numSpills); // slots were reused
+        }
+        for (const Instruction* instr : block.instructions) {
+            Verify(instr->typekind == Ir_void || instr->ra.dstReg < reglimit);
+            if (instr->opcode == Opcode_spill || instr->opcode == Opcode_load_spilled) {
+                Verify(static_cast<const LiteralValue*>(instr->Operand(0))->zext < numSpillLocs);
+            }
+        }
+    }
+}
+INVOKE_TEST(RegAllocWidthAndSpillSlotTest);
+
+static void EvictionHeuristicTest()
+{
+    // The exact solver is a lower bound for both heuristics, and Belady's MIN is not optimal
+    // once stores count, so it should lose to the solver somewhere.
+    uint numFarthestWorse = 0;
+    for (uint reglimit : { 2u, 3u, 4u }) {
+        for (uint seed = 0; seed < 30; ++seed) {
+            uint optimal = 0;
+            for (EvictionHeuristic eviction : { Eviction_farthestNextUse, Eviction_cleanAware }) {
+                Module m;
+                Block block;
+                IrBuilder b(m, block);
+                std::vector<char> names;
+                RandomBlockParams params = { 40, 8, 10, 10, 20, seed };
+                params.recentWindow = reglimit + 2;
+                GenerateRandomBlock(b, params, names);
+                EliminateDeadCodeAndRedundantTestIo(block);
+
+                optimal = OptimalLocalSpillCost(block, reglimit);
+                Verify(OptimalLocalSpillCost(block, 64) == 0);
+                LocalRegisterAllocation(m, block, reglimit, eviction, false); // the solver doesn't rematerialize
+                uint const cost = CountInstrs(block, Opcode_spill) + CountInstrs(block, Opcode_load_spilled);
+                Verify(optimal <= cost);
+                numFarthestWorse += eviction == Eviction_farthestNextUse && optimal < cost;
+            }
+        }
+    }
+    Verify(numFarthestWorse != 0);
+}
+INVOKE_TEST(EvictionHeuristicTest);
+
+// Runs from the block and returns the test outputs. After RA, runtime operands are read from registers
+// and spill slots instead of by value, so comparing with a run before RA checks the allocation.
+// Every value has vector lanes, scalars use lane 0 and literals are in all of them. Lanes are 64-bit for a64,
+// anything else keeps the high half zero.
+// Stops after maxBlocks blocks, since a loop runs forever if it runs at all.
+static std::vector<uint32_t> InterpretForTest(const Block& entry, const std::vector<uint32_t>& inputs, bool bAllocated,
+    uint maxBlocks = 1000)
+{
+    struct Lanes {
+        uint64_t v[MaxLanes];
+    };
+    auto splat = [](uint64_t z) {
+        Lanes lanes;
+        std::fill_n(lanes.v, MaxLanes, z);
+        return lanes;
+    };
+    std::vector<uint32_t> outputs(inputs.size(), 0);
+    std::unordered_map<const Value*, Lanes> values;
+    std::vector<Lanes> regs(RegClass_count << RegLocIndexBits, splat(0xDEAD'BEEFu));
+    std::unordered_map<uint64_t, Lanes> spillSlots; // by class and SpillLoc
+    std::unordered_map<uint64_t, uint32_t> globals; // by index, all start at 0
+    auto operandLanes = [&](const Instruction* instr, uint i) -> Lanes {
+        const Value* const v = instr->Operand(i);
+        if (IsLiteral(v)) {
+            return splat(static_cast<const LiteralValue*>(v)->zext);
+        }
+        if (!bAllocated)
+            return values.at(v);
+        Verify(instr->ra.srcRegs[i] != RegLocInvalid);
+        return regs[instr->ra.srcRegs[i]];
+    };
+    auto operand = [&](const Instruction* instr, uint i) { return operandLanes(instr, i).v[0]; };
+    auto slotClass = [](const Instruction* instr) {
+        if (instr->opcode == Opcode_load_spilled)
+            return RegClassOf(instr->ra.dstReg);
+        const Value* const value = instr->Operand(1);
+        return IsLiteral(value) ? RegClassOf(value->typekind, false) : RegClassOf(instr->ra.srcRegs[1]);
+    };
+    const Block* block = &entry;
+    for (uint numBlocks = 0; numBlocks < maxBlocks; ++numBlocks) {
+      const Block* next = nullptr;
+      for (const Instruction* const instr : block->instructions) {
+        Lanes result = { };
+        uint const numLanes = LaneCount(instr->typekind);
+        switch (instr->opcode) {
+        case Opcode_read_test_input:
+            for (uint lane = 0; lane < numLanes; ++lane)
+                result.v[lane] = inputs.at(operand(instr, 0) / 4 + lane);
+            if (instr->typekind == Ir_a64)
+                result.v[0] |= uint64_t(inputs.at(operand(instr, 0) / 4 + 1)) << 32;
+            break;
+        case Opcode_write_test_output: {
+            Lanes const value = operandLanes(instr, 1);
+            IrTypekind const typekind = instr->Operand(1)->typekind;
+            for (uint word = 0; word < WordCount(typekind); ++word) {
+                uint64_t const v = typekind == Ir_a64 ? value.v[0] >> (32 * word) : value.v[word];
+                outputs.at(operand(instr, 0) / 4 + word) = uint32_t(v);
+            }
+        } break;
+        case Opcode_spill:
+            spillSlots[uint64_t(slotClass(instr)) << 32 | operand(instr, 0)] = operandLanes(instr, 1);
+            break;
+        case Opcode_load_spilled:
+            result = spillSlots.at(uint64_t(slotClass(instr)) << 32 | operand(instr, 0));
+            break;
+        case Opcode_iadd: {
+            Lanes const a = operandLanes(instr, 0), b = operandLanes(instr, 1);
+            for (uint lane = 0; lane < numLanes; ++lane)
+                result.v[lane] = instr->typekind == Ir_a64 ? a.v[lane] + b.v[lane] : uint32_t(a.v[lane] + b.v[lane]);
+        } break;
+        case Opcode_icmp_eq:
+            result.v[0] = operand(instr, 0) == operand(instr, 1);
+            break;
+        case Opcode_icmp_ult:
+            result.v[0] = operand(instr, 0) < operand(instr, 1);
+            break;
+        case Opcode_select:
+            result.v[0] = operand(instr, 0) ? operand(instr, 1) : operand(instr, 2);
+            break;
+        case Opcode_load_global:
+            result.v[0] = globals[operand(instr, 0)];
+            break;
+        case Opcode_store_global:
+            globals[operand(instr, 0)] = operand(instr, 1);
+            break;
+        case Opcode_move:
+            result = operandLanes(instr, 0);
+            break;
+        case Opcode_swap:
+            std::swap(regs[instr->ra.srcRegs[0]], regs[instr->ra.srcRegs[1]]);
+            break;
+        case Opcode_return:
+            return outputs;
+        case Opcode_jump:
+            next = block->succs[0];
+            // After RA, moves before the jump have put the arguments in the params.
+            if (!bAllocated) {
+                std::vector<Lanes> args(instr->OperandCount());
+                for (uint i = 0; i < instr->OperandCount(); ++i)
+                    args[i] = operandLanes(instr, i);
+                for (uint i = 0; i < instr->OperandCount(); ++i)
+                    values[next->params[i]] = args[i];
+            }
+            break;
+        case Opcode_branch:
+            next = block->succs[operand(instr, 0) ? 0 : 1];
+            break;
+        default:
+            Verify(false);
+        }
+        if (instr->typekind != Ir_void) {
+            if (bAllocated)
+                regs[instr->ra.dstReg] = result;
+            else
+                values[instr] = result;
+        }
+      }
+      Verify(next != nullptr);
+      block = next;
+    }
+    return outputs;
+}
+
+static void IrBuilderFoldTest()
+{
+    Module m;
+    Block block;
+    IrBuilder b(m, block);
+
+    Value* const x = b.ReadTestInput(0, "x");
+    Verify(b.Iadd(m.LiteralU32(2), m.LiteralU32(3), "l") == m.LiteralU32(5));
+    Verify(b.Iadd(m.LiteralU32(0xFFFF'FFFFu), m.LiteralU32(2), "l") == m.LiteralU32(1)); // wraps
+    Verify(b.Iadd(x, m.lit_zero_a32, "x0") == x);
+    Verify(b.Iadd(m.lit_zero_a32, x, "x0") == x);
+    Verify(block.instructions.size() == 1);
+
+    // Literal is moved to the right:
+    Value* const x1 = b.Iadd(m.LiteralU32(1), x, "x1");
+    Verify(block.instructions.size() == 2 && AsIaddOfLiteral(x1) && x1 == block.instructions.back());
+    Verify(AsIaddOfLiteral(x1)->Operand(0) == x && AsIaddOfLiteral(x1)->Operand(1) == m.LiteralU32(1));
+
+    // Chain collapses to x + 6, then x + (6 - 6) is just x.
+    Value* const x3 = b.Iadd(x1, m.LiteralU32(2), "x3");
+    Value* const x6 = b.Iadd(x3, m.LiteralU32(3), "x6");
+    Verify(AsIaddOfLiteral(x6)->Operand(0) == x && AsIaddOfLiteral(x6)->Operand(1) == m.LiteralU32(6));
+    Verify(b.Iadd(x6, m.LiteralU32(uint32_t(-6)), "x") == x);
+
+    // Two non-literals are left alone:
+    Value* const xx = b.Iadd(x, x, "xx");
+    Verify(xx == block.instructions.back() && xx->opcode == Opcode_iadd);
+    b.Return();
+
+    // A random unfolded block, rebuilt instruction by instruction with folding, computes the same thing,
+    // including where sums of literals wrap, and is never bigger.
+    for (uint64_t seed = 0; seed < 16; ++seed) {
+        Module m2;
+        Block folded, unfolded;
+        IrBuilder bf(m2, folded), bu(m2, unfolded);
+        bu.bFold = false;
+        std::vector<char> names;
+        RandomBlockParams params = { 200, 8, 50, 10, 20, seed };
+        params.cmpPercent = 10;
+        GenerateRandomBlock(bu, params, names);
+
+        std::unordered_map<const Value*, Value*> rebuilt;
+        auto operand = [&](const Instruction* instr, uint i) {
+            Value* const value = instr->Operand(i);
+            return IsLiteral(value) ? value : rebuilt.at(value);
+        };
+        for (const Instruction* const instr : unfolded.instructions) {
+            uint32_t const offset = instr->OperandCount() != 0 && IsLiteral(instr->Operand(0))
+                ? uint32_t(static_cast<const LiteralValue*>(instr->Operand(0))->zext) : 0;
+            switch (instr->opcode) {
+            case Opcode_read_test_input:   rebuilt[instr] = bf.ReadTestInput(offset, instr->debugName); break;
+            case Opcode_write_test_output: bf.WriteTestOutput(offset, operand(instr, 1)); break;
+            case Opcode_iadd:              rebuilt[instr] = bf.Iadd(operand(instr, 0), operand(instr, 1), instr->debugName); break;
+            case Opcode_icmp_eq:
+            case Opcode_icmp_ult:
+                rebuilt[instr] = bf.Icmp(instr->opcode, operand(instr, 0), operand(instr, 1), instr->debugName);
+                break;
+            case Opcode_select:
+                rebuilt[instr] = bf.Select(operand(instr, 0), operand(instr, 1), operand(instr, 2), instr->debugName);
+                break;
+            case Opcode_return:            bf.Return(); break;
+            default:                       Verify(false);
+            }
+        }
+        Verify(folded.instructions.size() <= unfolded.instructions.size());
+        for (uint run = 0; run < 4; ++run) {
+            std::vector<uint32_t> inputs(params.numInputs);
+            for (uint i = 0; i < params.numInputs; ++i)
+                inputs[i] = uint32_t(Avalanche(seed * 100 + run * 10 + i));
+            Verify(InterpretForTest(folded, inputs, false) == InterpretForTest(unfolded, inputs, false));
+        }
+    }
+}
+INVOKE_TEST(IrBuilderFoldTest);
+
+static void RematerializeTest()
+{
+    {
+        // Everything is a test input or an iadd of one, so nothing needs a spill slot.
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        Value* const x = b.ReadTestInput(0, "x");
+        Value* const y = b.ReadTestInput(4, "y");
+        Value* const x1 = b.Iadd(x, m.LiteralU32(1), "x1");
+        Value* const y1 = b.Iadd(y, m.LiteralU32(1), "y1");
+        b.WriteTestOutput(0, b.Iadd(x1, y1, "x1y1"));
+        b.WriteTestOutput(4, b.Iadd(x, y1, "xy1"));
+        b.WriteTestOutput(8, b.Iadd(x1, y, "x1y"));
+        b.WriteTestOutput(12, b.Iadd(x, y, "xy"));
+        b.Return();
+        std::vector<uint32_t> const inputs = { 10, 20, 0, 0 };
+        std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+        Verify(LocalRegisterAllocation(m, block, 2) == 0);
+        Verify(CountInstrs(block, Opcode_spill) == 0);
+        Verify(InterpretForTest(block, inputs, true) == expected);
+    }
+
+    size_t numSpills[2] = {};
+    for (uint reglimit : { 2u, 3u, 4u, 8u }) {
+        for (uint seed = 0; seed < 20; ++seed) {
+            for (bool bRematerialize : { false, true }) {
+                Module m;
+                Block block;
+                IrBuilder b(m, block);
+                std::vector<char> names;
+                RandomBlockParams params = { 500, 16, 30, 10, 20, seed };
+                params.recentWindow = reglimit * 2;
+                GenerateRandomBlock(b, params, names);
+                CompileOptions options;
+                options.reglimit = reglimit;
+                options.bRematerialize = bRematerialize;
+                EliminateDeadCodeAndRedundantTestIo(block);
+                options.bEliminateDeadCode = false;
+
+                std::vector<uint32_t> inputs(params.numInputs);
+                for (uint i = 0; i < params.numInputs; ++i)
+                    inputs[i] = uint32_t(Avalanche(seed * 100 + i));
+                std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+                CompileBlock(m, block, options);
+                Verify(InterpretForTest(block, inputs, true) == expected);
+                numSpills[bRematerialize] += CountInstrs(block, Opcode_spill);
+            }
+        }
+    }
+    Verify(numSpills[1] < numSpills[0]);
+}
+INVOKE_TEST(RematerializeTest);
+
+static void PeepholeTest()
+{
+    {
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        Value* const x = b.ReadTestInput(0, "x");
+        Value* const y = b.ReadTestInput(4, "y");
+        Value* const xy = b.Iadd(x, y, "xy");
+        b.WriteTestOutput(0, b.Iadd(xy, x, "xyx"));
+        b.Return();
+        std::vector<uint32_t> const inputs = { 10, 20 };
+        std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+        SpillEverywhereForTest(m, block);
+        VerifyRegisterAllocation(block, 2);
+        Verify(CountInstrs(block, Opcode_spill) == 4 && CountInstrs(block, Opcode_load_spilled) == 5);
+
+        PeepholeStats const stats = EliminateRedundantSpillCode(block);
+        VerifyRegisterAllocation(block, 2);
+        Verify(InterpretForTest(block, inputs, true) == expected);
+        // xy and xyx are still in their registers when reloaded, so their spills are dead too.
+        // x and y really were overwritten in r0.
+        Verify(stats.numRedundantReloads == 2);
+        Verify(stats.numDeadSpills == 2);
+        Verify(CountInstrs(block, Opcode_spill) == 2 && CountInstrs(block, Opcode_load_spilled) == 3);
+    }
+
+    for (uint seed = 0; seed < 40; ++seed) {
+        for (bool bSpillEverywhere : { false, true }) {
+            uint const reglimit = 2 + seed % 4;
+            Module m;
+            Block block;
+            IrBuilder b(m, block);
+            std::vector<char> names;
+            RandomBlockParams params = { 300, 16, 30, 10, 20, seed };
+            params.recentWindow = reglimit * 2;
+            GenerateRandomBlock(b, params, names);
+            EliminateDeadCodeAndRedundantTestIo(block);
+
+            std::vector<uint32_t> inputs(params.numInputs);
+            for (uint i = 0; i < params.numInputs; ++i)
+                inputs[i] = uint32_t(Avalanche(seed * 100 + i));
+            std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+            if (bSpillEverywhere)
+                SpillEverywhereForTest(m, block);
+            else
+                LocalRegisterAllocation(m, block, reglimit);
+            VerifyRegisterAllocation(block, reglimit);
+            EliminateRedundantSpillCode(block);
+            VerifyRegisterAllocation(block, reglimit);
+            Verify(InterpretForTest(block, inputs, true) == expected);
+        }
+    }
+}
+INVOKE_TEST(PeepholeTest);
+
+// End of each instruction's live interval: its last use, or itself if it has none.
+static void ComputeLiveIntervalEnds(const Block& block, std::vector<uint>& ends)
+{
+    ends.resize(block.instructions.size());
+    // Forward over the operands rather than to the last use of each value, whose instruction is anywhere.
+    for (uint i = 0; i < block.instructions.size(); ++i) {
+        const Instruction* const instr = block.instructions[i];
+        ASSERT(instr->instrIndexInBlock == i);
+        ends[i] = i;
+        for (const Value* const src : instr->Operands()) {
+            if (!IsLiteral(src))
+                ends[static_cast<const RuntimeValue*>(src)->instrIndexInBlock] = i;
+        }
+    }
+}
+
+static void LinearScanTest()
+{
+    for (bool bLastIsInput : { false, true }) {
+        // When s needs a register, x, y and xy have the 3 there are. The one used again last, xy or the input y,
+        // is stored and reloaded for its output, or read again.
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        Value* const x = b.ReadTestInput(0, "x");
+        Value* const y = b.ReadTestInput(4, "y");
+        Value* const xy = b.Iadd(x, y, "xy");
+        Value* const s = b.Iadd(x, y, "s");
+        b.WriteTestOutput(0, b.Iadd(s, x, "sx"));
+        b.WriteTestOutput(4, bLastIsInput ? xy : y);
+        b.WriteTestOutput(8, bLastIsInput ? y : xy);
+        b.Return();
+        std::vector<uint32_t> const inputs = { 10, 20, 0 };
+        std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+        Verify(LinearScanRegisterAllocation(m, block, 3) == (bLastIsInput ? 0u : 1u));
+        VerifyRegisterAllocation(block, 3);
+        if (bLastIsInput) {
+            Verify(CountInstrs(block, Opcode_spill) == 0 && CountInstrs(block, Opcode_read_test_input) == 3);
+        }
+        else {
+            Verify(CountInstrs(block, Opcode_spill) == 1 && CountInstrs(block, Opcode_load_spilled) == 1);
+            for (const Instruction* instr : block.instructions)
+                Verify(instr->opcode != Opcode_spill || instr->Operand(1) == xy);
+        }
+        Verify(InterpretForTest(block, inputs, true) == expected);
+    }
+
+    for (uint reglimit : { 2u, 3u, 4u, 8u, 16u }) {
+        for (uint seed = 0; seed < 20; ++seed) {
+            for (bool bPeephole : { false, true }) {
+                Module m;
+                Block block;
+                IrBuilder b(m, block);
+                std::vector<char> names;
+                RandomBlockParams params = { 500, 16, 30, 10, 20, seed };
+                params.recentWindow = 6;
+                params.farPercent = reglimit == 16 ? 0 : 25;
+                GenerateRandomBlock(b, params, names);
+                CompileOptions options;
+                options.reglimit = reglimit;
+                options.allocator = RegisterAllocator_linearScan;
+                options.bPeephole = bPeephole;
+
+                EliminateDeadCodeAndRedundantTestIo(block);
+                ScheduleForRegisterPressure(block, reglimit);
+                options.bEliminateDeadCode = false;
+                options.bSchedule = false;
+
+                // Most intervals live at once: the ones crossing an instruction, plus its def if it is used.
+                std::vector<uint> ends;
+                ComputeLiveIntervalEnds(block, ends);
+                std::vector<int> delta(ends.size() + 1);
+                uint maxLive = 0;
+                int live = 0;
+                for (uint i = 0; i < ends.size(); ++i) {
+                    live += delta[i];
+                    maxLive = Max(maxLive, uint(live) + (ends[i] > i));
+                    if (ends[i] > i) {
+                        ++delta[i + 1];
+                        --delta[ends[i]];
+                    }
+                }
+
+                std::vector<uint32_t> inputs(params.numInputs);
+                for (uint i = 0; i < params.numInputs; ++i)
+                    inputs[i] = uint32_t(Avalanche(seed * 100 + i));
+                std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+                uint const numReads = CountInstrs(block, Opcode_read_test_input);
+                CompileBlock(m, block, options);
+                Verify(InterpretForTest(block, inputs, true) == expected);
+                // Evicts exactly when the intervals don't fit the registers: stores a value or reads an input again.
+                bool const bEvicted =
+                    CountInstrs(block, Opcode_spill) != 0 || CountInstrs(block, Opcode_read_test_input) != numReads;
+                Verify((maxLive > reglimit) == bEvicted);
+            }
+        }
+    }
+}
+INVOKE_TEST(LinearScanTest);
+
+static void RegClassTest()
+{
+    for (uint predlimit : { 0u, 2u }) {
+        // x, y and z are live throughout, so with 4 registers for everything the 2 compares don't fit with them.
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        Value* const x = b.ReadTestInput(0, "x");
+        Value* const y = b.ReadTestInput(4, "y");
+        Value* const z = b.ReadTestInput(8, "z");
+        Value* const c1 = b.Icmp(Opcode_icmp_ult, x, y, "c1");
+        Value* const c2 = b.Icmp(Opcode_icmp_eq, y, z, "c2");
+        b.WriteTestOutput(0, b.Select(c1, x, z, "w1"));
+        b.WriteTestOutput(4, b.Select(c2, y, x, "w2"));
+        b.WriteTestOutput(8, b.Iadd(x, y, "xy"));
+        b.WriteTestOutput(12, z);
+        b.Return();
+        std::vector<uint32_t> const inputs = { 10, 20, 20, 0 };
+        std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+        Verify(expected == std::vector<uint32_t>({ 10, 20, 30, 20 }));
+        LocalRegisterAllocation(m, block, 4, Eviction_farthestNextUse, false, predlimit);
+        VerifyRegisterAllocation(block, 4, predlimit);
+        Verify(InterpretForTest(block, inputs, true) == expected);
+        Verify((CountDataSpills(block) == 0) == (predlimit != 0));
+
+        ubyte streambuf[2048];
+        FixedBufferByteStream bs(streambuf, sizeof streambuf);
+        PrintContext ctx = { };
+        ctx.bPrintRegs = true;
+        PrintBlock(ctx, bs, block, 0);
+        static const char predReg[] = "\\p1";
+        const ubyte* const printedEnd = streambuf + bs.WrappedSize();
+        Verify((std::search(static_cast<const ubyte*>(streambuf), printedEnd, predReg, predReg + 3) != printedEnd) == (predlimit != 0));
+    }
+
+    // The scheduler counts c against reglimit only when it shares the data registers; then x and y fill them, and
+    // the write of x, which adds nothing, goes first.
+    for (uint predlimit : { 0u, 1u }) {
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        Value* const x = b.ReadTestInput(0, "x");
+        Value* const y = b.ReadTestInput(4, "y");
+        Value* const c = b.Icmp(Opcode_icmp_ult, x, y, "c");
+        b.WriteTestOutput(0, x);
+        b.WriteTestOutput(4, b.Select(c, x, y, "w"));
+        b.Return();
+        std::vector<Instruction*> const original = block.instructions;
+        ScheduleForRegisterPressure(block, 2, predlimit);
+        Verify((block.instructions == original) == (predlimit != 0));
+        Verify(block.instructions[2]->opcode == (predlimit != 0 ? Opcode_icmp_ult : Opcode_write_test_output));
+    }
+
+    // Compare-heavy blocks: both allocators, with bools sharing the data registers and in a file of their own.
+    uint dataSpills[2] = { }; // local allocator, without and with predicate registers
+    for (uint reglimit : { 3u, 4u, 8u }) {
+        for (uint predlimit : { 0u, 1u, 2u, 4u }) {
+            for (RegisterAllocator allocator : { RegisterAllocator_local, RegisterAllocator_linearScan }) {
+                for (uint seed = 0; seed < 10; ++seed) {
+                    Module m;
+                    Block block;
+                    IrBuilder b(m, block);
+                    std::vector<char> names;
+                    RandomBlockParams params = { 400, 16, 20, 10, 20, seed };
+                    params.recentWindow = 6;
+                    params.cmpPercent = 25;
+                    GenerateRandomBlock(b, params, names);
+                    Verify(CountInstrs(block, Opcode_select) != 0);
+
+                    std::vector<uint32_t> inputs(params.numInputs);
+                    for (uint i = 0; i < params.numInputs; ++i)
+                        inputs[i] = uint32_t(Avalanche(seed * 100 + i)) % 8; // small, so compares go both ways
+                    std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+                    CompileOptions options;
+                    options.reglimit = reglimit;
+                    options.predlimit = predlimit;
+                    options.allocator = allocator;
+                    options.bPeephole = seed & 1;
+                    CompileBlock(m, block, options); // verifies the allocation in debug builds
+                    Verify(InterpretForTest(block, inputs, true) == expected);
+                    for (const Instruction* instr : block.instructions) {
+                        if (instr->typekind != Ir_void)
+                            Verify(RegClassOf(instr->ra.dstReg) == RegClassOf(instr->typekind, predlimit != 0));
+                    }
+                    if (allocator == RegisterAllocator_local && (predlimit == 0 || predlimit == 4))
+                        dataSpills[predlimit != 0] += CountDataSpills(block);
+                }
+            }
+        }
+    }
+    // Bools no longer evict data values.
+    Verify(dataSpills[1] < dataSpills[0]);
+}
+INVOKE_TEST(RegClassTest);
+
+static void SlpTest()
+{
+    auto countVectorInstrs = [](const Block& block) {
+        uint n = 0;
+        for (const Instruction* instr : block.instructions)
+            n += HasVectorType(instr);
+        return n;
+    };
+
+    // 18 elements: 4 trees, and 2 left scalar.
+    for (uint veclimit : { 2u, 8u }) {
+        for (RegisterAllocator allocator : { RegisterAllocator_local, RegisterAllocator_linearScan }) {
+            Module m;
+            Block block;
+            IrBuilder b(m, block);
+            GenerateDataParallelBlock(b, 18, 3);
+            std::vector<uint32_t> inputs(18 * 3);
+            for (uint i = 0; i < inputs.size(); ++i)
+                inputs[i] = uint32_t(Avalanche(i));
+            std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+
+            EliminateDeadCodeAndRedundantTestIo(block);
+            Verify(VectorizeSlp(m, block) == 4);
+            Verify(CountInstrs(block, Opcode_write_test_output) == 4 + 2);
+            Verify(CountInstrs(block, Opcode_read_test_input) == 4 * 3 + 2 * 3);
+            Verify(countVectorInstrs(block) == 4 * (3 + 2 + 1 + 1)); // reads, sums, +3, write
+            Verify(InterpretForTest(block, inputs, false) == expected);
+
+            CompileOptions options;
+            options.reglimit = 3;
+            options.veclimit = veclimit;
+            options.allocator = allocator;
+            CompileBlock(m, block, options);
+            Verify(InterpretForTest(block, inputs, true) == expected);
+            for (const Instruction* instr : block.instructions) {
+                if (instr->typekind != Ir_void)
+                    Verify(RegClassOf(instr->ra.dstReg) == RegClassOf(instr->typekind, false));
+            }
+        }
+    }
+
+    // 22 elements with 8 lanes: 2 trees of 8, one of 4 and 2 left scalar. The vectors of both widths share the
+    // vector registers.
+    for (RegisterAllocator allocator : { RegisterAllocator_local, RegisterAllocator_linearScan }) {
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        GenerateDataParallelBlock(b, 22, 3);
+        std::vector<uint32_t> inputs(22 * 3);
+        for (uint i = 0; i < inputs.size(); ++i)
+            inputs[i] = uint32_t(Avalanche(i + 7));
+        std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+
+        EliminateDeadCodeAndRedundantTestIo(block);
+        Verify(VectorizeSlp(m, block, nullptr, 8) == 3);
+        Verify(CountInstrs(block, Opcode_write_test_output) == 3 + 2);
+        Verify(countVectorInstrs(block) == 3 * (3 + 2 + 1 + 1));
+        uint numWide = 0;
+        for (const Instruction* instr : block.instructions)
+            numWide += instr->typekind == Ir_v8a32;
+        Verify(numWide == 2 * (3 + 2 + 1));
+        Verify(InterpretForTest(block, inputs, false) == expected);
+
+        CompileOptions options;
+        options.reglimit = 3;
+        options.veclimit = 2;
+        options.allocator = allocator;
+        CompileBlock(m, block, options);
+        Verify(InterpretForTest(block, inputs, true) == expected);
+    }
+
+    // Vectors spill in slots of their own class. Each tree above is contiguous, so 8 sums are live here instead.
+    for (RegisterAllocator allocator : { RegisterAllocator_local, RegisterAllocator_linearScan }) {
+        Module m;
+        Block block;
+        GenerateNeighborSumsBlock(m, block);
+        std::vector<uint32_t> inputs(32);
+        for (uint i = 0; i < inputs.size(); ++i)
+            inputs[i] = uint32_t(Avalanche(i));
+        std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+        for (uint lane = 0; lane < 4; ++lane)
+            Verify(expected[lane] == 2 * (inputs[lane] + inputs[4 + lane] + inputs[8 + lane] + inputs[12 + lane] +
+                   inputs[16 + lane] + inputs[20 + lane] + inputs[24 + lane] + inputs[28 + lane]) + 7);
+        CompileOptions options;
+        options.reglimit = 2;
+        options.veclimit = 3;
+        options.allocator = allocator;
+        CompileBlock(m, block, options);
+        Verify(InterpretForTest(block, inputs, true) == expected);
+        uint numVectorSpills = 0;
+        for (const Instruction* instr : block.instructions)
+            numVectorSpills += instr->opcode == Opcode_spill && HasVectorType(instr);
+        Verify(numVectorSpills != 0 && CountDataSpills(block) == 0);
+    }
+
+    // Lanes that are commuted, and trees that can't be vectorized.
+    {
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        b.bFold = false;
+        Value* x[16];
+        for (uint i = 0; i < 16; ++i)
+            x[i] = b.ReadTestInput(i * 4, "x");
+        // Vectorized, lane 2 is commuted.
+        for (uint lane = 0; lane < 4; ++lane)
+            b.WriteTestOutput(lane * 4, lane == 2 ? b.Iadd(x[4 + lane], x[lane], "a") : b.Iadd(x[lane], x[4 + lane], "a"));
+        // Not: the reads of lane 3 aren't adjacent to the others.
+        for (uint lane = 0; lane < 4; ++lane)
+            b.WriteTestOutput(16 + lane * 4, b.Iadd(x[lane], x[lane == 3 ? 15 : 8 + lane], "b"));
+        // Not: the literals differ.
+        for (uint lane = 0; lane < 4; ++lane)
+            b.WriteTestOutput(32 + lane * 4, b.Iadd(x[lane], m.LiteralU32(lane), "c"));
+        // Not: lane 1's iadd is used again.
+        Value* d[4];
+        for (uint lane = 0; lane < 4; ++lane) {
+            d[lane] = b.Iadd(x[8 + lane], x[12 + lane], "d");
+            b.WriteTestOutput(48 + lane * 4, d[lane]);
+        }
+        b.WriteTestOutput(64, b.Iadd(d[1], x[0], "e"));
+        b.Return();
+        std::vector<uint32_t> inputs(17);
+        for (uint i = 0; i < inputs.size(); ++i)
+            inputs[i] = i * 1000 + 1;
+        std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+        Verify(VectorizeSlp(m, block) == 1);
+        Verify(countVectorInstrs(block) == 4); // 2 reads, iadd, write
+        Verify(InterpretForTest(block, inputs, false) == expected);
+    }
+
+    // Random blocks have few trees if any, the rest must come through unchanged.
+    for (uint seed = 0; seed < 20; ++seed) {
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        std::vector<char> names;
+        RandomBlockParams params = { 300, 8, 30, 30, 40, seed };
+        params.recentWindow = 4;
+        params.cmpPercent = 10;
+        GenerateRandomBlock(b, params, names);
+        std::vector<uint32_t> inputs(params.numInputs);
+        for (uint i = 0; i < params.numInputs; ++i)
+            inputs[i] = uint32_t(Avalanche(seed * 100 + i));
+        std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+        CompileOptions options;
+        options.reglimit = 4;
+        options.veclimit = 2;
+        options.bVectorize = true;
+        CompileBlock(m, block, options);
+        Verify(InterpretForTest(block, inputs, true) == expected);
+    }
+}
+INVOKE_TEST(SlpTest);
+
+static void A64Test()
+{
+    // 64-bit literals are interned by their whole value, apart from the 32-bit ones.
+    {
+        Module m;
+        Verify(m.LiteralU64(5) == m.LiteralU64(5) && m.LiteralU64(5)->typekind == Ir_a64);
+        Verify(m.LiteralU64(5) != m.LiteralU32(5) && m.LiteralU32(5)->typekind == Ir_a32);
+        Verify(m.LiteralU64(uint64_t(1) << 32) != m.LiteralU64(0));
+        Verify(m.LiteralU64(~uint64_t(0))->zext == ~uint64_t(0));
+        LiteralValue* const big = m.LiteralU64(0x1234'5678'9ABC'DEF0u);
+        for (uint i = 0; i < 1000; ++i)
+            (void)m.LiteralU64(i << 20); // rehashes, the literals must not move
+        Verify(m.LiteralU64(0x1234'5678'9ABC'DEF0u) == big);
+    }
+
+    // Folding is modulo 2^64.
+    {
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        Verify(b.Iadd(m.LiteralU64(0xFFFF'FFFFu), m.LiteralU64(1), "l") == m.LiteralU64(uint64_t(1) << 32));
+        Verify(b.Iadd(m.LiteralU64(~uint64_t(0)), m.LiteralU64(2), "l") == m.LiteralU64(1));
+        Value* const x = b.ReadTestInput(0, "x", Ir_a64);
+        Value* const x1 = b.Iadd(x, m.LiteralU64(uint64_t(1) << 32), "x1");
+        Verify(AsIaddOfLiteral(x1) && x1->typekind == Ir_a64);
+        Verify(b.Iadd(x1, m.LiteralU64(uint64_t(0) - (uint64_t(1) << 32)), "x") == x);
+        Verify(b.Icmp(Opcode_icmp_ult, m.LiteralU64(uint64_t(1) << 32), m.LiteralU64(1), "c") == m.LiteralBool(false));
+    }
+
+    // The same sums as a64 values or split into halves, before and after RA. a64 values take one data register.
+    for (uint reglimit : { 3u, 4u, 8u }) {
+        for (RegisterAllocator allocator : { RegisterAllocator_local, RegisterAllocator_linearScan }) {
+            std::vector<uint32_t> inputs(16 * 3 * 2);
+            for (uint i = 0; i < inputs.size(); ++i)
+                inputs[i] = i % 3 ? uint32_t(Avalanche(i)) : 0xFFFF'FFF0u + i % 7; // carries
+            std::vector<uint32_t> outputs[2];
+            for (uint bNative = 0; bNative < 2; ++bNative) {
+                Module m;
+                Block block;
+                IrBuilder b(m, block);
+                GenerateWideAddBlock(b, 16, 3, bNative != 0);
+                std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+                CompileOptions options;
+                options.reglimit = reglimit;
+                options.allocator = allocator;
+                CompileBlock(m, block, options);
+                Verify(InterpretForTest(block, inputs, true) == expected);
+                for (const Instruction* instr : block.instructions) {
+                    if (instr->typekind != Ir_void)
+                        Verify(RegClassOf(instr->ra.dstReg) == RegClass_data || instr->typekind == Ir_bool);
+                }
+                outputs[bNative] = expected;
+            }
+            Verify(outputs[0] == outputs[1]);
+            for (uint e = 0; e < 16; ++e) {
+                uint64_t sum = 0x1'0000'0003u;
+                for (uint t = 0; t < 3; ++t)
+                    sum += inputs[(t * 16 + e) * 2] | uint64_t(inputs[(t * 16 + e) * 2 + 1]) << 32;
+                Verify(outputs[1][e * 2] == uint32_t(sum) && outputs[1][e * 2 + 1] == uint32_t(sum >> 32));
+            }
+        }
+    }
+
+    // A write of half of an a64 keeps the a64 write live, and one of both halves doesn't.
+    {
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        Value* const x = b.ReadTestInput(0, "x", Ir_a64);
+        b.WriteTestOutput(0, x);
+        b.WriteTestOutput(4, m.LiteralU32(7));
+        b.WriteTestOutput(8, x);
+        b.WriteTestOutput(8, m.LiteralU64(9));
+        b.Return();
+        std::vector<uint32_t> const inputs = { 0x1111'1111u, 0x2222'2222u, 0, 0 };
+        std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+        Verify(expected == std::vector<uint32_t>({ 0x1111'1111u, 7, 9, 0 }));
+        Verify(EliminateDeadCodeAndRedundantTestIo(block).numDeadWrites == 1);
+        Verify(InterpretForTest(block, inputs, false) == expected);
+
+        ubyte streambuf[512];
+        FixedBufferByteStream bs(streambuf, sizeof streambuf);
+        PrintContext ctx = { };
+        PrintBlock(ctx, bs, block, 0);
+        static const char printed[] = "qword x = read_test_input(0);\n"
+                                      "write_test_output(0, x);\n"
+                                      "write_test_output(4, 7);\n"
+                                      "write_test_output(8, 9_q);\n"
+                                      "return;\n";
+        Verify(bs.WrappedSize() == sizeof printed - 1 && memcmp(streambuf, printed, sizeof printed - 1) == 0);
+    }
+}
+INVOKE_TEST(A64Test);
+
+static std::vector<uint32_t> RunBytecodeForTest(const BytecodeProgram& program, const std::vector<uint32_t>& inputs,
+    bool bThreaded)
+{
+    std::vector<uint32_t> outputs(inputs.size(), 0);
+    std::vector<uint32_t> frame;
+    (bThreaded ? RunBytecode : RunBytecodeSwitch)(program, frame,
+        reinterpret_cast<const ubyte*>(inputs.data()), inputs.size() * 4,
+        reinterpret_cast<ubyte*>(outputs.data()), outputs.size() * 4);
+    return outputs;
+}
+
+// Every way of running a block, before and after RA, must agree with InterpretForTest.
+static void BytecodeTest()
+{
+    {
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        Value* const x = b.ReadTestInput(0, "x");
+        Value* const y = b.ReadTestInput(4, "y");
+        b.WriteTestOutput(0, b.Iadd(x, y, "xy"));
+        b.WriteTestOutput(4, b.Select(b.Icmp(Opcode_icmp_ult, x, y, "c"), x, y, "min"));
+        b.WriteTestOutput(8, b.Iadd(x, m.LiteralU32(5), "x5"));
+        b.Return();
+        std::vector<uint32_t> const inputs = { 10, 3, 0 };
+        std::vector<uint32_t> const expected = { 13, 3, 15 };
+        BytecodeProgram program;
+        LowerToBytecode(block, false, false, program);
+        Verify(program.numIrInstrs == 9 && program.inputBytes == 8 && program.outputBytes == 12);
+        Verify(RunBytecodeForTest(program, inputs, false) == expected);
+        Verify(RunBytecodeForTest(program, inputs, true) == expected);
+
+        CompileOptions options;
+        options.reglimit = 3;
+        CompileBlock(m, block, options);
+        LowerToBytecode(block, true, true, program);
+        Verify(RunBytecodeForTest(program, inputs, false) == expected);
+        Verify(RunBytecodeForTest(program, inputs, true) == expected);
+    }
+
+    // a64 values in two cells. The inputs differ in either word, so the compares must look at both.
+    {
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        Value* const x = b.ReadTestInput(0, "x", Ir_a64);
+        Value* const y = b.ReadTestInput(8, "y", Ir_a64);
+        b.WriteTestOutput(0, b.Iadd(x, y, "xy"));
+        b.WriteTestOutput(8, b.Select(b.Icmp(Opcode_icmp_ult, x, y, "c"), x, y, "min"));
+        Value* const big = b.Iadd(x, m.LiteralU64(0x1'0000'0005u), "big");
+        b.WriteTestOutput(16, b.Select(b.Icmp(Opcode_icmp_eq, x, y, "e"), m.LiteralU64(~uint64_t(0)), big, "eq"));
+        b.Return();
+        static const uint32_t cases[][6] = { { 1, 2, 0, 2 }, { 0xFFFF'FFFFu, 2, 5, 1 }, { 7, 3, 7, 3 } };
+        for (const auto& words : cases) {
+            std::vector<uint32_t> const inputs(words, words + 6); // as many as the outputs
+            std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+            BytecodeProgram program;
+            LowerToBytecode(block, false, false, program);
+            Verify(program.inputBytes == 16 && program.outputBytes == 24);
+            Verify(RunBytecodeForTest(program, inputs, false) == expected);
+            Verify(RunBytecodeForTest(program, inputs, true) == expected);
+        }
+    }
+    for (uint reglimit : { 3u, 8u }) {
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        GenerateWideAddBlock(b, 12, 3, true);
+        std::vector<uint32_t> inputs(12 * 3 * 2);
+        for (uint i = 0; i < inputs.size(); ++i)
+            inputs[i] = i % 3 ? uint32_t(Avalanche(i)) : 0xFFFF'FFF0u + i % 7; // carries
+        std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+        CompileOptions options;
+        options.reglimit = reglimit;
+        CompileBlock(m, block, options);
+        BytecodeProgram program;
+        for (bool bSuperinstructions : { false, true }) {
+            LowerToBytecode(block, true, bSuperinstructions, program);
+            Verify(RunBytecodeForTest(program, inputs, false) == expected);
+            Verify(RunBytecodeForTest(program, inputs, true) == expected);
+        }
+    }
+
+    // Vectors, a cell per lane, before and after RA. Few vector registers so they are spilled too.
+    uint numVectorSpills = 0;
+    for (uint numElements : { 4u, 8u, 13u, 22u }) {
+        for (uint veclimit : { 2u, 3u, 4u }) {
+            uint const lanes = veclimit == 3 ? 8 : 4;
+            Module m;
+            Block block;
+            IrBuilder b(m, block);
+            GenerateDataParallelBlock(b, numElements, 5);
+            std::vector<uint32_t> inputs(numElements * 5);
+            for (uint i = 0; i < inputs.size(); ++i)
+                inputs[i] = uint32_t(Avalanche(numElements * 100 + i));
+            std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+            Verify(VectorizeSlp(m, block, nullptr, lanes) == numElements / lanes + numElements % lanes / 4);
+            BytecodeProgram program;
+            LowerToBytecode(block, false, false, program);
+            Verify(RunBytecodeForTest(program, inputs, true) == expected);
+
+            CompileOptions options;
+            options.reglimit = 2;
+            options.veclimit = veclimit;
+            CompileBlock(m, block, options);
+            for (const Instruction* instr : block.instructions)
+                numVectorSpills += instr->opcode == Opcode_spill && LaneCount(instr->Operand(1)->typekind) > 1;
+            for (bool bSuperinstructions : { false, true }) {
+                LowerToBytecode(block, true, bSuperinstructions, program);
+                Verify(RunBytecodeForTest(program, inputs, false) == expected);
+                Verify(RunBytecodeForTest(program, inputs, true) == expected);
+            }
+        }
+    }
+    {
+        Module m;
+        Block block;
+        GenerateNeighborSumsBlock(m, block);
+        std::vector<uint32_t> inputs(32);
+        for (uint i = 0; i < inputs.size(); ++i)
+            inputs[i] = uint32_t(Avalanche(i));
+        std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+        BytecodeProgram program;
+        LowerToBytecode(block, false, true, program);
+        Verify(RunBytecodeForTest(program, inputs, true) == expected);
+        CompileOptions options;
+        options.reglimit = 2;
+        options.veclimit = 3;
+        CompileBlock(m, block, options);
+        for (const Instruction* instr : block.instructions)
+            numVectorSpills += instr->opcode == Opcode_spill && LaneCount(instr->Operand(1)->typekind) > 1;
+        LowerToBytecode(block, true, true, program);
+        Verify(RunBytecodeForTest(program, inputs, false) == expected);
+        Verify(RunBytecodeForTest(program, inputs, true) == expected);
+    }
+    Verify(numVectorSpills != 0);
+
+    uint numFused = 0;
+    for (uint reglimit : { 3u, 8u }) {
+        for (uint predlimit : { 0u, 2u }) {
+            for (RegisterAllocator allocator : { RegisterAllocator_local, RegisterAllocator_linearScan }) {
+                for (uint seed = 0; seed < 5; ++seed) {
+                    Module m;
+                    Block block;
+                    IrBuilder b(m, block);
+                    std::vector<char> names;
+                    RandomBlockParams params = { 400, 16, 20, 10, 20, seed };
+                    params.recentWindow = 6;
+                    params.cmpPercent = 15;
+                    GenerateRandomBlock(b, params, names);
+                    EliminateDeadCodeAndRedundantTestIo(block);
+
+                    std::vector<uint32_t> inputs(params.numInputs);
+                    for (uint i = 0; i < params.numInputs; ++i)
+                        inputs[i] = uint32_t(Avalanche(seed * 100 + i)) % 8;
+                    std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+                    BytecodeProgram program;
+                    for (bool bSuperinstructions : { false, true }) {
+                        LowerToBytecode(block, false, bSuperinstructions, program);
+                        Verify(RunBytecodeForTest(program, inputs, false) == expected);
+                        Verify(RunBytecodeForTest(program, inputs, true) == expected);
+                    }
+
+                    CompileOptions options;
+                    options.reglimit = reglimit;
+                    options.predlimit = predlimit;
+                    options.allocator = allocator;
+                    options.bEliminateDeadCode = false;
+                    CompileBlock(m, block, options);
+                    for (bool bSuperinstructions : { false, true }) {
+                        LowerToBytecode(block, true, bSuperinstructions, program);
+                        Verify(program.numIrInstrs + 1 == block.instructions.size());
+                        Verify(RunBytecodeForTest(program, inputs, false) == expected);
+                        Verify(RunBytecodeForTest(program, inputs, true) == expected);
+                        for (const BytecodeInstr& bc : program.code)
+                            numFused += bc.op > Bc_return;
+                    }
+                }
+            }
+        }
+    }
+    Verify(numFused != 0);
+}
+INVOKE_TEST(BytecodeTest);
+
+// Each record of a batch, including the last partial chunk, must match running it alone.
+static void BatchTest()
+{
+    for (uint reglimit : { 0u, 3u, 8u }) { // 0 is before RA
+        for (uint seed = 0; seed < 7; ++seed) {
+            Module m;
+            Block block;
+            IrBuilder b(m, block);
+            std::vector<char> names;
+            RandomBlockParams params = { 300, 8, 20, 10, 20, seed };
+            params.cmpPercent = 20;
+            bool const bWide = seed >= 4; // vectors, with 3 vector registers after RA, then a64s
+            if (seed == 4) {
+                params.numInputs = 9 * 4;
+                GenerateDataParallelBlock(b, 9, 4);
+                VectorizeSlp(m, block);
+            }
+            else if (seed == 5) {
+                params.numInputs = 32;
+                GenerateNeighborSumsBlock(m, block);
+            }
+            else if (seed == 6) { // a64 values, the columns are their words
+                params.numInputs = 6 * 4 * 2;
+                GenerateWideAddBlock(b, 6, 4, true);
+            }
+            else {
+                GenerateRandomBlock(b, params, names);
+            }
+            if (reglimit) {
+                CompileOptions options;
+                options.reglimit = reglimit;
+                options.predlimit = seed % 2;
+                options.veclimit = 3;
+                CompileBlock(m, block, options);
+            }
+            BytecodeProgram program;
+            LowerToBytecode(block, reglimit != 0, false, program);
+            Verify(!bWide || program.code.size() > block.instructions.size()); // a record per lane or word
+
+            size_t const numRecords = 3 * BatchLanes + 5;
+            uint const numColumns = params.numInputs;
+            std::vector<uint32_t> input(numColumns * numRecords), output(numColumns * numRecords, 0);
+            for (size_t i = 0; i < input.size(); ++i)
+                input[i] = uint32_t(Avalanche(seed * 10'000 + i)) % (i % 3 ? 8 : 0xFFFF'FFFFu); // equal and wrapping
+            std::vector<uint32_t> frame;
+            RunBytecodeBatch(program, frame, input.data(), output.data(), numRecords);
+
+            std::vector<uint32_t> inputs(numColumns);
+            for (size_t r = 0; r < numRecords; ++r) {
+                for (uint k = 0; k < numColumns; ++k)
+                    inputs[k] = input[k * numRecords + r];
+                std::vector<uint32_t> const expected = RunBytecodeForTest(program, inputs, true);
+                for (uint k = 0; k < numColumns; ++k)
+                    Verify(output[k * numRecords + r] == expected[k]);
+            }
+        }
+    }
+}
+INVOKE_TEST(BatchTest);
+
+#if TC_X64_JIT
+// Each call adds its input to total, counts the call and outputs the old total. Doesn't return.
+static void BuildAccumulate(IrBuilder& b, const GlobalVariable* count, const GlobalVariable* total)
+{
+    Value* const x = b.ReadTestInput(0, "x");
+    Value* const old = b.LoadGlobal(total, "old");
+    b.StoreGlobal(total, b.Iadd(old, x, "new"));
+    b.StoreGlobal(count, b.Iadd(b.LoadGlobal(count, "n"), b.module.LiteralU32(1), "n1"));
+    b.WriteTestOutput(0, old);
+}
+
+static std::vector<uint32_t> RunJitForTest(const JitCode& jit, const std::vector<uint32_t>& inputs)
+{
+    std::vector<uint32_t> outputs(inputs.size(), 0);
+    Verify(inputs.size() * 4 >= jit.inputBytes && outputs.size() * 4 >= jit.outputBytes);
+    jit.fn(reinterpret_cast<const ubyte*>(inputs.data()), reinterpret_cast<ubyte*>(outputs.data()));
+    return outputs;
+}
+
+static void JitTest()
+{
+    // Literals in every operand position the builder allows without folding.
+    for (uint predlimit : { 0u, 1u }) {
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        b.bFold = false;
+        Value* const x = b.ReadTestInput(0, "x");
+        Value* const y = b.ReadTestInput(4, "y");
+        b.WriteTestOutput(0, b.Iadd(x, y, "xy"));
+        b.WriteTestOutput(4, b.Iadd(m.LiteralU32(7), y, "7y"));
+        b.WriteTestOutput(8, b.Iadd(m.LiteralU32(1), m.LiteralU32(0xFFFF'FFFFu), "0"));
+        b.WriteTestOutput(12, b.Select(b.Icmp(Opcode_icmp_ult, x, y, "c"), x, y, "min"));
+        b.WriteTestOutput(16, b.Select(b.Icmp(Opcode_icmp_ult, m.LiteralU32(3), x, "3x"), m.LiteralU32(1), m.LiteralU32(0), "b"));
+        b.WriteTestOutput(20, b.Select(b.Icmp(Opcode_icmp_eq, y, m.LiteralU32(200), "y200"), x, m.LiteralU32(0), "z"));
+        b.WriteTestOutput(24, b.Select(m.LiteralBool(true), x, y, "t"));
+        b.WriteTestOutput(28, m.LiteralU32(0x1234'5678u));
+        b.Return();
+        std::vector<uint32_t> const inputs = { 100, 200, 0, 0, 0, 0, 0, 0 };
+        std::vector<uint32_t> const expected = { 300, 207, 0, 100, 1, 100, 100, 0x1234'5678u };
+        Verify(InterpretForTest(block, inputs, false) == expected);
+
+        CompileOptions options;
+        options.reglimit = 3;
+        options.predlimit = predlimit;
+        options.bEliminateDeadCode = false;
+        options.bSchedule = false;
+        CompileBlock(m, block, options);
+        JitCode jit;
+        JitCompileBlock(block, jit);
+        Verify(RunJitForTest(jit, inputs) == expected);
+    }
+
+    // a64 values: literals that fit the sign-extended immediate and ones that go through a register, and both
+    // operands of a compare literal. The inputs differ in either word.
+    static const uint32_t wideCases[][18] = { { 1, 2, 0, 2 }, { 0xFFFF'FFFFu, 0, 5, 1 }, { 4, 1, 4, 1 } };
+    for (const auto& words : wideCases) {
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        b.bFold = false;
+        Value* const x = b.ReadTestInput(0, "x", Ir_a64);
+        Value* const y = b.ReadTestInput(8, "y", Ir_a64);
+        LiteralValue* const big = m.LiteralU64(0x1'0000'0005u);
+        b.WriteTestOutput(0, b.Iadd(x, y, "xy"));
+        b.WriteTestOutput(8, b.Select(b.Icmp(Opcode_icmp_ult, x, y, "c"), x, y, "min"));
+        b.WriteTestOutput(16, b.Iadd(x, big, "xbig"));
+        b.WriteTestOutput(24, b.Iadd(x, m.LiteralU64(~uint64_t(0)), "x-1"));
+        b.WriteTestOutput(32, b.Select(b.Icmp(Opcode_icmp_eq, x, y, "e"), m.LiteralU64(~uint64_t(0)), big, "eq"));
+        b.WriteTestOutput(40, b.Select(b.Icmp(Opcode_icmp_ult, x, big, "xb"), m.LiteralU64(1), m.LiteralU64(0x8000'0000u), "lt"));
+        b.WriteTestOutput(48, b.Select(b.Icmp(Opcode_icmp_eq, big, big, "bb"), x, y, "t"));
+        b.WriteTestOutput(56, m.LiteralU64(0x8000'0000u));
+        b.WriteTestOutput(64, m.LiteralU64(~uint64_t(0)));
+        b.Return();
+        std::vector<uint32_t> const inputs(words, words + 18);
+        std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+        Verify(expected[14] == 0x8000'0000u && expected[15] == 0 && expected[16] == ~0u && expected[17] == ~0u);
+
+        CompileOptions options;
+        options.reglimit = 3;
+        options.predlimit = uint(&words - wideCases) % 2;
+        options.bEliminateDeadCode = false;
+        options.bSchedule = false;
+        CompileBlock(m, block, options);
+        JitCode jit;
+        JitCompileBlock(block, jit);
+        Verify(RunJitForTest(jit, inputs) == expected);
+    }
+    // a64 values spill to 8-byte slots.
+    for (uint reglimit : { 3u, 8u }) {
+        for (RegisterAllocator allocator : { RegisterAllocator_local, RegisterAllocator_linearScan }) {
+            Module m;
+            Block block;
+            IrBuilder b(m, block);
+            GenerateWideAddBlock(b, 12, 3, true);
+            std::vector<uint32_t> inputs(12 * 3 * 2);
+            for (uint i = 0; i < inputs.size(); ++i)
+                inputs[i] = i % 3 ? uint32_t(Avalanche(i)) : 0xFFFF'FFF0u + i % 7;
+            std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+            CompileOptions options;
+            options.reglimit = reglimit;
+            options.allocator = allocator;
+            CompileBlock(m, block, options);
+            Verify(reglimit != 3 || CountInstrs(block, Opcode_spill) != 0);
+            JitCode jit;
+            JitCompileBlock(block, jit);
+            Verify(RunJitForTest(jit, inputs) == expected);
+        }
+    }
+
+    // Globals live as long as the code and start at 0, the literal store is the C7 form with an immediate.
+    {
+        Module m;
+        const GlobalVariable* const count = m.AddGlobal("count");
+        const GlobalVariable* const total = m.AddGlobal("total");
+        const GlobalVariable* const flag = m.AddGlobal("flag");
+        Block block;
+        IrBuilder b(m, block);
+        BuildAccumulate(b, count, total);
+        b.StoreGlobal(flag, m.LiteralU32(0x8765'4321u));
+        b.Return();
+        CompileOptions options;
+        options.reglimit = 2;
+        CompileBlock(m, block, options);
+        JitCode jit;
+        JitCompileBlock(block, jit);
+        Verify(RunJitForTest(jit, { 5 }) == std::vector<uint32_t>({ 0 }));
+        Verify(RunJitForTest(jit, { 7 }) == std::vector<uint32_t>({ 5 }));
+        Verify(jit.globals[0] == 2 && jit.globals[1] == 12 && jit.globals[2] == 0x8765'4321u);
+    }
+
+    // Random blocks up to the 12 registers there are, with registers and spills of both classes.
+    for (uint reglimit : { 3u, 4u, 8u, 10u, 12u }) {
+        for (uint predlimit : { 0u, 2u }) {
+            if (reglimit + predlimit > countof(X64AllocatableRegs))
+                continue;
+            for (RegisterAllocator allocator : { RegisterAllocator_local, RegisterAllocator_linearScan }) {
+                for (uint seed = 0; seed < 5; ++seed) {
+                    Module m;
+                    Block block;
+                    IrBuilder b(m, block);
+                    std::vector<char> names;
+                    RandomBlockParams params = { 500, 16, 20, 10, 20, seed };
+                    params.recentWindow = reglimit + 4;
+                    params.cmpPercent = 15;
+                    GenerateRandomBlock(b, params, names);
+
+                    std::vector<uint32_t> inputs(params.numInputs);
+                    for (uint i = 0; i < params.numInputs; ++i)
+                        inputs[i] = uint32_t(Avalanche(seed * 100 + i)) % 8;
+                    std::vector<uint32_t> const expected = InterpretForTest(block, inputs, false);
+                    CompileOptions options;
+                    options.reglimit = reglimit;
+                    options.predlimit = predlimit;
+                    options.allocator = allocator;
+                    CompileBlock(m, block, options);
+                    JitCode jit;
+                    JitCompileBlock(block, jit);
+                    Verify(RunJitForTest(jit, inputs) == expected);
+                }
+            }
+        }
+    }
+}
+INVOKE_TEST(JitTest);
+
+#if defined __linux__
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// The object is linked with a C driver by the system compiler, which prints what the functions write.
+static void ElfObjectTest()
+{
+    Module m;
+    const GlobalVariable* const count = m.AddGlobal("tc_count");
+    const GlobalVariable* const total = m.AddGlobal("tc_total");
+    (void)m.AddGlobal("tc_unused");
+    Block blocks[5];
+    std::vector<char> names[3];
+    std::vector<uint32_t> inputs[5];
+    static const char* const functionNames[] = { "tc_accumulate", "tc_random0", "tc_random1", "tc_random2", "tc_wide" };
+    {
+        IrBuilder b(m, blocks[0]);
+        BuildAccumulate(b, count, total);
+        b.Return();
+    }
+    inputs[0] = { 5 };
+    for (uint i = 1; i < 4; ++i) {
+        IrBuilder b(m, blocks[i]);
+        RandomBlockParams params = { 300, 12, 20, 10, 20, i };
+        params.cmpPercent = 15;
+        GenerateRandomBlock(b, params, names[i - 1]);
+        for (uint j = 0; j < params.numInputs; ++j)
+            inputs[i].push_back(uint32_t(Avalanche(i * 100 + j)));
+    }
+    {
+        IrBuilder b(m, blocks[4]); // a64 values, spilled to 8-byte slots
+        GenerateWideAddBlock(b, 8, 3, true);
+        for (uint j = 0; j < 8 * 3 * 2; ++j)
+            inputs[4].push_back(j % 3 ? uint32_t(Avalanche(400 + j)) : 0xFFFF'FFF0u + j % 7);
+    }
+
+    // What the driver should print: each function called once, the accumulator again with 7, then the globals.
+    std::vector<std::vector<uint32_t>> expected;
+    for (uint i = 0; i < 5; ++i)
+        expected.push_back(InterpretForTest(blocks[i], inputs[i], false));
+    Verify(expected[0] == std::vector<uint32_t>({ 0 }));
+
+    ObjectFunction functions[5];
+    for (uint i = 0; i < 5; ++i) {
+        CompileOptions options;
+        options.reglimit = i < 4 ? 4 + i : 3;
+        options.predlimit = i % 2;
+        CompileBlock(m, blocks[i], options);
+        functions[i] = { functionNames[i], &blocks[i] };
+    }
+
+    if (system("cc --version > /dev/null 2>&1") != 0) {
+        puts("  no cc, skipping linking");
+        return;
+    }
+    char dir[] = "/tmp/tc_elf_test_XXXXXX";
+    Verify(mkdtemp(dir) != nullptr);
+    char objPath[64], fileObjPath[64], cPath[64], exePath[64];
+    snprintf(objPath, sizeof objPath, "%s/tc.o", dir);
+    snprintf(fileObjPath, sizeof fileObjPath, "%s/tc_file.o", dir);
+    snprintf(cPath, sizeof cPath, "%s/driver.c", dir);
+    snprintf(exePath, sizeof exePath, "%s/driver", dir);
+    {
+        int const fd = open(objPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        Verify(fd >= 0);
+        {
+            FileByteStream bs(fd, 256); // small so the writer crosses flushes
+            WriteElfObject(bs, m, { functions, countof(functions) });
+            Verify(bs.Flush());
+        }
+        Verify(close(fd) == 0);
+    }
+    // Same bytes through the exported writer.
+    Verify(WriteElfObjectFile(fileObjPath, m, { functions, countof(functions) }));
+    {
+        auto readAll = [](const char* path) {
+            std::vector<char> bytes;
+            FILE* const file = fopen(path, "rb");
+            Verify(file != nullptr);
+            for (int c; (c = fgetc(file)) != EOF;)
+                bytes.push_back(char(c));
+            fclose(file);
+            return bytes;
+        };
+        Verify(readAll(fileObjPath) == readAll(objPath));
+    }
+    Verify(!WriteElfObjectFile("/nonexistent_tc_dir/tc.o", m, { functions, countof(functions) }));
+    {
+        int const fd = open(cPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        Verify(fd >= 0);
+        {
+            FileByteStream bs(fd);
+            ByteStream_printf(bs, "#include <stdio.h>\n#include <stdint.h>\nextern uint32_t tc_count, tc_total, tc_unused;\n");
+            for (uint i = 0; i < 5; ++i)
+                ByteStream_printf(bs, "void %s(const void* input, void* output);\n", functionNames[i]);
+            ByteStream_printf(bs, "static void Call(void (*f)(const void*, void*), const uint32_t* in, uint32_t n)\n{\n");
+            ByteStream_printf(bs, "    uint32_t out[64] = { 0 };\n    f(in, out);\n");
+            ByteStream_printf(bs, "    for (uint32_t i = 0; i < n; ++i)\n        printf(\"%%u \", out[i]);\n    printf(\"\\n\");\n}\n");
+            ByteStream_printf(bs, "int main(void)\n{\n");
+            for (uint i = 0; i < 5; ++i) {
+                ByteStream_printf(bs, "    {\n        static const uint32_t in[] = { ");
+                for (uint32_t input : inputs[i])
+                    ByteStream_printf(bs, "%uu, ", input);
+                ByteStream_printf(bs, "};\n        Call(%s, in, %u);\n    }\n", functionNames[i], uint(inputs[i].size()));
+            }
+            ByteStream_printf(bs, "    {\n        static const uint32_t in[] = { 7 };\n        Call(%s, in, 1);\n    }\n", functionNames[0]);
+            ByteStream_printf(bs, "    printf(\"%%u %%u %%u\\n\", tc_count, tc_total, tc_unused);\n    return 0;\n}\n");
+            Verify(bs.Flush());
+        }
+        Verify(close(fd) == 0);
+    }
+
+    ubyte header[20];
+    {
+        int const fd = open(objPath, O_RDONLY);
+        Verify(fd >= 0 && read(fd, header, sizeof header) == sizeof header);
+        close(fd);
+    }
+    Verify(memcmp(header, "\x7F" "ELF\x02\x01\x01", 7) == 0 && header[16] == 1 && header[18] == 62);
+
+    char command[256];
+    snprintf(command, sizeof command, "cc -o %s %s %s", exePath, cPath, objPath);
+    Verify(system(command) == 0);
+    FILE* const pipe = popen(exePath, "r");
+    Verify(pipe != nullptr);
+    std::vector<char> actual;
+    for (int c; (c = fgetc(pipe)) != EOF;)
+        actual.push_back(char(c));
+    Verify(pclose(pipe) == 0);
+
+    expected.push_back({ 5 }); // the accumulator's old total the second time
+    expected.push_back({ 2, 12, 0 });
+    std::vector<char> expectedText;
+    for (const std::vector<uint32_t>& outputs : expected) {
+        for (uint32_t output : outputs) {
+            char buf[16];
+            int const n = snprintf(buf, sizeof buf, "%u ", output);
+            expectedText.insert(expectedText.end(), buf, buf + n);
+        }
+        if (&outputs == &expected.back())
+            expectedText.pop_back(); // the globals line has no trailing space
+        expectedText.push_back('\n');
+    }
+    Verify(actual == expectedText);
+    remove(objPath);
+    remove(fileObjPath);
+    remove(cPath);
+    remove(exePath);
+    Verify(rmdir(dir) == 0);
+}
+INVOKE_TEST(ElfObjectTest);
+#endif // __linux__
+#endif // TC_X64_JIT
+
+static void CfgTest()
+{
+    {
+        // entry -> merge is a critical edge: entry has two successors and merge has two predecessors.
+        Module m;
+        Function function;
+        Block& entry = *function.NewBlock();
+        Block& t = *function.NewBlock();
+        Block& merge = *function.NewBlock();
+        IrBuilder b(m, entry);
+        Value* const x = b.ReadTestInput(0, "x");
+        Value* const y = b.ReadTestInput(4, "y");
+        b.Branch(x, t, merge);
+        b.SetBlock(t);
+        b.WriteTestOutput(0, b.Iadd(x, y, "xy"));
+        b.Jump(merge);
+        b.SetBlock(merge);
+        b.WriteTestOutput(4, b.Iadd(x, m.LiteralU32(1), "x1"));
+        b.Return();
+
+        function.BuildCfg();
+        function.ComputeDominators();
+        Verify(function.blocks.size() == 4 && function.rpo.size() == 4);
+        Block& split = *function.blocks[3];
+        Verify(entry.succs[1] == &split && split.numSuccs == 1 && split.succs[0] == &merge);
+        Verify(merge.preds.size() == 2 && t.preds.size() == 1);
+        Verify(entry.rpoIndex == 0 && merge.rpoIndex == 3);
+        Verify(function.idoms[merge.rpoIndex] == entry.rpoIndex);
+        Verify(function.Dominates(entry.rpoIndex, t.rpoIndex) && !function.Dominates(t.rpoIndex, merge.rpoIndex));
+
+        Liveness liveness;
+        ComputeLiveness(function, liveness);
+        uint const xIndex = static_cast<Instruction*>(x)->instrIndexInBlock;
+        uint const yIndex = static_cast<Instruction*>(y)->instrIndexInBlock;
+        Verify(TestBit(liveness.LiveIn(t.rpoIndex), xIndex) && TestBit(liveness.LiveIn(t.rpoIndex), yIndex));
+        Verify(TestBit(liveness.LiveIn(merge.rpoIndex), xIndex) && !TestBit(liveness.LiveIn(merge.rpoIndex), yIndex));
+        Verify(TestBit(liveness.LiveOut(split.rpoIndex), xIndex) && !TestBit(liveness.LiveOut(merge.rpoIndex), xIndex));
+
+        for (uint32_t input : { 0u, 5u }) {
+            std::vector<uint32_t> const inputs = { input, 20 };
+            std::vector<uint32_t> const expected = InterpretForTest(entry, inputs, false);
+            Verify(expected[1] == input + 1 && expected[0] == (input ? input + 20 : 0));
+        }
+        CompileOptions options;
+        CompileFunction(m, function, options);
+        for (uint32_t input : { 0u, 5u }) {
+            std::vector<uint32_t> const inputs = { input, 20 };
+            Verify(InterpretForTest(entry, inputs, true) == std::vector<uint32_t>({ input ? input + 20 : 0, input + 1 }));
+        }
+    }
+    {
+        // A value defined before a loop and used in it is live around the back edge.
+        Module m;
+        Function function;
+        Block& entry = *function.NewBlock();
+        Block& header = *function.NewBlock();
+        Block& body = *function.NewBlock();
+        Block& exit = *function.NewBlock();
+        IrBuilder b(m, entry);
+        Value* const x = b.ReadTestInput(0, "x");
+        Value* const y = b.ReadTestInput(4, "y");
+        b.Jump(header);
+        b.SetBlock(header);
+        b.Branch(x, body, exit);
+        b.SetBlock(body);
+        b.WriteTestOutput(0, b.Iadd(y, m.LiteralU32(1), "y1"));
+        b.Jump(header);
+        b.SetBlock(exit);
+        b.WriteTestOutput(4, b.Iadd(x, y, "xy"));
+        b.Return();
+
+        function.BuildCfg();
+        function.ComputeDominators();
+        Verify(function.blocks.size() == 4);
+        Verify(header.preds.size() == 2 && function.idoms[exit.rpoIndex] == header.rpoIndex);
+        Verify(function.Dominates(header.rpoIndex, body.rpoIndex));
+        Liveness liveness;
+        ComputeLiveness(function, liveness);
+        uint const yIndex = static_cast<Instruction*>(y)->instrIndexInBlock;
+        Verify(TestBit(liveness.LiveOut(body.rpoIndex), yIndex) && TestBit(liveness.LiveIn(header.rpoIndex), yIndex));
+
+        CompileOptions options;
+        CompileFunction(m, function, options);
+        Verify(InterpretForTest(entry, { 0, 7 }, true) == std::vector<uint32_t>({ 0, 7 }));
+        Verify(InterpretForTest(entry, { 1, 7 }, true, 10) == std::vector<uint32_t>({ 8, 0 }));
+    }
+}
+INVOKE_TEST(CfgTest);
+
+static void GlobalRegAllocTest()
+{
+    size_t numFixups = 0;
+    for (uint seed = 0; seed < 60; ++seed) {
+        uint const reglimit = 2 + seed % 4;
+        Module m;
+        Function function;
+        IrBuilder b(m, *function.NewBlock());
+        std::vector<char> names;
+        RandomBlockParams params = { 6, 8, 30, 10, 20, seed };
+        params.recentWindow = reglimit * 2;
+        GenerateRandomFunction(b, function, params, 10 + seed % 30, names);
+        function.BuildCfg();
+
+        std::vector<uint32_t> inputs(params.numInputs);
+        for (uint i = 0; i < params.numInputs; ++i)
+            inputs[i] = uint32_t(Avalanche(seed * 100 + i)) % 3; // zero often, so both ways of branches run
+        std::vector<uint32_t> const expected = InterpretForTest(*function.blocks[0], inputs, false, 200);
+        size_t numInstrsBefore = 0;
+        for (const Block* block : function.rpo)
+            numInstrsBefore += block->instructions.size();
+
+        CompileOptions options;
+        options.reglimit = reglimit;
+        CompileFunction(m, function, options);
+        VerifyRegisterAllocation(function, reglimit);
+        Verify(InterpretForTest(*function.blocks[0], inputs, true, 200) == expected);
+        for (const Block* block : function.rpo)
+            numFixups += block->instructions.size();
+        numFixups -= numInstrsBefore;
+    }
+    Verify(numFixups != 0); // spill code was needed somewhere, so the test covers it
+}
+INVOKE_TEST(GlobalRegAllocTest);
+
+// Runs the ops on locations that start out holding their own key: every dst must get the key of its src,
+// registers that are needed but aren't a dst must keep theirs, and only dst slots and scratch can be written.
+static void RunParallelMovesForTest(std::vector<ParallelMove> moves, const std::vector<bool>& bRegNeeded,
+    uint& numSwaps, uint& numOps)
+{
+    auto key = [](MoveLoc loc) { return uint64_t(loc.kind) << 32 | loc.index; };
+    std::vector<ParallelMove> const original = moves;
+    std::vector<MoveOp> ops;
+    SequentializeParallelMoves(moves, bRegNeeded, ops);
+
+    std::unordered_map<uint64_t, uint64_t> holds;
+    auto get = [&](MoveLoc loc) {
+        auto const it = holds.find(key(loc));
+        return it != holds.end() ? it->second : key(loc);
+    };
+    auto isDst = [&](MoveLoc loc) {
+        return std::any_of(original.begin(), original.end(), [&](const ParallelMove& m) { return m.dst == loc; });
+    };
+    numSwaps = 0;
+    for (const MoveOp& op : ops) {
+        Verify(op.dst.kind != MoveLoc::Literal);
+        Verify(op.dst.kind != MoveLoc::Slot || isDst(op.dst));
+        if (op.bSwap) {
+            Verify(op.dst.IsReg() && op.src.IsReg());
+            uint64_t const d = get(op.dst);
+            holds[key(op.dst)] = get(op.src);
+            holds[key(op.src)] = d;
+            numSwaps++;
+        }
+        else {
+            Verify(op.dst.IsReg() || op.src.IsReg());
+            holds[key(op.dst)] = get(op.src);
+        }
+    }
+    for (const ParallelMove& m : original)
+        Verify(get(m.dst) == key(m.src));
+    for (uint r = 0; r < bRegNeeded.size(); ++r) {
+        MoveLoc const reg = { MoveLoc::Reg, r };
+        Verify(!bRegNeeded[r] || isDst(reg) || get(reg) == key(reg));
+    }
+    numOps = uint(ops.size());
+}
+
+static void SequentializeParallelMovesTest()
+{
+    MoveLoc const r0 = { MoveLoc::Reg, 0 }, r1 = { MoveLoc::Reg, 1 }, r2 = { MoveLoc::Reg, 2 };
+    MoveLoc const s0 = { MoveLoc::Slot, 0 }, s1 = { MoveLoc::Slot, 1 };
+    uint numSwaps, numOps;
+
+    // A cycle of 3 registers takes 2 swaps.
+    RunParallelMovesForTest({ { r0, r1 }, { r1, r2 }, { r2, r0 } }, { true, true, true }, numSwaps, numOps);
+    Verify(numSwaps == 2 && numOps == 2);
+    // A chain with a fan-out and a literal is one op per move.
+    RunParallelMovesForTest({ { r0, r1 }, { r1, s0 }, { s1, r1 }, { r2, { MoveLoc::Literal, 0 } } },
+                            { true, true, true, false }, numSwaps, numOps);
+    Verify(numSwaps == 0 && numOps == 4);
+    // A register and a slot trading places go through a free register.
+    RunParallelMovesForTest({ { r0, s0 }, { s0, r0 } }, { true, false }, numSwaps, numOps);
+    Verify(numOps == 3);
+    // Without one, they go through scratch slots.
+    RunParallelMovesForTest({ { r0, s0 }, { s0, r0 } }, { true }, numSwaps, numOps);
+    RunParallelMovesForTest({ { s1, s0 }, { s0, s1 } }, { true }, numSwaps, numOps);
+
+    MoveLoc locs[8];
+    for (uint i = 0; i < 3; ++i) {
+        locs[i] = { MoveLoc::Reg, i };
+        locs[3 + i] = { MoveLoc::Slot, i };
+    }
+    locs[6] = { MoveLoc::Literal, 0 };
+    locs[7] = { MoveLoc::Literal, 1 };
+    for (uint seed = 0; seed < 2000; ++seed) {
+        uint64_t const r = Avalanche(seed);
+        std::vector<ParallelMove> moves;
+        std::vector<bool> bRegNeeded(3);
+        for (uint i = 0; i < 6; ++i) {
+            if ((r >> (i * 5)) & 1)
+                moves.push_back({ locs[i], locs[(r >> (i * 5 + 1)) % 8] });
+            if (i < 3)
+                bRegNeeded[i] = ((r >> (i * 5)) & 1) || ((r >> (40 + i)) & 1);
+        }
+        RunParallelMovesForTest(moves, bRegNeeded, numSwaps, numOps);
+    }
+}
+INVOKE_TEST(SequentializeParallelMovesTest);
+
+static void BlockParameterTest()
+{
+    // Each time around, the loop swaps x and y and counts i down from 3.
+    for (uint reglimit = 2; reglimit <= 4; ++reglimit) {
+        Module m;
+        Function function;
+        Block& entry = *function.NewBlock();
+        Block& header = *function.NewBlock();
+        Block& body = *function.NewBlock();
+        Block& exit = *function.NewBlock();
+        Value* const x = header.AddParam(Ir_a32, "x");
+        Value* const y = header.AddParam(Ir_a32, "y");
+        Value* const i = header.AddParam(Ir_a32, "i");
+        IrBuilder b(m, entry);
+        b.Jump(header, { b.ReadTestInput(0, "a"), b.ReadTestInput(4, "b"), m.LiteralU32(3) });
+        b.SetBlock(header);
+        b.Branch(i, body, exit);
+        b.SetBlock(body);
+        b.WriteTestOutput(8, b.Iadd(x, i, "xi"));
+        b.Jump(header, { y, x, b.Iadd(i, m.LiteralU32(uint32_t(-1)), "i1") });
+        b.SetBlock(exit);
+        b.WriteTestOutput(0, x);
+        b.WriteTestOutput(4, y);
+        b.Return();
+
+        function.BuildCfg();
+        std::vector<uint32_t> const inputs = { 10, 20, 0 };
+        std::vector<uint32_t> const expected = InterpretForTest(entry, inputs, false);
+        Verify(expected == std::vector<uint32_t>({ 20, 10, 11 }));
+        CompileOptions options;
+        options.reglimit = reglimit;
+        CompileFunction(m, function, options);
+        Verify(InterpretForTest(entry, inputs, true) == expected);
+        if (reglimit >= 4) {
+            // x, y, i and xi fit, x and y trade registers and i1 is where i was, so the back edge is one swap.
+            Verify(CountInstrs(body, Opcode_swap) == 1 && CountInstrs(body, Opcode_move) == 0);
+            Verify(CountInstrs(body, Opcode_spill) == 0 && CountInstrs(body, Opcode_load_spilled) == 0);
+        }
+    }
+}
+INVOKE_TEST(BlockParameterTest);
+
+// Random blocks, with a data-parallel one now and then so SLP allocates names, all compiled serially if numThreads
+// is 0. Returns each block printed with its registers.
+static std::vector<std::vector<ubyte>> CompileBlocksForTest(uint numBlocks, uint numThreads)
+{
+    Module m;
+    Function storage; // owns the blocks, they aren't connected
+    std::vector<std::vector<char>> names(numBlocks);
+    std::vector<Block*> blocks;
+    for (uint i = 0; i < numBlocks; ++i) {
+        IrBuilder b(m, *storage.NewBlock());
+        if (i % 10 == 3) {
+            GenerateDataParallelBlock(b, 8 + i % 5, 3);
+        }
+        else {
+            RandomBlockParams params = { 50 + i % 7 * 40, 8, 20, 20, 30, i };
+            params.cmpPercent = 10;
+            GenerateRandomBlock(b, params, names[i]);
+        }
+        blocks.push_back(b.block);
+    }
+    CompileOptions options;
+    options.reglimit = 4;
+    options.veclimit = 2;
+    options.bVectorize = true;
+    if (numThreads == 0) {
+        for (Block* block : blocks)
+            CompileBlock(m, *block, options);
+    }
+    else {
+        WorkStealingPool pool(numThreads);
+        CompileBlocksParallel(m, { blocks.data(), numBlocks }, options, pool);
+    }
+
+    std::vector<std::vector<ubyte>> printed(numBlocks);
+    std::vector<ubyte> streambuf(1u << 18);
+    for (uint i = 0; i < numBlocks; ++i) {
+        FixedBufferByteStream bs(streambuf.data(), uint32_t(streambuf.size()));
+        PrintContext ctx = { };
+        ctx.bPrintRegs = true;
+        PrintBlock(ctx, bs, *blocks[i], 0);
+        Verify(!bs.Overflowed());
+        printed[i].assign(streambuf.data(), streambuf.data() + bs.WrappedSize());
+    }
+    return printed;
+}
+
+// Random functions compiled serially if numThreads is 0, each printed with its registers.
+static std::vector<std::vector<ubyte>> CompileFunctionsForTest(uint numFunctions, uint numThreads)
+{
+    Module m;
+    std::vector<std::unique_ptr<Function>> storage;
+    std::vector<std::vector<char>> names(numFunctions);
+    std::vector<Function*> functions;
+    for (uint i = 0; i < numFunctions; ++i) {
+        storage.emplace_back(new Function());
+        Function& function = *storage.back();
+        IrBuilder b(m, *function.NewBlock());
+        RandomBlockParams params = { 6, 8, 30, 10, 20, i };
+        params.recentWindow = 6;
+        GenerateRandomFunction(b, function, params, 5 + i % 20, names[i]);
+        functions.push_back(&function);
+    }
+    CompileOptions options;
+    options.reglimit = 3;
+    if (numThreads == 0) {
+        for (Function* function : functions)
+            CompileFunction(m, *function, options);
+    }
+    else {
+        WorkStealingPool pool(numThreads);
+        CompileFunctionsParallel(m, { functions.data(), numFunctions }, options, pool);
+    }
+
+    std::vector<std::vector<ubyte>> printed(numFunctions);
+    std::vector<ubyte> streambuf(1u << 18);
+    for (uint i = 0; i < numFunctions; ++i) {
+        FixedBufferByteStream bs(streambuf.data(), uint32_t(streambuf.size()));
+        PrintContext ctx = { };
+        ctx.bPrintRegs = true;
+        PrintFunction(ctx, bs, *functions[i], 0);
+        Verify(!bs.Overflowed());
+        printed[i].assign(streambuf.data(), streambuf.data() + bs.WrappedSize());
+    }
+    return printed;
+}
+
+static void ParallelCompileTest()
+{
+    // Every index exactly once, on a worker no other call is using at the time. The work is uneven so threads
+    // steal, and each pool runs several loops.
+    for (uint numThreads : { 1u, 2u, 3u, 8u }) {
+        WorkStealingPool pool(numThreads);
+        Verify(pool.NumThreads() == numThreads);
+        for (uint count : { 0u, 1u, 5u, 1000u }) {
+            std::vector<std::atomic<uint>> calls(count);
+            std::vector<uint32_t> results(count);
+            std::vector<std::atomic<bool>> busy(numThreads);
+            std::atomic<uint> numOverlaps(0);
+            pool.ParallelFor(count, [&](size_t i, uint worker) {
+                Verify(worker < numThreads);
+                numOverlaps += busy[worker].exchange(true);
+                uint32_t x = uint32_t(i);
+                for (uint j = 0; j < (i % 7 == 0 ? 20'000u : 10u); ++j)
+                    x = Avalanche(x);
+                results[i] = x;
+                calls[i]++;
+                busy[worker] = false;
+            });
+            Verify(numOverlaps == 0);
+            for (const std::atomic<uint>& n : calls)
+                Verify(n == 1);
+        }
+    }
+
+    // Interning from many threads gives one literal per value.
+    {
+        Module m;
+        WorkStealingPool pool(8);
+        std::vector<const LiteralValue*> literals(4000);
+        pool.ParallelFor(literals.size(), [&](size_t i, uint) {
+            literals[i] = i % 2 ? m.LiteralU64(uint64_t(i % 200) << 32) : m.LiteralU32(uint32_t(i % 200));
+        });
+        for (uint i = 0; i < literals.size(); ++i)
+            Verify(literals[i] == (i % 2 ? m.LiteralU64(uint64_t(i % 200) << 32) : m.LiteralU32(i % 200)));
+    }
+
+    // The same blocks whatever the number of threads.
+    std::vector<std::vector<ubyte>> const serial = CompileBlocksForTest(200, 0);
+    for (uint numThreads : { 1u, 2u, 5u, 16u })
+        Verify(CompileBlocksForTest(200, numThreads) == serial);
+
+    // And the same functions.
+    std::vector<std::vector<ubyte>> const serialFunctions = CompileFunctionsForTest(60, 0);
+    for (uint numThreads : { 1u, 2u, 5u, 16u })
+        Verify(CompileFunctionsForTest(60, numThreads) == serialFunctions);
+}
+INVOKE_TEST(ParallelCompileTest);
+
+// Writes the blocks to an 8-byte aligned buffer.
+static std::vector<uint64_t> WriteBinaryIrForTest(view<Block* const> blocks, uint flags)
+{
+    std::vector<uint64_t> buffer(1u << 18);
+    FixedBufferByteStream bs(reinterpret_cast<ubyte*>(buffer.data()), uint32_t(buffer.size() * 8));
+    WriteBinaryIr(bs, blocks, flags);
+    Verify(!bs.Overflowed());
+    buffer.resize(bs.WrappedSize() / 8);
+    return buffer;
+}
+
+static void BinaryIrTest()
+{
+    auto print = [](const Block& block, bool bRegs) {
+        std::vector<ubyte> streambuf(1u << 17);
+        FixedBufferByteStream bs(streambuf.data(), uint32_t(streambuf.size()));
+        PrintContext ctx = { };
+        ctx.bPrintRegs = bRegs;
+        PrintBlock(ctx, bs, block, 0);
+        Verify(!bs.Overflowed());
+        return std::vector<ubyte>(streambuf.data(), streambuf.data() + bs.WrappedSize());
+    };
+
+    // Random blocks, a vectorized one, and one with a64 values and globals, before and after RA.
+    for (uint bCompiled = 0; bCompiled < 2; ++bCompiled) {
+        Module m;
+        m.AddGlobal("g");
+        Function storage;
+        std::vector<std::vector<char>> names(8);
+        std::vector<Block*> blocks;
+        for (uint i = 0; i < 8; ++i) {
+            IrBuilder b(m, *storage.NewBlock());
+            if (i == 6) {
+                GenerateDataParallelBlock(b, 12, 3); // a tree of 8 and one of 4
+            }
+            else if (i == 7) {
+                b.StoreGlobal(m.globals[0], b.Iadd(b.LoadGlobal(m.globals[0], "g"), m.LiteralU32(1), "g1"));
+                GenerateWideAddBlock(b, 6, 3, true);
+            }
+            else {
+                RandomBlockParams params = { 50 + i * 60, 8, 20, 20, 30, i };
+                params.cmpPercent = 10;
+                GenerateRandomBlock(b, params, names[i]);
+            }
+            if (bCompiled) {
+                CompileOptions options;
+                options.reglimit = 3;
+                options.veclimit = 2;
+                options.bVectorize = true;
+                options.vecLanes = 8;
+                CompileBlock(m, *b.block, options);
+            }
+            blocks.push_back(b.block);
+        }
+        uint const flags = BinaryIr_names | (bCompiled ? BinaryIr_regs : 0);
+        std::vector<uint64_t> const buffer = WriteBinaryIrForTest({ blocks.data(), uint(blocks.size()) }, flags);
+
+        BinaryIrView ir;
+        Verify(ir.Open(buffer.data(), buffer.size() * 8) && ir.Validate());
+        Verify(ir.header.numBlocks == blocks.size() && (ir.restores != nullptr) == (bCompiled != 0));
+        // Walked in place: the same instructions, and each literal once.
+        uint numInstrs = 0, numIadds = 0;
+        std::unordered_set<const Value*> literals;
+        for (const Block* block : blocks) {
+            numInstrs += uint(block->instructions.size());
+            numIadds += CountInstrs(*block, Opcode_iadd);
+            for (const Instruction* instr : block->instructions) {
+                for (const Value* operand : instr->Operands()) {
+                    if (IsLiteral(operand))
+                        literals.insert(operand);
+                }
+            }
+        }
+        Verify(ir.header.numInstrs == numInstrs && ir.header.numLiterals == literals.size());
+        Verify(uint(std::count(ir.opcodes, ir.opcodes + numInstrs, Opcode_iadd)) == numIadds);
+
+        // Loaded into another module, the blocks print and run the same.
+        Module m2;
+        m2.AddGlobal("g");
+        BinaryIrLoader loader(ir, m2);
+        std::vector<uint32_t> inputs(64);
+        for (uint i = 0; i < inputs.size(); ++i)
+            inputs[i] = uint32_t(Avalanche(i));
+        for (uint i = 0; i < blocks.size(); ++i) {
+            Block block;
+            loader.LoadBlock(i, block);
+            Verify(print(block, bCompiled != 0) == print(*blocks[i], bCompiled != 0));
+            Verify(InterpretForTest(block, inputs, bCompiled != 0) == InterpretForTest(*blocks[i], inputs, bCompiled != 0));
+            if (bCompiled)
+                VerifyRegisterAllocation(block, 3, 0, 2);
+        }
+        // Loading again, the literals are the module's, not new ones.
+        Block again;
+        BinaryIrLoader(ir, m2).LoadBlock(7, again);
+        Verify(again.instructions[1]->Operand(1) == m2.LiteralU32(1));
+    }
+
+    // Without names, and damaged buffers.
+    {
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        Value* const x = b.ReadTestInput(0, "x");
+        b.WriteTestOutput(0, b.Iadd(x, b.Iadd(x, m.LiteralU32(7), "x7"), "y"));
+        b.Return();
+        Block* const blocks[] = { &block };
+        std::vector<uint64_t> const buffer = WriteBinaryIrForTest({ blocks, 1 }, 0);
+        BinaryIrView ir;
+        Verify(ir.Open(buffer.data(), buffer.size() * 8) && ir.Validate() && ir.names == nullptr);
+        Module m2;
+        Block loaded;
+        BinaryIrLoader(ir, m2).LoadBlock(0, loaded);
+        Verify(loaded.instructions[1]->debugName == nullptr);
+        Verify(InterpretForTest(loaded, { 5 }, false) == std::vector<uint32_t>({ 17 }));
+
+        Verify(!ir.Open(buffer.data(), buffer.size() * 8 - 8)); // cut short
+        std::vector<uint64_t> damaged = buffer;
+        reinterpret_cast<uint32_t*>(reinterpret_cast<ubyte*>(damaged.data()) + ir.header.operands)[0] = 1; // forward
+        Verify(ir.Open(damaged.data(), damaged.size() * 8) && !ir.Validate());
+        damaged = buffer;
+        reinterpret_cast<ubyte*>(damaged.data())[ir.header.typekinds] = 200;
+        Verify(ir.Open(damaged.data(), damaged.size() * 8) && !ir.Validate());
+        damaged = buffer;
+        damaged[0] ^= 1; // magic
+        Verify(!ir.Open(damaged.data(), damaged.size() * 8));
+
+        // Operands an opcode doesn't take, though every ref is in range: x = read_test_input(0), x7 = iadd(x, 7),
+        // y = iadd(x, x7), write_test_output(0, y), return, and the operand of write_test_output's offset is the 6th.
+        Verify(ir.Open(buffer.data(), buffer.size() * 8));
+        auto opcodeAt = [&](std::vector<uint64_t>& d, uint i) -> Opcode& {
+            return reinterpret_cast<Opcode*>(reinterpret_cast<ubyte*>(d.data()) + ir.header.opcodes)[i];
+        };
+        auto operandAt = [&](std::vector<uint64_t>& d, uint j) -> uint32_t& {
+            return reinterpret_cast<uint32_t*>(reinterpret_cast<ubyte*>(d.data()) + ir.header.operands)[j];
+        };
+        auto isRejected = [](std::vector<uint64_t>& d) {
+            BinaryIrView view;
+            return view.Open(d.data(), d.size() * 8) && !view.Validate();
+        };
+        damaged = buffer;
+        opcodeAt(damaged, 0) = Opcode_load_global; // no operands, x7 takes the offset as a third
+        reinterpret_cast<uint32_t*>(reinterpret_cast<ubyte*>(damaged.data()) + ir.header.operandEnds)[0] = 0;
+        Verify(isRejected(damaged));
+        damaged = buffer;
+        opcodeAt(damaged, 3) = Opcode_load_global; // two operands
+        Verify(isRejected(damaged));
+        damaged = buffer;
+        opcodeAt(damaged, 1) = Opcode_store_global; // an instruction for the global index
+        Verify(isRejected(damaged));
+        damaged = buffer;
+        operandAt(damaged, 5) = 2; // an instruction for the offset
+        Verify(isRejected(damaged));
+        opcodeAt(damaged, 3) = Opcode_spill; // and for the slot
+        Verify(isRejected(damaged));
+        damaged = buffer;
+        opcodeAt(damaged, 2) = Opcode_load_spilled;
+        Verify(isRejected(damaged));
+        damaged = buffer;
+        reinterpret_cast<IrTypekind*>(reinterpret_cast<ubyte*>(damaged.data()) + ir.header.typekinds)[2] = Ir_bool;
+        Verify(isRejected(damaged));
+        damaged = buffer;
+        uint const lit7 = uint(std::find(ir.literalValues, ir.literalValues + ir.header.numLiterals, 7) - ir.literalValues);
+        Verify(lit7 < ir.header.numLiterals);
+        reinterpret_cast<IrTypekind*>(reinterpret_cast<ubyte*>(damaged.data()) + ir.header.literalTypekinds)[lit7] = Ir_a64;
+        Verify(isRejected(damaged));
+        damaged = buffer;
+        opcodeAt(damaged, 0) = Opcode_load_global; // well formed, the loader checks the index
+        BinaryIrView view;
+        Verify(view.Open(damaged.data(), damaged.size() * 8) && view.Validate());
+    }
+}
+INVOKE_TEST(BinaryIrTest);
+
+static void IrTextParserTest()
+{
+    auto print = [](const Block& block, bool bRegs, std::vector<char>& text) {
+        std::vector<ubyte> streambuf(1u << 17);
+        FixedBufferByteStream bs(streambuf.data(), uint32_t(streambuf.size()));
+        PrintContext ctx = { };
+        ctx.bPrintRegs = bRegs;
+        PrintBlock(ctx, bs, block, 4);
+        Verify(!bs.Overflowed());
+        text.insert(text.end(), streambuf.data(), streambuf.data() + bs.WrappedSize());
+    };
+
+    // Random blocks, a vectorized one, and one with a64 values and globals, printed one after another: before RA
+    // without and with (unassigned) registers, and after RA. Each parsed block prints and runs the same, and after
+    // RA the registers check out, which needs operands to be the original values and reloads to restore them.
+    for (uint pass = 0; pass < 3; ++pass) {
+        bool const bCompiled = pass == 2, bRegs = pass != 0;
+        Module m;
+        m.AddGlobal("g");
+        Function storage;
+        std::vector<std::vector<char>> names(8);
+        std::vector<Block*> blocks;
+        std::vector<char> text;
+        for (uint i = 0; i < 8; ++i) {
+            IrBuilder b(m, *storage.NewBlock());
+            if (i == 6) {
+                GenerateDataParallelBlock(b, 12, 3); // a tree of 8 and one of 4
+            }
+            else if (i == 7) {
+                b.StoreGlobal(m.globals[0], b.Iadd(b.LoadGlobal(m.globals[0], "g"), m.LiteralU32(1), "g1"));
+                GenerateWideAddBlock(b, 6, 3, true);
+            }
+            else {
+                RandomBlockParams params = { 50 + i * 60, 8, 20, 20, 30, i };
+                params.cmpPercent = 10;
+                GenerateRandomBlock(b, params, names[i]);
+            }
+            if (bCompiled) {
+                CompileOptions options;
+                options.reglimit = 3;
+                options.veclimit = 2;
+                options.bVectorize = true;
+                options.vecLanes = 8;
+                options.bRematerialize = true;
+                CompileBlock(m, *b.block, options);
+            }
+            blocks.push_back(b.block);
+            print(*b.block, bRegs, text);
+        }
+        text.push_back('\0');
+
+        Module m2;
+        m2.AddGlobal("g");
+        Function parsed;
+        IrTextParser parser(m2, { text.data(), uint(text.size() - 1) });
+        std::vector<uint32_t> inputs(64);
+        for (uint i = 0; i < inputs.size(); ++i)
+            inputs[i] = uint32_t(Avalanche(i));
+        for (uint i = 0; i < blocks.size(); ++i) {
+            Verify(!parser.AtEnd());
+            Block& block = *parsed.NewBlock();
+            parser.ParseBlock(block);
+            std::vector<char> expected, got;
+            print(*blocks[i], bRegs, expected);
+            print(block, bRegs, got);
+            Verify(got == expected);
+            if (i >= 6)
+                continue; // their names repeat, so the text means something else
+            Verify(InterpretForTest(block, inputs, bCompiled) == InterpretForTest(*blocks[i], inputs, bCompiled));
+            if (bCompiled)
+                VerifyRegisterAllocation(block, 3, 0, 2);
+        }
+        Verify(parser.AtEnd());
+    }
+
+    // Literals at the ends of their ranges, comments, globals, and a name defined twice before RA.
+    {
+        char const text[] = R"(
+            dword g = load_global(1);
+            store_global(0, g);
+            dword x = read_test_input(0);
+            qword y = read_test_input(4);
+            // the lowest a64, and the same literal written unsigned
+            qword y = iadd(y, -9223372036854775808_q);
+            qword z = iadd(y, 9223372036854775808_q);
+            dword x = iadd(x, -2147483648);
+            dword w = iadd(x, 4294967295);
+            bool c = icmp_ult(x, w);
+            dword s = select(c, x, -1);
+            dword t = select(true, s, 7);
+            write_test_output(0, x);
+            write_test_output(4, t);
+            write_test_output(8, z);
+            return;
+        )";
+        Module m;
+        m.AddGlobal("g0");
+        m.AddGlobal("g1");
+        Block block;
+        IrTextParser parser(m, { text, uint(sizeof text - 1) });
+        parser.ParseBlock(block);
+        Verify(parser.AtEnd() && block.instructions.size() == 15);
+        std::vector<Instruction*> const& instrs = block.instructions;
+        Verify(instrs[4]->Operand(1) == m.LiteralU64(uint64_t(1) << 63));
+        Verify(instrs[5]->Operand(1) == instrs[4]->Operand(1));
+        Verify(instrs[6]->Operand(0) == instrs[2]);
+        Verify(instrs[7]->Operand(0) == instrs[6]); // the second x
+        Verify(instrs[3]->uses.size() == 1 && instrs[6]->uses.size() == 4);
+        uint32_t const x = 5, yLo = 0, yHi = 0x1234;
+        std::vector<uint32_t> const out = InterpretForTest(block, { x, yLo, yHi, 0 }, false);
+        Verify(out == std::vector<uint32_t>({ x + 0x8000'0000u, 0xFFFF'FFFFu, yLo, yHi })); // w is x - 1, so s is -1
+    }
+}
+INVOKE_TEST(IrTextParserTest);
+
+#if !defined _WIN32 // the directory is made and cleaned up with POSIX calls
+static void CompileCacheTest()
+{
+    char dir[] = "/tmp/tc_cache_test_XXXXXX";
+    Verify(mkdtemp(dir) != nullptr);
+    CompileCache const cache(dir);
+    std::vector<uint64_t> keys;
+
+    // Random blocks, a vectorized one, and one with a64 values and globals, each compiled on a miss, then rebuilt
+    // from the file on a hit. The source is the block's text before compiling.
+    for (uint kind = 0; kind < 6; ++kind) {
+        auto build = [kind](Block& block, Module& m, std::vector<char>& names) {
+            IrBuilder b(m, block);
+            if (kind == 4) {
+                GenerateDataParallelBlock(b, 12, 3);
+            }
+            else if (kind == 5) {
+                b.StoreGlobal(m.globals[1], b.Iadd(b.LoadGlobal(m.globals[1], "g"), m.LiteralU32(1), "g1"));
+                GenerateWideAddBlock(b, 6, 3, true);
+            }
+            else {
+                RandomBlockParams params = { 100 + kind * 150, 8, 20, 20, 30, kind };
+                params.cmpPercent = 10;
+                GenerateRandomBlock(b, params, names);
+            }
+        };
+        std::vector<char> names;
+        std::vector<ubyte> source(1u << 16);
+        uint32_t sourceSize;
+        {
+            Module m;
+            m.AddGlobal("g0");
+            m.AddGlobal("g1");
+            Block block;
+            build(block, m, names);
+            FixedBufferByteStream bs(source.data(), uint32_t(source.size()));
+            PrintContext ctx = { };
+            PrintBlock(ctx, bs, block, 0);
+            Verify(!bs.Overflowed());
+            sourceSize = bs.WrappedSize();
+        }
+        view<const ubyte> const sourceView = { source.data(), sourceSize };
+        CompileOptions options;
+        options.reglimit = 3;
+        options.veclimit = 2;
+        options.bVectorize = kind == 4;
+        options.vecLanes = 8;
+
+        std::vector<uint32_t> inputs(64);
+        for (uint i = 0; i < inputs.size(); ++i)
+            inputs[i] = uint32_t(Avalanche(i + kind));
+        std::vector<ubyte> printed[2];
+        std::vector<uint32_t> outputs[2];
+        for (uint bHit = 0; bHit < 2; ++bHit) {
+            Module m;
+            m.AddGlobal("g0");
+            m.AddGlobal("g1");
+            Block block;
+            uint numBuilds = 0;
+            Verify(CompileBlockCached(cache, sourceView, m, block, options, [&](Block& b) {
+                build(b, m, names);
+                numBuilds++;
+            }) == (bHit != 0));
+            Verify(numBuilds == !bHit);
+            VerifyRegisterAllocation(block, options.reglimit, options.predlimit, options.veclimit);
+            outputs[bHit] = InterpretForTest(block, inputs, true);
+            std::vector<ubyte> streambuf(1u << 17);
+            FixedBufferByteStream bs(streambuf.data(), uint32_t(streambuf.size()));
+            PrintContext ctx = { };
+            ctx.bPrintRegs = true;
+            PrintBlock(ctx, bs, block, 0);
+            Verify(!bs.Overflowed());
+            printed[bHit].assign(streambuf.data(), streambuf.data() + bs.WrappedSize());
+        }
+        Verify(printed[0] == printed[1] && outputs[0] == outputs[1]);
+        keys.push_back(CompileCache::Key(sourceView, options));
+
+        // The block with globals is a miss in a module without g1.
+        if (kind == 5) {
+            Module m;
+            m.AddGlobal("g0");
+            Block block;
+            Verify(!cache.Lookup(keys.back(), m, block) && block.instructions.empty());
+        }
+
+        // Other options are another key.
+        CompileOptions other = options;
+        other.reglimit = 4;
+        Verify(CompileCache::Key(sourceView, other) != keys.back());
+        Module m;
+        Block block;
+        Verify(!cache.Lookup(CompileCache::Key(sourceView, other), m, block) && block.instructions.empty());
+    }
+
+    // A file cut short, or of another key, is a miss that leaves the block empty, and storing replaces it.
+    {
+        char path[512], otherPath[512];
+        cache.PathOf(path, keys[0], ".tcc");
+        cache.PathOf(otherPath, keys[1], ".tcc");
+        Verify(truncate(path, 40) == 0);
+        Module m;
+        m.AddGlobal("g0");
+        m.AddGlobal("g1");
+        Block block;
+        Verify(!cache.Lookup(keys[0], m, block) && block.instructions.empty());
+        Verify(rename(otherPath, path) == 0);
+        Verify(!cache.Lookup(keys[0], m, block) && block.instructions.empty());
+        Block stored;
+        IrBuilder b(m, stored);
+        b.WriteTestOutput(0, b.Iadd(b.ReadTestInput(0, "x"), m.LiteralU32(5), "x5"));
+        b.Return();
+        CompileBlock(m, stored, CompileOptions());
+        Verify(cache.Store(keys[0], stored));
+        Verify(cache.Lookup(keys[0], m, block) && block.instructions.size() == stored.instructions.size());
+        Verify(InterpretForTest(block, { 10 }, true) == std::vector<uint32_t>({ 15 }));
+        keys.erase(keys.begin() + 1);
+    }
+
+    for (uint64_t key : keys) {
+        char path[512];
+        cache.PathOf(path, key, ".tcc");
+        Verify(unlink(path) == 0);
+    }
+    Verify(rmdir(dir) == 0); // fails if a temporary file was left
+}
+INVOKE_TEST(CompileCacheTest);
+#endif
+#endif
+
+#if BUILD_BENCHMARKS
+// Timings vary a lot from one run to the next, so the allocator comparisons time each case a few times and print
+// the fastest and the median run, scaled. Sorts ns.
+static void MinAndMedian(std::vector<uint64_t>& ns, double scale, double& min, double& median)
+{
+    std::sort(ns.begin(), ns.end());
+    min = double(ns.front()) * scale;
+    median = double(ns[ns.size() / 2]) * scale;
+}
+
+static void IrBuilderFoldBenchmark()
+{
+    for (uint literalPercent : { 0u, 25u, 50u, 75u }) {
+        for (bool bFold : { false, true }) {
+            Module m;
+            Block block;
+            IrBuilder b(m, block);
+            b.bFold = bFold;
+            std::vector<char> names;
+            RandomBlockParams const params = { 1'000'000, 64, literalPercent, 10, 20, 1 };
+
+            uint64_t const t0 = BenchNowNs();
+            GenerateRandomBlock(b, params, names);
+            uint64_t const t1 = BenchNowNs();
+
+            uint numWithoutUses = 0;
+            for (const Instruction* instr : block.instructions)
+                numWithoutUses += (instr->typekind != Ir_void && instr->uses.empty());
+            printf("  literals %2u%% fold=%d: %7u instrs (%7u iadd, %7u without uses), build %6.1f ms\n",
+                   literalPercent, int(bFold), uint(block.instructions.size()), CountInstrs(block, Opcode_iadd),
+                   numWithoutUses, (t1 - t0) * 1e-6);
+        }
+    }
+}
+INVOKE_BENCHMARK(IrBuilderFoldBenchmark);
+
+static void EliminateDeadCodeBenchmark()
+{
+    {
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        std::vector<char> names;
+        RandomBlockParams const params = { 1'000'000, 1u << 16, 25, 10, 20, 1 };
+        GenerateRandomBlock(b, params, names);
+        size_t const numBefore = block.instructions.size();
+        uint64_t const t0 = BenchNowNs();
+        OptimizeStats const stats = EliminateDeadCodeAndRedundantTestIo(block);
+        uint64_t const t1 = BenchNowNs();
+        printf("  %zu instrs: removed %u (%u forwarded reads, %u dead writes) in %.1f ms, %.2f ns/instr\n",
+               numBefore, stats.numDeadInstrs, stats.numForwardedReads, stats.numDeadWrites,
+               (t1 - t0) * 1e-6, double(t1 - t0) / double(numBefore));
+    }
+
+    for (uint reglimit : { 4u, 8u, 16u }) {
+        size_t instrs[2] = {}, spills[2] = {}, reloads[2] = {};
+        for (uint seed = 0; seed < 2000; ++seed) {
+            for (uint optimize = 0; optimize < 2; ++optimize) {
+                Module m;
+                Block block;
+                IrBuilder b(m, block);
+                std::vector<char> names;
+                RandomBlockParams const params = { 60, 16, 25, 15, 25, seed };
+                GenerateRandomBlock(b, params, names);
+                if (optimize)
+                    EliminateDeadCodeAndRedundantTestIo(block);
+                instrs[optimize] += block.instructions.size();
+                LocalRegisterAllocation(m, block, reglimit);
+                spills[optimize] += CountInstrs(block, Opcode_spill);
+                reloads[optimize] += CountInstrs(block, Opcode_load_spilled);
+            }
+        }
+        printf("  reglimit %2u: instrs %6zu -> %6zu, spills %5zu -> %5zu, reloads %5zu -> %5zu\n",
+               reglimit, instrs[0], instrs[1], spills[0], spills[1], reloads[0], reloads[1]);
+    }
+}
+INVOKE_BENCHMARK(EliminateDeadCodeBenchmark);
+
+static void ScheduleBenchmark()
+{
+    for (uint reglimit = 2; reglimit <= 16; reglimit += reglimit < 4 ? 1 : 4) {
+        size_t spills[2] = {}, reloads[2] = {};
+        uint64_t scheduleNs = 0;
+        for (uint seed = 0; seed < 2000; ++seed) {
+            for (uint schedule = 0; schedule < 2; ++schedule) {
+                Module m;
+                Block block;
+                IrBuilder b(m, block);
+                std::vector<char> names;
+                RandomBlockParams const params = { 60, 16, 25, 15, 25, seed };
+                GenerateRandomBlock(b, params, names);
+                EliminateDeadCodeAndRedundantTestIo(block);
+                if (schedule) {
+                    uint64_t const t0 = BenchNowNs();
+                    ScheduleForRegisterPressure(block, reglimit);
+                    scheduleNs += BenchNowNs() - t0;
                 }
+                LocalRegisterAllocation(m, block, reglimit);
+                spills[schedule] += CountInstrs(block, Opcode_spill);
+                reloads[schedule] += CountInstrs(block, Opcode_load_spilled);
             }
-            ASSERT(srcIndex < sizeof(uniqueSrcIndexes) * BitsPerByte);
-            uniqueSrcIndexes |= 1u << srcIndex;
-            if (src->currentReg == RegLocInvalid) {
-                RA_DEBUG_PRINTF("allocating instr %s src %d\n", instr->debugName, srcIndex);
-                instr->ra.srcRegs[srcIndex] = AllocRegForValueAfterPossiblySpilling(ctx, origInstrIndex, instr, src);
+        }
+        printf("  reglimit %2u: spills %5zu -> %5zu, reloads %5zu -> %5zu, scheduling %.1f ms total\n",
+               reglimit, spills[0], spills[1], reloads[0], reloads[1], scheduleNs * 1e-6);
+    }
+}
+INVOKE_BENCHMARK(ScheduleBenchmark);
+
+template<uint MaxRegs>
+static uint64_t TimeLocalRegisterAllocation(Module& m, Block& block, uint reglimit, bool bLinearVictimSearch)
+{
+    RegAllocCtx<MaxRegs> ractx(m, reglimit);
+    ractx.bLinearVictimSearch = bLinearVictimSearch;
+    uint64_t const t0 = BenchNowNs();
+    LocalRegisterAllocation(ractx, block);
+    return BenchNowNs() - t0;
+}
+
+static void VictimSelectionBenchmark()
+{
+    // Operands are mostly from a window bigger than the register count, so there are spills.
+    for (uint reglimit = 8; reglimit <= 256; reglimit *= 2) {
+        for (bool bLinear : { true, false }) {
+            uint64_t raNs = 0;
+            size_t numInstrs = 0, numSpills = 0;
+            for (uint seed = 0; seed < 20; ++seed) {
+                Module m;
+                Block block;
+                IrBuilder b(m, block);
+                std::vector<char> names;
+                RandomBlockParams params = { 20'000, 1u << 16, 0, 5, 30, seed };
+                params.recentWindow = reglimit * 2;
+                params.farPercent = 0;
+                GenerateRandomBlock(b, params, names);
+                EliminateDeadCodeAndRedundantTestIo(block);
+                numInstrs += block.instructions.size();
+
+                raNs += reglimit <= 32 ? TimeLocalRegisterAllocation<32>(m, block, reglimit, bLinear) :
+                        reglimit <= 64 ? TimeLocalRegisterAllocation<64>(m, block, reglimit, bLinear) :
+                                         TimeLocalRegisterAllocation<256>(m, block, reglimit, bLinear);
+                numSpills += CountInstrs(block, Opcode_spill);
             }
-            else {
-                instr->ra.srcRegs[srcIndex] = src->currentReg;
+            printf("  reglimit %3u %s: %7zu instrs, %6zu spills, RA %6.1f ms, %5.1f ns/instr\n", reglimit,
+                   bLinear ? "linear" : "tree  ", numInstrs, numSpills, raNs * 1e-6, double(raNs) / double(numInstrs));
+        }
+    }
+}
+INVOKE_BENCHMARK(VictimSelectionBenchmark);
+
+// A small register limit should take the same time with the 32-register (single uint32_t bitset) code
+// as before there were wider ones; the wider ones are shown for comparison. Time is the fastest and the median
+// of a few runs, each on new blocks from the same seeds.
+static void RegisterFileWidthBenchmark()
+{
+    uint const numRuns = 5;
+    for (uint reglimit : { 4u, 8u, 16u, 32u }) {
+        std::vector<uint64_t> raNs[3];
+        size_t numInstrs = 0;
+        for (uint run = 0; run < numRuns; ++run) {
+            for (std::vector<uint64_t>& ns : raNs)
+                ns.push_back(0);
+            for (uint seed = 0; seed < 20; ++seed) {
+                for (uint width = 0; width < 3; ++width) {
+                    Module m;
+                    Block block;
+                    IrBuilder b(m, block);
+                    std::vector<char> names;
+                    RandomBlockParams params = { 20'000, 1u << 16, 0, 5, 30, seed };
+                    params.recentWindow = reglimit * 2;
+                    params.farPercent = 0;
+                    GenerateRandomBlock(b, params, names);
+                    EliminateDeadCodeAndRedundantTestIo(block);
+                    numInstrs += run == 0 && width == 0 ? block.instructions.size() : 0;
+
+                    raNs[width].back() += width == 0 ? TimeLocalRegisterAllocation<32>(m, block, reglimit, false) :
+                                          width == 1 ? TimeLocalRegisterAllocation<64>(m, block, reglimit, false) :
+                                                       TimeLocalRegisterAllocation<256>(m, block, reglimit, false);
+                }
             }
-            outer_continue_target:;
         }
-        for (uint32_t bits = uniqueSrcIndexes; bits; bits &= bits - 1) {
-            uint const srcIndex = bsf(bits);
-            UpdateJustUsedSrcValueInReg(ctx, origInstrIndex, instr, srcIndex,
-                                        static_cast<RuntimeValue*>(instr->Operand(srcIndex)));
+        double min[3], median[3];
+        for (uint width = 0; width < 3; ++width)
+            MinAndMedian(raNs[width], 1.0 / double(numInstrs), min[width], median[width]);
+        printf("  reglimit %2u: RegAllocCtx<32> %5.1f/%5.1f, <64> %5.1f/%5.1f, <256> %5.1f/%5.1f ns/instr\n", reglimit,
+               min[0], median[0], min[1], median[1], min[2], median[2]);
+    }
+}
+INVOKE_BENCHMARK(RegisterFileWidthBenchmark);
+
+static void EvictionHeuristicBenchmark()
+{
+    static const EvictionHeuristic heuristics[] = { Eviction_farthestNextUse, Eviction_cleanAware };
+    static const char* const heuristicNames[] = { "farthest next use", "clean aware" };
+    // Small blocks, so the exact solver finishes.
+    for (uint reglimit : { 2u, 3u, 4u }) {
+        size_t spills[2] = {}, reloads[2] = {}, optimal = 0;
+        for (uint seed = 0; seed < 200; ++seed) {
+            for (uint h = 0; h < 2; ++h) {
+                Module m;
+                Block block;
+                IrBuilder b(m, block);
+                std::vector<char> names;
+                RandomBlockParams params = { 32, 8, 10, 10, 20, seed };
+                params.recentWindow = reglimit + 2;
+                GenerateRandomBlock(b, params, names);
+                EliminateDeadCodeAndRedundantTestIo(block);
+                ScheduleForRegisterPressure(block, reglimit);
+                optimal += h == 0 ? OptimalLocalSpillCost(block, reglimit) : 0;
+                LocalRegisterAllocation(m, block, reglimit, heuristics[h], false);
+                spills[h] += CountInstrs(block, Opcode_spill);
+                reloads[h] += CountInstrs(block, Opcode_load_spilled);
+            }
         }
-        if (instr->typekind != Ir_void) {
-            RA_DEBUG_PRINTF("allocating instr %s dst\n", instr->debugName);
-            instr->ra.dstReg = AllocRegForValueAfterPossiblySpilling(ctx, origInstrIndex, instr, instr);
+        for (uint h = 0; h < 2; ++h) {
+            printf("  32 instrs x 200, reglimit %u, %-17s: %5zu spills + %5zu reloads = %5zu (optimal %zu)\n",
+                   reglimit, heuristicNames[h], spills[h], reloads[h], spills[h] + reloads[h], optimal);
+        }
+    }
+    for (uint reglimit : { 4u, 8u, 16u }) {
+        size_t spills[2] = {}, reloads[2] = {};
+        for (uint seed = 0; seed < 20; ++seed) {
+            for (uint h = 0; h < 2; ++h) {
+                Module m;
+                Block block;
+                IrBuilder b(m, block);
+                std::vector<char> names;
+                RandomBlockParams params = { 20'000, 1u << 16, 10, 5, 30, seed };
+                params.recentWindow = reglimit * 2;
+                GenerateRandomBlock(b, params, names);
+                CompileOptions options;
+                options.reglimit = reglimit;
+                options.eviction = heuristics[h];
+                options.bRematerialize = false;
+                CompileBlock(m, block, options);
+                spills[h] += CountInstrs(block, Opcode_spill);
+                reloads[h] += CountInstrs(block, Opcode_load_spilled);
+            }
+        }
+        for (uint h = 0; h < 2; ++h) {
+            printf("  20K instrs x 20, reglimit %2u, %-17s: %6zu spills + %6zu reloads = %6zu\n",
+                   reglimit, heuristicNames[h], spills[h], reloads[h], spills[h] + reloads[h]);
         }
-        ctx.newInstrs.push_back(instr);
     }
+}
+INVOKE_BENCHMARK(EvictionHeuristicBenchmark);
 
-#if _DEBUG
-    ASSERT(!block.instructions.empty());
-    // Could be stricter than this, like for a value defined in a block but only used in that block.
-    if (block.instructions.back()->opcode == Opcode_return) {
-        for (const Instruction* const instr : block.instructions) {
-            ASSERT(instr->useIterAccelerator == instr->uses.size());
+static void RematerializeBenchmark()
+{
+    for (uint reglimit : { 2u, 4u, 8u, 16u }) {
+        for (bool bRematerialize : { false, true }) {
+            size_t numSpillLocs = 0, numSpills = 0, numReloads = 0, numInstrsBeforeRa = 0, numInstrs = 0;
+            uint64_t raNs = 0;
+            for (uint seed = 0; seed < 20; ++seed) {
+                Module m;
+                Block block;
+                IrBuilder b(m, block);
+                std::vector<char> names;
+                RandomBlockParams params = { 20'000, 1u << 16, 30, 5, 30, seed };
+                params.recentWindow = reglimit * 2;
+                GenerateRandomBlock(b, params, names);
+                EliminateDeadCodeAndRedundantTestIo(block);
+                ScheduleForRegisterPressure(block, reglimit);
+                numInstrsBeforeRa += block.instructions.size();
+
+                uint64_t const t0 = BenchNowNs();
+                numSpillLocs += LocalRegisterAllocation(m, block, reglimit, Eviction_farthestNextUse, bRematerialize);
+                raNs += BenchNowNs() - t0;
+                numSpills += CountInstrs(block, Opcode_spill);
+                numReloads += CountInstrs(block, Opcode_load_spilled);
+                numInstrs += block.instructions.size();
+            }
+            size_t const numRemats = numInstrs - numInstrsBeforeRa - numSpills - numReloads;
+            printf("  reglimit %2u, remat %-3s: %5zu spill slots, %6zu spills, %6zu reloads, %6zu remats, "
+                   "%7zu instrs after RA (%zu before), RA %5.1f ns/instr\n",
+                   reglimit, bRematerialize ? "on" : "off", numSpillLocs, numSpills, numReloads, numRemats,
+                   numInstrs, numInstrsBeforeRa, double(raNs) / double(numInstrsBeforeRa));
+        }
+    }
+}
+INVOKE_BENCHMARK(RematerializeBenchmark);
+
+// Time is per instruction after RA, the fastest and the median of a few runs over the same blocks.
+static void PeepholeBenchmark()
+{
+    struct Config {
+        const char* name;
+        uint reglimit; // 0: spill everywhere
+        RegisterAllocator allocator;
+    };
+    static const Config configs[] = {
+        { "spill everywhere", 0, RegisterAllocator_local },
+        { "local RA, 2 regs", 2, RegisterAllocator_local },
+        { "local RA, 4 regs", 4, RegisterAllocator_local },
+        { "local RA, 8 regs", 8, RegisterAllocator_local },
+        { "LS RA, 2 regs", 2, RegisterAllocator_linearScan },
+        { "LS RA, 4 regs", 4, RegisterAllocator_linearScan },
+        { "LS RA, 8 regs", 8, RegisterAllocator_linearScan },
+    };
+    uint const numRuns = 5;
+    for (const Config& config : configs) {
+        uint const reglimit = config.reglimit;
+        size_t numMemOpsBefore = 0, numRedundant = 0, numForwarded = 0, numDeadSpills = 0, numInstrs = 0;
+        std::vector<uint64_t> ns(numRuns, 0);
+        for (uint run = 0; run < numRuns; ++run) {
+            for (uint seed = 0; seed < 20; ++seed) {
+                Module m;
+                Block block;
+                IrBuilder b(m, block);
+                std::vector<char> names;
+                RandomBlockParams params = { 20'000, 1u << 16, 30, 5, 30, seed };
+                params.recentWindow = Max(reglimit, 2u) * 2;
+                GenerateRandomBlock(b, params, names);
+                EliminateDeadCodeAndRedundantTestIo(block);
+                if (reglimit == 0) {
+                    SpillEverywhereForTest(m, block);
+                }
+                else {
+                    ScheduleForRegisterPressure(block, reglimit);
+                    if (config.allocator == RegisterAllocator_linearScan)
+                        LinearScanRegisterAllocation(m, block, reglimit);
+                    else
+                        LocalRegisterAllocation(m, block, reglimit);
+                }
+                if (run == 0) {
+                    numMemOpsBefore += CountInstrs(block, Opcode_spill) + CountInstrs(block, Opcode_load_spilled);
+                    numInstrs += block.instructions.size();
+                }
+
+                uint64_t const t0 = BenchNowNs();
+                PeepholeStats const stats = EliminateRedundantSpillCode(block);
+                ns[run] += BenchNowNs() - t0;
+                if (run == 0) {
+                    numRedundant += stats.numRedundantReloads;
+                    numForwarded += stats.numForwardedReloads;
+                    numDeadSpills += stats.numDeadSpills;
+                }
+            }
+        }
+        size_t const numRemoved = numRedundant + numForwarded + numDeadSpills;
+        double min, median;
+        MinAndMedian(ns, 1.0 / double(numInstrs), min, median);
+        printf("  %-16s: %6zu memory ops, removed %6zu redundant reloads, %6zu forwarded reloads, "
+               "%6zu dead spills (%4.1f%%), %4.1f/%4.1f ns/instr\n",
+               config.name, numMemOpsBefore, numRedundant, numForwarded, numDeadSpills,
+               100.0 * double(numRemoved) / double(Max<size_t>(numMemOpsBefore, 1)), min, median);
+    }
+}
+INVOKE_BENCHMARK(PeepholeBenchmark);
+
+// Both allocators on the same blocks, without the passes around them. Time is per instruction before RA, the
+// fastest and the median of a few runs, each on a new block from the same seed.
+static void LinearScanBenchmark()
+{
+    for (uint numInstrs : { 10'000u, 100'000u, 1'000'000u, 10'000'000u }) {
+        for (uint reglimit : { 4u, 16u }) {
+            uint const numRuns = numInstrs < 10'000'000u ? 5 : 3;
+            std::vector<uint64_t> raNs[2];
+            size_t numMemOps[2] = {};
+            for (uint run = 0; run < numRuns; ++run) {
+                for (uint bLinearScan = 0; bLinearScan < 2; ++bLinearScan) {
+                    Module m;
+                    Block block;
+                    IrBuilder b(m, block);
+                    std::vector<char> names;
+                    RandomBlockParams params = { numInstrs, 1u << 16, 10, 5, 30, reglimit };
+                    params.recentWindow = reglimit * 2;
+                    params.farPercent = 1;
+                    GenerateRandomBlock(b, params, names);
+                    EliminateDeadCodeAndRedundantTestIo(block);
+
+                    uint64_t const t0 = BenchNowNs();
+                    if (bLinearScan)
+                        LinearScanRegisterAllocation(m, block, reglimit);
+                    else
+                        LocalRegisterAllocation(m, block, reglimit);
+                    raNs[bLinearScan].push_back(BenchNowNs() - t0);
+                    numMemOps[bLinearScan] = CountInstrs(block, Opcode_spill) + CountInstrs(block, Opcode_load_spilled);
+                }
+            }
+            double min[2], median[2];
+            for (uint i = 0; i < 2; ++i)
+                MinAndMedian(raNs[i], 1.0 / numInstrs, min[i], median[i]);
+            printf("  %8u instrs, reglimit %2u: local %6.1f/%6.1f ns/instr, %6zu spills+reloads; "
+                   "linear scan %6.1f/%6.1f ns/instr, %6zu spills+reloads\n", numInstrs, reglimit,
+                   min[0], median[0], numMemOps[0], min[1], median[1], numMemOps[1]);
+        }
+    }
+}
+INVOKE_BENCHMARK(LinearScanBenchmark);
+
+// Compare-heavy blocks with bools in the data registers (predlimit 0) or in a file of their own.
+static void RegClassBenchmark()
+{
+    for (uint numInstrs : { 100'000u, 1'000'000u }) {
+        for (uint reglimit : { 4u, 8u, 16u }) {
+            uint64_t raNs[2] = {};
+            size_t numDataSpills[2] = {}, numMemOps[2] = {};
+            for (uint bPredRegs = 0; bPredRegs < 2; ++bPredRegs) {
+                Module m;
+                Block block;
+                IrBuilder b(m, block);
+                std::vector<char> names;
+                RandomBlockParams params = { numInstrs, 1u << 16, 10, 5, 30, reglimit };
+                params.recentWindow = reglimit * 2;
+                params.farPercent = 1;
+                params.cmpPercent = 20;
+                GenerateRandomBlock(b, params, names);
+                EliminateDeadCodeAndRedundantTestIo(block);
+
+                uint64_t const t0 = BenchNowNs();
+                LocalRegisterAllocation(m, block, reglimit, Eviction_farthestNextUse, true, bPredRegs ? 4 : 0);
+                raNs[bPredRegs] = BenchNowNs() - t0;
+                numDataSpills[bPredRegs] = CountDataSpills(block);
+                numMemOps[bPredRegs] = CountInstrs(block, Opcode_spill) + CountInstrs(block, Opcode_load_spilled);
+            }
+            printf("  %8u instrs, reglimit %2u: shared %6.1f ns/instr, %7zu data spills, %8zu spills+reloads; "
+                   "4 predicate regs %6.1f ns/instr, %7zu data spills, %8zu spills+reloads\n", numInstrs, reglimit,
+                   double(raNs[0]) / numInstrs, numDataSpills[0], numMemOps[0],
+                   double(raNs[1]) / numInstrs, numDataSpills[1], numMemOps[1]);
+        }
+    }
+}
+INVOKE_BENCHMARK(RegClassBenchmark);
+
+// Instructions and spill code per element of data-parallel blocks, all scalar or vectorized before RA.
+// The vector registers are as many as the data ones, like SSE2's xmm and the general purpose registers.
+static void SlpBenchmark()
+{
+    for (uint numElements : { 64u, 1024u }) {
+        for (uint reglimit : { 4u, 8u }) {
+            double instrs[2], memOps[2], ms[2];
+            for (uint bVectorize = 0; bVectorize < 2; ++bVectorize) {
+                Module m;
+                Block block;
+                IrBuilder b(m, block);
+                GenerateDataParallelBlock(b, numElements, 4);
+                CompileOptions options;
+                options.reglimit = reglimit;
+                options.veclimit = reglimit;
+                options.bVectorize = bVectorize != 0;
+                uint64_t const t0 = BenchNowNs();
+                CompileBlock(m, block, options);
+                ms[bVectorize] = double(BenchNowNs() - t0) * 1e-6;
+                instrs[bVectorize] = double(block.instructions.size() - 1) / numElements;
+                memOps[bVectorize] = double(CountInstrs(block, Opcode_spill) + CountInstrs(block, Opcode_load_spilled)) / numElements;
+            }
+            printf("  %4u elements, %u regs: scalar %5.2f instrs/element %5.2f spill code/element (%6.2f ms), "
+                   "SLP %5.2f instrs/element %5.2f spill code/element (%6.2f ms)\n", numElements, reglimit,
+                   instrs[0], memOps[0], ms[0], instrs[1], memOps[1], ms[1]);
+        }
+    }
+}
+INVOKE_BENCHMARK(SlpBenchmark);
+
+// Instructions and spill code per 64-bit add, with a64 values in one register each or split into 32-bit halves.
+static void A64Benchmark()
+{
+    for (uint numElements : { 64u, 1024u }) {
+        for (uint reglimit : { 4u, 8u, 16u }) {
+            double instrs[2], memOps[2], ms[2];
+            for (uint bNative = 0; bNative < 2; ++bNative) {
+                Module m;
+                Block block;
+                IrBuilder b(m, block);
+                GenerateWideAddBlock(b, numElements, 4, bNative != 0);
+                CompileOptions options;
+                options.reglimit = reglimit;
+                uint64_t const t0 = BenchNowNs();
+                CompileBlock(m, block, options);
+                ms[bNative] = double(BenchNowNs() - t0) * 1e-6;
+                uint const numAdds = numElements * 4; // 3 terms and the literal
+                instrs[bNative] = double(block.instructions.size() - 1) / numAdds;
+                memOps[bNative] = double(CountInstrs(block, Opcode_spill) + CountInstrs(block, Opcode_load_spilled)) / numAdds;
+            }
+            printf("  %4u elements, %2u regs: split %5.2f instrs/add %5.2f spill code/add (%6.2f ms), "
+                   "a64 %5.2f instrs/add %5.2f spill code/add (%6.2f ms)\n", numElements, reglimit,
+                   instrs[0], memOps[0], ms[0], instrs[1], memOps[1], ms[1]);
+        }
+    }
+}
+INVOKE_BENCHMARK(A64Benchmark);
+
+// CompileBlocksParallel of many small and some big blocks, from 1 to 64 threads. Building the IR isn't timed.
+// Speedups are bounded by the cores of the machine, more threads than that only show the cost of stealing.
+// The first round isn't printed: the blocks of a fresh heap are faster to compile than those of one that had
+// the previous round's blocks freed, which would flatter 1 thread.
+static void ParallelCompileBenchmark()
+{
+    uint const numBlocks = 20'000;
+    double ms1 = 0;
+    for (uint numThreads : { 1u, 1u, 2u, 4u, 8u, 16u, 32u, 64u }) {
+        Module m;
+        Function storage;
+        std::vector<std::vector<char>> names(numBlocks);
+        std::vector<Block*> blocks;
+        uint64_t numInstrs = 0;
+        for (uint i = 0; i < numBlocks; ++i) {
+            IrBuilder b(m, *storage.NewBlock());
+            RandomBlockParams params = { i % 100 == 0 ? 5000u : 20 + i % 13 * 10, 16, 20, 10, 30, i };
+            params.cmpPercent = 10;
+            GenerateRandomBlock(b, params, names[i]);
+            blocks.push_back(b.block);
+            numInstrs += b.block->instructions.size();
+        }
+        CompileOptions options;
+        options.reglimit = 8;
+        WorkStealingPool pool(numThreads);
+        uint64_t const t0 = BenchNowNs();
+        CompileBlocksParallel(m, { blocks.data(), numBlocks }, options, pool);
+        double const ms = double(BenchNowNs() - t0) * 1e-6;
+        bool const bWarmup = ms1 == 0;
+        if (numThreads == 1)
+            ms1 = ms;
+        if (!bWarmup)
+            printf("  %2u threads: %8.1f ms, %5.2fx, %6.0fK blocks/s, %5.1f ns/instr\n", numThreads, ms, ms1 / ms,
+                   numBlocks / ms, ms * 1e6 / double(numInstrs));
+    }
+}
+INVOKE_BENCHMARK(ParallelCompileBenchmark);
+
+#if !defined _WIN32
+// Blocks of a few sizes through CompileBlockCached: first all misses into an empty cache, then all hits, against
+// building and compiling without the cache. The source of a block is its text before compiling, printed untimed.
+// Compiling without the cache runs twice and the first is dropped, see ParallelCompileBenchmark.
+static void CompileCacheBenchmark()
+{
+    char dir[] = "/tmp/tc_cache_benchmark_XXXXXX";
+    Verify(mkdtemp(dir) != nullptr);
+    CompileCache const cache(dir);
+    uint const numBlocks = 2000;
+    for (uint numInstrs : { 20u, 200u, 2000u }) {
+        CompileOptions options;
+        options.reglimit = 8;
+        std::vector<std::vector<ubyte>> sources(numBlocks);
+        {
+            std::vector<ubyte> streambuf(1u << 20);
+            for (uint i = 0; i < numBlocks; ++i) {
+                Module m;
+                Block block;
+                IrBuilder b(m, block);
+                std::vector<char> names;
+                RandomBlockParams params = { numInstrs, 16, 20, 10, 30, numInstrs * numBlocks + i };
+                GenerateRandomBlock(b, params, names);
+                FixedBufferByteStream bs(streambuf.data(), uint32_t(streambuf.size()));
+                PrintContext ctx = { };
+                PrintBlock(ctx, bs, block, 0);
+                sources[i].assign(streambuf.data(), streambuf.data() + bs.WrappedSize());
+            }
+        }
+        // 0: no cache, 1: misses, 2: hits, 3: only the lookups of misses (hash and open)
+        uint64_t ns[4] = { };
+        uint numHits[3] = { };
+        for (uint round : { 0u, 0u, 1u, 2u, 3u }) {
+            Module m;
+            Function storage;
+            std::vector<std::vector<char>> names(numBlocks);
+            uint64_t const t0 = BenchNowNs();
+            for (uint i = 0; i < numBlocks; ++i) {
+                Block& block = *storage.NewBlock();
+                auto build = [&](Block& block) {
+                    IrBuilder b(m, block);
+                    RandomBlockParams params = { numInstrs, 16, 20, 10, 30, numInstrs * numBlocks + i };
+                    GenerateRandomBlock(b, params, names[i]);
+                };
+                view<const ubyte> const source = { sources[i].data(), uint(sources[i].size()) };
+                if (round == 0) {
+                    build(block);
+                    CompileBlock(m, block, options);
+                }
+                else if (round < 3) {
+                    numHits[round] += CompileBlockCached(cache, source, m, block, options, build);
+                }
+                else {
+                    CompileOptions other = options;
+                    other.reglimit = 7;
+                    Verify(!cache.Lookup(CompileCache::Key(source, other), m, block));
+                }
+            }
+            ns[round] = BenchNowNs() - t0;
+        }
+        Verify(numHits[1] == 0 && numHits[2] == numBlocks);
+        printf("  %4u instrs/block: compile %7.1f us/block, miss %7.1f us (lookup %4.1f us), hit %6.1f us (%5.1fx)\n",
+               numInstrs, ns[0] * 1e-3 / numBlocks, ns[1] * 1e-3 / numBlocks, ns[3] * 1e-3 / numBlocks,
+               ns[2] * 1e-3 / numBlocks, double(ns[0]) / double(ns[2]));
+
+        for (uint i = 0; i < numBlocks; ++i) {
+            char path[512];
+            cache.PathOf(path, CompileCache::Key({ sources[i].data(), uint(sources[i].size()) }, options), ".tcc");
+            Verify(unlink(path) == 0);
         }
     }
+    Verify(rmdir(dir) == 0);
+}
+INVOKE_BENCHMARK(CompileCacheBenchmark);
 #endif
 
-    // NOTE: use vectors are invalid if spilled, but don't have those always anyway?
-    block.instructions = std::move(ctx.newInstrs);
+// ns per IR instruction for switch and threaded dispatch, each without and with superinstructions.
+static void BytecodeBenchmark()
+{
+    for (uint numInstrs : { 10'000u, 100'000u, 1'000'000u }) {
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        std::vector<char> names;
+        RandomBlockParams params = { numInstrs, 1u << 10, 10, 5, 30, numInstrs };
+        params.cmpPercent = 10;
+        GenerateRandomBlock(b, params, names);
+        EliminateDeadCodeAndRedundantTestIo(block);
+        std::vector<uint32_t> inputs(params.numInputs), outputs(params.numInputs);
+        for (uint i = 0; i < params.numInputs; ++i)
+            inputs[i] = uint32_t(Avalanche(i));
+
+        for (bool bAllocated : { false, true }) {
+            if (bAllocated) {
+                CompileOptions options;
+                options.reglimit = 8;
+                options.bEliminateDeadCode = false;
+                CompileBlock(m, block, options);
+            }
+            double nsPerInstr[4];
+            uint32_t checksum = 0;
+            for (uint variant = 0; variant < 4; ++variant) {
+                bool const bThreaded = variant >= 2, bSuperinstructions = variant & 1;
+                BytecodeProgram program;
+                LowerToBytecode(block, bAllocated, bSuperinstructions, program);
+                std::vector<uint32_t> frame;
+                uint const reps = Max(1u, 20'000'000u / program.numIrInstrs);
+                uint64_t const t0 = BenchNowNs();
+                for (uint rep = 0; rep < reps; ++rep) {
+                    (bThreaded ? RunBytecode : RunBytecodeSwitch)(program, frame,
+                        reinterpret_cast<const ubyte*>(inputs.data()), inputs.size() * 4,
+                        reinterpret_cast<ubyte*>(outputs.data()), outputs.size() * 4);
+                }
+                nsPerInstr[variant] = double(BenchNowNs() - t0) / (double(reps) * program.numIrInstrs);
+                for (uint32_t v : outputs)
+                    checksum = checksum * 31 + v;
+            }
+            printf("  %8u IR instrs %s RA: switch %5.2f, +super %5.2f; threaded %5.2f, +super %5.2f ns/instr (%08x)\n",
+                   uint(block.instructions.size() - 1), bAllocated ? "after " : "before",
+                   nsPerInstr[0], nsPerInstr[1], nsPerInstr[2], nsPerInstr[3], checksum);
+        }
+    }
 }
+INVOKE_BENCHMARK(BytecodeBenchmark);
 
-void DoSomething()
+// A small kernel over many records, one at a time (threaded with superinstructions, and as machine code
+// where there is a JIT) and in batches. The I/O layouts differ, the transposing isn't timed.
+static void BatchBenchmark()
 {
-    PrintContext ctx = { };
-    ubyte streambuf[2048];
+    size_t const numRecords = 1u << 20;
+    for (uint numInstrs : { 50u, 200u }) {
+        Module m;
+        Block block;
+        IrBuilder b(m, block);
+        std::vector<char> names;
+        uint const numColumns = 16; // the same columns are in and out, only the last write of each stays
+        RandomBlockParams params = { numInstrs, numColumns, 10, 10, 20, numInstrs };
+        params.cmpPercent = 10;
+        GenerateRandomBlock(b, params, names);
+        CompileOptions options;
+        options.reglimit = 8;
+        CompileBlock(m, block, options);
+
+        std::vector<uint32_t> records(numRecords * numColumns), columns(numRecords * numColumns);
+        for (size_t r = 0; r < numRecords; ++r) {
+            for (uint k = 0; k < numColumns; ++k)
+                columns[k * numRecords + r] = records[r * numColumns + k] = uint32_t(Avalanche(r * numColumns + k));
+        }
+        std::vector<uint32_t> outRecords(records.size(), 0), outColumns(columns.size(), 0), frame;
+
+        BytecodeProgram program;
+        LowerToBytecode(block, true, true, program);
+        uint64_t const t0 = BenchNowNs();
+        for (size_t r = 0; r < numRecords; ++r) {
+            RunBytecode(program, frame, reinterpret_cast<const ubyte*>(&records[r * numColumns]), numColumns * 4,
+                        reinterpret_cast<ubyte*>(&outRecords[r * numColumns]), numColumns * 4);
+        }
+        uint64_t const t1 = BenchNowNs();
+        LowerToBytecode(block, true, false, program);
+        RunBytecodeBatch(program, frame, columns.data(), outColumns.data(), numRecords);
+        uint64_t const t2 = BenchNowNs();
+        for (size_t r = 0; r < numRecords; ++r) {
+            for (uint k = 0; k < numColumns; ++k)
+                Verify(outColumns[k * numRecords + r] == outRecords[r * numColumns + k]);
+        }
+        printf("  %3u IR instrs, %zu records: one at a time %6.1f M records/s, batch %6.1f M records/s",
+               program.numIrInstrs, numRecords, numRecords * 1e3 / double(t1 - t0), numRecords * 1e3 / double(t2 - t1));
+#if TC_X64_JIT
+        JitCode jit;
+        JitCompileBlock(block, jit);
+        uint64_t const t3 = BenchNowNs();
+        for (size_t r = 0; r < numRecords; ++r)
+            jit.fn(reinterpret_cast<const ubyte*>(&records[r * numColumns]), reinterpret_cast<ubyte*>(&outRecords[r * numColumns]));
+        uint64_t const t4 = BenchNowNs();
+        printf(", JIT one at a time %6.1f M records/s", numRecords * 1e3 / double(t4 - t3));
+#endif
+        printf("\n");
+    }
+}
+INVOKE_BENCHMARK(BatchBenchmark);
+
+#if TC_X64_JIT
+// The same allocated blocks run by the threaded interpreter with superinstructions and as machine code.
+static void JitBenchmark()
+{
+    for (uint numInstrs : { 10'000u, 100'000u, 1'000'000u }) {
+        for (uint reglimit : { 4u, 8u }) {
+            Module m;
+            Block block;
+            IrBuilder b(m, block);
+            std::vector<char> names;
+            RandomBlockParams params = { numInstrs, 1u << 10, 10, 5, 30, numInstrs };
+            params.cmpPercent = 10;
+            GenerateRandomBlock(b, params, names);
+            CompileOptions options;
+            options.reglimit = reglimit;
+            CompileBlock(m, block, options);
+            uint const numIrInstrs = uint(block.instructions.size() - 1);
+            std::vector<uint32_t> inputs(params.numInputs), outputs[2];
+            for (uint i = 0; i < params.numInputs; ++i)
+                inputs[i] = uint32_t(Avalanche(i));
+            for (std::vector<uint32_t>& out : outputs)
+                out.assign(params.numInputs, 0);
+            uint const reps = Max(1u, 20'000'000u / numIrInstrs);
+            const ubyte* const input = reinterpret_cast<const ubyte*>(inputs.data());
+
+            uint64_t const t0 = BenchNowNs();
+            BytecodeProgram program;
+            LowerToBytecode(block, true, true, program);
+            uint64_t const t1 = BenchNowNs();
+            std::vector<uint32_t> frame;
+            for (uint rep = 0; rep < reps; ++rep)
+                RunBytecode(program, frame, input, inputs.size() * 4, reinterpret_cast<ubyte*>(outputs[0].data()), inputs.size() * 4);
+            uint64_t const t2 = BenchNowNs();
+            JitCode jit;
+            JitCompileBlock(block, jit);
+            uint64_t const t3 = BenchNowNs();
+            Verify(inputs.size() * 4 >= jit.inputBytes && inputs.size() * 4 >= jit.outputBytes);
+            for (uint rep = 0; rep < reps; ++rep)
+                jit.fn(input, reinterpret_cast<ubyte*>(outputs[1].data()));
+            uint64_t const t4 = BenchNowNs();
+            Verify(outputs[0] == outputs[1]);
+
+            printf("  %8u IR instrs, reglimit %u: interpreter %5.2f ns/instr (lowering %5.1f ns/instr), "
+                   "JIT %5.2f ns/instr (compiling %5.1f ns/instr, %5.2f code bytes/instr)\n", numIrInstrs, reglimit,
+                   double(t2 - t1) / (double(reps) * numIrInstrs), double(t1 - t0) / numIrInstrs,
+                   double(t4 - t3) / (double(reps) * numIrInstrs), double(t3 - t2) / numIrInstrs,
+                   double(jit.size) / numIrInstrs);
+        }
+    }
+}
+INVOKE_BENCHMARK(JitBenchmark);
+#endif
+
+#if defined __linux__
+#include <fcntl.h>
+#include <unistd.h>
 
+// Many small functions like a module of a real program, each touching a global. Only WriteElfObject is timed
+// for the throughput, the IR and RA come before, and EmitX64Block alone shows the part of it that is codegen.
+static void ElfBenchmark()
+{
+    uint const numFunctions = 100'000, numGlobals = 1000;
     Module m;
-    Block block;
-    
+    Function storage; // owns the blocks, they aren't connected
+    std::vector<std::vector<char>> names(numFunctions);
+    std::vector<char> functionNames(numFunctions * 16);
+    std::vector<ObjectFunction> functions(numFunctions);
+    std::vector<char> globalNames(numGlobals * 16);
+    for (uint i = 0; i < numGlobals; ++i) {
+        snprintf(&globalNames[i * 16], 16, "tc_g%u", i);
+        (void)m.AddGlobal(&globalNames[i * 16]);
+    }
+
+    uint64_t const t0 = BenchNowNs();
+    for (uint i = 0; i < numFunctions; ++i) {
+        IrBuilder b(m, *storage.NewBlock());
+        const GlobalVariable* const global = m.globals[Avalanche(i) % numGlobals];
+        b.StoreGlobal(global, b.Iadd(b.LoadGlobal(global, "g"), m.LiteralU32(1), "g1"));
+        RandomBlockParams params = { 20, 4, 20, 10, 20, i };
+        params.cmpPercent = 10;
+        GenerateRandomBlock(b, params, names[i]);
+        CompileOptions options;
+        options.reglimit = 8;
+        CompileBlock(m, *b.block, options);
+        snprintf(&functionNames[i * 16], 16, "tc_f%u", i);
+        functions[i] = { &functionNames[i * 16], b.block };
+    }
+    uint64_t const t1 = BenchNowNs();
+    {
+        X64Emitter e;
+        for (const ObjectFunction& function : functions)
+            EmitX64Block(*function.block, X64SysV, e);
+    }
+    uint64_t const t2 = BenchNowNs();
+    char path[] = "/tmp/tc_elf_benchmark_XXXXXX";
+    int const fd = mkstemp(path);
+    Verify(fd >= 0);
     {
-#define IADD(n, a, b) Value* const n = block.CreateThenAppendInstr2(Opcode_iadd, Ir_a32, a, b, #n);
-#define READ_TEST_INPUT(n, c) Value* const n = block.CreateThenAppendInstr1(Opcode_read_test_input, Ir_a32, m.LiteralU32(c), #n);
-#define WRITE_TEST_OUTPUT(c, v) (void) block.CreateThenAppendInstr2(Opcode_write_test_output, Ir_void, m.LiteralU32(c), v)
+        FileByteStream bs(fd, 1u << 20);
+        WriteElfObject(bs, m, { functions.data(), uint(functions.size()) });
+        Verify(bs.Flush());
+    }
+    uint64_t const t3 = BenchNowNs();
+    off_t const fileBytes = lseek(fd, 0, SEEK_END);
+    Verify(close(fd) == 0);
+    remove(path);
+
+    double const seconds = double(t3 - t2) * 1e-9;
+    printf("  %u functions, %u globals: IR and RA %.0f ms, WriteElfObject %.0f ms (codegen alone %.0f ms), "
+           "%.1f MB, %.0f MB/s, %.0fK functions/s\n", numFunctions, numGlobals, double(t1 - t0) * 1e-6,
+           seconds * 1e3, double(t2 - t1) * 1e-6, double(fileBytes) * 1e-6, double(fileBytes) * 1e-6 / seconds,
+           numFunctions * 1e-3 / seconds);
+}
+INVOKE_BENCHMARK(ElfBenchmark);
+
+// Modules of a million instructions or more in binary IR with names, written to a file and mapped: validating it,
+// walking it in place (an opcode histogram) and loading it into Blocks, against building the same blocks again.
+static void BinaryIrBenchmark()
+{
+    for (uint numBlocks : { 5000u, 20'000u }) {
+        uint const instrsPerBlock = 200;
+        Module m;
+        Function storage;
+        std::vector<std::vector<char>> names(numBlocks);
+        std::vector<Block*> blocks;
+        uint64_t const t0 = BenchNowNs();
+        for (uint i = 0; i < numBlocks; ++i) {
+            IrBuilder b(m, *storage.NewBlock());
+            RandomBlockParams params = { instrsPerBlock, 64, 20, 10, 30, i };
+            params.cmpPercent = 10;
+            GenerateRandomBlock(b, params, names[i]);
+            blocks.push_back(b.block);
+        }
+        uint64_t const t1 = BenchNowNs();
+
+        char path[] = "/tmp/tc_binary_ir_benchmark_XXXXXX";
+        int const fd = mkstemp(path);
+        Verify(fd >= 0);
+        {
+            FileByteStream bs(fd, 1u << 20);
+            WriteBinaryIr(bs, { blocks.data(), numBlocks }, BinaryIr_names);
+            Verify(bs.Flush());
+        }
+        uint64_t const t2 = BenchNowNs();
+        size_t const size = size_t(lseek(fd, 0, SEEK_END));
+        void* const p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        Verify(p != MAP_FAILED);
 
-        READ_TEST_INPUT(x, 0);
-        READ_TEST_INPUT(y, 4);
-        IADD(xy, x, y);
-        READ_TEST_INPUT(z, 8);
-        IADD(zy, z, y);
-        WRITE_TEST_OUTPUT(0, xy);
-        WRITE_TEST_OUTPUT(4, zy);
-        READ_TEST_INPUT(w, 12);
-        IADD(ww, w, w);
-        WRITE_TEST_OUTPUT(8, ww);
+        uint64_t const t3 = BenchNowNs();
+        BinaryIrView ir;
+        Verify(ir.Open(p, size) && ir.Validate());
+        uint64_t const t4 = BenchNowNs();
+        uint histogram[Opcode_store_global + 1] = { };
+        for (uint i = 0; i < ir.header.numInstrs; ++i)
+            histogram[ir.opcodes[i]]++;
+        uint64_t const t5 = BenchNowNs();
+        Module loaded;
+        Function loadedStorage;
+        {
+            BinaryIrLoader loader(ir, loaded);
+            for (uint i = 0; i < numBlocks; ++i)
+                loader.LoadBlock(i, *loadedStorage.NewBlock());
+        }
+        uint64_t const t6 = BenchNowNs();
+        Verify(histogram[Opcode_return] == numBlocks);
+        Verify(munmap(p, size) == 0 && close(fd) == 0);
+        remove(path);
 
-        (void)block.CreateThenAppendInstr(Opcode_return, Ir_void, 0);
-#undef WRITE_TEST_OUTPUT
-#undef READ_TEST_INPUT
-#undef IADD
+        uint const numInstrs = ir.header.numInstrs;
+        printf("  %u instrs in %u blocks: build %.0f ms; write %.0f ms, %.1f MB (%.1f bytes/instr); "
+               "validate %.1f ms, walk %.1f ms, load %.0f ms (%.1fx faster than building)\n",
+               numInstrs, numBlocks, double(t1 - t0) * 1e-6, double(t2 - t1) * 1e-6, double(size) * 1e-6,
+               double(size) / numInstrs, double(t4 - t3) * 1e-6, double(t5 - t4) * 1e-6, double(t6 - t5) * 1e-6,
+               double(t1 - t0) / double(t6 - t5));
     }
+}
+INVOKE_BENCHMARK(BinaryIrBenchmark);
 
-    {
-        FixedBufferByteStream bs(streambuf, sizeof streambuf);
-        ctx.bPrintRegs = false;
-        Print(bs, "// Before RA/spilling:\n");
-        Print(bs, "void main()\n{\n");
-        PrintBlock(ctx, bs, block, 4);
-        Print(bs, "}\n");
-        fwrite(streambuf, 1, bs.WrappedSize(), stdout);
+// Dumps of about 25 MB and 100 MB printed by PrintBlock, parsed back into blocks.
+static void IrTextParserBenchmark()
+{
+    for (uint numBlocks : { 5000u, 20'000u }) {
+        uint const instrsPerBlock = 200;
+        Module m;
+        Function storage;
+        std::vector<std::vector<char>> names(numBlocks);
+        uint64_t const t0 = BenchNowNs();
+        for (uint i = 0; i < numBlocks; ++i) {
+            IrBuilder b(m, *storage.NewBlock());
+            RandomBlockParams params = { instrsPerBlock, 64, 20, 10, 30, i };
+            params.cmpPercent = 10;
+            GenerateRandomBlock(b, params, names[i]);
+        }
+        uint64_t const t1 = BenchNowNs();
+        std::vector<ubyte> text(size_t(numBlocks) * instrsPerBlock * 40);
+        FixedBufferByteStream bs(text.data(), uint32_t(text.size() - 1));
+        PrintContext ctx = { };
+        uint numInstrs = 0;
+        for (const Block* block : storage.blocks) {
+            PrintBlock(ctx, bs, *block, 4);
+            numInstrs += uint(block->instructions.size());
+        }
+        Verify(!bs.Overflowed());
+        uint32_t const size = bs.WrappedSize();
+        text[size] = '\0';
+        uint64_t const t2 = BenchNowNs();
+
+        Module parsedModule;
+        Function parsed;
+        IrTextParser parser(parsedModule, { reinterpret_cast<const char*>(text.data()), size });
+        while (!parser.AtEnd())
+            parser.ParseBlock(*parsed.NewBlock());
+        uint64_t const t3 = BenchNowNs();
+        Verify(parsed.blocks.size() == numBlocks);
+
+        printf("  %u instrs, %.1f MB: build %.0f ms, print %.0f ms; parse %.0f ms (%.0f MB/s, %.1fM instrs/s)\n",
+               numInstrs, double(size) * 1e-6, double(t1 - t0) * 1e-6, double(t2 - t1) * 1e-6, double(t3 - t2) * 1e-6,
+               double(size) * 1e3 / double(t3 - t2), double(numInstrs) * 1e3 / double(t3 - t2));
     }
+}
+INVOKE_BENCHMARK(IrTextParserBenchmark);
 
+// 1 GB of IR text with registers, the same blocks printed over and over, into each kind of growing or file sink.
+// Printing into a fixed buffer that wraps is the cost of formatting alone. The file is in the page cache, there is
+// no fsync.
+static void IrTextWriteBenchmark()
+{
+    uint const numBlocks = 1000;
+    Module m;
+    Function storage;
+    std::vector<std::vector<char>> names(numBlocks);
+    uint64_t numInstrs = 0;
+    for (uint i = 0; i < numBlocks; ++i) {
+        IrBuilder b(m, *storage.NewBlock());
+        RandomBlockParams params = { 200, 64, 20, 10, 30, i };
+        params.cmpPercent = 10;
+        GenerateRandomBlock(b, params, names[i]);
+        CompileOptions options;
+        options.reglimit = 8;
+        CompileBlock(m, *b.block, options);
+        numInstrs += b.block->instructions.size();
+    }
+    PrintContext ctx = { };
+    ctx.bPrintRegs = true;
+    auto printAll = [&](ByteStream& bs) {
+        for (const Block* block : storage.blocks)
+            PrintBlock(ctx, bs, *block, 4);
+    };
+    size_t passBytes;
     {
-        RegAllocCtx ractx(m, 2); // try changing this...
-        LocalRegisterAllocation(ractx, block);
+        MemoryByteStream bs;
+        printAll(bs);
+        passBytes = bs.Size();
     }
+    uint64_t const numPasses = ((uint64_t(1) << 30) + passBytes - 1) / passBytes;
+    auto run = [&](const char* name, auto& bs) { // the sink's own Flush, which waits for AsyncFileByteStream
+        uint64_t const t0 = BenchNowNs();
+        for (uint64_t pass = 0; pass < numPasses; ++pass)
+            printAll(bs);
+        Verify(bs.Flush());
+        uint64_t const t1 = BenchNowNs();
+        printf("  %-27s %5.0f ms, %4.0f MB/s, %4.1f ns/instr\n", name, double(t1 - t0) * 1e-6,
+               double(numPasses * passBytes) * 1e3 / double(t1 - t0), double(t1 - t0) / double(numPasses * numInstrs));
+    };
 
+    printf("  %.0f MB, %.1f bytes/instr\n", double(numPasses * passBytes) * 1e-6, double(passBytes) / double(numInstrs));
     {
-        FixedBufferByteStream bs(streambuf, sizeof streambuf);
-        ctx.bPrintRegs = true;
-        Print(bs, "// After RA/spilling:\n");
-        Print(bs, "void main()\n{\n");
-        PrintBlock(ctx, bs, block, 4);
-        Print(bs, "}\n");
-        fwrite(streambuf, 1, bs.WrappedSize(), stdout);
+        std::vector<ubyte> streambuf(1u << 20);
+        FixedBufferByteStream bs(streambuf.data(), uint32_t(streambuf.size()));
+        run("formatting only (wraps)", bs);
+    }
+    {
+        MemoryByteStream bs;
+        run("MemoryByteStream", bs);
+        Verify(bs.Size() == numPasses * passBytes);
+    }
+    for (uint kind = 0; kind < 3; ++kind) {
+        char path[] = "/tmp/tc_ir_text_benchmark_XXXXXX";
+        int const fd = mkstemp(path);
+        Verify(fd >= 0);
+        if (kind == 0) {
+            FileByteStream bs(fd);
+            run("FileByteStream 64 KB", bs);
+        }
+        else if (kind == 1) {
+            FileByteStream bs(fd, 1u << 20);
+            run("FileByteStream 1 MB", bs);
+        }
+        else {
+            AsyncFileByteStream bs(fd, 1u << 20);
+            run("AsyncFileByteStream 2x1 MB", bs);
+        }
+        Verify(uint64_t(lseek(fd, 0, SEEK_END)) == numPasses * passBytes && close(fd) == 0);
+        remove(path);
+    }
+}
+INVOKE_BENCHMARK(IrTextWriteBenchmark);
+#endif
+
+// PrintBlock alone, into a fixed buffer that wraps, before RA and after it with registers.
+static void PrintBlockBenchmark()
+{
+    uint const numBlocks = 1000;
+    Module m;
+    Function storage[2];
+    std::vector<std::vector<char>> names(numBlocks * 2);
+    uint64_t numInstrs[2] = { };
+    for (uint bRegs = 0; bRegs < 2; ++bRegs) {
+        for (uint i = 0; i < numBlocks; ++i) {
+            IrBuilder b(m, *storage[bRegs].NewBlock());
+            RandomBlockParams params = { 200, 64, 20, 10, 30, i };
+            params.cmpPercent = 10;
+            GenerateRandomBlock(b, params, names[bRegs * numBlocks + i]);
+            if (bRegs) {
+                CompileOptions options;
+                options.reglimit = 8;
+                CompileBlock(m, *b.block, options);
+            }
+            numInstrs[bRegs] += b.block->instructions.size();
+        }
+    }
+    std::vector<ubyte> streambuf(1u << 20);
+    for (uint round = 0; round < 3; ++round) {
+        for (uint bRegs = 0; bRegs < 2; ++bRegs) {
+            PrintContext ctx = { };
+            ctx.bPrintRegs = bRegs != 0;
+            FixedBufferByteStream bs(streambuf.data(), uint32_t(streambuf.size()));
+            uint64_t bytes = 0;
+            uint const numPasses = 10;
+            uint64_t const t0 = BenchNowNs();
+            for (uint pass = 0; pass < numPasses; ++pass) {
+                for (const Block* block : storage[bRegs].blocks) {
+                    uint32_t const before = bs.WrappedSize();
+                    PrintBlock(ctx, bs, *block, 4);
+                    bytes += bs.WrappedSize() >= before ? bs.WrappedSize() - before : bs.WrappedSize() + streambuf.size() - before;
+                }
+            }
+            uint64_t const t1 = BenchNowNs();
+            if (round != 0) {
+                printf("  %s: %.0f MB/s, %.1f ns/instr\n", bRegs ? "with registers   " : "without registers",
+                       double(bytes) * 1e3 / double(t1 - t0), double(t1 - t0) / double(numInstrs[bRegs] * numPasses));
+            }
+        }
+    }
+}
+INVOKE_BENCHMARK(PrintBlockBenchmark);
+
+static void GlobalRegAllocBenchmark()
+{
+    for (uint numBlocks : { 250u, 1000u, 4000u, 8000u }) {
+        uint64_t nsCfg = 0, nsDominators = 0, nsLiveness = 0, nsRa = 0;
+        size_t numLiveIn = 0, numInstrs = 0, numMemOps = 0, numWords = 0;
+        for (uint seed = 0; seed < 4; ++seed) {
+            Module m;
+            Function function;
+            IrBuilder b(m, *function.NewBlock());
+            std::vector<char> names;
+            RandomBlockParams params = { 8, 1u << 12, 30, 10, 20, seed };
+            params.farPercent = 2; // a value used anywhere later is live in every block until then
+            GenerateRandomFunction(b, function, params, numBlocks, names);
+
+            uint64_t const t0 = BenchNowNs();
+            function.BuildCfg();
+            uint64_t const t1 = BenchNowNs();
+            function.ComputeDominators();
+            uint64_t const t2 = BenchNowNs();
+            Liveness liveness;
+            ComputeLiveness(function, liveness);
+            uint64_t const t3 = BenchNowNs();
+            GlobalRegisterAllocation(m, function, liveness, 4);
+            uint64_t const t4 = BenchNowNs();
+            nsCfg += t1 - t0;
+            nsDominators += t2 - t1;
+            nsLiveness += t3 - t2;
+            nsRa += t4 - t3;
+
+            numWords += function.rpo.size() * liveness.numWords;
+            for (uint i = 0; i < function.rpo.size(); ++i) {
+                ForEachSetBit(liveness.LiveIn(i), liveness.numWords, [&](uint) { ++numLiveIn; });
+                numInstrs += function.rpo[i]->instructions.size();
+                numMemOps += CountInstrs(*function.rpo[i], Opcode_spill) + CountInstrs(*function.rpo[i], Opcode_load_spilled);
+            }
+        }
+        // Liveness is dense, so it costs per 64-bit word of a block's set, not per live value.
+        printf("  %5u blocks: %5.1f live-in/block, cfg %6.2f ms, dominators %5.2f ms, liveness %7.2f ms "
+               "(%4.2f ns/word), RA 4 regs %7.2f ms (%5.1f ns/live-in), %4.1f%% memory ops\n",
+               numBlocks, double(numLiveIn) / (4.0 * numBlocks), nsCfg / 4e6, nsDominators / 4e6, nsLiveness / 4e6,
+               double(nsLiveness) / double(numWords), nsRa / 4e6, double(nsRa) / double(Max<size_t>(numLiveIn, 1)),
+               100.0 * double(numMemOps) / double(numInstrs));
+    }
+}
+INVOKE_BENCHMARK(GlobalRegAllocBenchmark);
+
+// What the code on edges into blocks with params is made of, and what resolving it costs.
+static void ParallelMoveBenchmark()
+{
+    for (uint reglimit : { 2u, 4u, 8u }) {
+        size_t numEdges = 0, numMoves = 0, numSwaps = 0, numMemOps = 0;
+        uint64_t nsRa = 0;
+        for (uint seed = 0; seed < 8; ++seed) {
+            Module m;
+            Function function;
+            IrBuilder b(m, *function.NewBlock());
+            std::vector<char> names;
+            RandomBlockParams params = { 8, 64, 30, 10, 20, seed };
+            params.recentWindow = reglimit * 2;
+            GenerateRandomFunction(b, function, params, 1000, names);
+
+            function.BuildCfg();
+            function.ComputeDominators();
+            Liveness liveness;
+            ComputeLiveness(function, liveness);
+            uint64_t const t0 = BenchNowNs();
+            GlobalRegisterAllocation(m, function, liveness, reglimit);
+            nsRa += BenchNowNs() - t0;
+
+            for (const Block* const block : function.rpo) {
+                if (block->numSuccs != 1 || block->succs[0]->params.empty())
+                    continue;
+                // Fixups sit right before the jump; local RA doesn't put moves or swaps anywhere.
+                ++numEdges;
+                numMoves += CountInstrs(*block, Opcode_move);
+                numSwaps += CountInstrs(*block, Opcode_swap);
+                for (size_t i = block->instructions.size() - 1; i-- > 0;) {
+                    Opcode const opcode = block->instructions[i]->opcode;
+                    if (opcode != Opcode_move && opcode != Opcode_swap && opcode != Opcode_spill && opcode != Opcode_load_spilled)
+                        break;
+                    numMemOps += opcode == Opcode_spill || opcode == Opcode_load_spilled;
+                }
+            }
+        }
+        printf("  %u regs: %5zu edges with args, per edge %4.2f moves, %4.2f swaps, %4.2f spills/reloads; RA %7.2f ms\n",
+               reglimit, numEdges, double(numMoves) / double(numEdges), double(numSwaps) / double(numEdges),
+               double(numMemOps) / double(numEdges), nsRa / 8e6);
+    }
+
+    // The sequentializer alone, on random permutations with a couple of slots mixed in.
+    std::vector<bool> bRegNeeded(8, true);
+    std::vector<ParallelMove> moves;
+    std::vector<MoveOp> ops;
+    uint64_t ns = 0;
+    size_t numMovesIn = 0, numOpsOut = 0;
+    uint32_t r = 12345;
+    for (uint iter = 0; iter < 100000; ++iter) {
+        moves.clear();
+        uint perm[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+        for (uint i = 7; i > 0; --i) {
+            r = r * 1664525u + 1013904223u;
+            std::swap(perm[i], perm[(r >> 8) % (i + 1)]);
+        }
+        for (uint i = 0; i < 6; ++i) {
+            MoveLoc dst = { i < 5 ? MoveLoc::Reg : MoveLoc::Slot, perm[i] };
+            MoveLoc src = { i != 2 ? MoveLoc::Reg : MoveLoc::Slot, i };
+            moves.push_back({ dst, src });
+        }
+        numMovesIn += moves.size();
+        ops.clear();
+        uint64_t const t0 = BenchNowNs();
+        SequentializeParallelMoves(moves, bRegNeeded, ops);
+        ns += BenchNowNs() - t0;
+        numOpsOut += ops.size();
     }
+    printf("  sequentialize: %5.1f ns/move, %4.2f ops/move\n",
+           double(ns) / double(numMovesIn), double(numOpsOut) / double(numMovesIn));
 }
+INVOKE_BENCHMARK(ParallelMoveBenchmark);
+#endif
 
 
 
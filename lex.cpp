@@ -3,19 +3,6 @@
 #include "utility/common.h"
 #include "utility/str.h"
 
-struct Scanner {
-    const char* pCurrent = nullptr;
-    const char* pSentinel = nullptr;
-    uint        line = 0;
-
-    Scanner(view<const char> source)
-        : pCurrent(source.begin())
-        , pSentinel(source.end())
-        , line(1)
-    {
-    }
-};
-
 static forceinline bool IsNameFirstChar(char c)
 {
     return isalpha_simple(c) || (c == '_');
@@ -68,7 +55,16 @@ static const char* FinishIntegerLiteral(const char* p, Token* token, uint64_t ze
     // FP handled elsewhere
     ASSERT(*p != '.' && (*p | 32) != 'e' && (*p | 31) != 'p');
 
-    if (IsNameTrailerChar(*p)) {
+    // A C++ user-defined literal suffix, which is up to the caller to take or reject (IR text has 1_q for a64).
+    token->xdata.number.udSuffixLength = 0;
+    if (*p == '_') {
+        const char* const suffix = p;
+        while (IsNameTrailerChar(*p))
+            p++;
+        Implemented(p - suffix < 256);
+        token->xdata.number.udSuffixLength = uint8_t(p - suffix);
+    }
+    else if (IsNameTrailerChar(*p)) {
         Implemented(0); // other suffixes (could also be fp literal, like 1e6) or @invalid_source
     }
 
@@ -121,6 +117,8 @@ TokenKind Scanner_ScanToken(Scanner* scanner, Token* token)
                 break;
             }
             p++; // C++ style line comment
+            while (p < pSentinel && *p != '\n')
+                p++;
             continue; // if we got \n, we'll go to that case next in the outer loop
         default:
             break; // for valid source, sentinel/EOF goes down this path
@@ -140,6 +138,11 @@ TokenKind Scanner_ScanToken(Scanner* scanner, Token* token)
     case '}': token->kind = Token_CurlyBraceClose; break;
     case ',': token->kind = Token_Comma;           break;
     case '=': token->kind = Token_Assign;          break;
+    case '(': token->kind = Token_ParenOpen;       break;
+    case ')': token->kind = Token_ParenClose;      break;
+    case ';': token->kind = Token_Semicolon;       break;
+    case '\\': token->kind = Token_Backslash;      break;
+    case '?': token->kind = Token_QuestionMark;    break;
     case '*':
         if (*p == '/') {
             p++;
@@ -309,6 +312,25 @@ static void ScannerTest()
             Verify(t.data.number.nonFpZext64 == testcase.zext);
         }
     }
+
+    // IR text punctuation, a user-defined literal suffix, and line comments.
+    {
+        Scanner sc(R"(qword x\r? = iadd(x\r0, // operand
+-5_q); // no more tokens)"_view);
+        static const TokenKind expected[] = {
+            Token_Name, Token_Name, Token_Backslash, Token_Name, Token_QuestionMark, Token_Assign, Token_Name,
+            Token_ParenOpen, Token_Name, Token_Backslash, Token_Name, Token_Comma, Token_Minus, Token_NumberLiteral,
+            Token_ParenClose, Token_Semicolon,
+        };
+        Token t;
+        uint i = 0;
+        for (; Scanner_ScanToken(&sc, &t) != Token_EOF; i++) {
+            Verify(t.kind == expected[i]);
+            if (t.kind == Token_NumberLiteral)
+                Verify(t.data.number.nonFpZext64 == 5 && t.xdata.number.udSuffixLength == 2 && t.length == 3);
+        }
+        Verify(i == countof(expected));
+    }
 }
 INVOKE_TEST(ScannerTest);
 #endif
@@ -13,6 +13,11 @@ enum TokenKind : uint8_t {
     Token_CurlyBraceClose,  // }
     Token_Comma,            // ,
     Token_Assign,           // =
+    Token_ParenOpen,        // (
+    Token_ParenClose,       // )
+    Token_Semicolon,        // ;
+    Token_Backslash,        // \ (only in IR text, like the \r0 of register annotations)
+    Token_QuestionMark,     // ?
 };
 
 // The kind of type for a high-level C-like language.
@@ -37,19 +42,19 @@ enum Typekind : uint8_t {
     Typekind_u64_alias = Typekind_ulonglong,
 };
 
-forceinline bool IsInteger(Typekind typekind)
+inline forceinline bool IsInteger(Typekind typekind)
 {
     return typekind >= Typekind_s32 &&
            typekind <= Typekind_ulonglong;
 }
 
-forceinline bool IsIntegerOrBool(Typekind typekind)
+inline forceinline bool IsIntegerOrBool(Typekind typekind)
 {
     return typekind >= Typekind_bool &&
            typekind <= Typekind_ulonglong;
 }
 
-forceinline Typekind MakeIntegerUnsigned(Typekind typekind)
+inline forceinline Typekind MakeIntegerUnsigned(Typekind typekind)
 {
     static_assert(Typekind(Typekind_s32       | 1) == Typekind_u32   &&
                   Typekind(Typekind_slong     | 1) == Typekind_ulong &&
@@ -64,6 +69,7 @@ struct Token {
     {
         struct {
             Typekind typekind;
+            uint8_t udSuffixLength; // of a user-defined literal suffix like _q, the last chars of the token, or 0
         } number;
     } xdata;
     uint16_t length;
@@ -80,3 +86,19 @@ struct Token {
         } number;
     } data;
 };
+
+struct Scanner {
+    const char* pCurrent = nullptr;
+    const char* pSentinel = nullptr;
+    uint        line = 0;
+
+    // source[source.length] must be '\0'.
+    Scanner(view<const char> source)
+        : pCurrent(source.begin())
+        , pSentinel(source.end())
+        , line(1)
+    {
+    }
+};
+
+TokenKind Scanner_ScanToken(Scanner* scanner, Token* token);
@@ -6,3 +6,17 @@
 // Could push to head of linked list with string name, then begin of "main" could sort/filter.
 #define INVOKE_TEST(F) static const char s_##F = []() { puts("Running test: " #F "."); F(); return '\0'; }()
 #endif
+
+#if BUILD_BENCHMARKS
+#include <stdio.h>
+#include <stdint.h>
+#include <chrono>
+// Same idea as INVOKE_TEST, should be built with optimizations and without BUILD_TESTS.
+#define INVOKE_BENCHMARK(F) static const char s_##F = []() { puts("Running benchmark: " #F "."); F(); return '\0'; }()
+
+inline uint64_t BenchNowNs()
+{
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+#endif
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include <type_traits>
+
+#include "common.h"
+
+// Bump allocator: everything allocated lives until the arena is destroyed, nothing is freed on its own.
+// Destructors aren't run, so only for trivially destructible things like operand lists.
+class Arena {
+    struct Chunk {
+        Chunk* prev;
+    };
+
+    Chunk* chunks = nullptr;
+    ubyte* cur = nullptr;
+    ubyte* end = nullptr;
+    size_t chunkSize;
+
+public:
+    explicit Arena(size_t chunkSize = 64 * 1024) : chunkSize(chunkSize) { }
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    ~Arena()
+    {
+        while (chunks) {
+            Chunk* const prev = chunks->prev;
+            free(chunks);
+            chunks = prev;
+        }
+    }
+
+    void* Alloc(size_t size, size_t align)
+    {
+        ASSERT(align != 0 && (align & (align - 1)) == 0 && align <= alignof(Chunk));
+        uintptr_t const p = (uintptr_t(cur) + (align - 1)) & ~uintptr_t(align - 1);
+        if (cur == nullptr || p > uintptr_t(end) || size > uintptr_t(end) - p)
+            return AllocSlow(size, align);
+        cur = reinterpret_cast<ubyte*>(p + size);
+        return reinterpret_cast<void*>(p);
+    }
+
+    // Zeroed.
+    template<class T>
+    T* AllocArray(size_t n)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "destructors aren't run");
+        void* const p = Alloc(sizeof(T) * n, alignof(T));
+        memset(p, 0, sizeof(T) * n);
+        return static_cast<T*>(p);
+    }
+
+private:
+    // Allocations bigger than a quarter chunk get their own chunk, so the current one isn't wasted.
+    outline void* AllocSlow(size_t size, size_t align)
+    {
+        bool const bOwnChunk = size > chunkSize / 4;
+        size_t const payload = bOwnChunk ? size + align : chunkSize;
+        Chunk* const chunk = static_cast<Chunk*>(malloc(sizeof(Chunk) + payload));
+        Verify(chunk != nullptr);
+        ubyte* const begin = reinterpret_cast<ubyte*>(chunk + 1);
+        if (bOwnChunk && chunks) {
+            // Behind the current chunk in the list, which keeps bumping.
+            chunk->prev = chunks->prev;
+            chunks->prev = chunk;
+            uintptr_t const p = (uintptr_t(begin) + (align - 1)) & ~uintptr_t(align - 1);
+            return reinterpret_cast<void*>(p);
+        }
+        chunk->prev = chunks;
+        chunks = chunk;
+        cur = begin;
+        end = begin + payload;
+        return Alloc(size, align);
+    }
+};
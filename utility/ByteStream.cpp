@@ -1,5 +1,15 @@
 #include "ByteStream.h"
+#include <condition_variable>
+#include <errno.h>
+#include <mutex>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <thread>
+#if defined _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
 // May set error or overflow (FixedBuffer) flags.
 // May change begin/end/cap.
@@ -7,6 +17,9 @@ bool ByteStream::Flush()
 {
     switch (mode) {
     case FlushMode::FixedBuffer: return static_cast<FixedBufferByteStream*>(this)->Flush();
+    case FlushMode::File: return static_cast<FileByteStream*>(this)->Flush();
+    case FlushMode::AsyncFile: return static_cast<AsyncFileByteStream*>(this)->HandOff();
+    case FlushMode::Memory: return static_cast<MemoryByteStream*>(this)->Flush();
     default: unreachable;
     }
 }
@@ -90,6 +103,166 @@ void ByteStream::_printf_helper(_Printf_format_string_ char const* const fmt, ..
     }
 }
 
+FileByteStream::FileByteStream(int fd, uint32_t capacity) : ByteStream(FlushMode::File), fd(fd)
+{
+    ASSERT(capacity != 0);
+
+    begin = static_cast<ubyte*>(malloc(capacity));
+    Verify(begin != nullptr);
+    end = begin;
+    cap = begin + capacity;
+}
+
+FileByteStream::~FileByteStream()
+{
+    Flush();
+    free(begin);
+}
+
+static bool WriteAll(int fd, const ubyte* p, const ubyte* end)
+{
+    while (p != end) {
+#if defined _WIN32
+        int const n = _write(fd, p, unsigned(Min<size_t>(end - p, 1u << 30)));
+#else
+        ssize_t const n = write(fd, p, Min<size_t>(end - p, 1u << 30));
+#endif
+        if (n > 0)
+            p += n;
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else
+            return false;
+    }
+    return true;
+}
+
+bool FileByteStream::Flush()
+{
+    // After an error the buffered bytes are dropped and every later Flush fails, which drops later puts too.
+    error = error || !WriteAll(fd, begin, end);
+    end = begin;
+    return !error;
+}
+
+// The thread waits for a buffer to be handed to it, writes it, and gives it back by clearing pending.
+struct AsyncFileByteStream::Writer {
+    int fd;
+    std::mutex mutex;
+    std::condition_variable cv; // for both sides, there is one waiter on each at most
+    const ubyte* pending = nullptr; // the buffer being written, null when there is none
+    const ubyte* pendingEnd = nullptr;
+    bool bError = false;
+    bool bStop = false;
+    std::thread thread;
+
+    explicit Writer(int fd) : fd(fd), thread([this]() { Main(); }) { }
+
+    void Main()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            cv.wait(lock, [this]() { return pending != nullptr || bStop; });
+            if (pending == nullptr)
+                return;
+            const ubyte* const p = pending;
+            const ubyte* const e = pendingEnd;
+            bool const bSkip = bError; // after an error the rest is dropped, as by FileByteStream
+            lock.unlock();
+            bool const bOk = bSkip || WriteAll(fd, p, e);
+            lock.lock();
+            bError = bError || !bOk;
+            pending = nullptr;
+            cv.notify_all();
+        }
+    }
+
+    // Returns false if a write failed.
+    bool WaitIdle(std::unique_lock<std::mutex>& lock)
+    {
+        cv.wait(lock, [this]() { return pending == nullptr; });
+        return !bError;
+    }
+};
+
+AsyncFileByteStream::AsyncFileByteStream(int fd, uint32_t capacity) : ByteStream(FlushMode::AsyncFile), capacity(capacity)
+{
+    ASSERT(capacity != 0);
+
+    buffers[0] = static_cast<ubyte*>(malloc(capacity));
+    buffers[1] = static_cast<ubyte*>(malloc(capacity));
+    Verify(buffers[0] != nullptr && buffers[1] != nullptr);
+    begin = buffers[0];
+    end = begin;
+    cap = begin + capacity;
+    writer = new Writer(fd);
+}
+
+AsyncFileByteStream::~AsyncFileByteStream()
+{
+    Flush();
+    {
+        std::lock_guard<std::mutex> lock(writer->mutex);
+        writer->bStop = true;
+    }
+    writer->cv.notify_all();
+    writer->thread.join();
+    delete writer;
+    free(buffers[0]);
+    free(buffers[1]);
+}
+
+bool AsyncFileByteStream::HandOff()
+{
+    std::unique_lock<std::mutex> lock(writer->mutex);
+    error = !writer->WaitIdle(lock);
+    if (!error && end != begin) {
+        writer->pending = begin;
+        writer->pendingEnd = end;
+        writer->cv.notify_all();
+        begin = begin == buffers[0] ? buffers[1] : buffers[0];
+        cap = begin + capacity;
+    }
+    end = begin;
+    return !error;
+}
+
+bool AsyncFileByteStream::Flush()
+{
+    HandOff();
+    std::unique_lock<std::mutex> lock(writer->mutex);
+    error = !writer->WaitIdle(lock);
+    return !error;
+}
+
+MemoryByteStream::MemoryByteStream(size_t capacity) : ByteStream(FlushMode::Memory)
+{
+    ASSERT(capacity != 0);
+
+    begin = static_cast<ubyte*>(malloc(capacity));
+    Verify(begin != nullptr);
+    end = begin;
+    cap = begin + capacity;
+}
+
+MemoryByteStream::~MemoryByteStream()
+{
+    free(begin);
+}
+
+bool MemoryByteStream::Flush()
+{
+    if (end != cap)
+        return true;
+    size_t const size = size_t(end - begin);
+    ubyte* const grown = static_cast<ubyte*>(realloc(begin, size * 2));
+    Verify(grown != nullptr);
+    begin = grown;
+    end = grown + size;
+    cap = grown + size * 2;
+    return true;
+}
+
 /*
 Ideas:
 
@@ -100,6 +273,8 @@ Flush(): return view or scalar room?
 
 
 #if BUILD_TESTS
+#include <stdio.h>
+#include <vector>
 #include "str.h"
 MSVC_PRAGMA(warning(push))
 MSVC_PRAGMA(warning(disable : 4464)) // C4464: relative include path contains '..'
@@ -197,6 +372,214 @@ UtilStringTest()
         Verify(v.length < sizeof(buf) - 1 && buf[bs.WrappedSize()] == ';' && bs.WrappedSize() == v.length);
         Verify(memcmp(buf, v.ptr, v.length) == 0);
     }
+    {
+        // The same through ByteStream_format, into a buffer too small for the literal runs to take the fast path.
+        MemoryByteStream bs(4);
+        char const hello[] = "hello";
+        ByteStream_format(bs, "s=%d, u=%u, s=%s, c=%c, percent=%%100", -1, 4'000'000'123u, hello, '^');
+        ByteStream_format(bs, "%%");
+        ByteStream_format(bs, "%d%s", INT32_MIN, "");
+
+        view<const char> v = "s=-1, u=4000000123, s=hello, c=^, percent=%100%-2147483648"_view;
+        Verify(bs.Size() == v.length && memcmp(bs.Data(), v.ptr, v.length) == 0);
+    }
 }
 INVOKE_TEST(UtilStringTest);
+
+static void IntegerFormatTest()
+{
+    // Around every power of 2 and of 10, and random values of every length.
+    std::vector<uint64_t> values = { 0, UINT64_MAX };
+    for (uint i = 0; i < 64; ++i) {
+        for (uint64_t v : { uint64_t(1) << i, (uint64_t(1) << i) - 1, (uint64_t(1) << i) + 1 })
+            values.push_back(v);
+    }
+    for (uint64_t power = 10; power <= 10'000'000'000'000'000'000ull; power *= 10) {
+        for (uint64_t v : { power - 1, power, power + 1 })
+            values.push_back(v);
+        if (power > UINT64_MAX / 10)
+            break;
+    }
+    uint64_t state = 1;
+    for (uint i = 0; i < 2000; ++i) {
+        uint64_t z = state += 0x9E37'79B9'7F4A'7C15ull;
+        z = (z ^ (z >> 30)) * 0xBF58'476D'1CE4'E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D0'49BB'1331'11EBull;
+        values.push_back((z ^ (z >> 31)) >> (i % 64));
+    }
+
+    // Each into a stream with room and into one without, which stages the bytes.
+    auto check = [](const char* expected, void (*print)(ByteStream&, uint64_t), uint64_t v) {
+        size_t const n = strlen(expected);
+        MemoryByteStream roomy(256);
+        print(roomy, v);
+        Verify(roomy.Size() == n && memcmp(roomy.Data(), expected, n) == 0);
+        MemoryByteStream tight(1);
+        tight.PutByte('<');
+        print(tight, v);
+        Verify(tight.Size() == n + 1 && memcmp(tight.Data() + 1, expected, n) == 0);
+    };
+    for (uint64_t v : values) {
+        char expected[64];
+        snprintf(expected, sizeof expected, "%llu", (unsigned long long)v);
+        Verify(DecimalDigitCount(v) == strlen(expected));
+        check(expected, [](ByteStream& bs, uint64_t v) { Print(bs, v); }, v);
+        snprintf(expected, sizeof expected, "%lld", (long long)v);
+        check(expected, [](ByteStream& bs, uint64_t v) { Print(bs, int64_t(v)); }, v);
+        snprintf(expected, sizeof expected, "%u", uint32_t(v));
+        check(expected, [](ByteStream& bs, uint64_t v) { Print(bs, uint32_t(v)); }, v);
+        snprintf(expected, sizeof expected, "%d", int32_t(v));
+        check(expected, [](ByteStream& bs, uint64_t v) { Print(bs, int32_t(v)); }, v);
+        snprintf(expected, sizeof expected, "%llx", (unsigned long long)v);
+        check(expected, [](ByteStream& bs, uint64_t v) { Print(bs, Hex(v)); }, v);
+        snprintf(expected, sizeof expected, "%08llx", (unsigned long long)v);
+        check(expected, [](ByteStream& bs, uint64_t v) { Print(bs, Hex(v, 8)); }, v);
+        snprintf(expected, sizeof expected, "%020llx", (unsigned long long)v);
+        check(expected, [](ByteStream& bs, uint64_t v) { Print(bs, Hex(v, 20)); }, v);
+        snprintf(expected, sizeof expected, "%12d", int32_t(v));
+        check(expected, [](ByteStream& bs, uint64_t v) { Print(bs, Padded(int32_t(v), 12)); }, v);
+        snprintf(expected, sizeof expected, "%06lld", (long long)v);
+        check(expected, [](ByteStream& bs, uint64_t v) { Print(bs, Padded(int64_t(v), 6, '0')); }, v);
+        snprintf(expected, sizeof expected, "%24llu", (unsigned long long)v);
+        check(expected, [](ByteStream& bs, uint64_t v) { Print(bs, Padded(v, 24)); }, v);
+    }
+    {
+        MemoryByteStream bs(256);
+        Print(bs, Padded(7u, 3, '*'), "|", Hex(0xABCu, 1), "|", Padded(-1, 0));
+        view<const char> v = "**7|abc|-1"_view;
+        Verify(bs.Size() == v.length && memcmp(bs.Data(), v.ptr, v.length) == 0);
+    }
+}
+INVOKE_TEST(IntegerFormatTest);
+
+static void ByteStreamSinkTest()
+{
+    // The same bytes as the puts, across growth or many buffers.
+    std::vector<ubyte> expected;
+    for (uint i = 0; i < 3000; ++i) {
+        char line[32];
+        int const n = snprintf(line, sizeof line, "line %u\n", i);
+        expected.insert(expected.end(), line, line + n);
+    }
+    auto putAll = [](ByteStream& bs) {
+        for (uint i = 0; i < 3000; ++i)
+            ByteStream_printf(bs, "line %u\n", i);
+    };
+    {
+        MemoryByteStream bs(4);
+        putAll(bs);
+        Verify(bs.Size() == expected.size() && memcmp(bs.Data(), expected.data(), expected.size()) == 0);
+        bs.Clear();
+        bs.PutBytes("x", 1);
+        Verify(bs.Size() == 1 && bs.Data()[0] == 'x');
+    }
+#if !defined _WIN32
+    for (uint32_t capacity : { 1u, 7u, 4096u }) {
+        char path[] = "/tmp/tc_bytestream_test_XXXXXX";
+        int const fd = mkstemp(path);
+        Verify(fd >= 0);
+        {
+            AsyncFileByteStream bs(fd, capacity);
+            putAll(bs);
+            Verify(bs.Flush());
+            ubyte buf[16];
+            Verify(lseek(fd, 0, SEEK_CUR) == off_t(expected.size()) && pread(fd, buf, sizeof buf, 0) == sizeof buf);
+            Verify(memcmp(buf, expected.data(), sizeof buf) == 0);
+            bs.PutBytes("tail", 4); // written by the destructor
+        }
+        std::vector<ubyte> got(expected.size() + 8);
+        Verify(pread(fd, got.data(), got.size(), 0) == ssize_t(expected.size() + 4));
+        Verify(memcmp(got.data(), expected.data(), expected.size()) == 0 && memcmp(&got[expected.size()], "tail", 4) == 0);
+        Verify(close(fd) == 0 && unlink(path) == 0);
+    }
+    {
+        AsyncFileByteStream bs(-1, 8);
+        putAll(bs);
+        Verify(!bs.Flush() && bs.Error());
+    }
+#endif
+}
+INVOKE_TEST(ByteStreamSinkTest);
+#endif
+
+#if BUILD_BENCHMARKS
+#include <stdio.h>
+#include <vector>
+MSVC_PRAGMA(warning(push))
+MSVC_PRAGMA(warning(disable : 4464)) // C4464: relative include path contains '..'
+#include "../tc_common.h"
+MSVC_PRAGMA(warning(pop))
+
+// How Print(ByteStream&, uint64_t) used to work: a division per digit into a staging buffer, then PutBytes.
+static void PrintStaged(ByteStream& bs, uint64_t ui)
+{
+    char stage[24], *p = endof(stage);
+    do {
+        *--p = (ui % 10u) + '0';
+        ui /= 10u;
+    } while (ui);
+    bs.PutBytes(p, endof(stage) - p);
+}
+
+// Each kernel over a million values of a few length distributions, into a buffer that wraps.
+static void IntegerFormatBenchmark()
+{
+    struct Distribution {
+        const char* name;
+        uint64_t (*make)(uint64_t random);
+    };
+    static const Distribution distributions[] = {
+        { "1-2 digits  ", [](uint64_t r) { return r % 100; } },
+        { "1-5 digits  ", [](uint64_t r) { return r % 100'000; } },
+        { "uint32      ", [](uint64_t r) { return r >> 32; } },
+        { "uint64      ", [](uint64_t r) { return r; } },
+        { "any length  ", [](uint64_t r) { return r >> (r % 64); } },
+    };
+    struct Kernel {
+        const char* name;
+        void (*print)(ByteStream& bs, uint64_t v);
+    };
+    static const Kernel kernels[] = {
+        { "staged", PrintStaged },
+        { "snprintf %llu", [](ByteStream& bs, uint64_t v) {
+            char stage[24];
+            bs.PutBytes(stage, uint(snprintf(stage, sizeof stage, "%llu", (unsigned long long)v)));
+        } },
+        { "Print", [](ByteStream& bs, uint64_t v) { Print(bs, v); } },
+        { "Padded 20 '0'", [](ByteStream& bs, uint64_t v) { Print(bs, Padded(v, 20, '0')); } },
+        { "snprintf %llx", [](ByteStream& bs, uint64_t v) {
+            char stage[24];
+            bs.PutBytes(stage, uint(snprintf(stage, sizeof stage, "%llx", (unsigned long long)v)));
+        } },
+        { "Hex(v)", [](ByteStream& bs, uint64_t v) { Print(bs, Hex(v)); } },
+        { "Hex(v, 16)", [](ByteStream& bs, uint64_t v) { Print(bs, Hex(v, 16)); } },
+    };
+
+    printf("  ns/number   ");
+    for (const Kernel& kernel : kernels)
+        printf("%14s", kernel.name);
+    printf("\n");
+    std::vector<uint64_t> values(1'000'000);
+    std::vector<ubyte> buf(1 << 16);
+    for (const Distribution& distribution : distributions) {
+        uint64_t state = 1;
+        for (uint64_t& v : values) {
+            uint64_t z = state += 0x9E37'79B9'7F4A'7C15ull;
+            z = (z ^ (z >> 30)) * 0xBF58'476D'1CE4'E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D0'49BB'1331'11EBull;
+            v = distribution.make(z ^ (z >> 31));
+        }
+        printf("  %s", distribution.name);
+        for (const Kernel& kernel : kernels) {
+            FixedBufferByteStream bs(buf.data(), uint32_t(buf.size()));
+            uint64_t const t0 = BenchNowNs();
+            for (uint64_t v : values)
+                kernel.print(bs, v);
+            uint64_t const t1 = BenchNowNs();
+            printf("%14.1f", double(t1 - t0) / double(values.size()));
+        }
+        printf("\n");
+    }
+}
+INVOKE_BENCHMARK(IntegerFormatBenchmark);
 #endif
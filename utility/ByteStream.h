@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string.h>
+#include <type_traits>
 
 #include "common.h"
 
@@ -8,6 +9,9 @@ class ByteStream {
 protected:
     enum class FlushMode : uint8_t {
         FixedBuffer, // fixed capacity externally owned buffer
+        File,        // owned buffer written to a file descriptor when full
+        AsyncFile,   // two owned buffers, one written to a file descriptor by a thread while the other fills
+        Memory,      // owned buffer that grows when full
     };
 
     ubyte* begin = nullptr;
@@ -16,6 +20,7 @@ protected:
 
     FlushMode mode;
     bool overflowed = false; // only used by FixedBuffer
+    bool error = false;      // only used by File and AsyncFile
 
     ByteStream(FlushMode mode) : mode(mode) { }
 
@@ -49,34 +54,201 @@ public:
         }
     }
 
+    // Same as PutBytes, but the copy is inline when there is room. For short runs of known length.
+    forceinline void PutBytesFast(const void* src, size_t n)
+    {
+        ubyte* p = end;
+        if (size_t(cap - p) >= n) {
+            memcpy(p, src, n);
+            end = p + n;
+        }
+        else {
+            PutBytes(src, n);
+        }
+    }
+
+    // For writing straight into the buffer: if there are n bytes of room, returns where they begin, else nullptr.
+    // The caller writes up to n bytes there and passes the end of what it wrote to Commit.
+    forceinline ubyte* TryReserve(size_t n)
+    {
+        return size_t(cap - end) >= n ? end : nullptr;
+    }
+
+    forceinline void Commit(ubyte* newEnd)
+    {
+        ASSERT(newEnd >= end && newEnd <= cap);
+        end = newEnd;
+    }
+
     void _printf_helper(_Printf_format_string_ char const* const fmt, ...);
 };
 
-inline void Print(ByteStream& bs, uint64_t ui)
+// Number of decimal digits in v, 1 for 0.
+// t = floor(log10(2) * bit length) is the count or one less, and comparing with 10^t tells which.
+inline uint DecimalDigitCount(uint64_t v)
 {
-    // Number of bytes to write is { 1 + floor(log10(ui)) }.
-    // Based on current room in stream buffer and value of ui, could try a fast-path
-    // instead of always writing to staging buffer first.
-
-    char stage[24], *p = endof(stage);
-    do {
-        *--p = (ui % 10u) + '0';
-        ui /= 10u;
-    } while (ui);
-    bs.PutBytes(p, endof(stage) - p);
+    static constexpr uint64_t powers[] = {
+        0, 10u, 100u, 1000u, 10000u, 100000u,
+        1000000u, 10000000u, 100000000u, 1000000000u, 10000000000ull,
+        100000000000ull, 1000000000000ull, 10000000000000ull, 100000000000000ull, 1000000000000000ull,
+        10000000000000000ull, 100000000000000000ull, 1000000000000000000ull, 10000000000000000000ull
+    };
+    uint const t = uint(bsr64(v | 1) + 1) * 1233 >> 12;
+    return t + 1 - (v < powers[t]);
 }
 
-inline void Print(ByteStream& bs, int64_t si)
+// "00", "01", ..., "99".
+inline const char* DecimalDigitPairs()
 {
-    if (si < 0) {
-        bs.PutByte('-');
-        si = -si;
+    static constexpr char pairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+    return pairs;
+}
+
+// Writes the decimal digits of v so the last is just before last and returns the first, two at a time from
+// a table of digit pairs so there is half the divisions.
+inline char* WriteDecimalBackwards(char* last, uint32_t v)
+{
+    const char* const pairs = DecimalDigitPairs();
+    while (v >= 100) {
+        uint32_t const q = v / 100;
+        last -= 2;
+        memcpy(last, &pairs[(v - q * 100) * 2], 2);
+        v = q;
+    }
+    if (v >= 10) {
+        last -= 2;
+        memcpy(last, &pairs[v * 2], 2);
     }
-    Print(bs, uint64_t(si));
+    else {
+        *--last = char('0' + v);
+    }
+    return last;
 }
 
-inline void Print(ByteStream& bs, uint32_t ui) { Print(bs, uint64_t(ui)); }
-inline void Print(ByteStream& bs, int32_t si) { Print(bs, int64_t(si)); }
+inline char* WriteDecimalBackwards(char* last, uint64_t v)
+{
+    // Eight digits at a time in 32-bit arithmetic, which has cheaper divisions, until the rest fits in 32 bits.
+    const char* const pairs = DecimalDigitPairs();
+    while (v >> 32) {
+        uint64_t const q = v / 100'000'000;
+        uint32_t eight = uint32_t(v - q * 100'000'000);
+        for (uint i = 0; i < 4; ++i) {
+            uint32_t const q2 = eight / 100;
+            last -= 2;
+            memcpy(last, &pairs[(eight - q2 * 100) * 2], 2);
+            eight = q2;
+        }
+        v = q;
+    }
+    return WriteDecimalBackwards(last, uint32_t(v));
+}
+
+// The 8 hex digits of v in lowercase ASCII, most significant in the low byte, so storing the word little-endian
+// writes them in order. Moves each nibble to its own byte with shifts and masks, then adds '0' to all of them and
+// 'a' - '0' - 10 more to those above 9.
+inline uint64_t HexDigits8(uint32_t v)
+{
+    uint64_t x = (uint64_t(v & 0xFFFF) << 32) | (v >> 16);
+    x = ((x & 0x0000'00FF'0000'00FFull) << 16) | ((x >> 8) & 0x0000'00FF'0000'00FFull);
+    x = ((x & 0x000F'000F'000F'000Full) << 8) | ((x >> 4) & 0x000F'000F'000F'000Full);
+    uint64_t const letters = ((x + 0x0606'0606'0606'0606ull) >> 4) & 0x0101'0101'0101'0101ull;
+    return x + 0x3030'3030'3030'3030ull + letters * ('a' - '0' - 10);
+}
+
+// The decimal Prints write straight into the stream when it has room for the whole number, else into a staging
+// buffer for PutBytes.
+template<class T>
+inline void PrintDecimal(ByteStream& bs, T magnitude, bool negative)
+{
+    uint const length = DecimalDigitCount(magnitude) + negative;
+    char stage[24];
+    char* const dst = reinterpret_cast<char*>(bs.TryReserve(length));
+    char* const p = dst ? dst : stage;
+    p[0] = '-'; // the first digit when not negative
+    WriteDecimalBackwards(p + length, magnitude);
+    if (dst)
+        bs.Commit(reinterpret_cast<ubyte*>(dst + length));
+    else
+        bs.PutBytes(stage, length);
+}
+
+inline void Print(ByteStream& bs, uint64_t ui) { PrintDecimal(bs, ui, false); }
+inline void Print(ByteStream& bs, int64_t si) { PrintDecimal(bs, si < 0 ? 0 - uint64_t(si) : uint64_t(si), si < 0); }
+inline void Print(ByteStream& bs, uint32_t ui) { PrintDecimal(bs, ui, false); }
+inline void Print(ByteStream& bs, int32_t si) { PrintDecimal(bs, si < 0 ? 0 - uint32_t(si) : uint32_t(si), si < 0); }
+
+// Print(bs, Hex(v)) writes v in lowercase hex without a prefix, Hex(v, 8) pads it with zeros to at least 8 digits.
+struct Hex {
+    uint64_t value;
+    uint minDigits;
+
+    explicit Hex(uint64_t value, uint minDigits = 0) : value(value), minDigits(minDigits) { }
+};
+
+inline void Print(ByteStream& bs, Hex hex)
+{
+    if (hex.minDigits > 16) {
+        bs.PutByteRepeated('0', hex.minDigits - 16);
+        hex.minDigits = 16;
+    }
+    uint const length = Max(uint(bsr64(hex.value | 1)) / 4 + 1, hex.minDigits);
+    // All 16 digits are made with the wanted ones first, and the rest are written past the end or not at all.
+    uint64_t const v = hex.value << (64 - 4 * length);
+    uint64_t const words[2] = { HexDigits8(uint32_t(v >> 32)), HexDigits8(uint32_t(v)) };
+    if (ubyte* const dst = bs.TryReserve(sizeof words)) {
+        memcpy(dst, words, sizeof words);
+        bs.Commit(dst + length);
+    }
+    else {
+        bs.PutBytes(words, length);
+    }
+}
+
+// Print(bs, Padded(v, 6)) right-aligns v in 6 columns with spaces, Padded(v, 6, '0') pads with zeros after any
+// sign instead, like %06d. Numbers wider than that are written whole.
+struct Padded {
+    uint64_t magnitude;
+    uint width;
+    char fill;
+    bool negative;
+
+    Padded(uint64_t v, uint width, char fill = ' ') : magnitude(v), width(width), fill(fill), negative(false) { }
+    Padded(int64_t v, uint width, char fill = ' ')
+        : magnitude(v < 0 ? 0 - uint64_t(v) : uint64_t(v)), width(width), fill(fill), negative(v < 0) { }
+    Padded(uint32_t v, uint width, char fill = ' ') : Padded(uint64_t(v), width, fill) { }
+    Padded(int32_t v, uint width, char fill = ' ') : Padded(int64_t(v), width, fill) { }
+};
+
+inline void Print(ByteStream& bs, Padded padded)
+{
+    uint const numDigits = DecimalDigitCount(padded.magnitude);
+    uint const length = numDigits + padded.negative;
+    uint const pad = padded.width > length ? padded.width - length : 0;
+    bool const bZeros = padded.fill == '0';
+    char* p = reinterpret_cast<char*>(bs.TryReserve(size_t(length) + pad));
+    if (p == nullptr) {
+        if (!bZeros)
+            bs.PutByteRepeated(ubyte(padded.fill), pad);
+        if (padded.negative)
+            bs.PutByte('-');
+        if (bZeros)
+            bs.PutByteRepeated('0', pad);
+        PrintDecimal(bs, padded.magnitude, false);
+        return;
+    }
+    if (!bZeros) {
+        memset(p, padded.fill, pad);
+        p += pad;
+    }
+    if (padded.negative)
+        *p++ = '-';
+    if (bZeros) {
+        memset(p, '0', pad);
+        p += pad;
+    }
+    WriteDecimalBackwards(p + numDigits, padded.magnitude);
+    bs.Commit(reinterpret_cast<ubyte*>(p + numDigits));
+}
 
 inline void Print(ByteStream& bs, const char* str)
 {
@@ -92,6 +264,100 @@ inline void Print(ByteStream& bs, view<const char> v)
 // libc functions are always checked though, so "call" one inside sizeof so there is not a side effect.
 #define ByteStream_printf(bs_ref, ...) ((void)sizeof printf(__VA_ARGS__), (bs_ref)._printf_helper(__VA_ARGS__))
 
+// ByteStream_format(bs, "...", args...) takes the same conversions as ByteStream_printf (%u %d %s %c %%), but the
+// format string is parsed at compile time: each run of literal text becomes a PutBytesFast of known length and each
+// conversion a Print of its argument, with nothing left to do at runtime. An argument of the wrong type, or a
+// conversion without one, is a compile error. The format must be a string literal, ByteStream_printf takes any.
+struct ByteStreamFormat {
+    // Index of the next '%' or of the terminator.
+    static constexpr size_t RunEnd(const char* fmt, size_t i)
+    {
+        while (fmt[i] != '\0' && fmt[i] != '%')
+            ++i;
+        return i;
+    }
+
+    // Fmt::Get() returns the format, I is where the rest of it begins.
+    template<class Fmt, size_t I, class... Args>
+    static forceinline void From(ByteStream& bs, Args... args)
+    {
+        constexpr const char* fmt = Fmt::Get();
+        constexpr size_t end = RunEnd(fmt, I);
+        if (end != I)
+            bs.PutBytesFast(fmt + I, end - I);
+        // A '%' ending the format is passed on as '\1', which no conversion takes.
+        constexpr char c = fmt[end] == '\0' ? '\0' : fmt[end + 1] == '\0' ? '\1' : fmt[end + 1];
+        Conversion<Fmt, end + 2>(std::integral_constant<char, c>(), bs, args...);
+    }
+
+    template<class Fmt, size_t Next, class... Args>
+    static forceinline void Conversion(std::integral_constant<char, '\0'>, ByteStream&, Args...)
+    {
+        static_assert(sizeof...(Args) == 0, "more arguments than conversions");
+    }
+
+    template<class Fmt, size_t Next, class... Args>
+    static forceinline void Conversion(std::integral_constant<char, '%'>, ByteStream& bs, Args... args)
+    {
+        bs.PutByteFast('%');
+        From<Fmt, Next>(bs, args...);
+    }
+
+    template<class Fmt, size_t Next, class T, class... Args>
+    static forceinline void Conversion(std::integral_constant<char, 'u'>, ByteStream& bs, T value, Args... args)
+    {
+        static_assert(std::is_unsigned<T>::value && !std::is_same<T, bool>::value && sizeof(T) <= 4, "%u takes an unsigned int");
+        Print(bs, uint32_t(value));
+        From<Fmt, Next>(bs, args...);
+    }
+
+    template<class Fmt, size_t Next, class T, class... Args>
+    static forceinline void Conversion(std::integral_constant<char, 'd'>, ByteStream& bs, T value, Args... args)
+    {
+        static_assert(std::is_signed<T>::value && std::is_integral<T>::value && sizeof(T) <= 4, "%d takes an int");
+        Print(bs, int32_t(value));
+        From<Fmt, Next>(bs, args...);
+    }
+
+    template<class Fmt, size_t Next, class T, class... Args>
+    static forceinline void Conversion(std::integral_constant<char, 's'>, ByteStream& bs, T value, Args... args)
+    {
+        static_assert(std::is_convertible<T, const char*>::value, "%s takes a const char*");
+        Print(bs, static_cast<const char*>(value));
+        From<Fmt, Next>(bs, args...);
+    }
+
+    template<class Fmt, size_t Next, class T, class... Args>
+    static forceinline void Conversion(std::integral_constant<char, 'c'>, ByteStream& bs, T value, Args... args)
+    {
+        static_assert(std::is_same<T, char>::value, "%c takes a char");
+        bs.PutByteFast(ubyte(value));
+        From<Fmt, Next>(bs, args...);
+    }
+
+    // Anything not matched above.
+    template<class Fmt, size_t Next, char C, class... Args>
+    static void Conversion(std::integral_constant<char, C>, ByteStream&, Args...)
+    {
+        static_assert(C == 'u' || C == 'd' || C == 's' || C == 'c', "not one of %u %d %s %c %%");
+        static_assert(C != C, "more conversions than arguments");
+    }
+};
+
+template<class Fmt, class... Args>
+inline void ByteStream_FormatImpl(Fmt, ByteStream& bs, const char*, Args... args)
+{
+    ByteStreamFormat::From<Fmt, 0>(bs, args...);
+}
+
+// The format is returned by a constexpr function of a local class, whose type is the template argument.
+#define ByteStream_FIRST_(fmt, ...) fmt
+#define ByteStream_EXPAND_(x) x
+#define ByteStream_format(bs_ref, ...) ByteStream_FormatImpl([]() {                                          \
+        struct Fmt { static constexpr const char* Get() { return ByteStream_EXPAND_(ByteStream_FIRST_(__VA_ARGS__, 0)); } }; \
+        return Fmt();                                                                                        \
+    }(), (bs_ref), __VA_ARGS__)
+
 template<typename T, typename... Args>
 inline void Print(ByteStream& bs, T value, Args... args)
 {
@@ -128,3 +394,69 @@ public:
     bool Overflowed() const { return overflowed; }
     bool ClearOverflowed() { overflowed = false; }
 };
+
+// Writes go through the buffer, so the file sees a few big writes whatever the granularity of the puts.
+// The descriptor isn't owned, the caller opens it and closes it after the stream is destroyed or flushed.
+class FileByteStream : public ByteStream {
+    int fd;
+
+public:
+    FileByteStream(const FileByteStream&) = delete;
+    FileByteStream& operator=(const FileByteStream&) = delete;
+
+    explicit FileByteStream(int fd, uint32_t capacity = 64 * 1024);
+    ~FileByteStream();
+
+    // Writes everything buffered, returns false if this or an earlier write failed.
+    bool Flush();
+
+    bool Error() const { return error; }
+};
+
+// Same as FileByteStream, but when the buffer is full it is handed to a thread that writes it, and puts go on into
+// a second buffer. So formatting and writing overlap, and puts only wait when the thread is still writing the
+// buffer handed to it before. The descriptor isn't owned either.
+class AsyncFileByteStream : public ByteStream {
+    friend class ByteStream;
+    struct Writer;
+
+    Writer* writer;
+    ubyte* buffers[2];
+    uint32_t capacity;
+
+    // Waits until the thread is done with the other buffer, then hands it this one and switches to that.
+    bool HandOff();
+
+public:
+    AsyncFileByteStream(const AsyncFileByteStream&) = delete;
+    AsyncFileByteStream& operator=(const AsyncFileByteStream&) = delete;
+
+    explicit AsyncFileByteStream(int fd, uint32_t capacity = 1024 * 1024);
+    ~AsyncFileByteStream();
+
+    // Writes everything buffered and waits until it's written, returns false if this or an earlier write failed.
+    bool Flush();
+
+    bool Error() const { return error; }
+};
+
+// Everything put stays in memory, the buffer doubles when full. For output of unknown size that is wanted whole,
+// like a dump printed before it's written somewhere.
+class MemoryByteStream : public ByteStream {
+public:
+    MemoryByteStream(const MemoryByteStream&) = delete;
+    MemoryByteStream& operator=(const MemoryByteStream&) = delete;
+
+    explicit MemoryByteStream(size_t capacity = 64 * 1024);
+    ~MemoryByteStream();
+
+    // Grows the buffer if it's full, there is nothing else to flush.
+    bool Flush();
+
+    // Valid until the next put.
+    const ubyte* Data() const { return begin; }
+    size_t Size() const { return size_t(end - begin); }
+
+    // Keeps the buffer.
+    void Clear() { end = begin; }
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+
+// Threads that run loops of independent tasks, like compiling every function of a module.
+// ParallelFor splits the indices into one contiguous range per thread; a thread takes indices from the front
+// of its own range, and when that is empty it steals the back half of another's. So uneven tasks still keep
+// every thread busy, and a thread only touches another's range (and its lock) when it runs out of work.
+// The thread calling ParallelFor is worker 0 and the others wait between loops, so nothing is created per loop.
+class WorkStealingPool {
+    // On its own cache line, the owner writes it for every index it takes.
+    struct alignas(64) Range {
+        std::mutex mutex;
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    std::vector<std::thread> threads; // workers 1 and up
+    std::vector<Range> ranges;        // by worker
+
+    std::mutex mutex; // for the rest
+    std::condition_variable startCv;
+    std::condition_variable doneCv;
+    uint64_t generation = 0; // incremented for each loop, and to stop
+    uint numRunning = 0;     // workers 1 and up still in the current loop
+    bool bStop = false;
+
+    void (*fn)(void* context, size_t index, uint worker) = nullptr;
+    void* context = nullptr;
+
+public:
+    // numThreads includes the calling thread, so 1 runs everything on it.
+    explicit WorkStealingPool(uint numThreads) : ranges(numThreads)
+    {
+        Verify(numThreads != 0);
+        threads.reserve(numThreads - 1);
+        for (uint worker = 1; worker < numThreads; ++worker)
+            threads.emplace_back([this, worker]() { WorkerMain(worker); });
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            bStop = true;
+            generation++;
+        }
+        startCv.notify_all();
+        for (std::thread& thread : threads)
+            thread.join();
+    }
+
+    uint NumThreads() const { return uint(ranges.size()); }
+
+    // Calls f(index, worker) once for every index in [0, count), in any order and on any thread, and returns after
+    // the last call returns. worker is in [0, NumThreads()) and no two calls at the same time have the same one,
+    // so it can index per-thread state. Not reentrant: f must not call ParallelFor of the same pool.
+    template<class F>
+    void ParallelFor(size_t count, F&& f)
+    {
+        uint const numThreads = NumThreads();
+        for (uint worker = 0; worker < numThreads; ++worker) {
+            ranges[worker].begin = count * worker / numThreads;
+            ranges[worker].end = count * (worker + 1) / numThreads;
+        }
+        if (numThreads == 1) {
+            for (size_t i = 0; i < count; ++i)
+                f(i, 0u);
+            return;
+        }
+        fn = [](void* context, size_t index, uint worker) { (*static_cast<F*>(context))(index, worker); };
+        context = &f;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            numRunning = numThreads - 1;
+            generation++;
+        }
+        startCv.notify_all();
+        RunWorker(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        doneCv.wait(lock, [this]() { return numRunning == 0; });
+    }
+
+private:
+    void WorkerMain(uint worker)
+    {
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                startCv.wait(lock, [&]() { return generation != seen; });
+                seen = generation;
+                if (bStop)
+                    return;
+            }
+            RunWorker(worker);
+            bool bLast;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                bLast = --numRunning == 0;
+            }
+            if (bLast)
+                doneCv.notify_one();
+        }
+    }
+
+    bool TakeOwn(uint worker, size_t& index)
+    {
+        Range& own = ranges[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (own.begin == own.end)
+            return false;
+        index = own.begin++;
+        return true;
+    }
+
+    // Takes the back half of the first nonempty range after the worker's own, runs its first index right away
+    // and leaves the rest in the worker's range. Ranges only shrink or move, so once a pass over all of them finds
+    // nothing, the indices left are being run or were stolen by threads that will run them.
+    bool Steal(uint worker, size_t& index)
+    {
+        uint const numThreads = NumThreads();
+        for (uint i = 1; i < numThreads; ++i) {
+            Range& victim = ranges[(worker + i) % numThreads];
+            size_t begin, end;
+            {
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (victim.begin == victim.end)
+                    continue;
+                end = victim.end;
+                begin = victim.begin + (victim.end - victim.begin) / 2;
+                victim.end = begin;
+            }
+            Range& own = ranges[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            own.begin = begin + 1;
+            own.end = end;
+            index = begin;
+            return true;
+        }
+        return false;
+    }
+
+    void RunWorker(uint worker)
+    {
+        size_t index;
+        while (TakeOwn(worker, index) || Steal(worker, index))
+            fn(context, index, worker);
+    }
+};
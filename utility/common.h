@@ -35,7 +35,9 @@ unsigned char _BitScanForward(unsigned long* Index, unsigned long Mask);
 unsigned char _BitScanForward64(unsigned long* Index, unsigned __int64 Mask);
 } // extern "C"
 __forceinline int bsr(unsigned long v) { unsigned long i; _BitScanReverse(&i, v); return i; }
+__forceinline int bsr64(unsigned __int64 v) { unsigned long i; _BitScanReverse64(&i, v); return i; }
 __forceinline int bsf(unsigned long v) { unsigned long i; _BitScanForward(&i, v); return i; }
+__forceinline int bsf64(unsigned __int64 v) { unsigned long i; _BitScanForward64(&i, v); return i; }
 #elif defined __GNUC__
 #define ASSUME(x)     ASSERT(x)
 #define unreachable   (ASSERT(0), __builtin_unreachable())
@@ -44,6 +46,13 @@ __forceinline int bsf(unsigned long v) { unsigned long i; _BitScanForward(&i, v)
 #define noreturn_void __attribute__((noreturn)) void
 #define bsr32(v)      (__builtin_clz(v) ^ 31)
 #define MSVC_PRAGMA(...)
+#ifndef __debugbreak
+#define __debugbreak() __builtin_trap()
+#endif
+inline int bsr(uint32_t v)   { return __builtin_clz(v) ^ 31; }
+inline int bsr64(uint64_t v) { return __builtin_clzll(v) ^ 63; }
+inline int bsf(uint32_t v)   { return __builtin_ctz(v); }
+inline int bsf64(uint64_t v) { return __builtin_ctzll(v); }
 #else
 #define ASSUME(x)     ASSERT(x)
 #define unreachable   ASSERT(0)